@@ -0,0 +1,7 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+for each in $BASEDIR/**/*.sh
+do
+	$each
+done
@@ -0,0 +1,13 @@
+#!/bin/bash
+if [ $# -eq 0 ]; then
+	echo "Usage $0 [target] [args...]"
+	exit 1
+fi
+
+BASEDIR=$(dirname $0)
+target=$1
+
+shift
+
+gcc -O2 -I$BASEDIR/../src $target -o bench.out \
+&& ./bench.out $@ && rm bench.out
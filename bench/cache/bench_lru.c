@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <cache/lru.h>
+
+#define DEFAULT_GETS 1000000	// per thread
+#define NUM_KEYS 1024
+#define VALUE_SIZE 1024
+
+typedef struct {
+	lru_cache_t *cache;
+	long num_gets;
+	unsigned int seed;
+} reader_t;
+
+static char keys[NUM_KEYS][32];
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *read_keys(void *data) {
+	reader_t *reader = (reader_t *) data;
+	void *value;
+	size_t value_len;
+	long i;
+	int k;
+
+	for (i = 0; i < reader->num_gets; i++) {
+		k = rand_r(&reader->seed) % NUM_KEYS;
+		lru_cache_get(reader->cache, keys[k], strlen(keys[k]) + 1,
+			&value, &value_len);
+
+		if (!value) {
+			fprintf(stderr, "miss: %s\n", keys[k]);
+			exit(EXIT_FAILURE);
+		}
+
+		lru_cache_release(value);
+	}
+
+	return NULL;
+}
+
+// Return gets/sec of num_threads threads hitting a cache of num_shards.
+static double run(size_t num_shards, int num_threads, long num_gets) {
+	lru_cache_t *cache = lru_cache_init_sharded(
+		(size_t) NUM_KEYS * VALUE_SIZE * 4, VALUE_SIZE, num_shards);
+	pthread_t threads[num_threads];
+	reader_t readers[num_threads];
+	char value[VALUE_SIZE];
+	double start, elapsed;
+	int i;
+
+	if (!cache) {
+		fprintf(stderr, "lru_cache_init_sharded() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(value, 'x', sizeof(value));
+	for (i = 0; i < NUM_KEYS; i++) {
+		lru_cache_set(cache, keys[i], strlen(keys[i]) + 1, value,
+			sizeof(value));
+	}
+
+	start = now();
+	for (i = 0; i < num_threads; i++) {
+		readers[i].cache = cache;
+		readers[i].num_gets = num_gets;
+		readers[i].seed = i + 1;
+		pthread_create(&threads[i], NULL, read_keys, &readers[i]);
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	elapsed = now() - start;
+
+	lru_cache_free(cache);
+	return num_gets * num_threads / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+	int threads[] = { 1, 2, 4, 8, 16, 32, 64 };
+	size_t shards[] = { 1, LRU_CACHE_DEFAULT_SHARDS };
+	long num_gets = argc > 1 ? atol(argv[1]) : DEFAULT_GETS;
+	int i, j;
+
+	for (i = 0; i < NUM_KEYS; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "www.example.com/%d", i);
+	}
+
+	printf("%8s %8s %14s\n", "shards", "threads", "gets/sec");
+	for (j = 0; j < sizeof(shards) / sizeof(size_t); j++) {
+		for (i = 0; i < sizeof(threads) / sizeof(int); i++) {
+			printf("%8zu %8d %14.0f\n", shards[j], threads[i],
+				run(shards[j], threads[i], num_gets));
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,8 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+# Hit throughput of one lock against LRU_CACHE_DEFAULT_SHARDS locks.
+$BASEDIR/../bench.sh "$BASEDIR/bench_lru.c \
+$BASEDIR/../../src/cache/lru.c \
+$BASEDIR/../../src/cache/slab.c \
+-lpthread" $@
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cache/lru.h>
+
+#define DEFAULT_SETS 100000
+#define VALUE_SIZE 64
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static lru_cache_error set(lru_cache_t *cache, long i, char *value) {
+	char key[32];
+
+	snprintf(key, sizeof(key), "www.example.com/%ld", i);
+	return lru_cache_set(cache, key, strlen(key) + 1, value, VALUE_SIZE);
+}
+
+// Return ns per set in a single shard full of num_objects, so that every
+// set evicts one.
+static double run(long num_objects, long num_sets) {
+	lru_cache_t *cache = lru_cache_init_sharded(num_objects * VALUE_SIZE,
+		VALUE_SIZE, 1);
+	char value[VALUE_SIZE];
+	double start, elapsed;
+	long i;
+
+	if (!cache) {
+		fprintf(stderr, "lru_cache_init_sharded() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(value, 'x', sizeof(value));
+	for (i = 0; i < num_objects; i++) {
+		set(cache, i, value);
+	}
+
+	start = now();
+	for (i = num_objects; i < num_objects + num_sets; i++) {
+		if (set(cache, i, value) != LRU_CACHE_NO_ERROR) {
+			fprintf(stderr, "lru_cache_set() failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	elapsed = now() - start;
+
+	lru_cache_free(cache);
+	return elapsed * 1e9 / num_sets;
+}
+
+int main(int argc, char *argv[]) {
+	long objects[] = { 1000, 10000, 100000, 1000000 };
+	long num_sets = argc > 1 ? atol(argv[1]) : DEFAULT_SETS;
+	int i;
+
+	printf("%10s %10s\n", "objects", "ns/set");
+	for (i = 0; i < sizeof(objects) / sizeof(long); i++) {
+		printf("%10ld %10.0f\n", objects[i], run(objects[i], num_sets));
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,8 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+# Insert latency of a full cache as the number of objects grows.
+$BASEDIR/../bench.sh "$BASEDIR/bench_lru_set.c \
+$BASEDIR/../../src/cache/lru.c \
+$BASEDIR/../../src/cache/slab.c \
+-lpthread" $@
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <http/http_clock.h>
+
+#define DEFAULT_CALLS 10000000
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	long num_calls = argc > 1 ? atol(argv[1]) : DEFAULT_CALLS;
+	char date[HTTP_DATE_LEN];
+	size_t sum = 0;
+	double start;
+	time_t t;
+	struct tm tm;
+	long i;
+
+	printf("%-12s %10s\n", "date", "ns/call");
+
+	start = now();
+	for (i = 0; i < num_calls; i++) {
+		t = time(NULL);
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+			gmtime_r(&t, &tm));
+		sum += date[0];
+	}
+	printf("%-12s %10.1f\n", "strftime", (now() - start) * 1e9 / num_calls);
+
+	if (!http_clock_start()) {
+		fprintf(stderr, "http_clock_start() failed\n");
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < num_calls; i++) {
+		sum += http_clock_date()[0];
+	}
+	printf("%-12s %10.1f\n", "http_clock", (now() - start) * 1e9 / num_calls);
+
+	http_clock_stop();
+	return sum == 0;
+}
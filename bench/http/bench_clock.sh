@@ -0,0 +1,7 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+# Cost of getting the HTTP date string.
+$BASEDIR/../bench.sh "$BASEDIR/bench_clock.c \
+$BASEDIR/../../src/http/http_clock.c \
+-lpthread" $@
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <http/http_request.h>
+
+#define DEFAULT_REQUESTS 200000
+
+static const char *message =
+	"GET http://www.example.com/index.html HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"If-None-Match: \"5d8c72a5edda8\"\r\n"
+	"If-Modified-Since: Mon, 27 Jul 2009 12:28:53 GMT\r\n"
+	"Referer: http://www.example.com/\r\n"
+	"Cookie: session=0123456789abcdef; theme=dark\r\n"
+	"DNT: 1\r\n"
+	"Pragma: no-cache\r\n"
+	"TE: trailers\r\n"
+	"X-Forwarded-For: 192.168.0.1\r\n\r\n";
+
+enum { FRESH, REUSED, BORROWED };
+
+static size_t num_allocs;
+static size_t num_copied;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+	num_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	num_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	num_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+	if (ptr) {
+		num_allocs++;
+	}
+	__real_free(ptr);
+}
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void parse(http_parser_settings *settings, http_request_t *request,
+	bool borrow) {
+	http_arena_block_t *block;
+	http_parser parser;
+
+	http_parser_init(&parser, HTTP_REQUEST);
+	parser.data = request;
+
+	if (borrow) {
+		borrow_http_headers(request->headers, message, strlen(message));
+	}
+
+	if (http_parser_execute(&parser, settings, message, strlen(message))
+		!= strlen(message) || request->headers->num_headers != 20) {
+		fprintf(stderr, "parse failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (block = request->headers->arena.head; block; block = block->next) {
+		num_copied += block->used;
+	}
+}
+
+// A request object per message, as thread mode does.
+static void run_fresh(http_parser_settings *settings, long num_requests) {
+	http_request_t *request;
+	long i;
+
+	for (i = 0; i < num_requests; i++) {
+		if ((request = init_http_request(0)) == NULL) {
+			fprintf(stderr, "init_http_request() failed\n");
+			exit(EXIT_FAILURE);
+		}
+
+		parse(settings, request, false);
+		free_http_request(request);
+	}
+}
+
+// One request object per connection, reset between messages. Borrowed
+// headers reference the message instead of copying it.
+static void run_reused(http_parser_settings *settings, long num_requests,
+	bool borrow) {
+	http_request_t *request;
+	long i;
+
+	if ((request = init_http_request(0)) == NULL) {
+		fprintf(stderr, "init_http_request() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num_requests; i++) {
+		reset_http_request(request);
+		parse(settings, request, borrow);
+	}
+
+	free_http_request(request);
+}
+
+static void run(http_parser_settings *settings, long num_requests,
+	const char *name, int mode) {
+	double start, elapsed;
+
+	num_allocs = 0;
+	num_copied = 0;
+	start = now();
+	if (mode == FRESH) {
+		run_fresh(settings, num_requests);
+	} else {
+		run_reused(settings, num_requests, mode == BORROWED);
+	}
+	elapsed = now() - start;
+
+	printf("%-8s %14.1f %14.1f %12.0f\n", name,
+		(double) num_allocs / num_requests,
+		(double) num_copied / num_requests, elapsed * 1e9 / num_requests);
+}
+
+int main(int argc, char *argv[]) {
+	long num_requests = argc > 1 ? atol(argv[1]) : DEFAULT_REQUESTS;
+	http_parser_settings settings;
+
+	http_parser_settings_init(&settings);
+	settings.on_url = request_on_url_cb;
+	settings.on_header_field = request_on_header_field_cb;
+	settings.on_header_value = request_on_header_value_cb;
+	settings.on_message_complete = request_on_message_complete_cb;
+
+	printf("%-8s %14s %14s %12s\n", "mode", "heap ops/req", "copied B/req",
+		"ns/req");
+
+	run(&settings, num_requests, "fresh", FRESH);
+	run(&settings, num_requests, "reused", REUSED);
+	run(&settings, num_requests, "borrowed", BORROWED);
+
+	return 0;
+}
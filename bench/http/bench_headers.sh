@@ -0,0 +1,9 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+# Heap operations, bytes copied and time to parse a request with 20 headers.
+$BASEDIR/../bench.sh "$BASEDIR/bench_headers.c \
+$BASEDIR/../../src/http/http_common.c \
+$BASEDIR/../../src/http/http_request.c \
+$BASEDIR/../../src/http/http_parser.c \
+-Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc -Wl,--wrap=free" $@
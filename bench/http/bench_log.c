@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <http/http_log.h>
+
+#define DEFAULT_RECORDS 100000
+#define LOG_FILE "/tmp/bench_log.log"
+
+static http_request_t *request;
+static http_response_t *response;
+static long num_records;
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *thread_main(void *data) {
+	long i;
+
+	for (i = 0; i < num_records; i++) {
+		log_http_request(request, response);
+	}
+
+	return NULL;
+}
+
+// Time spent by request threads in log_http_request().
+static double run(int num_threads) {
+	pthread_t threads[64];
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, thread_main, NULL)) {
+			perror("pthread_create() failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	return (now() - start) * 1e9 / (num_records * num_threads);
+}
+
+int main(int argc, char *argv[]) {
+	int threads[] = { 1, 4, 16 };
+	double sync_ns, async_ns;
+	size_t dropped;
+	int i;
+
+	num_records = argc > 1 ? atol(argv[1]) : DEFAULT_RECORDS;
+
+	if ((request = init_http_request(0)) == NULL
+		|| (response = init_http_response(0)) == NULL
+		|| !http_log_set_file(LOG_FILE)) {
+		fprintf(stderr, "init failed\n");
+		return 1;
+	}
+
+	strcpy(request->ip, "192.168.0.1");
+	strcpy(request->schema, "http");
+	strcpy(request->host, "www.example.com");
+	strcpy(request->path, "/index.html");
+	response->content_length = 1024;
+
+	printf("%-8s %12s %12s %12s\n", "threads", "sync ns/req", "async ns/req",
+		"dropped");
+
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+		sync_ns = run(threads[i]);
+
+		dropped = http_log_dropped();
+		http_log_start(HTTP_LOG_DEFAULT_FLUSH_INTERVAL);
+		async_ns = run(threads[i]);
+		http_log_stop();
+
+		printf("%-8d %12.0f %12.0f %12zu\n", threads[i], sync_ns, async_ns,
+			http_log_dropped() - dropped);
+	}
+
+	http_log_set_file(NULL);
+	remove(LOG_FILE);
+	free_http_request(request);
+	free_http_response(response);
+	return 0;
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+# Time spent logging a request, written in place or by the log thread.
+$BASEDIR/../bench.sh "$BASEDIR/bench_log.c \
+$BASEDIR/../../src/http/http_log.c \
+$BASEDIR/../../src/http/http_clock.c \
+$BASEDIR/../../src/http/http_common.c \
+$BASEDIR/../../src/http/http_request.c \
+$BASEDIR/../../src/http/http_response.c \
+$BASEDIR/../../src/http/http_parser.c \
+-lpthread" $@
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <thpool/thpool.h>
+
+#ifdef THPOOL_LIST_QUEUE
+#define QUEUE_NAME "list"
+#else
+#define QUEUE_NAME "ring"
+#endif
+
+#define DEFAULT_JOBS 500000
+
+typedef struct {
+	threadpool thpool;
+	long num_jobs;
+} producer_t;
+
+static volatile long done;
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void job(void *arg) {
+	__atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+}
+
+static void *produce(void *data) {
+	producer_t *producer = (producer_t *) data;
+	long i;
+
+	for (i = 0; i < producer->num_jobs; i++) {
+		// Queue is full, let workers catch up.
+		while (thpool_add_work(producer->thpool, job, NULL) == -1) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+// Return jobs/sec of num_producers threads feeding num_threads workers.
+static double run(int num_threads, int num_producers, long num_jobs) {
+	threadpool thpool = thpool_init(num_threads);
+	pthread_t producers[num_producers];
+	producer_t producer;
+	double start, elapsed;
+	int i;
+
+	if (!thpool) {
+		fprintf(stderr, "thpool_init() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	done = 0;
+	producer.thpool = thpool;
+	producer.num_jobs = num_jobs / num_producers;
+
+	start = now();
+	for (i = 0; i < num_producers; i++) {
+		pthread_create(&producers[i], NULL, produce, &producer);
+	}
+	for (i = 0; i < num_producers; i++) {
+		pthread_join(producers[i], NULL);
+	}
+	thpool_wait(thpool);
+	elapsed = now() - start;
+
+	if (done != producer.num_jobs * num_producers) {
+		fprintf(stderr, "lost jobs: %ld/%ld\n", done,
+			producer.num_jobs * num_producers);
+		exit(EXIT_FAILURE);
+	}
+
+	thpool_destroy(thpool);
+	return done / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+	int threads[] = { 1, 2, 4, 8, 16, 32, 64 };
+	int producers[] = { 1, 4 };
+	long num_jobs = argc > 1 ? atol(argv[1]) : DEFAULT_JOBS;
+	int i, j;
+
+	printf("%-6s %8s %10s %14s\n", "queue", "threads", "producers",
+		"jobs/sec");
+	for (j = 0; j < sizeof(producers) / sizeof(int); j++) {
+		for (i = 0; i < sizeof(threads) / sizeof(int); i++) {
+			printf("%-6s %8d %10d %14.0f\n", QUEUE_NAME, threads[i],
+				producers[j], run(threads[i], producers[j], num_jobs));
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
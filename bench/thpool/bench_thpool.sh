@@ -0,0 +1,12 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+# Lock-free ring (default) against the mutex linked-list job queue.
+$BASEDIR/../bench.sh "$BASEDIR/bench_thpool.c \
+$BASEDIR/../../src/thpool/thpool.c \
+-lpthread" $@
+
+$BASEDIR/../bench.sh "-DTHPOOL_LIST_QUEUE \
+$BASEDIR/bench_thpool.c \
+$BASEDIR/../../src/thpool/thpool.c \
+-lpthread" $@
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "inflight.h"
+
+// FNV-1a
+static size_t inflight_hash(const char *key, size_t key_len) {
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < key_len; i++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+inflight_t *inflight_init(size_t num_buckets) {
+	inflight_t *inflight;
+	pthread_condattr_t attr;
+
+	if ((inflight = malloc(sizeof(inflight_t))) == NULL) {
+		return NULL;
+	}
+	memset(inflight, 0, sizeof(inflight_t));
+
+	inflight->num_buckets = num_buckets > 0
+		? num_buckets : INFLIGHT_DEFAULT_BUCKETS;
+	if ((inflight->buckets = calloc(inflight->num_buckets,
+			sizeof(inflight_flight_t *))) == NULL) {
+		free(inflight);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&inflight->lock, NULL)) {
+		free(inflight->buckets);
+		free(inflight);
+		return NULL;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (pthread_cond_init(&inflight->landed, &attr)) {
+		pthread_condattr_destroy(&attr);
+		pthread_mutex_destroy(&inflight->lock);
+		free(inflight->buckets);
+		free(inflight);
+		return NULL;
+	}
+	pthread_condattr_destroy(&attr);
+
+	return inflight;
+}
+
+static void flight_free(inflight_flight_t *flight) {
+	free(flight->key);
+	free(flight);
+}
+
+void inflight_free(inflight_t *inflight) {
+	inflight_flight_t *flight, *next;
+	size_t i;
+
+	if (!inflight) {
+		return;
+	}
+
+	for (i = 0; i < inflight->num_buckets; i++) {
+		for (flight = inflight->buckets[i]; flight; flight = next) {
+			next = flight->next;
+			flight_free(flight);
+		}
+	}
+
+	pthread_cond_destroy(&inflight->landed);
+	pthread_mutex_destroy(&inflight->lock);
+	free(inflight->buckets);
+	free(inflight);
+}
+
+/**
+ * Find the flight of key, or start one if there is none. inflight must be
+ * locked.
+ *
+ * @return 1 if a flight was started, 0 if found, -1 on error.
+ */
+static int flight_find(inflight_t *inflight, const char *key, size_t key_len,
+	inflight_flight_t **flight) {
+	size_t bucket = inflight_hash(key, key_len) % inflight->num_buckets;
+	inflight_flight_t *f;
+
+	for (f = inflight->buckets[bucket]; f; f = f->next) {
+		if (f->key_len == key_len && memcmp(f->key, key, key_len) == 0) {
+			*flight = f;
+			return 0;
+		}
+	}
+
+	if ((f = malloc(sizeof(inflight_flight_t))) == NULL) {
+		return -1;
+	}
+
+	if ((f->key = malloc(key_len)) == NULL) {
+		free(f);
+		return -1;
+	}
+
+	memcpy(f->key, key, key_len);
+	f->key_len = key_len;
+	f->bucket = bucket;
+	f->waiters = NULL;
+	f->next = inflight->buckets[bucket];
+	inflight->buckets[bucket] = f;
+
+	inflight->stats.leaders++;
+	inflight->stats.in_flight++;
+
+	*flight = f;
+	return 1;
+}
+
+// Add a follower to flight. inflight must be locked.
+static void flight_follow(inflight_t *inflight, inflight_flight_t *flight,
+	inflight_waiter_t *waiter) {
+	waiter->flight = flight;
+	waiter->next = flight->waiters;
+	waiter->pprev = &flight->waiters;
+	if (flight->waiters) {
+		flight->waiters->pprev = &waiter->next;
+	}
+	flight->waiters = waiter;
+
+	inflight->stats.followers++;
+}
+
+// Remove a follower from its flight. inflight must be locked.
+static bool flight_unfollow(inflight_waiter_t *waiter) {
+	if (!waiter->flight) {
+		return false;
+	}
+
+	*waiter->pprev = waiter->next;
+	if (waiter->next) {
+		waiter->next->pprev = waiter->pprev;
+	}
+	waiter->flight = NULL;
+
+	return true;
+}
+
+int inflight_join(inflight_t *inflight, const char *key, size_t key_len,
+	inflight_flight_t **flight, inflight_waiter_t *waiter) {
+	inflight_flight_t *f;
+	int r;
+
+	*flight = NULL;
+	waiter->flight = NULL;
+
+	pthread_mutex_lock(&inflight->lock);
+	if ((r = flight_find(inflight, key, key_len, &f)) == 1) {
+		*flight = f;
+	} else if (r == 0) {
+		flight_follow(inflight, f, waiter);
+	}
+	pthread_mutex_unlock(&inflight->lock);
+
+	return r;
+}
+
+bool inflight_cancel(inflight_t *inflight, inflight_waiter_t *waiter) {
+	bool following;
+
+	pthread_mutex_lock(&inflight->lock);
+	following = flight_unfollow(waiter);
+	pthread_mutex_unlock(&inflight->lock);
+
+	return following;
+}
+
+static void flight_landed(void *data) {
+	*(bool *) data = true;
+}
+
+inflight_flight_t *inflight_enter(inflight_t *inflight, const char *key,
+	size_t key_len, int timeout) {
+	inflight_flight_t *flight;
+	inflight_waiter_t waiter;
+	struct timespec deadline;
+	bool landed = false;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (long) (timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	waiter.cb = flight_landed;
+	waiter.data = &landed;
+
+	pthread_mutex_lock(&inflight->lock);
+	if ((r = flight_find(inflight, key, key_len, &flight)) == 0) {
+		flight_follow(inflight, flight, &waiter);
+		while (!landed) {
+			if (pthread_cond_timedwait(&inflight->landed, &inflight->lock,
+					&deadline) == ETIMEDOUT) {
+				// The leader is slow, fetch without it.
+				flight_unfollow(&waiter);
+				break;
+			}
+		}
+		flight = NULL;
+	} else if (r == -1) {
+		flight = NULL;
+	}
+	pthread_mutex_unlock(&inflight->lock);
+
+	return flight;
+}
+
+inflight_flight_t *inflight_lead(inflight_t *inflight, const char *key,
+	size_t key_len) {
+	inflight_flight_t *flight;
+
+	pthread_mutex_lock(&inflight->lock);
+	if (flight_find(inflight, key, key_len, &flight) != 1) {
+		flight = NULL;
+	}
+	pthread_mutex_unlock(&inflight->lock);
+
+	return flight;
+}
+
+void inflight_end(inflight_t *inflight, inflight_flight_t *flight) {
+	inflight_flight_t **p;
+	inflight_waiter_t *waiter, *next;
+	bool blocked = false;
+
+	if (!flight) {
+		return;
+	}
+
+	pthread_mutex_lock(&inflight->lock);
+	for (p = &inflight->buckets[flight->bucket]; *p != flight;
+		p = &(*p)->next);
+	*p = flight->next;
+	inflight->stats.in_flight--;
+
+	// A waiter may be freed as soon as its cb is called.
+	for (waiter = flight->waiters; waiter; waiter = next) {
+		next = waiter->next;
+		waiter->flight = NULL;
+		blocked = blocked || waiter->cb == flight_landed;
+		waiter->cb(waiter->data);
+	}
+
+	if (blocked) {
+		pthread_cond_broadcast(&inflight->landed);
+	}
+	pthread_mutex_unlock(&inflight->lock);
+
+	flight_free(flight);
+}
+
+void inflight_stats(inflight_t *inflight, inflight_stats_t *stats) {
+	pthread_mutex_lock(&inflight->lock);
+	*stats = inflight->stats;
+	pthread_mutex_unlock(&inflight->lock);
+}
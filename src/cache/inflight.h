@@ -0,0 +1,125 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define INFLIGHT_DEFAULT_BUCKETS 1024
+
+typedef struct inflight_flight inflight_flight_t;
+
+/**
+ * Called once when the flight a follower waits for ends. It runs on the
+ * thread ending the flight with the table locked, so it must be short and
+ * must not call inflight functions.
+ */
+typedef void (*inflight_cb)(void *data);
+
+/**
+ * Follower of a flight, owned by the caller. cb and data are set by the
+ * caller before inflight_join().
+ */
+typedef struct inflight_waiter {
+	inflight_cb cb;
+	void *data;
+	inflight_flight_t *flight;		// Followed, NULL once it ended.
+	struct inflight_waiter *next;
+	struct inflight_waiter **pprev;
+} inflight_waiter_t;
+
+/**
+ * Fetch of one key in progress. Requests for the key that arrive meanwhile
+ * wait for it instead of fetching it again.
+ */
+struct inflight_flight {
+	char *key;
+	size_t key_len;
+	size_t bucket;
+	inflight_waiter_t *waiters;
+	struct inflight_flight *next;		// Bucket chain.
+};
+
+typedef struct {
+	size_t leaders;			// Started a flight.
+	size_t followers;		// Waited for a flight in progress.
+	size_t in_flight;		// Flights in progress now.
+} inflight_stats_t;
+
+typedef struct {
+	inflight_flight_t **buckets;
+	size_t num_buckets;
+	inflight_stats_t stats;
+	pthread_mutex_t lock;
+	pthread_cond_t landed;		// Broadcast for inflight_enter(), on
+					// CLOCK_MONOTONIC.
+} inflight_t;
+
+/**
+ * Initialize inflight_t with num_buckets hash buckets. If num_buckets is
+ * 0, INFLIGHT_DEFAULT_BUCKETS is applied.
+ *
+ * @return Pointer to inflight_t or NULL on error.
+ */
+inflight_t *inflight_init(size_t num_buckets);
+
+/**
+ * Free inflight_t. Flights left are freed, and the callbacks of their
+ * followers are not called.
+ */
+void inflight_free(inflight_t *inflight);
+
+/**
+ * Lead the fetch of key, or follow the one in progress without blocking.
+ *
+ * @params flight Set to the new flight if the caller leads.
+ * @params waiter Linked to the flight in progress if the caller follows,
+ *         until its cb is called or it is cancelled.
+ * @return 1 if the caller leads, 0 if waiter->cb will be called, -1 on
+ *         error.
+ */
+int inflight_join(inflight_t *inflight, const char *key, size_t key_len,
+	inflight_flight_t **flight, inflight_waiter_t *waiter);
+
+/**
+ * Stop following with waiter, unlinking it from its flight alone. After it
+ * returns, waiter->cb is not called.
+ *
+ * @return true if waiter was still following, false if the flight ended
+ *         and waiter->cb was called already.
+ */
+bool inflight_cancel(inflight_t *inflight, inflight_waiter_t *waiter);
+
+/**
+ * Lead the fetch of key, or wait for the one in progress to end, for at
+ * most timeout milliseconds.
+ *
+ * @return The new flight if the caller leads, or NULL once the one in
+ *         progress ended, on timeout or on error.
+ */
+inflight_flight_t *inflight_enter(inflight_t *inflight, const char *key,
+	size_t key_len, int timeout);
+
+/**
+ * Lead the fetch of key unless one is in progress already, never waiting
+ * for it.
+ *
+ * @return The new flight, or NULL if key is in flight or on error.
+ */
+inflight_flight_t *inflight_lead(inflight_t *inflight, const char *key,
+	size_t key_len);
+
+/**
+ * End flight and wake its followers. NULL is ignored.
+ */
+void inflight_end(inflight_t *inflight, inflight_flight_t *flight);
+
+void inflight_stats(inflight_t *inflight, inflight_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,7 +1,11 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "lru.h"
 
@@ -12,17 +16,23 @@
 	lru_cache_error(!(key) || (key) == 0, LRU_CACHE_MISSING_KEY)
 #define lru_cache_test_missing_value(value) \
 	lru_cache_error(!(value) || (value) == 0, LRU_CACHE_MISSING_VALUE)
-#define lru_cache_test_value_too_large(cache, value_len) \
-	lru_cache_error(cache->total_memory < value_len, LRU_CACHE_VALUE_TOO_LONG)
+#define lru_cache_test_value_too_large(shard, size) \
+	lru_cache_error(shard->total_memory < size, LRU_CACHE_VALUE_TOO_LONG)
 
-#define lock_cache(cache) \
-	if (pthread_mutex_lock(cache->lock)) { \
+// Item, value and key are one object, and the value is found by its data.
+#define LRU_OBJECT_HEADER (sizeof(lru_item_t) + sizeof(lru_value_t))
+#define lru_value_of(ptr) \
+	((lru_value_t *) ((char *) (ptr) - offsetof(lru_value_t, data)))
+#define lru_item_of(value) ((lru_item_t *) (value) - 1)
+
+#define lock_shard(shard) \
+	if (pthread_mutex_lock(&shard->lock)) { \
 		perror("lru_cache failed to pthread_mutex_lock"); \
 		return LRU_CACHE_PTHREAD_ERROR; \
 	}
 
-#define unlock_cache(cache) \
-	if (pthread_mutex_unlock(cache->lock)) { \
+#define unlock_shard(shard) \
+	if (pthread_mutex_unlock(&shard->lock)) { \
 		perror("lru_cache faeild to pthread_mutex_unlock"); \
 		return LRU_CACHE_PTHREAD_ERROR; \
 	}
@@ -58,7 +68,20 @@ static uint32_t lru_hash(lru_cache_t *cache, void *key, size_t key_len) {
 	h ^= h >> 13;
 	h *= m;
 	h ^= h >> 15;
-	return h % cache->hash_table_size;
+	return h;
+}
+
+/**
+ * Find the shard of hash and the bucket in it. The shard is picked by the
+ * low part of hash, so the bucket uses the rest.
+ *
+ */
+static lru_shard_t *lru_cache_shard(lru_cache_t *cache, uint32_t hash,
+	uint32_t *hash_index) {
+	lru_shard_t *shard = &cache->shards[hash % cache->num_shards];
+
+	*hash_index = (hash / cache->num_shards) % shard->hash_table_size;
+	return shard;
 }
 
 /**
@@ -69,77 +92,292 @@ static inline int lru_cache_cmp_keys(lru_item_t *item, void *key, size_t key_len
 	return item->key_len != key_len ? 1 : memcmp(item->key, key, key_len);
 }
 
+size_t lru_cache_item_size(size_t key_len, size_t value_len) {
+	size_t size = LRU_OBJECT_HEADER + value_len + key_len;
+	size_t chunk = lru_slab_chunk_size(size);
+
+	if (chunk) {
+		return chunk;
+	}
+
+	return (size + LRU_CACHE_LARGE_ALIGN - 1)
+		& ~(size_t) (LRU_CACHE_LARGE_ALIGN - 1);
+}
+
 /**
- * Remove an item and push it to the free items queue.
+ * Create an item holding a copy of key and data, referenced by the cache
+ * only. It is a slab chunk if small enough.
  *
  */
-static void lru_cache_remove_item(lru_cache_t *cache, lru_item_t *prev,
-	lru_item_t *item, uint32_t hash_index) {
-	if (prev) {
-		prev->next = item->next;
+static lru_item_t *lru_item_create(lru_slab_t *slab, void *key,
+	size_t key_len, const struct iovec *iov, int iovcnt, size_t len) {
+	size_t size = LRU_OBJECT_HEADER + len + key_len, offset = 0;
+	int i, fd = -1, slab_class = lru_slab_class(slab, size);
+	lru_item_t *item = NULL;
+	lru_value_t *value;
+
+	if (slab_class != -1) {
+		if ((item = lru_slab_alloc(slab, slab_class)) == NULL) {
+			return NULL;
+		}
+		size = slab->classes[slab_class].size;
 	} else {
-		cache->items[hash_index] = item->next;
+		slab_class = LRU_SLAB_MAX_CLASSES;
+
+		if (len >= LRU_CACHE_MEMFD_MIN
+			&& (fd = memfd_create("lru_cache", MFD_CLOEXEC)) != -1) {
+			if (ftruncate(fd, size) == -1 || (item = mmap(NULL, size,
+					PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+				close(fd);
+				fd = -1;
+				item = NULL;
+			}
+		}
+
+		// Fall back to memory if memfd is not available.
+		if (!item && (item = malloc(size)) == NULL) {
+			return NULL;
+		}
 	}
 
-	cache->free_memory += item->value_len;
-	free(item->value);
-	free(item->key);
+	value = (lru_value_t *) (item + 1);
+	value->refcount = 1;
+	value->len = len;
+	value->size = size;
+	value->slab = slab_class < LRU_SLAB_MAX_CLASSES ? slab : NULL;
+	value->fd = fd;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(value->data + offset, iov[i].iov_base, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
 
 	memset(item, 0, sizeof(lru_item_t));
-	item->next = cache->free_items;
-	cache->free_items = item;
+	item->key = value->data + len;
+	item->value = value;
+	item->key_len = key_len;
+	item->value_len = len;
+	item->size = lru_cache_item_size(key_len, len);
+	item->slab_class = slab_class;
+	memcpy(item->key, key, key_len);
+
+	return item;
 }
 
 /**
- * Remove the least recently used item.
+ * Drop a reference to value, and free its object with the last one. The
+ * item header is not used once the cache dropped it.
  *
  */
-static void lru_cache_remove_lru(lru_cache_t *cache) {
-	lru_item_t *min_item = NULL, *min_prev = NULL;
-	lru_item_t *item = NULL, *prev = NULL;
-	uint32_t i, min_index = -1;
-	size_t min_access_count = -1;
+static void lru_value_release(lru_value_t *value) {
+	lru_item_t *item = lru_item_of(value);
+	int fd;
 
-	for (i = 0; i < cache->hash_table_size; i++) {
-		item = cache->items[i];
-		prev = NULL;
+	if (__atomic_sub_fetch(&value->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
 
-		while (item) {
-			if (item->access_count < min_access_count || min_access_count == -1) {
-				min_access_count = item->access_count;
-				min_item = item;
-				min_prev = prev;
-				min_index = i;
-			}
-			prev = item;
-			item = item->next;
-		}
+	if (value->slab) {
+		lru_slab_free(value->slab, item);
+	} else if (value->fd == -1) {
+		free(item);
+	} else {
+		fd = value->fd;
+		munmap(item, value->size);
+		close(fd);
 	}
+}
+
+/**
+ * Unlink an item from the recency list.
+ *
+ */
+static inline void lru_cache_unlink(lru_shard_t *shard, lru_item_t *item) {
+	int c = item->slab_class;
 
-	if (min_item) {
-		lru_cache_remove_item(cache, min_prev, min_item, min_index);
+	if (item->class_prev) {
+		item->class_prev->class_next = item->class_next;
+	} else {
+		shard->class_head[c] = item->class_next;
+	}
+
+	if (item->class_next) {
+		item->class_next->class_prev = item->class_prev;
+	} else {
+		shard->class_tail[c] = item->class_prev;
+	}
+
+	item->class_prev = item->class_next = NULL;
+
+	if (item->lru_prev) {
+		item->lru_prev->lru_next = item->lru_next;
+	} else {
+		shard->lru_head = item->lru_next;
 	}
+
+	if (item->lru_next) {
+		item->lru_next->lru_prev = item->lru_prev;
+	} else {
+		shard->lru_tail = item->lru_prev;
+	}
+
+	item->lru_prev = item->lru_next = NULL;
 }
 
 /**
- * Pop an existing item of the free queue, or create new item.
+ * Link an item as the most recently used.
  *
  */
-static lru_item_t *lru_cache_create_item(lru_cache_t *cache) {
-	lru_item_t *item = NULL;
+static inline void lru_cache_link(lru_shard_t *shard, lru_item_t *item) {
+	int c = item->slab_class;
 
-	if (cache->free_items) {
-		item = cache->free_items;
-		cache->free_items = item->next;
+	item->class_prev = NULL;
+	item->class_next = shard->class_head[c];
+
+	if (shard->class_head[c]) {
+		shard->class_head[c]->class_prev = item;
 	} else {
-		item = malloc(sizeof(lru_item_t));
+		shard->class_tail[c] = item;
 	}
 
-	return item;
+	shard->class_head[c] = item;
+
+	item->lru_prev = NULL;
+	item->lru_next = shard->lru_head;
+
+	if (shard->lru_head) {
+		shard->lru_head->lru_prev = item;
+	} else {
+		shard->lru_tail = item;
+	}
+
+	shard->lru_head = item;
+}
+
+static inline void lru_cache_touch(lru_shard_t *shard, lru_item_t *item) {
+	if (shard->lru_head != item) {
+		lru_cache_unlink(shard, item);
+		lru_cache_link(shard, item);
+	}
+}
+
+/**
+ * Link an item at the head of its hash chain.
+ *
+ */
+static inline void lru_cache_hash_link(lru_shard_t *shard, lru_item_t *item) {
+	item->pprev = &shard->items[item->hash_index];
+	item->next = *item->pprev;
+
+	if (item->next) {
+		item->next->pprev = &item->next;
+	}
+
+	*item->pprev = item;
 }
 
-lru_cache_t *lru_cache_init(size_t cache_size, size_t average_len) {
-	lru_cache_t *cache = malloc(sizeof(lru_cache_t));
+/**
+ * Remove an item. Its object is freed once readers release it.
+ *
+ */
+static void lru_cache_remove_item(lru_shard_t *shard, lru_item_t *item) {
+	*item->pprev = item->next;
+
+	if (item->next) {
+		item->next->pprev = item->pprev;
+	}
+
+	lru_cache_unlink(shard, item);
+
+	shard->free_memory += item->size;
+	lru_value_release(item->value);
+}
+
+/**
+ * Remove the least recently used item of slab_class, or of the shard if
+ * the class has none.
+ *
+ */
+static void lru_cache_remove_lru(lru_shard_t *shard, int slab_class) {
+	lru_item_t *lru_item = shard->class_tail[slab_class];
+
+	if (!lru_item && !(lru_item = shard->lru_tail)) {
+		return;
+	}
+
+	lru_cache_remove_item(shard, lru_item);
+}
+
+static bool lru_shard_init(lru_shard_t *shard, size_t shard_size,
+	size_t hash_table_size) {
+	memset(shard, 0, sizeof(lru_shard_t));
+
+	shard->hash_table_size = hash_table_size > 0 ? hash_table_size : 1;
+	shard->total_memory = shard->free_memory = shard_size;
+
+	shard->items = calloc(shard->hash_table_size, sizeof(lru_item_t *));
+	if (!shard->items) {
+		perror("lru_cache cannot create hash table");
+		return false;
+	}
+
+	if (pthread_mutex_init(&shard->lock, NULL)) {
+		perror("lru_cache cannot create mutex");
+		free(shard->items);
+		return false;
+	}
+
+	return true;
+}
+
+static lru_cache_error lru_shard_free(lru_shard_t *shard) {
+	lru_item_t *item = NULL, *next = NULL;
+	uint32_t i;
+
+	for (i = 0; i < shard->hash_table_size; i++) {
+		item = shard->items[i];
+		while (item) {
+			next = item->next;
+			lru_value_release(item->value);
+			item = next;
+		}
+	}
+
+	free(shard->items);
+
+	if (pthread_mutex_destroy(&shard->lock)) {
+		perror("lru_cache cannot destroy mutex");
+		return LRU_CACHE_PTHREAD_ERROR;
+	}
+
+	return LRU_CACHE_NO_ERROR;
+}
+
+lru_cache_t *lru_cache_init(size_t cache_size, size_t max_len) {
+	size_t num_shards = LRU_CACHE_DEFAULT_SHARDS;
+	size_t shard_min = lru_cache_item_size(0, max_len)
+		* LRU_CACHE_SHARD_OBJECTS;
+
+	// A value near max_len should neither be refused nor flush its shard.
+	if (cache_size / shard_min < num_shards) {
+		num_shards = cache_size / shard_min;
+	}
+
+	return lru_cache_init_sharded(cache_size,
+		max_len < LRU_CACHE_EXPECTED_LEN ? max_len : LRU_CACHE_EXPECTED_LEN,
+		num_shards > 0 ? num_shards : 1);
+}
+
+lru_cache_t *lru_cache_init_sharded(size_t cache_size, size_t average_len,
+	size_t num_shards) {
+	lru_cache_t *cache;
+	size_t i;
+
+	if (num_shards == 0 || average_len == 0) {
+		return NULL;
+	}
+
+	cache = malloc(sizeof(lru_cache_t));
 	if (!cache) {
 		perror("lru_cache cannot create object");
 		return NULL;
@@ -147,152 +385,127 @@ lru_cache_t *lru_cache_init(size_t cache_size, size_t average_len) {
 
 	memset(cache, 0, sizeof(lru_cache_t));
 
-	cache->hash_table_size = cache_size / average_len;
-	cache->total_memory = cache->free_memory = cache_size;
+	cache->num_shards = num_shards;
+	cache->total_memory = cache_size / num_shards * num_shards;
 	cache->seed = time(NULL);
 
-	cache->items = malloc(sizeof(lru_cache_t *) * cache->hash_table_size);
-	if (!cache->items) {
-		perror("lru_cache cannot create hash table");
+	cache->slab = lru_slab_init();
+	if (!cache->slab) {
 		free(cache);
 		return NULL;
 	}
 
-	cache->lock = malloc(sizeof(pthread_mutex_t));
-	if (pthread_mutex_init(cache->lock, NULL)) {
-		perror("lru_cache cannot create mutex");
-		free(cache->items);
+	cache->shards = malloc(sizeof(lru_shard_t) * num_shards);
+	if (!cache->shards) {
+		perror("lru_cache cannot create shards");
+		lru_slab_close(cache->slab);
 		free(cache);
 		return NULL;
 	}
 
+	for (i = 0; i < num_shards; i++) {
+		if (!lru_shard_init(&cache->shards[i], cache_size / num_shards,
+				cache_size / average_len / num_shards)) {
+			while (i-- > 0) {
+				lru_shard_free(&cache->shards[i]);
+			}
+			lru_slab_close(cache->slab);
+			free(cache->shards);
+			free(cache);
+			return NULL;
+		}
+	}
+
 	return cache;
 }
 
 lru_cache_error lru_cache_free(lru_cache_t *cache) {
 	lru_cache_test_missing_cache(cache);
 
-	lru_item_t *item = NULL, *next = NULL;
-	uint32_t i;
-
-	if (cache->items) {
-		for (i = 0; i < cache->hash_table_size; i++) {
-			item = cache->items[i];
-			while (item) {
-				next = item->next;
-				free(item);
-				item = next;
-			}
-		}
+	lru_cache_error err = LRU_CACHE_NO_ERROR;
+	size_t i;
 
-		free(cache->items);
-	}
-
-	if (cache->lock) {
-		if (pthread_mutex_destroy(cache->lock)) {
-			perror("lru_cache cannot destroy mutex");
-			return LRU_CACHE_PTHREAD_ERROR;
+	for (i = 0; i < cache->num_shards; i++) {
+		if (lru_shard_free(&cache->shards[i]) != LRU_CACHE_NO_ERROR) {
+			err = LRU_CACHE_PTHREAD_ERROR;
 		}
-
-		free(cache->lock);
 	}
 
+	// Values still read keep their pages until released.
+	lru_slab_close(cache->slab);
+	free(cache->shards);
 	free(cache);
 
-	return LRU_CACHE_NO_ERROR;
+	return err;
 }
 
 lru_cache_error lru_cache_set(lru_cache_t *cache, void *key, size_t key_len,
 	void *value, size_t value_len) {
-	lru_cache_test_missing_cache(cache);
-	lru_cache_test_missing_key(key);
 	lru_cache_test_missing_value(value);
-	lru_cache_test_value_too_large(cache, value_len);
 
-	lock_cache(cache);
+	struct iovec iov = { value, value_len };
 
-	uint32_t hash_index = lru_hash(cache, key, key_len);
-	uint32_t required = 0;
-	lru_item_t *item = cache->items[hash_index];
-	lru_item_t *prev = NULL;
-
-	void *new_key;
-	void *new_value;
-
-	while (item && lru_cache_cmp_keys(item, key, key_len)) {
-		prev = item;
-		item = item->next;
-	}
-
-	if (item) {
-		required = value_len - item->value_len;
-		free(item->value);
-		new_value = malloc(value_len);
-
-		if (!new_value) {
-			perror("lru_cache_set cannot create new_value");
-			unlock_cache(cache);
-			return LRU_CACHE_NO_MEM;
-		}
+	return lru_cache_setv(cache, key, key_len, &iov, 1);
+}
 
-		memcpy(new_value, value, value_len);
+lru_cache_error lru_cache_setv(lru_cache_t *cache, void *key, size_t key_len,
+	const struct iovec *iov, int iovcnt) {
+	lru_cache_test_missing_cache(cache);
+	lru_cache_test_missing_key(key);
+	lru_cache_test_missing_value(iov);
 
-		item->value = new_value;
-		item->value_len = value_len;
-	} else {
-		item = lru_cache_create_item(cache);
-		if (!item) {
-			perror("lru_cache_set cannot create item");
-			unlock_cache(cache);
-			return LRU_CACHE_NO_MEM;
-		}
+	size_t value_len = 0;
+	uint32_t hash_index;
+	lru_shard_t *shard = lru_cache_shard(cache,
+		lru_hash(cache, key, key_len), &hash_index);
+	int i;
 
-		memset(item, 0, sizeof(lru_item_t));
+	for (i = 0; i < iovcnt; i++) {
+		value_len += iov[i].iov_len;
+	}
 
-		new_key = malloc(key_len);
+	lru_cache_test_value_too_large(shard,
+		lru_cache_item_size(key_len, value_len));
 
-		if (!new_key) {
-			perror("lru_cache_set cannot create new_key");
-			unlock_cache(cache);
-			return LRU_CACHE_NO_MEM;
-		}
+	// Copied before locking, so that readers of the shard do not wait.
+	lru_item_t *new_item = lru_item_create(cache->slab, key, key_len, iov,
+		iovcnt, value_len);
 
-		new_value = malloc(value_len);
+	if (!new_item) {
+		perror("lru_cache_set cannot create new_item");
+		return LRU_CACHE_NO_MEM;
+	}
 
-		if (!new_value) {
-			free(new_key);
-			perror("lru_cache_set cannot create new_value");
-			unlock_cache(cache);
-			return LRU_CACHE_NO_MEM;
-		}
+	new_item->hash_index = hash_index;
 
-		memcpy(new_key, key, key_len);
-		memcpy(new_value, value, value_len);
+	if (pthread_mutex_lock(&shard->lock)) {
+		perror("lru_cache failed to pthread_mutex_lock");
+		lru_value_release(new_item->value);
+		return LRU_CACHE_PTHREAD_ERROR;
+	}
 
-		item->key = new_key;
-		item->value = new_value;
-		item->key_len = key_len;
-		item->value_len = value_len;
-		required = value_len;
+	lru_item_t *item = shard->items[hash_index];
 
-		if (prev) {
-			prev->next = item;
-		} else {
-			cache->items[hash_index] = item;
-		}
+	while (item && lru_cache_cmp_keys(item, key, key_len)) {
+		item = item->next;
 	}
 
-	item->access_count = ++cache->access_count;
+	// Removed first so that it is never evicted below. Readers holding its
+	// value keep it alive.
+	if (item) {
+		lru_cache_remove_item(shard, item);
+	}
 
-	if (required > 0 && required > cache->free_memory) {
-		while (cache->free_memory < required) {
-			lru_cache_remove_lru(cache);
-		}
+	while (shard->free_memory < new_item->size) {
+		lru_cache_remove_lru(shard, new_item->slab_class);
 	}
 
-	cache->free_memory -= required;
+	shard->free_memory -= new_item->size;
 
-	unlock_cache(cache);
+	lru_cache_hash_link(shard, new_item);
+	lru_cache_link(shard, new_item);
+
+	unlock_shard(shard);
 
 	return LRU_CACHE_NO_ERROR;
 }
@@ -302,47 +515,79 @@ lru_cache_error lru_cache_get(lru_cache_t *cache, void *key, size_t key_len,
 	lru_cache_test_missing_cache(cache);
 	lru_cache_test_missing_key(key);
 
-	lock_cache(cache);
+	uint32_t hash_index;
+	lru_shard_t *shard = lru_cache_shard(cache,
+		lru_hash(cache, key, key_len), &hash_index);
+
+	lock_shard(shard);
 
-	uint32_t hash_index = lru_hash(cache, key, key_len);
-	lru_item_t *item = cache->items[hash_index];
+	lru_item_t *item = shard->items[hash_index];
 
 	while (item && lru_cache_cmp_keys(item, key, key_len)) {
 		item = item->next;
 	}
 
 	if (item) {
-		*value = item->value;
+		__atomic_add_fetch(&item->value->refcount, 1, __ATOMIC_RELAXED);
+		*value = item->value->data;
 		*value_len = item->value_len;
-		item->access_count++;
+		lru_cache_touch(shard, item);
 	} else {
 		*value = NULL;
 		*value_len = 0;
 	}
 
-	unlock_cache(cache);
+	unlock_shard(shard);
 	return LRU_CACHE_NO_ERROR;
 }
 
+void lru_cache_release(void *value) {
+	if (value) {
+		lru_value_release(lru_value_of(value));
+	}
+}
+
+int lru_cache_value_fd(void *value, off_t *offset) {
+	*offset = sizeof(lru_item_t) + offsetof(lru_value_t, data);
+	return lru_value_of(value)->fd;
+}
+
+size_t lru_cache_free_memory(lru_cache_t *cache) {
+	size_t i, free_memory = 0;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		pthread_mutex_lock(&cache->shards[i].lock);
+		free_memory += cache->shards[i].free_memory;
+		pthread_mutex_unlock(&cache->shards[i].lock);
+	}
+
+	return free_memory;
+}
+
+size_t lru_cache_slab_memory(lru_cache_t *cache) {
+	return lru_slab_memory(cache->slab);
+}
+
 lru_cache_error lru_cache_delete(lru_cache_t *cache, void *key, size_t key_len) {
 	lru_cache_test_missing_cache(cache);
 	lru_cache_test_missing_key(key);
 
-	lock_cache(cache);
+	uint32_t hash_index;
+	lru_shard_t *shard = lru_cache_shard(cache,
+		lru_hash(cache, key, key_len), &hash_index);
+
+	lock_shard(shard);
 
-	uint32_t hash_index = lru_hash(cache, key, key_len);
-	lru_item_t *item = cache->items[hash_index];
-	lru_item_t *prev = NULL;
+	lru_item_t *item = shard->items[hash_index];
 
 	while (item && lru_cache_cmp_keys(item, key, key_len)) {
-		prev = item;
 		item = item->next;
 	}
 
 	if (item) {
-		lru_cache_remove_item(cache, prev, item, hash_index);
+		lru_cache_remove_item(shard, item);
 	}
 
-	unlock_cache(cache);
+	unlock_shard(shard);
 	return LRU_CACHE_NO_ERROR;
 }
@@ -7,6 +7,10 @@ extern "C" {
 #include <stdlib.h>
 #include <time.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "slab.h"
 
 typedef enum {
 	LRU_CACHE_NO_ERROR = 0,
@@ -18,31 +22,92 @@ typedef enum {
 	LRU_CACHE_VALUE_TOO_LONG
 } lru_cache_error;
 
+/**
+ * Immutable value shared by the cache and its readers. It is freed when
+ * the cache drops it and the last reader releases it.
+ * Values of at least LRU_CACHE_MEMFD_MIN bytes are mapped from a memfd,
+ * which holds this header too, so they can be sent with sendfile().
+ */
+typedef struct {
+	size_t refcount;
+	size_t len;
+	size_t size;			// Bytes of the whole object.
+	struct lru_slab *slab;		// Owner of the chunk, or NULL if large.
+	int fd;				// memfd, or -1 if not mapped.
+	_Alignas(8) char data[];	// As aligned as slab chunks.
+} lru_value_t;
+
+/**
+ * Item header, followed by its value and then its key in one object. Objects
+ * up to LRU_SLAB_MAX_CHUNK bytes are slab chunks, larger ones are mapped
+ * from a memfd or malloc'ed.
+ */
 typedef struct lru_item {
 	void *key;
-	void *value;
+	lru_value_t *value;
 	size_t key_len;
 	size_t value_len;
-	size_t access_count;
-	struct lru_item *next;
+	size_t size;			// Bytes charged to the shard.
+	size_t hash_index;
+	int slab_class;			// LRU_SLAB_MAX_CLASSES if large.
+	struct lru_item *next;		// Hash chain.
+	struct lru_item **pprev;	// Link to this item in the chain.
+	struct lru_item *lru_prev;	// Recency list, toward most recently used.
+	struct lru_item *lru_next;	// Recency list, toward least recently used.
+	struct lru_item *class_prev;	// Same for items of slab_class only.
+	struct lru_item *class_next;
 } lru_item_t;
 
+/**
+ * Independent part of the cache with its own lock and memory budget.
+ * Items are also linked from most (lru_head) to least (lru_tail) recently
+ * used, so the item to evict is always at lru_tail. Each slab class has
+ * its own list too, evicted first so that a new item reuses the chunk of
+ * an old one instead of taking another page.
+ */
 typedef struct {
 	lru_item_t **items;
-	lru_item_t *free_items;
-	size_t access_count;
+	lru_item_t *lru_head;
+	lru_item_t *lru_tail;
+	lru_item_t *class_head[LRU_SLAB_MAX_CLASSES + 1];
+	lru_item_t *class_tail[LRU_SLAB_MAX_CLASSES + 1];
 	size_t total_memory;
 	size_t free_memory;
 	size_t hash_table_size;
+	pthread_mutex_t lock;
+} lru_shard_t;
+
+typedef struct {
+	lru_shard_t *shards;
+	size_t num_shards;
+	size_t total_memory;
+	lru_slab_t *slab;		// Shared by shards.
 	time_t seed;
-	pthread_mutex_t *lock;
 } lru_cache_t;
 
+#define LRU_CACHE_DEFAULT_SHARDS 16
+#define LRU_CACHE_SHARD_OBJECTS 4	// Largest values a shard holds at least.
+#define LRU_CACHE_EXPECTED_LEN (8*1024)	// Item size hash tables are sized for.
+#define LRU_CACHE_MEMFD_MIN (64*1024)
+#define LRU_CACHE_LARGE_ALIGN 4096	// Large objects are charged in pages.
+
+/**
+ * Initialize lru_cache_t object for values up to max_len bytes.
+ * The number of shards is LRU_CACHE_DEFAULT_SHARDS, or less so that every
+ * shard can hold LRU_CACHE_SHARD_OBJECTS values of max_len bytes. Hash
+ * tables are sized for items of LRU_CACHE_EXPECTED_LEN bytes.
+ *
+ */
+lru_cache_t *lru_cache_init(size_t cache_size, size_t max_len);
+
 /**
- * Initialize lru_cache_t object.
+ * Initialize lru_cache_t object split into num_shards shards.
+ * Keys are spread over shards by hash. Each shard has its own lock and
+ * cache_size / num_shards bytes, so a value must fit in a shard.
  *
  */
-lru_cache_t *lru_cache_init(size_t cache_size, size_t average_len);
+lru_cache_t *lru_cache_init_sharded(size_t cache_size, size_t average_len,
+	size_t num_shards);
 
 /**
  * Free lru_cache_t object.
@@ -57,13 +122,58 @@ lru_cache_error lru_cache_free(lru_cache_t *cache);
 lru_cache_error lru_cache_set(lru_cache_t *cache, void *key, size_t key_len,
 	void *value, size_t value_len);
 
+/**
+ * Set item to cache. The value is the concatenation of iov, copied once.
+ *
+ */
+lru_cache_error lru_cache_setv(lru_cache_t *cache, void *key, size_t key_len,
+	const struct iovec *iov, int iovcnt);
+
 /**
  * Get item from cache.
+ * On hit, value points to the cached bytes without copying them. They stay
+ * valid even if the item is replaced or evicted, until value is passed to
+ * lru_cache_release().
  *
  */
 lru_cache_error lru_cache_get(lru_cache_t *cache, void *key, size_t key_len,
 	void **value, size_t *value_len);
 
+/**
+ * Release a value returned by lru_cache_get(). NULL is ignored.
+ *
+ */
+void lru_cache_release(void *value);
+
+/**
+ * Get the file holding a value returned by lru_cache_get(), to send it
+ * with sendfile() instead of from memory.
+ *
+ * @params offset Set to the offset of the value in the file.
+ * @return File descriptor owned by the value, or -1 if it is in memory
+ *         only.
+ */
+int lru_cache_value_fd(void *value, off_t *offset);
+
+/**
+ * Get free memory summed over shards.
+ *
+ */
+size_t lru_cache_free_memory(lru_cache_t *cache);
+
+/**
+ * Get the bytes an item is charged, its header and the rest of its chunk
+ * included.
+ *
+ */
+size_t lru_cache_item_size(size_t key_len, size_t value_len);
+
+/**
+ * Get the bytes held in slab pages, unused chunks included.
+ *
+ */
+size_t lru_cache_slab_memory(lru_cache_t *cache);
+
 /**
  * Delete item associated by key from cache.
  *
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define LRU_SLAB_PAGE_SPACE (LRU_SLAB_PAGE_SIZE - LRU_SLAB_PAGE_HEADER)
+
+_Static_assert(sizeof(lru_slab_page_t) <= LRU_SLAB_PAGE_HEADER,
+	"lru_slab_page_t does not fit LRU_SLAB_PAGE_HEADER");
+
+/**
+ * Chunk size of the class after the one of size. It is grown to use the
+ * end of the page left by as many chunks.
+ */
+static inline size_t lru_slab_next_size(size_t size) {
+	size = size * LRU_SLAB_GROWTH;
+	size = (LRU_SLAB_PAGE_SPACE / (LRU_SLAB_PAGE_SPACE / size)) & ~(size_t) 7;
+	return size < LRU_SLAB_MAX_CHUNK ? size : LRU_SLAB_MAX_CHUNK;
+}
+
+static inline lru_slab_page_t *lru_slab_page_of(void *chunk) {
+	return (lru_slab_page_t *)
+		((uintptr_t) chunk & ~(uintptr_t) (LRU_SLAB_PAGE_SIZE - 1));
+}
+
+static void lru_slab_unlink(lru_slab_page_t **head, lru_slab_page_t *page) {
+	if (page->prev) {
+		page->prev->next = page->next;
+	} else {
+		*head = page->next;
+	}
+
+	if (page->next) {
+		page->next->prev = page->prev;
+	}
+
+	page->prev = page->next = NULL;
+}
+
+static void lru_slab_link(lru_slab_page_t **head, lru_slab_page_t *page) {
+	page->prev = NULL;
+	page->next = *head;
+
+	if (*head) {
+		(*head)->prev = page;
+	}
+
+	*head = page;
+}
+
+static void lru_slab_destroy(lru_slab_t *slab) {
+	lru_slab_page_t *page, *next;
+	int i;
+
+	// Only spare pages are left once every chunk is freed.
+	for (page = slab->spare; page; page = next) {
+		next = page->next;
+		free(page);
+	}
+
+	for (i = 0; i < slab->num_classes; i++) {
+		pthread_mutex_destroy(&slab->classes[i].lock);
+	}
+	pthread_mutex_destroy(&slab->spare_lock);
+	free(slab);
+}
+
+// Drop a reference, and destroy slab with the last one.
+static void lru_slab_unref(lru_slab_t *slab) {
+	if (__atomic_sub_fetch(&slab->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		lru_slab_destroy(slab);
+	}
+}
+
+lru_slab_t *lru_slab_init() {
+	lru_slab_t *slab;
+	size_t size = LRU_SLAB_MIN_CHUNK;
+	int i;
+
+	if ((slab = malloc(sizeof(lru_slab_t))) == NULL) {
+		perror("lru_slab cannot create object");
+		return NULL;
+	}
+
+	memset(slab, 0, sizeof(lru_slab_t));
+	slab->refs = 1;
+
+	if (pthread_mutex_init(&slab->spare_lock, NULL)) {
+		perror("lru_slab cannot create mutex");
+		free(slab);
+		return NULL;
+	}
+
+	for (i = 0; ; size = lru_slab_next_size(size)) {
+		if (pthread_mutex_init(&slab->classes[i].lock, NULL)) {
+			perror("lru_slab cannot create mutex");
+			slab->num_classes = i;
+			lru_slab_destroy(slab);
+			return NULL;
+		}
+
+		slab->classes[i].size = size;
+		slab->classes[i].per_page = LRU_SLAB_PAGE_SPACE / size;
+		if (++i == LRU_SLAB_MAX_CLASSES || size == LRU_SLAB_MAX_CHUNK) {
+			break;
+		}
+	}
+	slab->num_classes = i;
+
+	return slab;
+}
+
+void lru_slab_close(lru_slab_t *slab) {
+	lru_slab_unref(slab);
+}
+
+size_t lru_slab_chunk_size(size_t size) {
+	size_t chunk = LRU_SLAB_MIN_CHUNK;
+	int i;
+
+	for (i = 1; chunk < size && i < LRU_SLAB_MAX_CLASSES
+		&& chunk < LRU_SLAB_MAX_CHUNK; i++) {
+		chunk = lru_slab_next_size(chunk);
+	}
+
+	return chunk >= size ? chunk : 0;
+}
+
+int lru_slab_class(lru_slab_t *slab, size_t size) {
+	int i;
+
+	for (i = 0; i < slab->num_classes; i++) {
+		if (slab->classes[i].size >= size) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void *lru_slab_alloc(lru_slab_t *slab, int slab_class) {
+	lru_slab_class_t *cls = &slab->classes[slab_class];
+	lru_slab_page_t *page;
+	void *chunk;
+
+	pthread_mutex_lock(&cls->lock);
+
+	if ((page = cls->partial) == NULL) {
+		// No class lock is taken while the spare lock is held.
+		pthread_mutex_lock(&slab->spare_lock);
+		if ((page = slab->spare) != NULL) {
+			lru_slab_unlink(&slab->spare, page);
+			slab->num_spare--;
+		}
+		pthread_mutex_unlock(&slab->spare_lock);
+
+		if (!page) {
+			if ((page = aligned_alloc(LRU_SLAB_PAGE_SIZE,
+					LRU_SLAB_PAGE_SIZE)) == NULL) {
+				pthread_mutex_unlock(&cls->lock);
+				return NULL;
+			}
+			__atomic_add_fetch(&slab->num_pages, 1, __ATOMIC_RELAXED);
+		}
+
+		memset(page, 0, sizeof(lru_slab_page_t));
+		page->slab_class = slab_class;
+		lru_slab_link(&cls->partial, page);
+	}
+
+	if ((chunk = page->free_chunks) != NULL) {
+		page->free_chunks = *(void **) chunk;
+	} else {
+		chunk = (char *) page + LRU_SLAB_PAGE_HEADER
+			+ page->carved++ * cls->size;
+	}
+
+	page->used++;
+
+	if (page->used == cls->per_page) {
+		lru_slab_unlink(&cls->partial, page);
+	}
+
+	pthread_mutex_unlock(&cls->lock);
+
+	__atomic_add_fetch(&slab->refs, 1, __ATOMIC_RELAXED);
+	return chunk;
+}
+
+void lru_slab_free(lru_slab_t *slab, void *chunk) {
+	lru_slab_page_t *page = lru_slab_page_of(chunk);
+	// The class of a page stays while chunk is in use.
+	lru_slab_class_t *cls = &slab->classes[page->slab_class];
+	bool empty;
+
+	pthread_mutex_lock(&cls->lock);
+
+	// A full page is in no list.
+	if (page->used == cls->per_page) {
+		lru_slab_link(&cls->partial, page);
+	}
+
+	*(void **) chunk = page->free_chunks;
+	page->free_chunks = chunk;
+	page->used--;
+
+	// An empty page is out of every list, so nothing else can reach it.
+	if ((empty = page->used == 0)) {
+		lru_slab_unlink(&cls->partial, page);
+	}
+
+	pthread_mutex_unlock(&cls->lock);
+
+	if (empty) {
+		pthread_mutex_lock(&slab->spare_lock);
+		if (slab->num_spare < LRU_SLAB_SPARE_PAGES) {
+			lru_slab_link(&slab->spare, page);
+			slab->num_spare++;
+			page = NULL;
+		}
+		pthread_mutex_unlock(&slab->spare_lock);
+
+		if (page) {
+			free(page);
+			__atomic_sub_fetch(&slab->num_pages, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	lru_slab_unref(slab);
+}
+
+size_t lru_slab_memory(lru_slab_t *slab) {
+	return __atomic_load_n(&slab->num_pages, __ATOMIC_RELAXED)
+		* LRU_SLAB_PAGE_SIZE;
+}
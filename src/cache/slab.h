@@ -0,0 +1,105 @@
+#ifndef SLAB_H
+#define SLAB_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define LRU_SLAB_PAGE_SIZE (64*1024)    // Aligned, so a chunk finds its page.
+#define LRU_SLAB_PAGE_HEADER 64         // Chunks start on a cache line.
+#define LRU_SLAB_MIN_CHUNK 192
+#define LRU_SLAB_MAX_CHUNK ((LRU_SLAB_PAGE_SIZE - LRU_SLAB_PAGE_HEADER) / 4)
+#define LRU_SLAB_GROWTH 1.25            // Chunk size of a class to the next.
+#define LRU_SLAB_MAX_CLASSES 32
+#define LRU_SLAB_SPARE_PAGES 4          // Empty pages kept for any class.
+
+/**
+ * Header at the start of a page, followed by chunks of one class.
+ * Chunks are carved in order, and freed ones are reused first.
+ */
+typedef struct lru_slab_page {
+	struct lru_slab_page *prev;     // Partial pages of the class, or spare
+	struct lru_slab_page *next;     // pages.
+	void *free_chunks;
+	size_t used;
+	size_t carved;
+	int slab_class;
+} lru_slab_page_t;
+
+typedef struct {
+	size_t size;                    // Chunk size.
+	size_t per_page;
+	lru_slab_page_t *partial;       // Pages with chunks to hand out.
+	pthread_mutex_t lock;           // Protects partial and pages of class.
+} lru_slab_class_t;
+
+/**
+ * Size class allocator. Every chunk of a class has the same size and
+ * pages are all LRU_SLAB_PAGE_SIZE bytes, so memory freed by one object
+ * is always reusable by another one of its class, and an empty page by
+ * any class.
+ * Each class has its own lock, so shards sharing the slab only wait for
+ * each other when they allocate or free chunks of the same class.
+ */
+typedef struct lru_slab {
+	lru_slab_class_t classes[LRU_SLAB_MAX_CLASSES];
+	int num_classes;
+	lru_slab_page_t *spare;
+	size_t num_spare;
+	pthread_mutex_t spare_lock;     // Protects spare and num_spare.
+	size_t num_pages;               // Atomic.
+	size_t refs;                    // Atomic. Chunks handed out, and one
+	                                // until closed.
+} lru_slab_t;
+
+/**
+ * Init lru_slab_t with classes from LRU_SLAB_MIN_CHUNK to
+ * LRU_SLAB_MAX_CHUNK bytes.
+ */
+lru_slab_t *lru_slab_init();
+
+/**
+ * Give up slab. It is freed with its pages once every chunk is freed.
+ */
+void lru_slab_close(lru_slab_t *slab);
+
+/**
+ * Get the chunk size used for size bytes, as lru_slab_t classes are the
+ * same for every slab.
+ *
+ * @return Chunk size, or 0 if size is larger than LRU_SLAB_MAX_CHUNK.
+ */
+size_t lru_slab_chunk_size(size_t size);
+
+/**
+ * Find the smallest class with chunks of at least size bytes.
+ *
+ * @return Class, or -1 if size is larger than LRU_SLAB_MAX_CHUNK.
+ */
+int lru_slab_class(lru_slab_t *slab, size_t size);
+
+/**
+ * Get a chunk of slab_class, taking a new page if needed.
+ *
+ * @return Chunk of classes[slab_class].size bytes, or NULL if no memory.
+ */
+void *lru_slab_alloc(lru_slab_t *slab, int slab_class);
+
+/**
+ * Give chunk back to its class. A page left empty is kept as a spare or
+ * freed.
+ */
+void lru_slab_free(lru_slab_t *slab, void *chunk);
+
+/**
+ * Bytes held in pages, spare ones included.
+ */
+size_t lru_slab_memory(lru_slab_t *slab);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "http_cache.h"
+
+#define DELTA_SECONDS_MAX 0x7fffffffL
+
+/**
+ * Find directive name in every header id of headers, as in Cache-Control
+ * or Pragma. Values may be borrowed slices, so lengths are used.
+ *
+ * @params value Set to the delta-seconds argument of the directive, or -1
+ *         if it has none or an invalid one. May be NULL.
+ * @return true if found.
+ */
+static bool find_directive(http_headers_t *headers, http_header_id id,
+    const char *name, long *value) {
+    size_t i, name_len = strlen(name);
+    const char *p, *end, *token;
+    bool quoted;
+    long n;
+
+    for (i = 0; i < headers->num_headers; i++) {
+        if (headers->field_id[i] != id) {
+            continue;
+        }
+
+        p = headers->value[i];
+        end = p + headers->value_len[i];
+
+        while (p < end) {
+            while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+                p++;
+            }
+
+            for (token = p; p < end && *p != '=' && *p != ','
+                && *p != ' ' && *p != '\t'; p++);
+
+            if ((size_t) (p - token) == name_len
+                && strncasecmp(token, name, name_len) == 0) {
+                if (!value) {
+                    return true;
+                }
+
+                *value = -1;
+                if (p < end && *p == '=') {
+                    if (++p < end && *p == '"') {
+                        p++;
+                    }
+
+                    for (n = 0; p < end && isdigit((unsigned char) *p); p++) {
+                        n = n < DELTA_SECONDS_MAX / 10
+                            ? n * 10 + (*p - '0') : DELTA_SECONDS_MAX;
+                        *value = n;
+                    }
+                }
+                return true;
+            }
+
+            // Arguments may be quoted strings with commas.
+            for (quoted = false; p < end && (quoted || *p != ','); p++) {
+                if (*p == '"') {
+                    quoted = !quoted;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool has_directive(http_headers_t *headers, const char *name) {
+    return find_directive(headers, HTTP_HEADER_CACHE_CONTROL, name, NULL);
+}
+
+/**
+ * Statuses cacheable by default, so with heuristic freshness too. Partial
+ * content is left out, only whole objects are stored.
+ */
+static bool is_cacheable_status(enum http_status status) {
+    switch (status) {
+    case HTTP_STATUS_OK:
+    case HTTP_STATUS_NON_AUTHORITATIVE_INFORMATION:
+    case HTTP_STATUS_NO_CONTENT:
+    case HTTP_STATUS_MULTIPLE_CHOICES:
+    case HTTP_STATUS_MOVED_PERMANENTLY:
+    case HTTP_STATUS_PERMANENT_REDIRECT:
+    case HTTP_STATUS_NOT_FOUND:
+    case HTTP_STATUS_METHOD_NOT_ALLOWED:
+    case HTTP_STATUS_GONE:
+    case HTTP_STATUS_URI_TOO_LONG:
+    case HTTP_STATUS_NOT_IMPLEMENTED:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+bool http_cache_storable(http_request_t *request, http_response_t *response) {
+    http_headers_t *headers = response->headers;
+    char vary[HTTP_CACHE_VARY_LEN];
+
+    if (request->method != HTTP_GET
+        || has_directive(request->headers, "no-store")
+        || !is_cacheable_status(response->status)) {
+        return false;
+    }
+
+    if (has_directive(headers, "no-store") || has_directive(headers, "private")
+        || headers->index[HTTP_HEADER_SET_COOKIE] != 0
+        || http_cache_vary(response, vary, sizeof(vary)) == -1) {
+        return false;
+    }
+
+    // Answers to an authorized request are for its user only, unless
+    // origin says otherwise.
+    if (request->headers->index[HTTP_HEADER_AUTHORIZATION] != 0
+        && !has_directive(headers, "public")
+        && !has_directive(headers, "s-maxage")
+        && !has_directive(headers, "must-revalidate")) {
+        return false;
+    }
+
+    return true;
+}
+
+time_t http_cache_parse_date(const char *str) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT",    // RFC 850
+        "%a %b %e %H:%M:%S %Y",         // asctime
+    };
+    struct tm tm;
+    const char *end;
+    size_t i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+
+        if ((end = strptime(str, formats[i], &tm)) != NULL) {
+            while (*end == ' ' || *end == '\t') {
+                end++;
+            }
+
+            if (*end == '\0') {
+                return timegm(&tm);
+            }
+        }
+    }
+
+    return -1;
+}
+
+static time_t get_date(http_headers_t *headers, http_header_id id) {
+    char *value = find_header(headers, id);
+
+    return value ? http_cache_parse_date(value) : -1;
+}
+
+/**
+ * Headers holding id once stored headers, if any, are updated with the
+ * received ones.
+ */
+static http_headers_t *updated(http_headers_t *headers,
+    http_headers_t *stored, http_header_id id) {
+    return stored && headers->index[id] == 0 ? stored : headers;
+}
+
+static void init_entry(http_cache_entry_t *entry, http_headers_t *headers,
+    http_headers_t *stored, time_t request_time, time_t response_time) {
+    http_headers_t *cache_control = updated(headers, stored,
+        HTTP_HEADER_CACHE_CONTROL);
+    http_headers_t *expires = updated(headers, stored, HTTP_HEADER_EXPIRES);
+    time_t date, expires_date, last_modified, apparent_age, age = 0;
+    char *value;
+    long n;
+
+    memset(entry, 0, sizeof(http_cache_entry_t));
+    entry->response_time = response_time;
+    entry->stale_while_revalidate = -1;
+    entry->stale_if_error = -1;
+
+    // Date and Age are of the received response only.
+    if ((date = get_date(headers, HTTP_HEADER_DATE)) == -1) {
+        date = response_time;
+    }
+
+    if ((value = find_header(headers, HTTP_HEADER_AGE)) != NULL
+        && isdigit((unsigned char) *value)) {
+        age = strtol(value, NULL, 10);
+    }
+
+    // Age is corrected for the delay of the response, as origin counted it
+    // from when the response left.
+    apparent_age = response_time > date ? response_time - date : 0;
+    age += response_time > request_time ? response_time - request_time : 0;
+    entry->initial_age = apparent_age > age ? apparent_age : age;
+
+    if (has_directive(cache_control, "no-cache")) {
+        entry->lifetime = 0;
+    } else if (find_directive(cache_control, HTTP_HEADER_CACHE_CONTROL,
+            "s-maxage", &n)
+        || find_directive(cache_control, HTTP_HEADER_CACHE_CONTROL,
+            "max-age", &n)) {
+        entry->lifetime = n > 0 ? n : 0;
+    } else if (expires->index[HTTP_HEADER_EXPIRES] != 0) {
+        // An invalid date means already expired.
+        expires_date = get_date(expires, HTTP_HEADER_EXPIRES);
+        entry->lifetime = expires_date > date ? expires_date - date : 0;
+    } else if ((last_modified = get_date(updated(headers, stored,
+            HTTP_HEADER_LAST_MODIFIED), HTTP_HEADER_LAST_MODIFIED)) != -1
+        && last_modified < date) {
+        entry->lifetime = (date - last_modified)
+            / HTTP_CACHE_HEURISTIC_FRACTION;
+        if (entry->lifetime > HTTP_CACHE_HEURISTIC_MAX) {
+            entry->lifetime = HTTP_CACHE_HEURISTIC_MAX;
+        }
+    }
+
+    // RFC 5861. s-maxage implies proxy-revalidate.
+    entry->must_revalidate = has_directive(cache_control, "must-revalidate")
+        || has_directive(cache_control, "proxy-revalidate")
+        || has_directive(cache_control, "s-maxage")
+        || has_directive(cache_control, "no-cache");
+
+    if (find_directive(cache_control, HTTP_HEADER_CACHE_CONTROL,
+            "stale-while-revalidate", &n)) {
+        entry->stale_while_revalidate = n;
+    }
+
+    if (find_directive(cache_control, HTTP_HEADER_CACHE_CONTROL,
+            "stale-if-error", &n)) {
+        entry->stale_if_error = n;
+    }
+}
+
+void http_cache_init_entry(http_cache_entry_t *entry,
+    http_response_t *response, time_t request_time, time_t response_time) {
+    init_entry(entry, response->headers, NULL, request_time, response_time);
+}
+
+void http_cache_update_entry(http_cache_entry_t *entry,
+    http_response_t *stored, http_response_t *response, time_t request_time,
+    time_t response_time) {
+    init_entry(entry, response->headers, stored->headers, request_time,
+        response_time);
+}
+
+bool http_cache_has_validator(http_response_t *response) {
+    return response->headers->index[HTTP_HEADER_ETAG] != 0
+        || response->headers->index[HTTP_HEADER_LAST_MODIFIED] != 0;
+}
+
+bool http_cache_make_conditional(http_request_t *request,
+    http_response_t *stored) {
+    http_headers_t *headers = request->headers;
+    char *etag, *last_modified;
+
+    // A client validating its own copy gets the answer of origin.
+    if (headers->index[HTTP_HEADER_IF_NONE_MATCH] != 0
+        || headers->index[HTTP_HEADER_IF_MODIFIED_SINCE] != 0) {
+        return false;
+    }
+
+    etag = find_header(stored->headers, HTTP_HEADER_ETAG);
+    last_modified = find_header(stored->headers, HTTP_HEADER_LAST_MODIFIED);
+
+    if (!etag && !last_modified) {
+        return false;
+    }
+
+    return (!etag || set_header(headers, "If-None-Match", etag))
+        && (!last_modified
+            || set_header(headers, "If-Modified-Since", last_modified));
+}
+
+time_t http_cache_age(const http_cache_entry_t *entry, time_t now) {
+    return entry->initial_age
+        + (now > entry->response_time ? now - entry->response_time : 0);
+}
+
+bool http_cache_fresh(const http_cache_entry_t *entry,
+    http_request_t *request, time_t now) {
+    http_headers_t *headers = request->headers;
+    time_t age = http_cache_age(entry, now);
+    long n;
+
+    // Pragma counts only from clients not sending Cache-Control.
+    if (has_directive(headers, "no-cache")
+        || (headers->index[HTTP_HEADER_CACHE_CONTROL] == 0
+            && find_directive(headers, HTTP_HEADER_PRAGMA, "no-cache",
+                NULL))) {
+        return false;
+    }
+
+    if (find_directive(headers, HTTP_HEADER_CACHE_CONTROL, "max-age", &n)
+        && age > (n > 0 ? n : 0)) {
+        return false;
+    }
+
+    if (find_directive(headers, HTTP_HEADER_CACHE_CONTROL, "min-fresh", &n)
+        && entry->lifetime - age < n) {
+        return false;
+    }
+
+    return age < entry->lifetime;
+}
+
+/**
+ * Tell whether entry may be served stale to request for window seconds
+ * after it expired.
+ */
+static bool stale_within(const http_cache_entry_t *entry,
+    http_request_t *request, time_t now, time_t window) {
+    http_headers_t *headers = request->headers;
+
+    // A client asking for freshness gets it.
+    if (entry->must_revalidate || window <= 0
+        || has_directive(headers, "no-cache")
+        || has_directive(headers, "max-age")
+        || has_directive(headers, "min-fresh")
+        || (headers->index[HTTP_HEADER_CACHE_CONTROL] == 0
+            && find_directive(headers, HTTP_HEADER_PRAGMA, "no-cache",
+                NULL))) {
+        return false;
+    }
+
+    return http_cache_age(entry, now) < entry->lifetime + window;
+}
+
+bool http_cache_stale_while_revalidate(const http_cache_entry_t *entry,
+    http_request_t *request, time_t now, time_t window) {
+    if (entry->stale_while_revalidate != -1) {
+        window = entry->stale_while_revalidate;
+    }
+
+    return stale_within(entry, request, now, window);
+}
+
+bool http_cache_stale_if_error(const http_cache_entry_t *entry,
+    http_request_t *request, time_t now, time_t window) {
+    long n;
+
+    if (entry->stale_if_error != -1) {
+        window = entry->stale_if_error;
+    } else if (find_directive(request->headers, HTTP_HEADER_CACHE_CONTROL,
+            "stale-if-error", &n)) {
+        window = n;
+    }
+
+    return stale_within(entry, request, now, window);
+}
+
+/**
+ * Tell whether If-Range value holds for stored: an entity tag matching its
+ * ETag strongly, or a date equal to its Last-Modified.
+ */
+static bool if_range_matches(const char *value, http_response_t *stored) {
+    char *validator;
+
+    if (strncmp(value, "W/", 2) == 0) {
+        return false;
+    }
+
+    validator = find_header(stored->headers, *value == '"'
+        ? HTTP_HEADER_ETAG : HTTP_HEADER_LAST_MODIFIED);
+
+    return validator && strncmp(validator, "W/", 2) != 0
+        && strcmp(validator, value) == 0;
+}
+
+int http_cache_range(http_request_t *request, http_response_t *stored,
+    range_t *range) {
+    size_t length = stored->content_length, total = 0;
+    char *value;
+    int i, n = 0;
+    long first, last;
+
+    // A chunked body is not stored as its bytes.
+    if (request->method != HTTP_GET || stored->status != HTTP_STATUS_OK
+        || stored->headers->index[HTTP_HEADER_TRANSFER_ENCODING] != 0
+        || (value = find_header(request->headers, HTTP_HEADER_RANGE)) == NULL
+        || get_range(value, range) == -1 || range->unit != BYTES) {
+        return -1;
+    }
+
+    if ((value = find_header(request->headers, HTTP_HEADER_IF_RANGE)) != NULL
+        && !if_range_matches(value, stored)) {
+        return -1;
+    }
+
+    for (i = 0; i < range->num_range; i++) {
+        if (range->start[i] == -1) {
+            if (range->end[i] == 0 || length == 0) {
+                continue;
+            }
+            first = (size_t) range->end[i] < length
+                ? (long) (length - range->end[i]) : 0;
+            last = length - 1;
+        } else {
+            if ((size_t) range->start[i] >= length) {
+                continue;
+            }
+            first = range->start[i];
+            last = range->end[i] == -1 || (size_t) range->end[i] >= length
+                ? (long) length - 1 : range->end[i];
+        }
+
+        total += last - first + 1;
+        range->start[n] = first;
+        range->end[n++] = last;
+    }
+    range->num_range = n;
+
+    // Overlapping ranges could make the answer many times the object.
+    return total <= length ? n : -1;
+}
+
+/**
+ * Write the header of a part of multipart/byteranges to dst, as snprintf()
+ * does.
+ */
+static int write_part_header(char *dst, size_t size, unsigned long boundary,
+    const char *content_type, long first, long last, size_t length) {
+    return snprintf(dst, size, "\r\n--%020lu\r\n%s%s%s"
+        "Content-Range: bytes %ld-%ld/%zu\r\n\r\n", boundary,
+        content_type ? "Content-Type: " : "",
+        content_type ? content_type : "", content_type ? "\r\n" : "",
+        first, last, length);
+}
+
+bool http_cache_make_partial(http_response_t *stored, const char *body,
+    const range_t *range, int num_ranges, char **dst, size_t *dst_len) {
+    static unsigned long boundaries;
+    http_headers_t *headers = stored->headers;
+    http_response_t *partial;
+    size_t length = stored->content_length, len = 0, i;
+    unsigned long boundary = 0;
+    char value[64], *content_type, *p;
+    bool made;
+    int id;
+
+    if ((partial = init_http_response(0)) == NULL) {
+        return false;
+    }
+
+    partial->http_major = stored->http_major;
+    partial->http_minor = stored->http_minor;
+    content_type = find_header(headers, HTTP_HEADER_CONTENT_TYPE);
+
+    // Headers of the body as a whole are replaced.
+    for (i = 0; i < headers->num_headers; i++) {
+        id = headers->field_id[i];
+        if (id == HTTP_HEADER_CONTENT_LENGTH || id == HTTP_HEADER_CONTENT_RANGE
+            || id == HTTP_HEADER_TRANSFER_ENCODING
+            || (id == HTTP_HEADER_CONTENT_TYPE && num_ranges != 1)
+            || headers->value_len[i] == 0) {
+            continue;
+        }
+
+        if (!append_header_field(partial->headers, headers->field[i],
+                headers->field_len[i])
+            || !append_header_value(partial->headers, headers->value[i],
+                headers->value_len[i])) {
+            free_http_response(partial);
+            return false;
+        }
+    }
+
+    if (num_ranges == 0) {
+        partial->status = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+        snprintf(value, sizeof(value), "bytes */%zu", length);
+    } else if (num_ranges == 1) {
+        partial->status = HTTP_STATUS_PARTIAL_CONTENT;
+        snprintf(value, sizeof(value), "bytes %d-%d/%zu", range->start[0],
+            range->end[0], length);
+        len = range->end[0] - range->start[0] + 1;
+    } else {
+        partial->status = HTTP_STATUS_PARTIAL_CONTENT;
+        boundary = __atomic_add_fetch(&boundaries, 1, __ATOMIC_RELAXED);
+        snprintf(value, sizeof(value),
+            "multipart/byteranges; boundary=%020lu", boundary);
+
+        for (i = 0; i < (size_t) num_ranges; i++) {
+            len += write_part_header(NULL, 0, boundary, content_type,
+                range->start[i], range->end[i], length)
+                + range->end[i] - range->start[i] + 1;
+        }
+        len += snprintf(NULL, 0, "\r\n--%020lu--\r\n", boundary);
+    }
+
+    if (!set_header(partial->headers, num_ranges > 1 ? "Content-Type"
+            : "Content-Range", value)) {
+        free_http_response(partial);
+        return false;
+    }
+
+    snprintf(value, sizeof(value), "%zu", len);
+    if (!set_header(partial->headers, "Content-Length", value)
+        || (len != 0 && (partial->content = malloc(len + 1)) == NULL)) {
+        free_http_response(partial);
+        return false;
+    }
+    partial->content_length = len;
+
+    if (num_ranges == 1) {
+        memcpy(partial->content, body + range->start[0], len);
+    } else if (num_ranges > 1) {
+        for (p = partial->content, i = 0; i < (size_t) num_ranges; i++) {
+            p += write_part_header(p, len + 1 - (p - partial->content),
+                boundary, content_type, range->start[i], range->end[i],
+                length);
+            memcpy(p, body + range->start[i],
+                range->end[i] - range->start[i] + 1);
+            p += range->end[i] - range->start[i] + 1;
+        }
+        sprintf(p, "\r\n--%020lu--\r\n", boundary);
+    }
+
+    made = make_response_string(partial, dst, dst_len);
+    free_http_response(partial);
+
+    return made;
+}
+
+int http_cache_vary(http_response_t *response, char *dst, size_t size) {
+    http_headers_t *headers = response->headers;
+    const char *p, *end, *token;
+    size_t i, len = 0, token_len;
+
+    for (i = 0; i < headers->num_headers; i++) {
+        if (headers->field_id[i] != HTTP_HEADER_VARY) {
+            continue;
+        }
+
+        p = headers->value[i];
+        end = p + headers->value_len[i];
+
+        while (p < end) {
+            while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+                p++;
+            }
+
+            for (token = p; p < end && *p != ',' && *p != ' '
+                && *p != '\t'; p++);
+
+            if ((token_len = p - token) == 0) {
+                continue;
+            }
+
+            if ((token_len == 1 && *token == '*')
+                || len + token_len + 2 > size) {
+                return -1;
+            }
+
+            if (len != 0) {
+                dst[len++] = ',';
+            }
+
+            for (; token < p; token++) {
+                dst[len++] = tolower((unsigned char) *token);
+            }
+        }
+    }
+
+    if (size != 0) {
+        dst[len] = '\0';
+    }
+
+    return len;
+}
+
+char *http_cache_variant_key(const char *key, size_t key_len,
+    const char *vary, size_t vary_len, http_request_t *request,
+    size_t *variant_len) {
+    char name[HTTP_CACHE_VARY_LEN], *values[HTTP_CACHE_VARY_LEN / 2];
+    char *variant, *p;
+    size_t i, n = 0, len = key_len, name_len;
+    const char *start, *end = vary + vary_len, *next;
+
+    // Headers a request lacks are empty, so it matches only requests
+    // lacking them too.
+    for (start = vary; vary < end && n < HTTP_CACHE_VARY_LEN / 2;
+        vary = next + 1) {
+        if ((next = memchr(vary, ',', end - vary)) == NULL) {
+            next = end;
+        }
+
+        name_len = next - vary;
+        memcpy(name, vary, name_len);
+        name[name_len] = '\0';
+
+        values[n] = find_header_value(request->headers, name);
+        len += name_len + 2 + (values[n] ? strlen(values[n]) : 0);
+        n++;
+    }
+
+    if ((variant = malloc(len)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(variant, key, key_len - 1);
+    p = variant + key_len - 1;
+
+    for (i = 0, vary = start; i < n; i++, vary = next + 1) {
+        if ((next = memchr(vary, ',', end - vary)) == NULL) {
+            next = end;
+        }
+
+        *p++ = '\n';
+        memcpy(p, vary, next - vary);
+        p += next - vary;
+        *p++ = ':';
+
+        if (values[i]) {
+            strcpy(p, values[i]);
+            p += strlen(values[i]);
+        }
+    }
+
+    *p = '\0';
+    *variant_len = len;
+    return variant;
+}
@@ -0,0 +1,157 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "http_request.h"
+#include "http_response.h"
+
+#define HTTP_CACHE_HEURISTIC_FRACTION 10    // Of the time since Last-Modified.
+#define HTTP_CACHE_HEURISTIC_MAX (24 * 3600)
+#define HTTP_CACHE_VARY_LEN 256
+
+/**
+ * Freshness of a stored response, kept in the cache in front of its bytes.
+ * An entry of a response with Vary is followed by the normalized Vary
+ * field names instead, and each variant is stored under the key made by
+ * http_cache_variant_key().
+ */
+typedef struct {
+    time_t response_time;   // When the response was received.
+    time_t initial_age;     // Its age then, from Age and Date.
+    time_t lifetime;        // Fresh while younger than this.
+    time_t stale_while_revalidate;  // Directive arguments, -1 if absent.
+    time_t stale_if_error;
+    bool must_revalidate;   // Never served stale.
+    bool variants;
+} http_cache_entry_t;
+
+/**
+ * Tell whether response to request may be stored in a shared cache:
+ * a GET answered with a cacheable status, and no no-store, private,
+ * Set-Cookie, "Vary: *" or Authorization without public.
+ */
+bool http_cache_storable(http_request_t *request, http_response_t *response);
+
+/**
+ * Compute freshness of response from Cache-Control s-maxage or max-age,
+ * Expires, Date, Age, or else a fraction of the time since Last-Modified.
+ * A response with no-cache is stale at once.
+ *
+ * @params request_time When the request was sent.
+ * @params response_time When the response was received.
+ */
+void http_cache_init_entry(http_cache_entry_t *entry,
+    http_response_t *response, time_t request_time, time_t response_time);
+
+/**
+ * Compute freshness of stored once revalidated by response, a 304 Not
+ * Modified. Headers of response replace those of stored.
+ */
+void http_cache_update_entry(http_cache_entry_t *entry,
+    http_response_t *stored, http_response_t *response, time_t request_time,
+    time_t response_time);
+
+/**
+ * Tell whether response has an ETag or Last-Modified to be revalidated
+ * with.
+ */
+bool http_cache_has_validator(http_response_t *response);
+
+/**
+ * Make request conditional on stored being still valid, with
+ * If-None-Match and If-Modified-Since from its validators.
+ *
+ * @return true if set, or false if stored has no validator, request is
+ *         conditional already or no memory.
+ */
+bool http_cache_make_conditional(http_request_t *request,
+    http_response_t *stored);
+
+/**
+ * Current age of entry.
+ */
+time_t http_cache_age(const http_cache_entry_t *entry, time_t now);
+
+/**
+ * Tell whether entry may answer request without asking origin. Request
+ * Cache-Control no-cache, max-age and min-fresh, and Pragma: no-cache are
+ * honoured.
+ */
+bool http_cache_fresh(const http_cache_entry_t *entry,
+    http_request_t *request, time_t now);
+
+/**
+ * Tell whether entry, stale for request, may still answer it while it is
+ * revalidated in the background. The stale-while-revalidate directive of
+ * the response sets how long after expiry, or window if absent.
+ * must-revalidate, proxy-revalidate, s-maxage and no-cache forbid it, and
+ * so do request no-cache, max-age and min-fresh.
+ */
+bool http_cache_stale_while_revalidate(const http_cache_entry_t *entry,
+    http_request_t *request, time_t now, time_t window);
+
+/**
+ * Tell whether entry, stale for request, may answer it as origin could
+ * not be reached or failed with a 5xx. Same as
+ * http_cache_stale_while_revalidate() but with stale-if-error, of the
+ * response or else of the request.
+ */
+bool http_cache_stale_if_error(const http_cache_entry_t *entry,
+    http_request_t *request, time_t now, time_t window);
+
+/**
+ * Resolve the Range of request against stored, a whole 200 response parsed
+ * with its body counted in content_length. range is set to the satisfiable
+ * ranges, as offsets of their first and last bytes.
+ *
+ * @return Number of ranges, 0 if none is satisfiable, or -1 if stored is to
+ *         be sent whole: request has no valid bytes Range, its If-Range
+ *         does not match stored, or the ranges add up to more than it.
+ */
+int http_cache_range(http_request_t *request, http_response_t *stored,
+    range_t *range);
+
+/**
+ * Make the 206 Partial Content answer with num_ranges ranges of body, the
+ * body of stored, as multipart/byteranges if more than one, or 416 Range
+ * Not Satisfiable if none. Returned dst must be free'd after use.
+ *
+ * @return true if made, or false if no memory.
+ */
+bool http_cache_make_partial(http_response_t *stored, const char *body,
+    const range_t *range, int num_ranges, char **dst, size_t *dst_len);
+
+/**
+ * Write the Vary field names of response to dst, lowercased and separated
+ * by commas.
+ *
+ * @return Length written, 0 if response has no Vary, or -1 if it varies on
+ *         "*" or dst is too small.
+ */
+int http_cache_vary(http_response_t *response, char *dst, size_t size);
+
+/**
+ * Make the key of the variant of request, from the primary key and the
+ * values of the request headers named in vary. key_len and variant_len
+ * include the terminating NUL. Returned key must be free'd after use.
+ */
+char *http_cache_variant_key(const char *key, size_t key_len,
+    const char *vary, size_t vary_len, http_request_t *request,
+    size_t *variant_len);
+
+/**
+ * Parse an HTTP date in IMF-fixdate, RFC 850 or asctime format.
+ *
+ * @return The time, or -1 if str is not a date.
+ */
+time_t http_cache_parse_date(const char *str);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
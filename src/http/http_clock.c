@@ -0,0 +1,102 @@
+#include <pthread.h>
+#include <string.h>
+#include "http_clock.h"
+
+#define CLOCK_SLOTS 4
+
+/**
+ * Readers load current and use its slot. The writer fills the next slot
+ * before moving current to it, so a slot is rewritten only after
+ * CLOCK_SLOTS - 1 seconds.
+ */
+static struct {
+	time_t time;
+	char date[HTTP_DATE_LEN];
+} slots[CLOCK_SLOTS];
+static unsigned int current;
+
+static pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t clock_thread;
+static bool running;
+static bool stopping;
+
+void http_clock_update() {
+	struct timespec ts;
+	unsigned int next;
+	time_t now;
+	struct tm tm;
+
+	// Not time(), which may lag behind the second the thread woke up for.
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec;
+
+	if (slots[__atomic_load_n(&current, __ATOMIC_ACQUIRE)].time == now
+		|| pthread_mutex_trylock(&update_lock)) {
+		return;
+	}
+
+	next = (current + 1) % CLOCK_SLOTS;
+	slots[next].time = now;
+	strftime(slots[next].date, HTTP_DATE_LEN, "%a, %d %b %Y %H:%M:%S GMT",
+		gmtime_r(&now, &tm));
+	__atomic_store_n(&current, next, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&update_lock);
+}
+
+time_t http_clock_now() {
+	if (!__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		http_clock_update();
+	}
+
+	return slots[__atomic_load_n(&current, __ATOMIC_ACQUIRE)].time;
+}
+
+const char *http_clock_date() {
+	if (!__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		http_clock_update();
+	}
+
+	return slots[__atomic_load_n(&current, __ATOMIC_ACQUIRE)].date;
+}
+
+// Sleep until the next second begins, then refresh.
+static void *clock_main(void *data) {
+	struct timespec ts;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		ts.tv_nsec = 0;
+		clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL);
+		http_clock_update();
+	}
+
+	return NULL;
+}
+
+bool http_clock_start() {
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
+
+	http_clock_update();
+	__atomic_store_n(&stopping, false, __ATOMIC_RELAXED);
+
+	if (pthread_create(&clock_thread, NULL, clock_main, NULL)) {
+		return false;
+	}
+
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+void http_clock_stop() {
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	__atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+	pthread_join(clock_thread, NULL);
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+}
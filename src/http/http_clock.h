@@ -0,0 +1,45 @@
+#ifndef HTTP_CLOCK_H
+#define HTTP_CLOCK_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <time.h>
+
+#define HTTP_DATE_LEN 32        // "Sun, 06 Nov 1994 08:49:37 GMT" and NUL
+
+/**
+ * Start the thread refreshing the clock at every second.
+ * Until it is started, the clock is refreshed by its readers.
+ *
+ * @return true if succeed, otherwise false.
+ */
+bool http_clock_start();
+
+/**
+ * Stop the clock thread.
+ */
+void http_clock_stop();
+
+/**
+ * Refresh the clock if the second has changed. Safe to call from any
+ * thread, a caller finding another one refreshing keeps the old second.
+ */
+void http_clock_update();
+
+/**
+ * Current time in seconds, read without locking.
+ */
+time_t http_clock_now();
+
+/**
+ * Current time formatted for HTTP Date headers, read without locking.
+ * The string stays unchanged for a few seconds, copy it to keep it.
+ */
+const char *http_clock_date();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
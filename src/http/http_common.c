@@ -1,34 +1,163 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include "http_common.h"
 
-http_headers_t *init_http_headers(size_t max_num_headers) {
-    http_headers_t *headers;
+#define HEADER_NAME(name) { name, sizeof(name) - 1 }
+#define HEADER_SLOTS 64     // Power of two, at least twice HTTP_HEADER_MAX.
 
-    headers = malloc(sizeof(http_headers_t));
-    if (!headers) {
-        return NULL;
+_Static_assert(HTTP_HEADER_MAX * 2 <= HEADER_SLOTS,
+    "HEADER_SLOTS is too small for well-known headers");
+
+static const struct {
+    const char *name;
+    size_t len;
+} header_names[HTTP_HEADER_MAX] = {
+    [HTTP_HEADER_HOST] = HEADER_NAME("Host"),
+    [HTTP_HEADER_CONNECTION] = HEADER_NAME("Connection"),
+    [HTTP_HEADER_PROXY_CONNECTION] = HEADER_NAME("Proxy-Connection"),
+    [HTTP_HEADER_KEEP_ALIVE] = HEADER_NAME("Keep-Alive"),
+    [HTTP_HEADER_TE] = HEADER_NAME("TE"),
+    [HTTP_HEADER_TRAILER] = HEADER_NAME("Trailer"),
+    [HTTP_HEADER_TRANSFER_ENCODING] = HEADER_NAME("Transfer-Encoding"),
+    [HTTP_HEADER_UPGRADE] = HEADER_NAME("Upgrade"),
+    [HTTP_HEADER_PROXY_AUTHORIZATION] = HEADER_NAME("Proxy-Authorization"),
+    [HTTP_HEADER_PROXY_AUTHENTICATE] = HEADER_NAME("Proxy-Authenticate"),
+    [HTTP_HEADER_CONTENT_LENGTH] = HEADER_NAME("Content-Length"),
+    [HTTP_HEADER_CONTENT_TYPE] = HEADER_NAME("Content-Type"),
+    [HTTP_HEADER_CONTENT_RANGE] = HEADER_NAME("Content-Range"),
+    [HTTP_HEADER_RANGE] = HEADER_NAME("Range"),
+    [HTTP_HEADER_CACHE_CONTROL] = HEADER_NAME("Cache-Control"),
+    [HTTP_HEADER_PRAGMA] = HEADER_NAME("Pragma"),
+    [HTTP_HEADER_EXPIRES] = HEADER_NAME("Expires"),
+    [HTTP_HEADER_DATE] = HEADER_NAME("Date"),
+    [HTTP_HEADER_AGE] = HEADER_NAME("Age"),
+    [HTTP_HEADER_VARY] = HEADER_NAME("Vary"),
+    [HTTP_HEADER_ETAG] = HEADER_NAME("ETag"),
+    [HTTP_HEADER_LAST_MODIFIED] = HEADER_NAME("Last-Modified"),
+    [HTTP_HEADER_IF_NONE_MATCH] = HEADER_NAME("If-None-Match"),
+    [HTTP_HEADER_IF_MODIFIED_SINCE] = HEADER_NAME("If-Modified-Since"),
+    [HTTP_HEADER_IF_RANGE] = HEADER_NAME("If-Range"),
+    [HTTP_HEADER_IF_MATCH] = HEADER_NAME("If-Match"),
+    [HTTP_HEADER_IF_UNMODIFIED_SINCE] = HEADER_NAME("If-Unmodified-Since"),
+    [HTTP_HEADER_SET_COOKIE] = HEADER_NAME("Set-Cookie"),
+    [HTTP_HEADER_AUTHORIZATION] = HEADER_NAME("Authorization"),
+};
+
+// Well-known ids by header_hash() of their name, linearly probed.
+// HTTP_HEADER_OTHER marks an empty slot.
+static unsigned char header_slots[HEADER_SLOTS];
+static pthread_once_t header_slots_once = PTHREAD_ONCE_INIT;
+
+/**
+ * FNV-1a of lowercased field.
+ */
+static uint32_t header_hash(const char *field, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) tolower((unsigned char) field[i]);
+        h *= 16777619u;
     }
 
-    memset(headers, 0, sizeof(http_headers_t));
-    headers->max_num_headers =
-        max_num_headers <= 0 ? DEFAULT_MAX_HEADERS : max_num_headers;
+    return h;
+}
 
-    headers->field = malloc(sizeof(char *) * headers->max_num_headers);
-    if (!headers->field) {
-        free(headers);
-        return NULL;
+/**
+ * Start a string of len bytes, or extend str of str_len bytes by len bytes.
+ * str is extended in place if it is the latest string, otherwise copied.
+ * Returned string may be moved, and it is terminated by NUL.
+ */
+static char *http_arena_append(http_arena_t *arena, char *str,
+    size_t str_len, const char *at, size_t len) {
+    http_arena_block_t *block = arena->head;
+    size_t size;
+
+    // A new string gets its NUL, an extended one reuses it.
+    if (str && str == arena->last
+        && block->used + len <= block->size) {
+        memcpy(str + str_len, at, len);
+        str[str_len + len] = '\0';
+        block->used += len;
+        return str;
+    }
+
+    if (!block || block->used + str_len + len + 1 > block->size) {
+        size = str_len + len + 1 > HTTP_ARENA_BLOCK_SIZE
+            ? str_len + len + 1 : HTTP_ARENA_BLOCK_SIZE;
+
+        if ((block = malloc(sizeof(http_arena_block_t) + size)) == NULL) {
+            return NULL;
+        }
+
+        block->size = size;
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    arena->last = block->data + block->used;
+    memcpy(arena->last, str, str_len);
+    memcpy(arena->last + str_len, at, len);
+    arena->last[str_len + len] = '\0';
+    block->used += str_len + len + 1;
+
+    return arena->last;
+}
+
+// Free blocks other than the initial one, and empty it.
+static void http_arena_reset(http_arena_t *arena) {
+    http_arena_block_t *block, *next;
+
+    for (block = arena->head; block; block = next) {
+        next = block->next;
+        if (block != arena->initial) {
+            free(block);
+        }
     }
-    memset(headers->field, 0, sizeof(char *) * headers->max_num_headers);
 
-    headers->value = malloc(sizeof(char *) * headers->max_num_headers);
-    if (!headers->value) {
-        free(headers->field);
-        free(headers);
+    arena->head = arena->initial;
+    arena->head->next = NULL;
+    arena->head->used = 0;
+    arena->last = NULL;
+}
+
+http_headers_t *init_http_headers(size_t max_num_headers) {
+    http_headers_t *headers;
+    size_t array_size;
+
+    max_num_headers =
+        max_num_headers <= 0 ? DEFAULT_MAX_HEADERS : max_num_headers;
+    array_size = (2 * sizeof(char *) + 2 * sizeof(size_t) + sizeof(uint32_t)
+        + sizeof(unsigned char)) * max_num_headers;
+
+    // Arrays and the first arena block come with headers, in one malloc.
+    array_size = (array_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    headers = malloc(sizeof(http_headers_t) + array_size
+        + sizeof(http_arena_block_t) + HTTP_ARENA_BLOCK_SIZE);
+    if (!headers) {
         return NULL;
     }
-    memset(headers->value, 0, sizeof(char *) * headers->max_num_headers);
+
+    memset(headers, 0, sizeof(http_headers_t) + array_size);
+    headers->max_num_headers = max_num_headers;
+    headers->field = (char **) (headers + 1);
+    headers->value = headers->field + max_num_headers;
+    headers->field_len = (size_t *) (headers->value + max_num_headers);
+    headers->value_len = headers->field_len + max_num_headers;
+    headers->field_hash = (uint32_t *) (headers->value_len + max_num_headers);
+    headers->field_id = (unsigned char *)
+        (headers->field_hash + max_num_headers);
+
+    headers->arena.initial = (http_arena_block_t *)
+        ((char *) (headers + 1) + array_size);
+    headers->arena.initial->size = HTTP_ARENA_BLOCK_SIZE;
+    http_arena_reset(&headers->arena);
 
     return headers;
 }
@@ -36,15 +165,242 @@ http_headers_t *init_http_headers(size_t max_num_headers) {
 void free_http_headers(http_headers_t *headers) {
     if (!headers) return;
 
-    int i;
+    http_arena_reset(&headers->arena);
+    free(headers);
+}
+
+void reset_http_headers(http_headers_t *headers) {
+    memset(headers->field, 0, sizeof(char *) * headers->num_headers);
+    memset(headers->value, 0, sizeof(char *) * headers->num_headers);
+    memset(headers->field_len, 0, sizeof(size_t) * headers->num_headers);
+    memset(headers->value_len, 0, sizeof(size_t) * headers->num_headers);
+    memset(headers->index, 0, sizeof(headers->index));
+    headers->num_headers = 0;
+    headers->last_header_element = HEADER_NONE;
+    headers->input = NULL;
+    headers->input_len = 0;
+    http_arena_reset(&headers->arena);
+}
+
+static bool http_headers_borrowed(http_headers_t *headers, const char *str,
+    size_t len) {
+    return headers->input && str >= headers->input
+        && str + len <= headers->input + headers->input_len;
+}
+
+/**
+ * Start a field or value with a fragment, or continue str of *str_len
+ * bytes. A borrowed fragment is referenced, and it grows in place while
+ * the next one follows it in the input. Anything else goes to arena.
+ */
+static char *http_headers_append(http_headers_t *headers, char *str,
+    size_t *str_len, const char *at, size_t len) {
+    if (!str && http_headers_borrowed(headers, at, len)) {
+        *str_len = len;
+        return (char *) at;
+    }
+
+    if (str && http_headers_borrowed(headers, str, *str_len)
+        && str + *str_len == at) {
+        *str_len += len;
+        return str;
+    }
+
+    if (!str) {
+        *str_len = 0;
+    }
+
+    if ((str = http_arena_append(&headers->arena, str, *str_len,
+            at, len)) != NULL) {
+        *str_len += len;
+    }
+
+    return str;
+}
+
+void borrow_http_headers(http_headers_t *headers, const char *buf,
+    size_t len) {
+    headers->input = buf;
+    headers->input_len = len;
+}
+
+// Copy str into arena if it is borrowed.
+static bool http_headers_own(http_headers_t *headers, char **str,
+    size_t len) {
+    char *temp;
+
+    if (!*str || !http_headers_borrowed(headers, *str, len)) {
+        return true;
+    }
+
+    if ((temp = http_arena_append(&headers->arena, NULL, 0, *str, len))
+        == NULL) {
+        return false;
+    }
+
+    *str = temp;
+    return true;
+}
+
+static void header_slots_init() {
+    size_t slot;
+    int id;
+
+    for (id = HTTP_HEADER_OTHER + 1; id < HTTP_HEADER_MAX; id++) {
+        slot = header_hash(header_names[id].name, header_names[id].len);
+        while (header_slots[slot &= HEADER_SLOTS - 1] != HTTP_HEADER_OTHER) {
+            slot++;
+        }
+        header_slots[slot] = id;
+    }
+}
+
+// Id of field whose header_hash() is hash.
+static http_header_id header_id(const char *field, size_t len,
+    uint32_t hash) {
+    size_t slot;
+    int id;
+
+    pthread_once(&header_slots_once, header_slots_init);
+
+    for (slot = hash & (HEADER_SLOTS - 1);
+            (id = header_slots[slot]) != HTTP_HEADER_OTHER;
+            slot = (slot + 1) & (HEADER_SLOTS - 1)) {
+        if (header_names[id].len == len
+            && strncasecmp(header_names[id].name, field, len) == 0) {
+            return id;
+        }
+    }
+
+    return HTTP_HEADER_OTHER;
+}
+
+http_header_id get_header_id(const char *field, size_t len) {
+    return header_id(field, len, header_hash(field, len));
+}
+
+// Hash field i, and index it if it is the first of a well-known header.
+static void http_headers_index(http_headers_t *headers, size_t i) {
+    http_header_id id;
+
+    headers->field_hash[i] = header_hash(headers->field[i],
+        headers->field_len[i]);
+    headers->field_id[i] = id = header_id(headers->field[i],
+        headers->field_len[i], headers->field_hash[i]);
+
+    if (id != HTTP_HEADER_OTHER && !headers->index[id]) {
+        headers->index[id] = i + 1;
+    }
+}
+
+// Undo http_headers_index() for the last header.
+static void http_headers_unindex(http_headers_t *headers, size_t i) {
+    http_header_id id = headers->field_id[i];
+
+    if (id != HTTP_HEADER_OTHER && headers->index[id] == i + 1) {
+        headers->index[id] = 0;
+    }
+}
+
+/**
+ * Position of the first header named field, ignoring case.
+ *
+ * @return Position or -1 if not found.
+ */
+static long http_headers_lookup(http_headers_t *headers, const char *field,
+    size_t len) {
+    uint32_t hash = header_hash(field, len);
+    http_header_id id = header_id(field, len, hash);
+    size_t i;
+
+    if (id != HTTP_HEADER_OTHER) {
+        return (long) headers->index[id] - 1;
+    }
+
     for (i = 0; i < headers->num_headers; i++) {
-        free(headers->field[i]);
-        free(headers->value[i]);
+        if (headers->field_hash[i] == hash && headers->field_len[i] == len
+            && strncasecmp(headers->field[i], field, len) == 0) {
+            return i;
+        }
     }
 
-    free(headers->field);
-    free(headers->value);
-    free(headers);
+    return -1;
+}
+
+bool retain_http_headers(http_headers_t *headers) {
+    size_t i;
+
+    for (i = 0; i < headers->num_headers; i++) {
+        if (!http_headers_own(headers, &headers->field[i],
+                headers->field_len[i])
+            || !http_headers_own(headers, &headers->value[i],
+                headers->value_len[i])) {
+            return false;
+        }
+    }
+
+    headers->input = NULL;
+    headers->input_len = 0;
+    return true;
+}
+
+bool append_header_field(http_headers_t *headers, const char *at,
+    size_t len) {
+    size_t i = headers->num_headers;
+    char *field;
+
+    if (headers->last_header_element != HEADER_FIELD) {
+        if (i + 1 > headers->max_num_headers)
+            return false;
+
+        if ((field = http_headers_append(headers, NULL,
+                &headers->field_len[i], at, len)) == NULL)
+            return false;
+
+        headers->field[i] = field;
+        headers->value[i] = NULL;
+        headers->value_len[i] = 0;
+        headers->num_headers++;
+    } else {
+        // A field spanning reads is indexed again with its new length.
+        http_headers_unindex(headers, --i);
+        if ((field = http_headers_append(headers, headers->field[i],
+                &headers->field_len[i], at, len)) == NULL) {
+            headers->num_headers--;
+            headers->field[i] = NULL;
+            return false;
+        }
+        headers->field[i] = field;
+    }
+
+    http_headers_index(headers, i);
+    headers->last_header_element = HEADER_FIELD;
+    return true;
+}
+
+bool append_header_value(http_headers_t *headers, const char *at,
+    size_t len) {
+    size_t i = headers->num_headers - 1;
+    char *value;
+
+    if (headers->num_headers == 0)
+        return false;
+
+    if ((value = http_headers_append(headers,
+            headers->last_header_element == HEADER_VALUE
+            ? headers->value[i] : NULL,
+            &headers->value_len[i], at, len)) == NULL) {
+        // Never leave a field without value.
+        http_headers_unindex(headers, i);
+        headers->num_headers--;
+        headers->field[i] = NULL;
+        headers->value[i] = NULL;
+        return false;
+    }
+
+    headers->value[i] = value;
+    headers->last_header_element = HEADER_VALUE;
+    return true;
 }
 
 bool set_header(http_headers_t *headers, const char *field, const char *value) {
@@ -52,106 +408,214 @@ bool set_header(http_headers_t *headers, const char *field, const char *value) {
         return false;
     }
 
-    int i;
+    long i;
     char *temp;
-    for (i = 0; i < headers->num_headers; i++) {
-        if (strcmp(headers->field[i], field) == 0) {
-            temp = headers->value[i];
-            headers->value[i] = malloc(strlen(value) + 1);
-            if (!headers->value[i]) {
-                headers->value[i] = temp;
-                return false;
-            }
+    size_t field_len = strlen(field);
+    size_t value_len = strlen(value);
 
-            free(temp);
-            strcpy(headers->value[i], value);
-            return true;
+    if ((i = http_headers_lookup(headers, field, field_len)) != -1) {
+        // The old value stays in the arena until reset.
+        temp = http_arena_append(&headers->arena, NULL, 0, value, value_len);
+        if (!temp) {
+            return false;
         }
+
+        headers->value[i] = temp;
+        headers->value_len[i] = value_len;
+        return true;
     }
 
     if (headers->num_headers + 1 > headers->max_num_headers) {
         return false;
     }
 
-    headers->field[headers->num_headers] = malloc(strlen(field) + 1);
+    headers->field[headers->num_headers] = http_arena_append(
+        &headers->arena, NULL, 0, field, field_len);
     if (!headers->field[headers->num_headers]) {
         return false;
     }
 
-    headers->value[headers->num_headers] = malloc(strlen(value) + 1);
+    headers->value[headers->num_headers] = http_arena_append(
+        &headers->arena, NULL, 0, value, value_len);
     if (!headers->value[headers->num_headers]) {
-        free(headers->field[headers->num_headers]);
         return false;
     }
 
-    strcpy(headers->field[headers->num_headers], field);
-    strcpy(headers->value[headers->num_headers], value);
+    headers->field_len[headers->num_headers] = field_len;
+    headers->value_len[headers->num_headers] = value_len;
+    http_headers_index(headers, headers->num_headers);
     headers->num_headers++;
     return true;
 }
 
+char *find_header(http_headers_t *headers, http_header_id id) {
+    size_t i;
+
+    if (id <= HTTP_HEADER_OTHER || id >= HTTP_HEADER_MAX
+        || (i = headers->index[id]) == 0) {
+        return NULL;
+    }
+
+    if (!http_headers_own(headers, &headers->value[i - 1],
+            headers->value_len[i - 1])) {
+        return NULL;
+    }
+
+    return headers->value[i - 1];
+}
+
 char *find_header_value(http_headers_t *headers, const char *search) {
-    int i;
+    long i = http_headers_lookup(headers, search, strlen(search));
+
+    if (i == -1 || !http_headers_own(headers, &headers->value[i],
+            headers->value_len[i])) {
+        return NULL;
+    }
+
+    return headers->value[i];
+}
+
+size_t get_headers_length(http_headers_t *headers) {
+    size_t i, len = 2;
+
     for (i = 0; i < headers->num_headers; i++) {
-        if (strcmp(headers->field[i], search) == 0) {
-            return headers->value[i];
-        }
+        len += headers->field_len[i] + headers->value_len[i] + 4;
     }
 
-    return NULL;
+    return len;
 }
 
-int get_range(char *str, range_t *range) {
-    memset(range, 0, sizeof(range_t));
+size_t write_headers(http_headers_t *headers, char *dst) {
+    char *p = dst;
+    size_t i;
 
-    char *tmp_str = malloc(sizeof(strlen(str)) + 1);
-    char *tmp2_str = tmp_str;
-    if (tmp_str == NULL) {
-        return -1;
+    for (i = 0; i < headers->num_headers; i++) {
+        memcpy(p, headers->field[i], headers->field_len[i]);
+        p += headers->field_len[i];
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy(p, headers->value[i], headers->value_len[i]);
+        p += headers->value_len[i];
+        *p++ = '\r';
+        *p++ = '\n';
     }
 
-    strcpy(tmp_str, str);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - dst;
+}
 
-    char *unit = strsep(&tmp_str, "=");
+int make_headers_iov(http_headers_t *headers, struct iovec *iov, int iovcnt) {
+    static char separator[] = ": ", crlf[] = "\r\n";
+    struct iovec *p = iov;
+    size_t i;
 
-    if (unit == NULL) {
-        free(tmp2_str);
+    if (iovcnt < 0 || (size_t) iovcnt < 4 * headers->num_headers + 1) {
         return -1;
     }
 
-    if (strcmp(unit, "bytes") == 0) {
-        range->unit = BYTES;
-    } else {
-        range->unit = UNIT_NONE;
+    for (i = 0; i < headers->num_headers; i++) {
+        p->iov_base = headers->field[i];
+        p++->iov_len = headers->field_len[i];
+        p->iov_base = separator;
+        p++->iov_len = 2;
+        p->iov_base = headers->value[i];
+        p++->iov_len = headers->value_len[i];
+        p->iov_base = crlf;
+        p++->iov_len = 2;
     }
 
-    char *ranges = strsep(&tmp_str, "=");
+    p->iov_base = crlf;
+    p++->iov_len = 2;
+    return p - iov;
+}
 
-    if (ranges == NULL) {
-        free(tmp2_str);
-        return -1;
+void print_headers(http_headers_t *headers) {
+    size_t i;
+
+    for (i = 0; i < headers->num_headers; i++) {
+        printf("%.*s: %.*s\n", (int) headers->field_len[i], headers->field[i],
+            (int) headers->value_len[i], headers->value[i]);
     }
+}
+
+/**
+ * Parse the digits at *p into value, saturated at INT_MAX, and advance *p.
+ *
+ * @return false if *p is not a digit.
+ */
+static bool get_range_pos(const char **p, int *value) {
+    long n = 0;
 
-    do {
-        char *range_str = strsep(&ranges, ",\t");
-        if (range_str != NULL) {
-            char *start = strsep(&range_str, "-");
-            if (start != NULL) {
-                range->start[range->num_range] = atoi(start);
-                if (strcmp(range_str, "\0") == 0) {
-                    range->end[range->num_range++] = -1;
-                } else {
-                    char *end = strsep(&range_str, "-");
-                    if (end != NULL) {
-                        range->end[range->num_range++] = atoi(end);
-                    }
-                }
+    if (!isdigit((unsigned char) **p)) {
+        return false;
+    }
+
+    for (; isdigit((unsigned char) **p); (*p)++) {
+        n = n < INT_MAX / 10 ? n * 10 + (**p - '0') : INT_MAX;
+    }
+
+    *value = n < INT_MAX ? n : INT_MAX;
+    return true;
+}
+
+int get_range(const char *str, range_t *range) {
+    const char *p = str;
+    int i;
+
+    memset(range, 0, sizeof(range_t));
+
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+
+    if (strncasecmp(p, "bytes", 5) != 0 || p[5] != '=') {
+        return strchr(p, '=') ? 0 : -1;
+    }
+    range->unit = BYTES;
+
+    // Elements are separated by commas and optional spaces, and may be
+    // empty.
+    for (p += 6; *p != '\0'; ) {
+        if (*p == ',' || *p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+
+        if ((i = range->num_range) == MAX_RANGE) {
+            return -1;
+        }
+
+        if (*p == '-') {
+            p++;
+            range->start[i] = -1;
+            if (!get_range_pos(&p, &range->end[i])) {
+                return -1;
+            }
+        } else {
+            if (!get_range_pos(&p, &range->start[i]) || *p++ != '-') {
+                return -1;
+            }
+
+            range->end[i] = -1;
+            if (isdigit((unsigned char) *p)
+                && (!get_range_pos(&p, &range->end[i])
+                    || range->end[i] < range->start[i])) {
+                return -1;
             }
         }
-    } while (ranges != NULL);
 
-    free(tmp2_str);
-    return 0;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+
+        if (*p != ',' && *p != '\0') {
+            return -1;
+        }
+        range->num_range++;
+    }
+
+    return range->num_range != 0 ? 0 : -1;
 }
 
 void print_range(range_t *range) {
@@ -6,23 +6,91 @@ extern "C" {
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #define DEFAULT_MAX_HEADERS 50
 #define MAX_RANGE 50
+#define HTTP_ARENA_BLOCK_SIZE 4096
+
+typedef struct http_arena_block {
+    struct http_arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} http_arena_block_t;
+
+/**
+ * Bump allocator owning the bytes of header fields and values. Nothing is
+ * freed alone, blocks are dropped together when headers are reset or freed.
+ */
+typedef struct {
+    http_arena_block_t *head;       // Block in use, older blocks follow.
+    http_arena_block_t *initial;    // Allocated with http_headers_t.
+    char *last;                     // Latest string, which may still grow.
+} http_arena_t;
+
+/**
+ * Headers the proxy looks up, indexed when they are parsed or set.
+ */
+typedef enum {
+    HTTP_HEADER_OTHER = 0,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_PROXY_CONNECTION,
+    HTTP_HEADER_KEEP_ALIVE,
+    HTTP_HEADER_TE,
+    HTTP_HEADER_TRAILER,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_PROXY_AUTHORIZATION,
+    HTTP_HEADER_PROXY_AUTHENTICATE,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONTENT_RANGE,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_PRAGMA,
+    HTTP_HEADER_EXPIRES,
+    HTTP_HEADER_DATE,
+    HTTP_HEADER_AGE,
+    HTTP_HEADER_VARY,
+    HTTP_HEADER_ETAG,
+    HTTP_HEADER_LAST_MODIFIED,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_IF_MATCH,
+    HTTP_HEADER_IF_UNMODIFIED_SINCE,
+    HTTP_HEADER_SET_COOKIE,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_MAX
+} http_header_id;
 
 /**
  * Common struct for http_request_t and http_response_t
+ * A field or value is either a NUL terminated string in arena, or a slice
+ * of the borrowed input which is not terminated. Use the lengths.
  */
 typedef struct {
     enum { HEADER_NONE=0, HEADER_FIELD, HEADER_VALUE } last_header_element;
     char **field;
     char **value;
+    size_t *field_len;
+    size_t *value_len;
+    uint32_t *field_hash;   // Case-insensitive, set with field_id when the
+    unsigned char *field_id;    // field is appended.
+    size_t index[HTTP_HEADER_MAX];  // 1 + first header of each id, or 0.
     size_t num_headers;
     size_t max_num_headers;
+    http_arena_t arena;
+    const char *input;      // See borrow_http_headers().
+    size_t input_len;
 } http_headers_t;
 
 /**
  * Struct for "Range" header in request.
+ * "N-" has end -1, and a suffix "-N" has start -1 and end N.
  */
 typedef struct {
     enum { UNIT_NONE=0, BYTES } unit;
@@ -43,6 +111,36 @@ http_headers_t *init_http_headers(size_t max_num_headers);
  */
 void free_http_headers(http_headers_t *headers);
 
+/**
+ * Remove every header, keeping memory for the next message.
+ */
+void reset_http_headers(http_headers_t *headers);
+
+/**
+ * Let fragments lying in buf be referenced instead of copied. buf must not
+ * change until retain_http_headers() or reset_http_headers() is called.
+ */
+void borrow_http_headers(http_headers_t *headers, const char *buf,
+    size_t len);
+
+/**
+ * Copy fragments referencing the borrowed buffer into arena, so that the
+ * buffer can be reused. Called when a message spans reads.
+ *
+ * @return true if succeed, otherwise false (no memory).
+ */
+bool retain_http_headers(http_headers_t *headers);
+
+/**
+ * Append a fragment of header field or value received from http_parser.
+ * A fragment following one of the same kind continues it, otherwise a new
+ * field or value is started. Fragments are copied unless borrowed.
+ *
+ * @return true if succeed, otherwise false (too many headers or no memory).
+ */
+bool append_header_field(http_headers_t *headers, const char *at, size_t len);
+bool append_header_value(http_headers_t *headers, const char *at, size_t len);
+
 /**
  * Set header
  * If header field is already set, it will replace with new value.
@@ -55,7 +153,23 @@ void free_http_headers(http_headers_t *headers);
 bool set_header(http_headers_t *headers, const char *field, const char *value);
 
 /**
- * Find header value using search keyword (field).
+ * Get id of a well-known header field, ignoring case.
+ *
+ * @return http_header_id of field or HTTP_HEADER_OTHER.
+ */
+http_header_id get_header_id(const char *field, size_t len);
+
+/**
+ * Find the first value of a well-known header in O(1).
+ * A borrowed value is copied into arena to be terminated by NUL.
+ *
+ * @return The value or NULL if not found.
+ */
+char *find_header(http_headers_t *headers, http_header_id id);
+
+/**
+ * Find header value using search keyword (field), ignoring case.
+ * A borrowed value is copied into arena to be terminated by NUL.
  *
  * @params headers Pointer to http_headers_t
  * @params search Field keyword.
@@ -63,14 +177,41 @@ bool set_header(http_headers_t *headers, const char *field, const char *value);
  */
 char *find_header_value(http_headers_t *headers, const char *search);
 
+/**
+ * Length of headers written by write_headers(), with the empty line.
+ */
+size_t get_headers_length(http_headers_t *headers);
+
+/**
+ * Write "field: value\r\n" for each header and the empty line to dst,
+ * which must have get_headers_length() bytes.
+ *
+ * @return Number of bytes written.
+ */
+size_t write_headers(http_headers_t *headers, char *dst);
+
+/**
+ * Describe headers and the empty line as iovecs referencing their bytes,
+ * 4 per header and 1 for the empty line.
+ *
+ * @return Number of iovecs used, or -1 if iovcnt is too small.
+ */
+int make_headers_iov(http_headers_t *headers, struct iovec *iov, int iovcnt);
+
+/**
+ * Print headers as "field: value" lines.
+ */
+void print_headers(http_headers_t *headers);
+
 /**
  * Get range from "Range" field in header
+ * Ranges of a unit other than bytes are left unparsed.
  *
  * @params str Raw string of value part of "Range" field.
  * @params range The result to be stored.
- * @return If stroing range is succeed, return 0 or -1 otherwise.
+ * @return 0, or -1 if str is malformed or has more than MAX_RANGE ranges.
  */
-int get_range(char *str, range_t *range);
+int get_range(const char *str, range_t *range);
 
 /**
  * Print range struct
@@ -1,20 +1,49 @@
+#include <stdlib.h>
 #include <pthread.h>
 #include <time.h>
 #include <string.h>
 #include "http_log.h"
+#include "http_clock.h"
+
+#define LOG_URL_LEN (SCHEMA_LEN + 3 + HOST_LEN + PATH_LEN)
+#define LOG_LINE_LEN (LOG_URL_LEN + INET_ADDRSTRLEN + 64)
+#define LOG_BATCH_SIZE 65536
+
+typedef struct {
+	time_t time;
+	int content_length;
+	char ip[INET_ADDRSTRLEN];
+	char url[LOG_URL_LEN];
+} log_record_t;
+
+/**
+ * Records of one thread. Only the thread moves tail, and only the log
+ * thread moves head.
+ */
+typedef struct log_ring {
+	log_record_t records[HTTP_LOG_RING_SIZE];
+	size_t head;
+	size_t tail;
+	bool closed;		// Thread exited, free once drained.
+	struct log_ring *next;
+} log_ring_t;
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static FILE *file;
 
-static char *get_current_time() {
-	static char time_str[32] = {0};
+// Protects rings and stopping. Never held while writing file.
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static log_ring_t *rings;
+static bool stopping;
 
-	memset(time_str, 0, 32);
-	time_t now = time(NULL);
-	strftime(time_str, 32, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
-
-	return time_str;
-}
+static bool running;
+static int flush_interval;
+static size_t dropped;
+static pthread_t log_thread;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread log_ring_t *ring;
 
 bool http_log_set_file(const char *path) {
 	if (path == NULL) {
@@ -43,19 +72,211 @@ bool http_log_set_file(const char *path) {
 	return true;
 }
 
-void log_http_request(http_request_t *request, http_response_t *response) {
+static void make_record(log_record_t *record, http_request_t *request,
+	http_response_t *response) {
+	record->time = http_clock_now();
+	record->content_length = response->content_length;
+	strcpy(record->ip, request->ip);
+	snprintf(record->url, LOG_URL_LEN, "%s%s%s%s", request->schema,
+		strcmp(request->schema, "") != 0 ? "://" : "", request->host,
+		request->path);
+}
+
+static void ring_close(void *data) {
+	__atomic_store_n(&((log_ring_t *) data)->closed, true, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init() {
+	pthread_key_create(&ring_key, ring_close);
+}
+
+// Ring of the calling thread, created by its first log.
+static log_ring_t *get_ring() {
+	if (ring) {
+		return ring;
+	}
+
+	pthread_once(&ring_key_once, ring_key_init);
+
+	if ((ring = malloc(sizeof(log_ring_t))) == NULL) {
+		return NULL;
+	}
+	ring->head = 0;
+	ring->tail = 0;
+	ring->closed = false;
+
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+/**
+ * Format records of every ring into batch, as many as fit in size.
+ * Rings of exited threads are freed once drained. rings_lock must be held.
+ *
+ * @return Number of bytes in batch.
+ */
+static size_t log_drain(char *batch, size_t size) {
+	static time_t last;
+	static char time_str[HTTP_DATE_LEN];
+	log_ring_t *r, **prev;
+	log_record_t *record;
+	size_t head, tail, len = 0;
+	struct tm tm;
+	bool closed;
+
+	for (prev = &rings; (r = *prev) != NULL; ) {
+		closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+		for (head = r->head; head != tail && len + LOG_LINE_LEN <= size;
+			head++) {
+			record = &r->records[head % HTTP_LOG_RING_SIZE];
+
+			// Most records of a batch share the second.
+			if (record->time != last) {
+				last = record->time;
+				strftime(time_str, sizeof(time_str),
+					"%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&last, &tm));
+			}
+
+			len += snprintf(batch + len, size - len, "Date: %s: %s %s %d\n",
+				time_str, record->ip, record->url, record->content_length);
+		}
+		__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+		if (closed && head == tail) {
+			*prev = r->next;
+			free(r);
+		} else {
+			prev = &r->next;
+		}
+	}
+
+	return len;
+}
+
+static void log_write(const char *batch, size_t len) {
 	pthread_mutex_lock(&lock);
 	FILE *stream = file != NULL ? file : stdout;
-	char url[256] = {0};
-	if (strcmp(request->schema, "") != 0) {
-		strcpy(url, request->schema);
-		strcat(url, "://");
-	}
-	strcat(url, request->host);
-	strcat(url, request->path);
-	
-	fprintf(stream, "Date: %s: %s %s %d\n", get_current_time(), request->ip,
-		url, response->content_length);
+	fwrite(batch, 1, len, stream);
 	fflush(stream);
 	pthread_mutex_unlock(&lock);
 }
+
+static void *log_main(void *data) {
+	char *batch = (char *) data;
+	struct timespec deadline;
+	size_t len;
+	bool stop;
+
+	pthread_mutex_lock(&rings_lock);
+	do {
+		if (!stopping) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += flush_interval / 1000;
+			deadline.tv_nsec += (flush_interval % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&wake, &rings_lock, &deadline);
+		}
+		stop = stopping;
+
+		while ((len = log_drain(batch, LOG_BATCH_SIZE)) > 0) {
+			pthread_mutex_unlock(&rings_lock);
+			log_write(batch, len);
+			pthread_mutex_lock(&rings_lock);
+		}
+	} while (!stop);
+	pthread_mutex_unlock(&rings_lock);
+
+	free(batch);
+	return NULL;
+}
+
+bool http_log_start(int flush_interval_ms) {
+	char *batch;
+
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
+
+	flush_interval = flush_interval_ms > 0
+		? flush_interval_ms : HTTP_LOG_DEFAULT_FLUSH_INTERVAL;
+	stopping = false;
+
+	if ((batch = malloc(LOG_BATCH_SIZE)) == NULL) {
+		return false;
+	}
+
+	if (pthread_create(&log_thread, NULL, log_main, batch)) {
+		free(batch);
+		return false;
+	}
+
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+void http_log_stop() {
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&rings_lock);
+	stopping = true;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&rings_lock);
+
+	pthread_join(log_thread, NULL);
+}
+
+size_t http_log_dropped() {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+void log_http_request(http_request_t *request, http_response_t *response) {
+	log_record_t record;
+	log_ring_t *r;
+	size_t head, tail;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		make_record(&record, request, response);
+
+		pthread_mutex_lock(&lock);
+		FILE *stream = file != NULL ? file : stdout;
+		fprintf(stream, "Date: %s: %s %s %d\n", http_clock_date(),
+			record.ip, record.url, record.content_length);
+		fflush(stream);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	if ((r = get_ring()) == NULL) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	tail = r->tail;
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (tail - head == HTTP_LOG_RING_SIZE) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	make_record(&r->records[tail % HTTP_LOG_RING_SIZE], request, response);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+	// Do not wait for the interval when the ring is filling up.
+	if (tail - head == HTTP_LOG_RING_SIZE / 2) {
+		pthread_cond_signal(&wake);
+	}
+}
@@ -11,6 +11,9 @@ extern "C" {
 #include "http_request.h"
 #include "http_response.h"
 
+#define HTTP_LOG_RING_SIZE 128              // Records per thread.
+#define HTTP_LOG_DEFAULT_FLUSH_INTERVAL 100 // ms
+
 /**
  * Set file path to log.
  * If file is not specified, log is printed out to stdout.
@@ -20,8 +23,30 @@ extern "C" {
  */
 bool http_log_set_file(const char *path);
 
+/**
+ * Start the thread writing log in batches.
+ * Until it is started, each request is written and flushed when logged.
+ *
+ * @params flush_interval_ms Time between batches. If <= 0,
+ *         HTTP_LOG_DEFAULT_FLUSH_INTERVAL is applied.
+ * @return true if succeed, otherwise false.
+ */
+bool http_log_start(int flush_interval_ms);
+
+/**
+ * Write what is logged so far and stop the thread.
+ */
+void http_log_stop();
+
+/**
+ * Number of records dropped because the ring of a thread was full.
+ */
+size_t http_log_dropped();
+
 /**
  * Log http_request_t.
+ * Once started, the record is put in a ring of the calling thread without
+ * locking, and dropped if the ring is full, so a slow disk never blocks.
  *
  * @params request The pointer to a http_requeset_t to log
  * @params response The pointer to a http_response_t to log
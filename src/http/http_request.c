@@ -2,15 +2,6 @@
 #include <stdlib.h>
 #include "http_request.h"
 
-static __thread char *local_content;
-static __thread size_t local_content_len;
-static __thread size_t local_alloc_content_size;
-
-static __thread char *field;
-static __thread size_t field_len;
-static __thread char *value;
-static __thread size_t value_len;
-
 http_request_t *init_http_request(size_t max_num_headers) {
     http_request_t *request;
     http_headers_t *headers;
@@ -42,16 +33,27 @@ void free_http_request(http_request_t *request) {
     free(request);
 }
 
+void reset_http_request(http_request_t *request) {
+    http_headers_t *headers = request->headers;
+    char ip[INET_ADDRSTRLEN];
+
+    if (request->content_length != 0)
+        free(request->content);
+
+    strcpy(ip, request->ip);
+    reset_http_headers(headers);
+    memset(request, 0, sizeof(http_request_t));
+    request->headers = headers;
+    strcpy(request->ip, ip);
+}
+
 void print_http_request(http_request_t *request) {
-    int i;
     http_headers_t *headers = request->headers;
 
     printf("host: %s\n", request->host);
     printf("path: %s\n", request->path);
     printf("method: %s\n", http_method_str(request->method));
-    for (i = 0; i < headers->num_headers; i++) {
-        printf("%s: %s\n", headers->field[i], headers->value[i]);
-    }
+    print_headers(headers);
 
     printf("content: \n%s\n", request->content);
     fflush(stdout);
@@ -94,99 +96,45 @@ int request_on_header_field_cb(http_parser *parser, const char *at, size_t len)
     if (!parser->data) return -1;
 
     http_request_t *request = (http_request_t *) parser->data;
-    http_headers_t *headers = request->headers;
-
-    if (headers->last_header_element != HEADER_FIELD) {
-        if (headers->num_headers + 1 > headers->max_num_headers)
-            return -1;
 
-        if (value) {
-            value = NULL;
-            value_len = 0;
-        }
-
-        if ((field = malloc(len + 1)) == NULL)
-            return -1;
-        memset(field, 0, len + 1);
-
-        field_len = len + 1;
-        headers->num_headers++;
-        headers->field[headers->num_headers - 1] = field;
-    } else {
-        if ((field = realloc(field, field_len + len)) == NULL) {
-            headers->num_headers--;
-            return -1;
-        }
-        memset(field + field_len - 1, 0, len + 1);
-
-        field_len += len;
-        headers->field[headers->num_headers - 1] = field;
-    }
-
-    strncat(headers->field[headers->num_headers - 1], at, len);
-    headers->last_header_element = HEADER_FIELD;
-
-    return 0;
+    return append_header_field(request->headers, at, len) ? 0 : -1;
 }
 
 int request_on_header_value_cb(http_parser *parser, const char *at, size_t len) {
     if (!parser->data) return -1;
 
     http_request_t *request = (http_request_t *) parser->data;
-    http_headers_t *headers = request->headers;
-
-    if (!value) {
-        if ((value = malloc(len + 1)) == NULL) {
-            free(headers->field[headers->num_headers - 1]);
-            headers->num_headers--;
-            return -1;
-        }
-        memset(value, 0, len + 1);
-
-        field = NULL;
-        field_len = 0;
 
-        value_len = len + 1;
-        headers->value[headers->num_headers - 1] = value;
-    } else {
-        if ((value = realloc(value, value_len + len)) == NULL) {
-            free(headers->field[headers->num_headers - 1]);
-            headers->num_headers--;
-            return -1;
-        }
-        memset(value + value_len - 1, 0, len + 1);
-
-        value_len += len;
-        headers->value[headers->num_headers - 1] = value;
-    }
-
-    strncat(headers->value[headers->num_headers - 1], at, len);
-    headers->last_header_element = HEADER_VALUE;
-
-    return 0;
+    return append_header_value(request->headers, at, len) ? 0 : -1;
 }
 
 int request_on_body_cb(http_parser *parser, const char *at, size_t len) {
     if (!parser->data) return -1;
 
-    if (local_content_len == 0) {
-        local_alloc_content_size = 2 * sizeof(char) * len;
-        if ((local_content = malloc(local_alloc_content_size)) == NULL) {
+    http_request_t *request = (http_request_t *) parser->data;
+    char *content;
+
+    if (request->content_length == 0) {
+        request->content_alloc_size = 2 * sizeof(char) * len;
+        if ((request->content = malloc(request->content_alloc_size)) == NULL) {
+            request->content_alloc_size = 0;
+            return -1;
+        }
+        memset(request->content, 0, request->content_alloc_size);
+
+    } else if ((request->content_length + len) > request->content_alloc_size) {
+        request->content_alloc_size += 2 * sizeof(char) * len;
+        if ((content = realloc(request->content,
+                request->content_alloc_size)) == NULL) {
             return -1;
         }
-        memset(local_content, 0, local_alloc_content_size);
-
-    } else if (local_content_len != 0
-        && (local_content_len + len) > local_alloc_content_size) {
-            local_alloc_content_size += 2 * sizeof(char) * len;
-            if ((local_content = realloc(local_content,
-                    local_alloc_content_size)) == NULL) {
-                return -1;
-            }
+        memset(content + request->content_length, 0,
+            request->content_alloc_size - request->content_length);
+        request->content = content;
     }
 
-    memcpy(local_content + local_content_len, at, len);
-    local_content_len += len;
+    memcpy(request->content + request->content_length, at, len);
+    request->content_length += len;
     return 0;
 }
 
@@ -206,7 +154,7 @@ int request_on_message_complete_cb(http_parser *parser) {
 
     char url[256] = {0};
 
-    char *host = find_header_value(request->headers, "Host");
+    char *host = find_header(request->headers, HTTP_HEADER_HOST);
 
     if (host) {
         if (!strstr(host, "http")) {
@@ -248,70 +196,60 @@ int request_on_message_complete_cb(http_parser *parser) {
         strcpy(request->port, "80");
     }
 
-    if (local_content_len != 0) {
-        request->content = local_content;
-        request->content_length = local_content_len;
-        local_content = NULL;
-        local_content_len = 0;
-        local_alloc_content_size = 0;
-    }
-
     return 0;
 }
 
 bool make_request_string(http_request_t *request, char **dst, size_t *dst_size) {
-    http_headers_t *headers;
-    size_t buf_size, offset;
-    char *buf;
-    int i;
+    size_t offset;
+    int line_len;
 
-    headers = request->headers;
-    buf_size = request->content_length + 2048;
     *dst = NULL;
     *dst_size = 0;
 
-    if ((buf = malloc(buf_size)) == NULL) {
+    line_len = snprintf(NULL, 0, "%s %s HTTP/%d.%d\r\n",
+        http_method_str(request->method), request->path, request->http_major, request->http_minor);
+    if (line_len < 0) {
         return false;
     }
 
-    memset(buf, 0, buf_size);
+    // Headers are written from their slices, no copy in between.
+    offset = line_len + get_headers_length(request->headers);
+    if ((*dst = malloc(offset + request->content_length + 1)) == NULL) {
+        return false;
+    }
 
-    sprintf(buf, "%s %s HTTP/%d.%d\r\n", http_method_str(request->method),
-        request->path, request->http_major, request->http_minor);
-    offset = strlen(buf);
+    sprintf(*dst, "%s %s HTTP/%d.%d\r\n",
+        http_method_str(request->method), request->path, request->http_major, request->http_minor);
+    write_headers(request->headers, *dst + line_len);
+    memcpy(*dst + offset, request->content, request->content_length);
+    *dst_size = offset + request->content_length;
 
-    for (i = 0; i < headers->num_headers; i++) {
-        offset += strlen(headers->field[i]) + strlen(headers->value[i]) + 4;
-        if (buf_size - 2 <= offset + 1) {
-            if ((buf = realloc(buf, buf_size + offset + 1024)) == NULL) {
-                return false;
-            }
-            memset(buf + buf_size + offset, 0, 1024);
-            buf_size += offset + 1024;
-        }
+    return true;
+}
 
-        strcat(buf, headers->field[i]);
-        strcat(buf, ": ");
-        strcat(buf, headers->value[i]);
-        strcat(buf, "\r\n");
-    }
+int make_request_iov(http_request_t *request, char line[REQUEST_LINE_LEN],
+    struct iovec *iov, int iovcnt) {
+    int line_len, n;
 
-    offset += 2;
-    strcat(buf, "\r\n");
+    line_len = snprintf(line, REQUEST_LINE_LEN, "%s %s HTTP/%d.%d\r\n",
+        http_method_str(request->method), request->path,
+        request->http_major, request->http_minor);
+    if (line_len < 0 || line_len >= REQUEST_LINE_LEN || iovcnt < 2) {
+        return -1;
+    }
 
-    *dst_size = offset + request->content_length;
+    iov[0].iov_base = line;
+    iov[0].iov_len = line_len;
 
-    if ((*dst = malloc(*dst_size)) == NULL) {
-        free(buf);
-        *dst_size = 0;
-        return false;
+    if ((n = make_headers_iov(request->headers, iov + 1, iovcnt - 2)) == -1) {
+        return -1;
     }
 
-    memset(*dst, 0, *dst_size);
-
-    memcpy(*dst, buf, offset);
-    memcpy(*dst + offset, request->content, request->content_length);
+    if (request->content_length == 0) {
+        return n + 1;
+    }
 
-    free(buf);
-    return true;
+    iov[n + 1].iov_base = request->content;
+    iov[n + 1].iov_len = request->content_length;
+    return n + 2;
 }
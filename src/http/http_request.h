@@ -14,6 +14,8 @@ extern "C" {
 #define PATH_LEN 256
 #define PORT_LEN 8
 #define HOST_LEN 128
+#define REQUEST_LINE_LEN (PATH_LEN + 32)
+#define REQUEST_IOV_LEN(max_num_headers) (4 * (max_num_headers) + 3)
 
 typedef struct {
     char path[PATH_LEN];
@@ -21,6 +23,7 @@ typedef struct {
     unsigned short http_minor;
     http_headers_t *headers;
     int content_length;
+    size_t content_alloc_size;
     char *content;
     int method;
     bool on_message_completed;
@@ -40,6 +43,12 @@ http_request_t *init_http_request(size_t max_num_headers);
  */
 void free_http_request(http_request_t *request);
 
+/**
+ * Reset http_request_t for the next request on the same connection.
+ * Memory of headers is kept, and so is ip.
+ */
+void reset_http_request(http_request_t *request);
+
 /**
  * Print request.
  */
@@ -61,6 +70,17 @@ int request_on_headers_complete(http_parser *parser);
  */
 bool make_request_string(http_request_t *request, char **dst, size_t *dst_size);
 
+/**
+ * Describe request as iovecs of its line, headers and content, to be sent
+ * by writev() without being copied. line is filled with the request line.
+ * iov references line, headers and content, which must outlive it.
+ *
+ * @params iovcnt REQUEST_IOV_LEN(max_num_headers) is always enough.
+ * @return Number of iovecs used, or -1 if iovcnt is too small.
+ */
+int make_request_iov(http_request_t *request, char line[REQUEST_LINE_LEN],
+    struct iovec *iov, int iovcnt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,13 +4,6 @@
 
 #include "http_response.h"
 
-static __thread size_t local_content_len;
-
-static __thread char *field;
-static __thread size_t field_len;
-static __thread char *value;
-static __thread size_t value_len;
-
 http_response_t *init_http_response(size_t max_num_headers) {
     http_response_t *response;
     http_headers_t *headers;
@@ -42,6 +35,17 @@ void free_http_response(http_response_t *response) {
     free(response);
 }
 
+void reset_http_response(http_response_t *response) {
+    http_headers_t *headers = response->headers;
+
+    if (response->content_length != 0)
+        free(response->content);
+
+    reset_http_headers(headers);
+    memset(response, 0, sizeof(http_response_t));
+    response->headers = headers;
+}
+
 static char *get_status_string(enum http_status status) {
     switch (status) {
     case HTTP_STATUS_CONTINUE:
@@ -231,81 +235,44 @@ int response_on_header_field_cb(http_parser *parser, const char *at, size_t len)
     if (!parser->data) return -1;
 
     http_response_t *response = (http_response_t *) parser->data;
-    http_headers_t *headers = response->headers;
 
-    if (headers->last_header_element != HEADER_FIELD) {
-        if (headers->num_headers + 1 > headers->max_num_headers)
-            return -1;
-
-        if (value) {
-            value = NULL;
-            value_len = 0;
-        }
-
-        if ((field = malloc(len + 1)) == NULL)
-            return -1;
-        memset(field, 0, len + 1);
-
-        field_len = len + 1;
-        headers->num_headers++;
-        headers->field[headers->num_headers - 1] = field;
-    } else {
-        if ((field = realloc(field, field_len + len)) == NULL) {
-            headers->num_headers--;
-            return -1;
-        }
-        memset(field + field_len - 1, 0, len + 1);
-
-        field_len += len;
-        headers->field[headers->num_headers - 1] = field;
-    }
+    return append_header_field(response->headers, at, len) ? 0 : -1;
+}
+
+int response_on_header_value_cb(http_parser *parser, const char *at, size_t len) {
+    if (!parser->data) return -1;
 
-    strncat(headers->field[headers->num_headers - 1], at, len);
-    headers->last_header_element = HEADER_FIELD;
+    http_response_t *response = (http_response_t *) parser->data;
 
-    return 0;
+    return append_header_value(response->headers, at, len) ? 0 : -1;
 }
 
-int response_on_header_value_cb(http_parser *parser, const char *at, size_t len) {
+int response_on_headers_complete_cb(http_parser *parser) {
     if (!parser->data) return -1;
 
     http_response_t *response = (http_response_t *) parser->data;
-    http_headers_t *headers = response->headers;
+    response->on_headers_completed = true;
+    response->status = parser->status_code;
+    response->http_major = parser->http_major;
+    response->http_minor = parser->http_minor;
 
-    if (!value) {
-        if ((value = malloc(len + 1)) == NULL) {
-            free(headers->field[headers->num_headers - 1]);
-            headers->num_headers--;
-            return -1;
-        }
-        memset(value, 0, len + 1);
-
-        field = NULL;
-        field_len = 0;
-
-        value_len = len + 1;
-        headers->value[headers->num_headers - 1] = value;
-    } else {
-        if ((value = realloc(value, value_len + len)) == NULL) {
-            free(headers->field[headers->num_headers - 1]);
-            headers->num_headers--;
-            return -1;
-        }
-        memset(value + value_len - 1, 0, len + 1);
-
-        value_len += len;
-        headers->value[headers->num_headers - 1] = value;
+    // Tell the parser not to wait for a body that is never sent, whatever
+    // Content-Length says.
+    if (response->request_method == HTTP_HEAD
+        || parser->status_code / 100 == 1
+        || parser->status_code == HTTP_STATUS_NO_CONTENT
+        || parser->status_code == HTTP_STATUS_NOT_MODIFIED) {
+        return 1;
     }
 
-    strncat(headers->value[headers->num_headers - 1], at, len);
-    headers->last_header_element = HEADER_VALUE;
-
     return 0;
 }
 
 int response_on_body_cb(http_parser *parser, const char *at, size_t len) {
     if (!parser->data) return -1;
-    local_content_len += len;
+
+    http_response_t *response = (http_response_t *) parser->data;
+    response->content_length += len;
     return 0;
 }
 
@@ -318,80 +285,42 @@ int response_on_message_complete_cb(http_parser *parser) {
     response->http_major = parser->http_major;
     response->http_minor = parser->http_minor;
 
-    if (local_content_len != 0) {
-        response->content_length = local_content_len;
-        local_content_len = 0;
-    }
-
     return 0;
 }
 
 bool make_response_string(http_response_t *response, char **dst, size_t *dst_size) {
-    http_headers_t *headers;
-    size_t buf_size, offset;
-    char *buf;
-    int i;
+    size_t offset;
+    int line_len;
 
-    headers = response->headers;
-    buf_size = response->content_length + 2048;
     *dst = NULL;
     *dst_size = 0;
-    buf = malloc(buf_size);
 
-    if ((buf = malloc(buf_size)) == NULL) {
-        return false;
-    }
-
-    memset(buf, 0, buf_size);
-
-    sprintf(buf, "HTTP/%d.%d %s\r\n", response->http_major,
+    line_len = snprintf(NULL, 0, "HTTP/%d.%d %s\r\n", response->http_major,
         response->http_minor, get_status_string(response->status));
-    offset = strlen(buf);
-
-    for (i = 0; i < headers->num_headers; i++) {
-        offset += strlen(headers->field[i]) + strlen(headers->value[i]) + 4;
-        if (buf_size - 2 <= offset + 1) {
-            if ((buf = realloc(buf, buf_size + offset + 1024)) == NULL) {
-                return false;
-            }
-            memset(buf + buf_size + offset, 0, 1024);
-            buf_size += offset + 1024;
-        }
-
-        strcat(buf, headers->field[i]);
-        strcat(buf, ": ");
-        strcat(buf, headers->value[i]);
-        strcat(buf, "\r\n");
+    if (line_len < 0) {
+        return false;
     }
 
-    offset += 2;
-    strcat(buf, "\r\n");
-
-    *dst_size = offset + response->content_length;
-
-    if ((*dst = malloc(*dst_size)) == NULL) {
-        free(buf);
-        *dst_size = 0;
+    // Headers are written from their slices, no copy in between.
+    offset = line_len + get_headers_length(response->headers);
+    if ((*dst = malloc(offset + response->content_length + 1)) == NULL) {
         return false;
     }
 
-    memset(*dst, 0, *dst_size);
-
-    memcpy(*dst, buf, offset);
+    sprintf(*dst, "HTTP/%d.%d %s\r\n", response->http_major,
+        response->http_minor, get_status_string(response->status));
+    write_headers(response->headers, *dst + line_len);
     memcpy(*dst + offset, response->content, response->content_length);
+    *dst_size = offset + response->content_length;
 
-    free(buf);
     return true;
 }
 
 void print_http_response(http_response_t *response) {
     http_headers_t *headers = response->headers;
-    int i;
     printf("status: %s\n", get_status_string(response->status));
 
-    for (i = 0; i < headers->num_headers; i++) {
-        printf("%s: %s\n", headers->field[i], headers->value[i]);
-    }
+    print_headers(headers);
     printf("\n");
     fflush(stdout);
 }
@@ -16,7 +16,9 @@ typedef struct {
     http_headers_t *headers;
     int content_length;
     char *content;      // Required manually calling free after use if content_length is not 0
+    bool on_headers_completed;
     bool on_message_completed;
+    enum http_method request_method;    // Set before parsing, a HEAD answer has no body
 } http_response_t;
 
 /**
@@ -29,9 +31,16 @@ http_response_t *init_http_response(size_t max_num_headers);
  */
 void free_http_response(http_response_t *response);
 
+/**
+ * Reset http_response_t for the next response on the same connection.
+ * Memory of headers is kept.
+ */
+void reset_http_response(http_response_t *response);
+
 /* ********************** Callback for http_parser ********************* */
 int response_on_header_field_cb(http_parser *parser, const char *at, size_t len);
 int response_on_header_value_cb(http_parser *parser, const char *at, size_t len);
+int response_on_headers_complete_cb(http_parser *parser);
 int response_on_body_cb(http_parser *parser, const char *at, size_t len);
 int response_on_message_complete_cb(http_parser *parser);
 /** ******************************************************************** */
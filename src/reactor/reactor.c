@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "reactor.h"
+
+/**
+ * Registered fd. Handlers are indexed by fd, so a stale event of a closed
+ * fd in the same epoll_wait() batch never dereferences freed memory.
+ */
+typedef struct {
+    reactor_cb cb;
+    void *data;
+    uint32_t events;
+} reactor_handler_t;
+
+struct reactor {
+    int epfd;
+    int max_events;
+    struct epoll_event *events;
+    reactor_handler_t *handlers;
+    int num_handlers;
+    bool stop;
+    int tick_interval;          // ms
+    long long next_tick;        // ms, CLOCK_MONOTONIC
+    reactor_tick_cb tick_cb;
+    void *tick_data;
+};
+
+static long long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Grow handler table so that fd can be used as index.
+ */
+static bool reactor_reserve(reactor_t *reactor, int fd) {
+    reactor_handler_t *handlers;
+    int num_handlers;
+
+    if (fd < reactor->num_handlers) {
+        return true;
+    }
+
+    num_handlers = reactor->num_handlers ? reactor->num_handlers : 1024;
+    while (num_handlers <= fd) {
+        num_handlers *= 2;
+    }
+
+    handlers = realloc(reactor->handlers,
+        sizeof(reactor_handler_t) * num_handlers);
+    if (!handlers) {
+        return false;
+    }
+
+    memset(handlers + reactor->num_handlers, 0,
+        sizeof(reactor_handler_t) * (num_handlers - reactor->num_handlers));
+    reactor->handlers = handlers;
+    reactor->num_handlers = num_handlers;
+
+    return true;
+}
+
+reactor_t *reactor_init(int max_events) {
+    reactor_t *reactor;
+
+    reactor = malloc(sizeof(reactor_t));
+    if (!reactor) {
+        return NULL;
+    }
+    memset(reactor, 0, sizeof(reactor_t));
+
+    reactor->max_events =
+        max_events <= 0 ? REACTOR_DEFAULT_MAX_EVENTS : max_events;
+
+    reactor->events = malloc(sizeof(struct epoll_event) * reactor->max_events);
+    if (!reactor->events) {
+        free(reactor);
+        return NULL;
+    }
+
+    if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        free(reactor->events);
+        free(reactor);
+        return NULL;
+    }
+
+    return reactor;
+}
+
+void reactor_free(reactor_t *reactor) {
+    if (!reactor) return;
+
+    close(reactor->epfd);
+    free(reactor->handlers);
+    free(reactor->events);
+    free(reactor);
+}
+
+bool reactor_add(reactor_t *reactor, int fd, uint32_t events, reactor_cb cb,
+    void *data) {
+    struct epoll_event ev;
+
+    if (!reactor_reserve(reactor, fd)) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        return false;
+    }
+
+    reactor->handlers[fd].cb = cb;
+    reactor->handlers[fd].data = data;
+    reactor->handlers[fd].events = events;
+
+    return true;
+}
+
+bool reactor_mod(reactor_t *reactor, int fd, uint32_t events) {
+    struct epoll_event ev;
+
+    if (fd >= reactor->num_handlers || !reactor->handlers[fd].cb) {
+        errno = ENOENT;
+        return false;
+    }
+
+    if (reactor->handlers[fd].events == events) {
+        return true;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        return false;
+    }
+
+    reactor->handlers[fd].events = events;
+    return true;
+}
+
+bool reactor_del(reactor_t *reactor, int fd) {
+    if (fd >= reactor->num_handlers || !reactor->handlers[fd].cb) {
+        errno = ENOENT;
+        return false;
+    }
+
+    memset(&reactor->handlers[fd], 0, sizeof(reactor_handler_t));
+
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        return false;
+    }
+
+    return true;
+}
+
+void reactor_set_tick(reactor_t *reactor, int interval_ms, reactor_tick_cb cb,
+    void *data) {
+    if (interval_ms <= 0 || !cb) {
+        reactor->tick_interval = 0;
+        reactor->tick_cb = NULL;
+        reactor->tick_data = NULL;
+        return;
+    }
+
+    reactor->tick_interval = interval_ms;
+    reactor->tick_cb = cb;
+    reactor->tick_data = data;
+    reactor->next_tick = now_ms() + interval_ms;
+}
+
+int reactor_run(reactor_t *reactor) {
+    int i, n, fd, timeout;
+    long long now;
+    reactor_handler_t *handler;
+
+    reactor->stop = false;
+
+    while (!reactor->stop) {
+        timeout = -1;
+        if (reactor->tick_cb) {
+            now = now_ms();
+            timeout = reactor->next_tick > now ?
+                (int) (reactor->next_tick - now) : 0;
+        }
+
+        if ((n = epoll_wait(reactor->epfd, reactor->events,
+                reactor->max_events, timeout)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait() failed");
+            return -1;
+        }
+
+        for (i = 0; i < n && !reactor->stop; i++) {
+            fd = reactor->events[i].data.fd;
+            if (fd >= reactor->num_handlers) {
+                continue;
+            }
+
+            handler = &reactor->handlers[fd];
+            if (!handler->cb) {     // Removed by a previous callback.
+                continue;
+            }
+
+            handler->cb(reactor, fd, reactor->events[i].events, handler->data);
+        }
+
+        if (reactor->tick_cb && now_ms() >= reactor->next_tick) {
+            reactor->next_tick = now_ms() + reactor->tick_interval;
+            reactor->tick_cb(reactor, reactor->tick_data);
+        }
+    }
+
+    return 0;
+}
+
+void reactor_stop(reactor_t *reactor) {
+    reactor->stop = true;
+}
@@ -0,0 +1,83 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_DEFAULT_MAX_EVENTS 256
+
+typedef struct reactor reactor_t;
+
+/**
+ * Called when fd becomes ready. events is the epoll event mask.
+ */
+typedef void (*reactor_cb)(reactor_t *reactor, int fd, uint32_t events,
+    void *data);
+
+/**
+ * Called every tick interval from the reactor thread.
+ */
+typedef void (*reactor_tick_cb)(reactor_t *reactor, void *data);
+
+/**
+ * Init reactor_t.
+ * max_events is the number of events fetched by one epoll_wait(). If
+ * max_events <= 0, REACTOR_DEFAULT_MAX_EVENTS (256) is applied.
+ */
+reactor_t *reactor_init(int max_events);
+
+/**
+ * Free reactor_t. Registered fds are not closed.
+ */
+void reactor_free(reactor_t *reactor);
+
+/**
+ * Register fd with the reactor.
+ *
+ * @params reactor Pointer to reactor_t.
+ * @params fd File descriptor to watch. It should be non-blocking.
+ * @params events epoll event mask (e.g. EPOLLIN | EPOLLOUT | EPOLLET).
+ * @params cb Callback invoked when fd is ready.
+ * @params data User data passed to cb.
+ * @return true if succeed, otherwise false. errno will be set.
+ */
+bool reactor_add(reactor_t *reactor, int fd, uint32_t events, reactor_cb cb,
+    void *data);
+
+/**
+ * Change the event mask of already registered fd.
+ */
+bool reactor_mod(reactor_t *reactor, int fd, uint32_t events);
+
+/**
+ * Unregister fd. Must be called before fd is closed.
+ * Pending events of fd in the current iteration are discarded.
+ */
+bool reactor_del(reactor_t *reactor, int fd);
+
+/**
+ * Set a periodic callback. interval_ms <= 0 disables it.
+ */
+void reactor_set_tick(reactor_t *reactor, int interval_ms, reactor_tick_cb cb,
+    void *data);
+
+/**
+ * Run event loop until reactor_stop() is called.
+ *
+ * @return 0 if stopped, -1 if epoll_wait() failed.
+ */
+int reactor_run(reactor_t *reactor);
+
+/**
+ * Stop event loop. Must be called from the reactor thread.
+ */
+void reactor_stop(reactor_t *reactor);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
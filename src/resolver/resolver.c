@@ -0,0 +1,928 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#include "resolver.h"
+
+#define HASH_SIZE 1024
+#define HOST_MAX 253
+#define LABEL_MAX 63
+#define PACKET_SIZE 4096
+#define SWEEP_INTERVAL 10000    // ms
+
+#define DNS_PORT 53
+#define DNS_HEADER_SIZE 12
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_CLASS_IN 1
+
+typedef struct resolver_waiter {
+    resolver_cb cb;
+    void *data;
+    struct resolver_waiter *next;
+} resolver_waiter_t;
+
+typedef struct resolver_entry {
+    char *host;
+    bool pending;                   // Query in flight.
+    resolver_result_t result;
+    long long expires;              // ms, -1 if never.
+    uint16_t id;                    // Id of the query in flight.
+    int sockfd;                     // Socket of the query in flight, or -1.
+    int tries;
+    long long deadline;             // ms, when the query is sent again.
+    resolver_waiter_t *waiters;
+    struct resolver_entry *next;    // Hash chain.
+    struct resolver_entry *next_pending;
+} resolver_entry_t;
+
+struct resolver {
+    struct sockaddr_in nameserver;
+    int wake_fds[2];                // Wakes resolver thread for a new query.
+    int timeout;                    // ms
+    resolver_entry_t *entries[HASH_SIZE];
+    size_t num_entries;
+    resolver_entry_t *pending;
+    struct pollfd *fds;             // Wake pipe and sockets of pending.
+    size_t fds_size;
+    long long last_sweep;
+    resolver_stats_t stats;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    resolver_result_t *result;
+} resolver_wait_t;
+
+static long long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * djb2
+ */
+static uint32_t resolver_hash(const char *host) {
+    uint32_t h = 5381;
+
+    while (*host) {
+        h = ((h << 5) + h) + (unsigned char) *host++;
+    }
+
+    return h % HASH_SIZE;
+}
+
+/**
+ * Copy host to name in lower case without the trailing dot.
+ */
+static bool normalize_host(const char *host, char *name) {
+    size_t i, len = strlen(host);
+
+    if (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+
+    if (len == 0 || len > HOST_MAX) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        name[i] = tolower((unsigned char) host[i]);
+    }
+    name[len] = '\0';
+
+    return true;
+}
+
+static resolver_entry_t *find_entry(resolver_t *resolver, const char *host) {
+    resolver_entry_t *entry;
+
+    for (entry = resolver->entries[resolver_hash(host)]; entry;
+            entry = entry->next) {
+        if (strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static resolver_entry_t *new_entry(resolver_t *resolver, const char *host) {
+    resolver_entry_t *entry;
+    uint32_t hash_index = resolver_hash(host);
+
+    if ((entry = malloc(sizeof(resolver_entry_t))) == NULL) {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(resolver_entry_t));
+
+    if ((entry->host = strdup(host)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->sockfd = -1;
+
+    entry->next = resolver->entries[hash_index];
+    resolver->entries[hash_index] = entry;
+    resolver->num_entries++;
+
+    return entry;
+}
+
+/**
+ * Unlink and free entry. It must not be pending.
+ */
+static void remove_entry(resolver_t *resolver, resolver_entry_t *entry) {
+    resolver_entry_t **p = &resolver->entries[resolver_hash(entry->host)];
+
+    while (*p != entry) {
+        p = &(*p)->next;
+    }
+    *p = entry->next;
+
+    resolver->num_entries--;
+    free(entry->host);
+    free(entry);
+}
+
+static void free_waiters(resolver_waiter_t *waiter) {
+    resolver_waiter_t *next;
+
+    for (; waiter; waiter = next) {
+        next = waiter->next;
+        free(waiter);
+    }
+}
+
+/**
+ * Build an A query for host into buf.
+ *
+ * @return Length of the query, or -1 if host is not a valid name.
+ */
+static int dns_build_query(uint8_t *buf, size_t buf_size, uint16_t id,
+    const char *host) {
+    const char *label, *dot;
+    size_t len, offset = DNS_HEADER_SIZE;
+
+    if (buf_size < DNS_HEADER_SIZE + strlen(host) + 2 + 4) {
+        return -1;
+    }
+
+    memset(buf, 0, DNS_HEADER_SIZE);
+    buf[0] = id >> 8;
+    buf[1] = id & 0xff;
+    buf[2] = DNS_FLAG_RD >> 8;
+    buf[5] = 1;     // QDCOUNT
+
+    for (label = host; *label; label = dot + 1) {
+        dot = strchr(label, '.');
+        len = dot ? (size_t) (dot - label) : strlen(label);
+
+        if (len == 0 || len > LABEL_MAX) {
+            return -1;
+        }
+
+        buf[offset++] = len;
+        memcpy(buf + offset, label, len);
+        offset += len;
+
+        if (!dot) {
+            break;
+        }
+    }
+
+    buf[offset++] = 0;
+    buf[offset++] = 0;
+    buf[offset++] = DNS_TYPE_A;
+    buf[offset++] = 0;
+    buf[offset++] = DNS_CLASS_IN;
+
+    return offset;
+}
+
+/**
+ * Skip a possibly compressed name at offset.
+ *
+ * @return Offset following the name, or -1 if it is truncated.
+ */
+static int dns_skip_name(const uint8_t *buf, size_t len, size_t offset) {
+    while (offset < len) {
+        if ((buf[offset] & 0xc0) == 0xc0) {
+            return offset + 2 <= len ? (int) offset + 2 : -1;
+        }
+
+        if (buf[offset] == 0) {
+            return offset + 1;
+        }
+
+        offset += buf[offset] + 1;
+    }
+
+    return -1;
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**
+ * Parse a response to query into result. ttl is set to the smallest TTL
+ * of the answer records, or RESOLVER_NEGATIVE_TTL for a negative answer.
+ *
+ * @return false if buf is not a well-formed response to query.
+ */
+static bool dns_parse_response(const uint8_t *buf, size_t len,
+    const uint8_t *query, size_t query_len, resolver_result_t *result,
+    uint32_t *ttl) {
+    uint16_t flags, ancount, type, class, rdlength;
+    uint32_t record_ttl;
+    int offset, i;
+
+    memset(result, 0, sizeof(resolver_result_t));
+    *ttl = RESOLVER_NEGATIVE_TTL;
+
+    // Id, QDCOUNT and the question must echo the query.
+    if (len < query_len || memcmp(buf, query, 2) != 0
+        || memcmp(buf + 4, query + 4, 2) != 0
+        || memcmp(buf + DNS_HEADER_SIZE, query + DNS_HEADER_SIZE,
+            query_len - DNS_HEADER_SIZE) != 0) {
+        return false;
+    }
+
+    flags = get16(buf + 2);
+    if (!(flags & DNS_FLAG_QR)) {
+        return false;
+    }
+
+    if ((flags & 0xf) == DNS_RCODE_NXDOMAIN) {
+        result->status = RESOLVER_NOT_FOUND;
+        return true;
+    }
+
+    if ((flags & 0xf) != 0) {
+        result->status = RESOLVER_FAILED;
+        return true;
+    }
+
+    ancount = get16(buf + 6);
+    offset = query_len;
+    *ttl = RESOLVER_MAX_TTL;
+
+    for (i = 0; i < ancount; i++) {
+        if ((offset = dns_skip_name(buf, len, offset)) == -1
+            || offset + 10 > len) {
+            return false;
+        }
+
+        type = get16(buf + offset);
+        class = get16(buf + offset + 2);
+        record_ttl = get32(buf + offset + 4);
+        rdlength = get16(buf + offset + 8);
+        offset += 10;
+
+        if (offset + rdlength > len) {
+            return false;
+        }
+
+        if (class == DNS_CLASS_IN
+            && (type == DNS_TYPE_A || type == DNS_TYPE_CNAME)) {
+            if (record_ttl < *ttl) {
+                *ttl = record_ttl;
+            }
+
+            if (type == DNS_TYPE_A && rdlength == 4
+                && result->num_addrs < RESOLVER_MAX_ADDRS) {
+                memcpy(&result->addrs[result->num_addrs++], buf + offset, 4);
+            }
+        }
+
+        offset += rdlength;
+    }
+
+    if (result->num_addrs == 0) {   // No A record for the name.
+        result->status = RESOLVER_NOT_FOUND;
+        *ttl = RESOLVER_NEGATIVE_TTL;
+    } else {
+        result->status = RESOLVER_OK;
+    }
+
+    return true;
+}
+
+/**
+ * Open the socket of a new query and pick its id. Each query has a socket
+ * of its own, connected so datagrams from other sources are dropped by
+ * kernel, and bound by connect() to a random ephemeral port. A forged
+ * answer has to guess both the port and the id.
+ */
+static bool open_query(resolver_t *resolver, resolver_entry_t *entry) {
+    if (getrandom(&entry->id, sizeof(entry->id), 0) != sizeof(entry->id)) {
+        perror("resolver getrandom() failed");
+        return false;
+    }
+
+    if ((entry->sockfd = socket(AF_INET,
+            SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("resolver cannot create socket");
+        return false;
+    }
+
+    if (connect(entry->sockfd, (struct sockaddr *) &resolver->nameserver,
+            sizeof(resolver->nameserver)) == -1) {
+        perror("resolver cannot connect socket");
+        close(entry->sockfd);
+        entry->sockfd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static void close_query(resolver_entry_t *entry) {
+    if (entry->sockfd != -1) {
+        close(entry->sockfd);
+        entry->sockfd = -1;
+    }
+}
+
+static void send_query(resolver_t *resolver, resolver_entry_t *entry,
+    long long now) {
+    uint8_t buf[PACKET_SIZE];
+    int len;
+
+    // Retransmits keep the socket and id, so a late answer to an earlier
+    // try counts. A query that cannot be opened fails at deadline.
+    if (entry->tries == 0 && !open_query(resolver, entry)) {
+        entry->tries = RESOLVER_RETRIES;
+        entry->deadline = now;
+        return;
+    }
+    entry->tries++;
+    entry->deadline = now + resolver->timeout;
+
+    if ((len = dns_build_query(buf, sizeof(buf), entry->id,
+            entry->host)) == -1) {
+        return;     // Checked by resolver_lookup().
+    }
+
+    // A lost datagram is sent again at deadline.
+    send(entry->sockfd, buf, len, MSG_NOSIGNAL);
+    resolver->stats.queries++;
+}
+
+/**
+ * Answer waiters of pending entry and cache result for ttl seconds.
+ */
+static void complete_entry(resolver_t *resolver, resolver_entry_t *entry,
+    const resolver_result_t *result, uint32_t ttl) {
+    resolver_entry_t **p;
+    resolver_waiter_t *waiter;
+
+    for (p = &resolver->pending; *p != entry; p = &(*p)->next_pending) {
+        ;
+    }
+    *p = entry->next_pending;
+    entry->next_pending = NULL;
+    entry->pending = false;
+    entry->result = *result;
+    close_query(entry);
+
+    for (waiter = entry->waiters; waiter; waiter = waiter->next) {
+        waiter->cb(result, waiter->data);
+    }
+    free_waiters(entry->waiters);
+    entry->waiters = NULL;
+
+    if (result->status == RESOLVER_FAILED) {
+        resolver->stats.failures++;
+    }
+
+    if (result->status == RESOLVER_FAILED || ttl == 0
+        || resolver->num_entries > RESOLVER_MAX_ENTRIES) {
+        remove_entry(resolver, entry);
+        return;
+    }
+
+    if (ttl > RESOLVER_MAX_TTL) {
+        ttl = RESOLVER_MAX_TTL;
+    }
+    entry->expires = now_ms() + (long long) ttl * 1000;
+}
+
+/**
+ * Handle a datagram received on the socket of pending entry.
+ *
+ * @return true if it answered the query.
+ */
+static bool on_response(resolver_t *resolver, resolver_entry_t *entry,
+    const uint8_t *buf, size_t len) {
+    resolver_result_t result;
+    uint8_t query[PACKET_SIZE];
+    uint32_t ttl;
+    int query_len;
+
+    if (len < DNS_HEADER_SIZE || entry->id != get16(buf)) {
+        return false;
+    }
+
+    query_len = dns_build_query(query, sizeof(query), entry->id,
+        entry->host);
+    if (query_len == -1 || !dns_parse_response(buf, len, query, query_len,
+            &result, &ttl)) {
+        return false;
+    }
+
+    complete_entry(resolver, entry, &result, ttl);
+    return true;
+}
+
+/**
+ * Read the answers received by pending queries.
+ */
+static void receive_responses(resolver_t *resolver) {
+    resolver_entry_t *entry, *next;
+    uint8_t buf[PACKET_SIZE];
+    ssize_t len;
+
+    for (entry = resolver->pending; entry; entry = next) {
+        next = entry->next_pending;
+
+        if (entry->sockfd == -1) {
+            continue;
+        }
+
+        // Errors such as ECONNREFUSED are left to the deadline.
+        while ((len = recv(entry->sockfd, buf, sizeof(buf),
+                MSG_DONTWAIT)) != -1 || errno == ECONNREFUSED
+                || errno == EINTR) {
+            if (len > 0 && on_response(resolver, entry, buf, len)) {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Fill resolver->fds with the wake pipe and the sockets of pending queries.
+ *
+ * @return Number of fds filled.
+ */
+static size_t poll_fds(resolver_t *resolver) {
+    resolver_entry_t *entry;
+    struct pollfd *fds;
+    size_t n = 1;
+
+    for (entry = resolver->pending; entry; entry = entry->next_pending) {
+        n++;
+    }
+
+    if (n > resolver->fds_size) {
+        if ((fds = realloc(resolver->fds, n * sizeof(struct pollfd))) == NULL) {
+            n = resolver->fds_size;     // Others wait for their deadline.
+        } else {
+            resolver->fds = fds;
+            resolver->fds_size = n;
+        }
+    }
+
+    resolver->fds[0].fd = resolver->wake_fds[0];
+    resolver->fds[0].events = POLLIN;
+
+    for (n = 1, entry = resolver->pending; entry && n < resolver->fds_size;
+            entry = entry->next_pending) {
+        if (entry->sockfd != -1) {
+            resolver->fds[n].fd = entry->sockfd;
+            resolver->fds[n].events = POLLIN;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Send queries again, and fail those out of tries.
+ */
+static void check_deadlines(resolver_t *resolver, long long now) {
+    resolver_entry_t *entry, *next;
+    resolver_result_t result;
+
+    for (entry = resolver->pending; entry; entry = next) {
+        next = entry->next_pending;
+
+        if (entry->deadline > now) {
+            continue;
+        }
+
+        if (entry->tries < RESOLVER_RETRIES) {
+            send_query(resolver, entry, now);
+        } else {
+            memset(&result, 0, sizeof(result));
+            result.status = RESOLVER_FAILED;
+            complete_entry(resolver, entry, &result, 0);
+        }
+    }
+}
+
+static void sweep(resolver_t *resolver, long long now) {
+    resolver_entry_t *entry, *next;
+    int i;
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        for (entry = resolver->entries[i]; entry; entry = next) {
+            next = entry->next;
+            if (!entry->pending && entry->expires != -1
+                && entry->expires <= now) {
+                remove_entry(resolver, entry);
+            }
+        }
+    }
+
+    resolver->last_sweep = now;
+}
+
+static int next_timeout(resolver_t *resolver, long long now) {
+    resolver_entry_t *entry;
+    long long deadline = resolver->last_sweep + SWEEP_INTERVAL;
+
+    for (entry = resolver->pending; entry; entry = entry->next_pending) {
+        if (entry->deadline < deadline) {
+            deadline = entry->deadline;
+        }
+    }
+
+    return deadline > now ? (int) (deadline - now) : 0;
+}
+
+static void *resolver_main(void *data) {
+    resolver_t *resolver = (resolver_t *) data;
+    uint8_t buf[PACKET_SIZE];
+    long long now;
+    size_t num_fds;
+    int timeout;
+
+    pthread_mutex_lock(&resolver->lock);
+
+    while (!resolver->stop) {
+        timeout = next_timeout(resolver, now_ms());
+
+        // Sockets of pending queries are closed by this thread only, so
+        // they stay open while it polls them unlocked.
+        num_fds = poll_fds(resolver);
+        pthread_mutex_unlock(&resolver->lock);
+
+        if (poll(resolver->fds, num_fds, timeout) == -1 && errno != EINTR) {
+            perror("resolver poll() failed");
+        }
+
+        while (read(resolver->wake_fds[0], buf, sizeof(buf)) > 0) {
+            ;
+        }
+
+        pthread_mutex_lock(&resolver->lock);
+        receive_responses(resolver);
+
+        now = now_ms();
+        check_deadlines(resolver, now);
+
+        if (now - resolver->last_sweep >= SWEEP_INTERVAL) {
+            sweep(resolver, now);
+        }
+    }
+
+    pthread_mutex_unlock(&resolver->lock);
+    return NULL;
+}
+
+/**
+ * Add names of /etc/hosts to cache. They never expire.
+ */
+static void load_hosts(resolver_t *resolver) {
+    FILE *fp;
+    char line[1024], name[HOST_MAX + 1], *token, *save;
+    struct in_addr addr;
+    resolver_entry_t *entry;
+
+    if ((fp = fopen("/etc/hosts", "r")) == NULL) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "#\n")] = '\0';
+
+        if ((token = strtok_r(line, " \t", &save)) == NULL
+            || inet_pton(AF_INET, token, &addr) != 1) {
+            continue;
+        }
+
+        while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+            if (!normalize_host(token, name)) {
+                continue;
+            }
+
+            if ((entry = find_entry(resolver, name)) == NULL) {
+                if ((entry = new_entry(resolver, name)) == NULL) {
+                    break;
+                }
+                entry->result.status = RESOLVER_OK;
+                entry->expires = -1;
+            }
+
+            if (entry->result.num_addrs < RESOLVER_MAX_ADDRS) {
+                entry->result.addrs[entry->result.num_addrs++] = addr;
+            }
+        }
+    }
+
+    fclose(fp);
+}
+
+/**
+ * Find the first IPv4 nameserver in /etc/resolv.conf.
+ */
+static bool load_nameserver(struct in_addr *addr) {
+    FILE *fp;
+    char line[1024], *token, *save;
+    bool found = false;
+
+    if ((fp = fopen("/etc/resolv.conf", "r")) == NULL) {
+        return false;
+    }
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        if ((token = strtok_r(line, " \t\n", &save)) != NULL
+            && strcmp(token, "nameserver") == 0
+            && (token = strtok_r(NULL, " \t\n", &save)) != NULL) {
+            found = inet_pton(AF_INET, token, addr) == 1;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+resolver_t *resolver_init(const char *nameserver, int port, int timeout_ms) {
+    resolver_t *resolver;
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port > 0 ? port : DNS_PORT);
+
+    if (nameserver) {
+        if (inet_pton(AF_INET, nameserver, &addr.sin_addr) != 1) {
+            fprintf(stderr, "resolver: invalid nameserver %s\n", nameserver);
+            return NULL;
+        }
+    } else if (!load_nameserver(&addr.sin_addr)) {
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+
+    if ((resolver = malloc(sizeof(resolver_t))) == NULL) {
+        perror("resolver cannot create object");
+        return NULL;
+    }
+    memset(resolver, 0, sizeof(resolver_t));
+
+    resolver->nameserver = addr;
+    resolver->timeout = timeout_ms > 0 ? timeout_ms : RESOLVER_DEFAULT_TIMEOUT;
+    resolver->last_sweep = now_ms();
+
+    if ((resolver->fds = malloc(sizeof(struct pollfd))) == NULL) {
+        perror("resolver cannot create object");
+        free(resolver);
+        return NULL;
+    }
+    resolver->fds_size = 1;
+
+    if (pipe2(resolver->wake_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("resolver cannot create pipe");
+        free(resolver->fds);
+        free(resolver);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&resolver->lock, NULL)) {
+        perror("resolver cannot create mutex");
+        close(resolver->wake_fds[0]);
+        close(resolver->wake_fds[1]);
+        free(resolver->fds);
+        free(resolver);
+        return NULL;
+    }
+
+    load_hosts(resolver);
+
+    if (pthread_create(&resolver->thread, NULL, resolver_main, resolver)) {
+        perror("resolver cannot create thread");
+        resolver->stop = true;  // Nothing to join.
+        resolver_free(resolver);
+        return NULL;
+    }
+
+    return resolver;
+}
+
+void resolver_free(resolver_t *resolver) {
+    resolver_entry_t *entry, *next;
+    int i;
+
+    if (!resolver) return;
+
+    pthread_mutex_lock(&resolver->lock);
+    if (!resolver->stop) {
+        resolver->stop = true;
+        write(resolver->wake_fds[1], "", 1);
+        pthread_mutex_unlock(&resolver->lock);
+        pthread_join(resolver->thread, NULL);
+    } else {
+        pthread_mutex_unlock(&resolver->lock);
+    }
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        for (entry = resolver->entries[i]; entry; entry = next) {
+            next = entry->next;
+            free_waiters(entry->waiters);
+            close_query(entry);
+            free(entry->host);
+            free(entry);
+        }
+    }
+
+    close(resolver->wake_fds[0]);
+    close(resolver->wake_fds[1]);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver->fds);
+    free(resolver);
+}
+
+int resolver_lookup(resolver_t *resolver, const char *host,
+    resolver_result_t *result, resolver_cb cb, void *data) {
+    char name[HOST_MAX + 1];
+    uint8_t query[PACKET_SIZE];
+    resolver_entry_t *entry;
+    resolver_waiter_t *waiter;
+    long long now;
+
+    if (!normalize_host(host, name)) {
+        return -1;
+    }
+
+    memset(result, 0, sizeof(resolver_result_t));
+    if (inet_pton(AF_INET, name, &result->addrs[0]) == 1) {
+        result->status = RESOLVER_OK;
+        result->num_addrs = 1;
+
+        pthread_mutex_lock(&resolver->lock);
+        resolver->stats.hits++;
+        pthread_mutex_unlock(&resolver->lock);
+        return 1;
+    }
+
+    if (dns_build_query(query, sizeof(query), 0, name) == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    now = now_ms();
+
+    if ((entry = find_entry(resolver, name)) != NULL && !entry->pending
+        && (entry->expires == -1 || entry->expires > now)) {
+        *result = entry->result;
+        if (result->status == RESOLVER_OK) {
+            resolver->stats.hits++;
+        } else {
+            resolver->stats.negative_hits++;
+        }
+        pthread_mutex_unlock(&resolver->lock);
+        return 1;
+    }
+
+    if ((waiter = malloc(sizeof(resolver_waiter_t))) == NULL) {
+        pthread_mutex_unlock(&resolver->lock);
+        return -1;
+    }
+    waiter->cb = cb;
+    waiter->data = data;
+
+    if (entry && entry->pending) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        resolver->stats.coalesced++;
+        pthread_mutex_unlock(&resolver->lock);
+        return 0;
+    }
+
+    // Missing or expired.
+    if (!entry && (entry = new_entry(resolver, name)) == NULL) {
+        free(waiter);
+        pthread_mutex_unlock(&resolver->lock);
+        return -1;
+    }
+
+    waiter->next = NULL;
+    entry->waiters = waiter;
+    entry->pending = true;
+    entry->tries = 0;
+    entry->next_pending = resolver->pending;
+    resolver->pending = entry;
+    resolver->stats.misses++;
+
+    send_query(resolver, entry, now);
+    write(resolver->wake_fds[1], "", 1);     // Wait for the new deadline.
+
+    pthread_mutex_unlock(&resolver->lock);
+    return 0;
+}
+
+void resolver_cancel(resolver_t *resolver, resolver_cb cb, void *data) {
+    resolver_entry_t *entry;
+    resolver_waiter_t **p, *waiter;
+
+    pthread_mutex_lock(&resolver->lock);
+
+    for (entry = resolver->pending; entry; entry = entry->next_pending) {
+        p = &entry->waiters;
+        while (*p) {
+            if ((*p)->cb == cb && (*p)->data == data) {
+                waiter = *p;
+                *p = waiter->next;
+                free(waiter);
+            } else {
+                p = &(*p)->next;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+static void resolve_done(const resolver_result_t *result, void *data) {
+    resolver_wait_t *wait = (resolver_wait_t *) data;
+
+    pthread_mutex_lock(&wait->lock);
+    *wait->result = *result;
+    wait->done = true;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->lock);
+}
+
+bool resolver_resolve(resolver_t *resolver, const char *host,
+    resolver_result_t *result) {
+    resolver_wait_t wait;
+    int r;
+
+    memset(&wait, 0, sizeof(wait));
+    pthread_mutex_init(&wait.lock, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    wait.result = result;
+
+    if ((r = resolver_lookup(resolver, host, result, resolve_done,
+            &wait)) == 0) {
+        pthread_mutex_lock(&wait.lock);
+        while (!wait.done) {
+            pthread_cond_wait(&wait.cond, &wait.lock);
+        }
+        pthread_mutex_unlock(&wait.lock);
+    } else if (r == -1) {
+        memset(result, 0, sizeof(resolver_result_t));
+        result->status = RESOLVER_FAILED;
+    }
+
+    pthread_cond_destroy(&wait.cond);
+    pthread_mutex_destroy(&wait.lock);
+
+    return result->status == RESOLVER_OK;
+}
+
+void resolver_stats(resolver_t *resolver, resolver_stats_t *stats) {
+    pthread_mutex_lock(&resolver->lock);
+    *stats = resolver->stats;
+    pthread_mutex_unlock(&resolver->lock);
+}
@@ -0,0 +1,103 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define RESOLVER_MAX_ADDRS 8
+#define RESOLVER_MAX_ENTRIES 4096
+#define RESOLVER_DEFAULT_TIMEOUT 1000   // ms, per try
+#define RESOLVER_RETRIES 3
+#define RESOLVER_MAX_TTL 3600           // sec
+#define RESOLVER_NEGATIVE_TTL 30        // sec
+
+typedef struct resolver resolver_t;
+
+typedef enum {
+    RESOLVER_OK = 0,
+    RESOLVER_NOT_FOUND,     // NXDOMAIN or no A record. Cached.
+    RESOLVER_FAILED         // Timeout, server failure or bad response.
+} resolver_status;
+
+typedef struct {
+    resolver_status status;
+    struct in_addr addrs[RESOLVER_MAX_ADDRS];
+    size_t num_addrs;
+} resolver_result_t;
+
+typedef struct {
+    size_t hits;            // Answered from cache, /etc/hosts or numeric.
+    size_t negative_hits;   // Answered RESOLVER_NOT_FOUND from cache.
+    size_t misses;          // Started a query.
+    size_t coalesced;       // Joined a query already in flight.
+    size_t queries;         // Datagrams sent, retransmits included.
+    size_t failures;        // Lookups ended with RESOLVER_FAILED.
+} resolver_stats_t;
+
+/**
+ * Called once when an asynchronous lookup completes. It runs on the
+ * resolver thread with the resolver locked, so it must be short and must
+ * not call resolver functions.
+ */
+typedef void (*resolver_cb)(const resolver_result_t *result, void *data);
+
+/**
+ * Init resolver_t and start its thread.
+ * IPv4 addresses are looked up with A queries sent over UDP, each from a
+ * socket of its own with a random source port and id, and answers are
+ * cached for their TTL (at most RESOLVER_MAX_TTL). Names in /etc/hosts
+ * never expire.
+ *
+ * @params nameserver IPv4 address of the DNS server. If NULL, the first
+ *         nameserver in /etc/resolv.conf (or 127.0.0.1) is used.
+ * @params port DNS server port. If <= 0, 53 is applied.
+ * @params timeout_ms Time to wait for each of RESOLVER_RETRIES tries. If
+ *         <= 0, RESOLVER_DEFAULT_TIMEOUT is applied.
+ * @return Pointer to resolver_t or NULL on error.
+ */
+resolver_t *resolver_init(const char *nameserver, int port, int timeout_ms);
+
+/**
+ * Stop resolver thread and free resolver_t. Pending callbacks are not
+ * called.
+ */
+void resolver_free(resolver_t *resolver);
+
+/**
+ * Look up host without blocking.
+ * Concurrent lookups of the same host share one query.
+ *
+ * @params host Hostname or dotted IPv4 address.
+ * @params result Filled if the answer is known now.
+ * @params cb Called with the answer later if it is not known now.
+ * @params data User data passed to cb.
+ * @return 1 if result is filled, 0 if cb will be called, -1 on error
+ *         (invalid host or no memory).
+ */
+int resolver_lookup(resolver_t *resolver, const char *host,
+    resolver_result_t *result, resolver_cb cb, void *data);
+
+/**
+ * Cancel a pending lookup started with cb and data. After it returns, cb
+ * is not called for data.
+ */
+void resolver_cancel(resolver_t *resolver, resolver_cb cb, void *data);
+
+/**
+ * Look up host and wait for the answer.
+ *
+ * @return true if result->status is RESOLVER_OK, otherwise false.
+ */
+bool resolver_resolve(resolver_t *resolver, const char *host,
+    resolver_result_t *result);
+
+void resolver_stats(resolver_t *resolver, resolver_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
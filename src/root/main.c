@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -6,34 +7,122 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <getopt.h>
 #include <pthread.h>
 
-// #include <thpool/thpool.h>
+#include <thpool/thpool.h>
 #include <cache/lru.h>
+#include <cache/inflight.h>
 #include <http/http_common.h>
 #include <http/http_request.h>
 #include <http/http_response.h>
 #include <http/http_log.h>
-
-#define BACKLOG 10
-// #define THREAD_NUM 8
+#include <http/http_clock.h>
+#include <http/http_cache.h>
+#include <reactor/reactor.h>
+#include <upstream/upstream.h>
+#include <resolver/resolver.h>
+#include <tunnel/tunnel.h>
+
+#define BACKLOG SOMAXCONN
+#define THREAD_NUM 8
+#define QUEUE_LEN 1024
 #define BUFFER_SIZE (80 * 1024)
 #define CACHE_SIZE (5 * 1024 * 1024)  // 5MB
 #define OBJECT_SIZE (512 * 1024)        // 512KB
-
-// key: <request->host>:<requset->port>/<request->path>
-// value: entire response
+#define CANDIDATE_BLOCK_SIZE (16 * 1024)
+#define UPSTREAM_MAX_IDLE 256
+#define UPSTREAM_MAX_IDLE_PER_HOST 8
+#define UPSTREAM_IDLE_TIMEOUT 15000     // ms
+#define CLIENT_IDLE_TIMEOUT 5           // sec, between keep-alive requests
+#define IDLE_CHECK_INTERVAL 1000        // ms, epoll mode closes idle clients
+#define FLIGHT_WAIT_TIMEOUT CLIENT_IDLE_TIMEOUT // sec, then requests waiting
+                                        // for one fetch go to the origin too.
+                                        // Equal, as epoll mode keeps both
+                                        // in one list.
+#define REFRESH_THREADS 4               // Background refreshes at once
+#define REFRESH_QUEUE_LEN 64            // and waiting, others are skipped.
+
+// key: <request->host>:<requset->port>/<request->path>, and the request
+//      headers named by Vary for a variant
+// value: http_cache_entry_t followed by the entire response, or by the
+//        Vary field names of the variants
 static lru_cache_t *cache;
 
+// Fetches in progress, keyed like cache. Concurrent misses of a key wait
+// for the first one instead of going to the origin too.
+static inflight_t *flights;
+
+// Idle keep-alive connections to origin servers.
+static upstream_pool_t *upstream;
+
+// Cached DNS lookups of origin servers.
+static resolver_t *resolver;
+
+// Refreshes of stale responses served meanwhile.
+static threadpool refreshes;
+
+// Seconds past expiry a response without stale-while-revalidate or
+// stale-if-error may still be served, while it is refreshed or when origin
+// fails.
+static time_t stale_while_revalidate;
+static time_t stale_if_error;
+
+static http_parser_settings request_settings;
+static http_parser_settings response_settings;
+
 typedef struct {
     int sockfd;
     char ip[INET_ADDRSTRLEN];
 } args_t;
 
+// Client connection in thread mode. Bytes are kept across requests, so
+// pipelined requests read together with a previous one are not lost.
+typedef struct {
+    int sockfd;
+    char buf[BUFFER_SIZE];
+    size_t len;             // Bytes in buf.
+    size_t offset;          // Bytes of buf already parsed.
+    bool keep_alive;        // Client allows another request after this one.
+    bool closed;            // Client closed or timed out between requests.
+} client_t;
+
+// Response kept for the cache while it is relayed. Bytes are appended to
+// a chain of fixed size blocks, so nothing is copied to grow it, and the
+// chain is dropped as soon as the response exceeds OBJECT_SIZE or its
+// headers show it may not be stored.
+typedef struct candidate_block {
+    struct candidate_block *next;
+    size_t len;
+    char data[CANDIDATE_BLOCK_SIZE];
+} candidate_block_t;
+
+typedef struct {
+    candidate_block_t *head;
+    candidate_block_t *tail;
+    size_t len;
+    size_t num_blocks;
+    time_t request_time;    // When the request was sent, for its age.
+    bool checked;           // Headers were checked.
+    bool dropped;           // Not cacheable, appends are ignored.
+} candidate_t;
+
+// Cache state of a request that missed.
+typedef struct {
+    char *stale;                // Cached response to revalidate or to fall
+    size_t stale_len;           // back on, or NULL once anything is relayed.
+    bool conditional;           // Request was made conditional on stale.
+    inflight_flight_t *flight;  // Fetch other requests wait for, or NULL.
+} miss_t;
+
 static void error(const char *str) {
 	perror(str);
 	exit(EXIT_FAILURE);
@@ -41,7 +130,7 @@ static void error(const char *str) {
 
 static void print_cache_status() {
     size_t total_memory = cache->total_memory;
-    size_t free_memory = cache->free_memory;
+    size_t free_memory = lru_cache_free_memory(cache);
     size_t in_use_memory = total_memory - free_memory;
 
     total_memory /= 1024 * 1024;
@@ -51,41 +140,528 @@ static void print_cache_status() {
     fflush(stdout);
 }
 
-// get addrinfo struct from hostname. result must be free'd using
-// freeaddrinfo() after use.
-static bool get_addrinfo(const char *hostname, const char *port,
-        struct addrinfo **result) {
-    struct addrinfo hints;
+static void print_upstream_status() {
+    upstream_stats_t stats;
+
+    upstream_pool_stats(upstream, &stats);
+    printf("%lu/%lu reused, %lu idle\n", stats.hits,
+        stats.hits + stats.misses, stats.idle);
+    fflush(stdout);
+}
+
+// Make sockaddr of the i-th address in result.
+static void make_sockaddr(struct sockaddr_in *addr,
+    const resolver_result_t *result, size_t i, const char *port) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr = result->addrs[i];
+    addr->sin_port = htons(atoi(port));
+}
+
+// Make cache key of request. key_len includes the terminating NUL.
+// Returned key must be free'd after use.
+static char *make_cache_key(http_request_t *request, size_t *key_len) {
+    char *key;
+
+    *key_len = strlen(request->host) + strlen(request->port)
+        + 1 /* ":" */ + strlen(request->path) + 1;
+    key = malloc(*key_len);
+
+    if (!key) {
+        return NULL;
+    }
+
+    strcpy(key, request->host);
+    strcat(key, ":");
+    strcat(key, request->port);
+    strcat(key, request->path);
+
+    return key;
+}
+
+static void candidate_drop(candidate_t *candidate) {
+    candidate_block_t *block, *next;
+
+    for (block = candidate->head; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+
+    memset(candidate, 0, sizeof(candidate_t));
+    candidate->dropped = true;
+}
+
+// Empty candidate for the next response.
+static void candidate_reset(candidate_t *candidate) {
+    candidate_drop(candidate);
+    candidate->dropped = false;
+}
+
+static void candidate_append(candidate_t *candidate, const char *data,
+    size_t len) {
+    candidate_block_t *block;
+    size_t n;
+
+    if (candidate->dropped) {
+        return;
+    }
+
+    if (candidate->len + len > OBJECT_SIZE) {
+        candidate_drop(candidate);
+        return;
+    }
+
+    candidate->len += len;
+
+    while (len != 0) {
+        if (!candidate->tail
+            || candidate->tail->len == CANDIDATE_BLOCK_SIZE) {
+            if ((block = malloc(sizeof(candidate_block_t))) == NULL) {
+                candidate_drop(candidate);
+                return;
+            }
+
+            block->next = NULL;
+            block->len = 0;
+
+            if (candidate->tail) {
+                candidate->tail->next = block;
+            } else {
+                candidate->head = block;
+            }
+            candidate->tail = block;
+            candidate->num_blocks++;
+        }
+
+        block = candidate->tail;
+        n = CANDIDATE_BLOCK_SIZE - block->len;
+        n = n < len ? n : len;
+
+        memcpy(block->data + block->len, data, n);
+        block->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Drop candidate as soon as the headers of response show it may not be
+// stored.
+static void candidate_check(candidate_t *candidate, http_request_t *request,
+    http_response_t *response) {
+    if (candidate->dropped || candidate->checked
+        || !response->on_headers_completed) {
+        return;
+    }
+
+    candidate->checked = true;
+    if (!http_cache_storable(request, response)) {
+        candidate_drop(candidate);
+    }
+}
+
+// Find a response to request in cache, and whether it is fresh. A response
+// with Vary is found in two steps, its Vary field names under the primary
+// key first. Returned value starts with http_cache_entry_t, and must be
+// released with lru_cache_release().
+static char *cache_lookup(http_request_t *request, size_t *value_len,
+    bool *fresh) {
+    http_cache_entry_t *entry;
+    char *key, *variant_key, *value;
+    size_t key_len, variant_len;
+
+    if (request->method != HTTP_GET) {
+        return NULL;
+    }
+
+    if ((key = make_cache_key(request, &key_len)) == NULL) {
+        perror("key cannot be initialized");
+        return NULL;
+    }
+
+    if (lru_cache_get(cache, key, key_len, (void **) &value, value_len)
+        != LRU_CACHE_NO_ERROR) {
+        fprintf(stderr, "lru_cache_get() failed\n");
+        value = NULL;
+    }
+
+    if (value && ((http_cache_entry_t *) value)->variants) {
+        variant_key = http_cache_variant_key(key, key_len,
+            value + sizeof(http_cache_entry_t),
+            *value_len - sizeof(http_cache_entry_t), request, &variant_len);
+        lru_cache_release(value);
+        value = NULL;
+
+        if (variant_key && lru_cache_get(cache, variant_key, variant_len,
+                (void **) &value, value_len) != LRU_CACHE_NO_ERROR) {
+            fprintf(stderr, "lru_cache_get() failed\n");
+            value = NULL;
+        }
+        free(variant_key);
+    }
+
+    free(key);
+
+    entry = (http_cache_entry_t *) value;
+    *fresh = value && http_cache_fresh(entry, request, http_clock_now());
+
+    return value;
+}
+
+// Lead the fetch of the response to request, or wait for the one in
+// progress. Return NULL once that one ended.
+static inflight_flight_t *flight_enter(http_request_t *request) {
+    inflight_flight_t *flight;
+    char *key;
+    size_t key_len;
+
+    if ((key = make_cache_key(request, &key_len)) == NULL) {
+        perror("key cannot be initialized");
+        return NULL;
+    }
+
+    flight = inflight_enter(flights, key, key_len, FLIGHT_WAIT_TIMEOUT * 1000);
+    free(key);
+
+    return flight;
+}
+
+// Store the response to request, made of entry and the iovcnt - 1 buffers
+// following iov[0], which is filled here. Vary is read from response.
+static void cache_store(http_request_t *request, http_response_t *response,
+    http_cache_entry_t *entry, struct iovec *iov, size_t iovcnt) {
+    http_cache_entry_t variants;
+    struct iovec marker[2];
+    char vary[HTTP_CACHE_VARY_LEN], *key, *variant_key;
+    size_t key_len, variant_len;
+    int vary_len;
+
+    if ((vary_len = http_cache_vary(response, vary, sizeof(vary))) == -1) {
+        return;
+    }
+
+    if ((key = make_cache_key(request, &key_len)) == NULL) {
+        perror("key cannot be initialized");
+        return;
+    }
+
+    // The primary key tells which request headers select the variant.
+    if (vary_len > 0) {
+        memset(&variants, 0, sizeof(variants));
+        variants.variants = true;
+        marker[0].iov_base = &variants;
+        marker[0].iov_len = sizeof(variants);
+        marker[1].iov_base = vary;
+        marker[1].iov_len = vary_len;
+
+        if (lru_cache_setv(cache, key, key_len, marker, 2)
+            != LRU_CACHE_NO_ERROR
+            || (variant_key = http_cache_variant_key(key, key_len, vary,
+                vary_len, request, &variant_len)) == NULL) {
+            fprintf(stderr, "lru_cache_set() failed\n");
+            free(key);
+            return;
+        }
+
+        free(key);
+        key = variant_key;
+        key_len = variant_len;
+    }
+
+    iov[0].iov_base = entry;
+    iov[0].iov_len = sizeof(http_cache_entry_t);
+
+    if (lru_cache_setv(cache, key, key_len, iov, iovcnt)
+        != LRU_CACHE_NO_ERROR) {
+        fprintf(stderr, "lru_cache_set() failed\n");
+    } else {
+        printf("caching - key: %s, ", key);
+        print_cache_status();
+    }
+
+    free(key);
+}
+
+// Cache candidate as the response to request, if it may be stored and
+// stays fresh for a while or can be revalidated.
+static void candidate_store(candidate_t *candidate, http_request_t *request,
+    http_response_t *response) {
+    http_cache_entry_t entry;
+    candidate_block_t *block;
+    struct iovec *iov;
+    size_t i;
+
+    if (candidate->dropped || candidate->len == 0
+        || !http_cache_storable(request, response)) {
+        return;
+    }
+
+    http_cache_init_entry(&entry, response, candidate->request_time,
+        http_clock_now());
+    if (entry.lifetime <= entry.initial_age
+        && !http_cache_has_validator(response)) {
+        return;
+    }
+
+    if ((iov = malloc(sizeof(struct iovec) * (candidate->num_blocks + 1)))
+        == NULL) {
+        perror("iov cannot be allocated");
+        return;
+    }
+
+    for (block = candidate->head, i = 1; block; block = block->next, i++) {
+        iov[i].iov_base = block->data;
+        iov[i].iov_len = block->len;
+    }
+
+    cache_store(request, response, &entry, iov, candidate->num_blocks + 1);
+    free(iov);
+}
+
+// Parse the cached response in value. Return whether the connection may be
+// kept alive after sending it.
+static bool parse_cached(const char *value, size_t value_len,
+    http_response_t *response) {
+    http_parser parser;
+
+    http_parser_init(&parser, HTTP_RESPONSE);
+    parser.data = response;
+    http_parser_execute(&parser, &response_settings,
+        value + sizeof(http_cache_entry_t),
+        value_len - sizeof(http_cache_entry_t));
+
+    return http_should_keep_alive(&parser);
+}
+
+// Make request conditional on the validators of the stale value.
+static bool cache_revalidate(http_request_t *request, const char *stale,
+    size_t stale_len) {
+    http_response_t *stored;
+    bool conditional;
+
+    if ((stored = init_http_response(0)) == NULL) {
+        perror("response cannot be allocated");
+        return false;
+    }
+
+    parse_cached(stale, stale_len, stored);
+    conditional = http_cache_make_conditional(request, stored);
+    free_http_response(stored);
+
+    return conditional;
+}
+
+// Store the stale value again with the metadata of the 304 response.
+static void cache_refresh(http_request_t *request, char *stale,
+    size_t stale_len, http_response_t *response, time_t request_time) {
+    http_cache_entry_t entry;
+    http_response_t *stored;
+    struct iovec iov[2];
+
+    if ((stored = init_http_response(0)) == NULL) {
+        perror("response cannot be allocated");
+        return;
+    }
+
+    parse_cached(stale, stale_len, stored);
+    http_cache_update_entry(&entry, stored, response, request_time,
+        http_clock_now());
+
+    // Values are immutable, the body is copied into the new one.
+    iov[1].iov_base = stale + sizeof(http_cache_entry_t);
+    iov[1].iov_len = stale_len - sizeof(http_cache_entry_t);
+    cache_store(request, stored, &entry, iov, 2);
+
+    free_http_response(stored);
+}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+// Make the answer to the Range of request from the cached value, whose
+// response is parsed in stored: 206 with the ranges asked for, or 416.
+// Return false if the whole value is to be sent instead. dst must be free'd
+// after use.
+static bool cache_partial(http_request_t *request, http_response_t *stored,
+    const char *value, size_t value_len, char **dst, size_t *dst_len) {
+    range_t range;
+    int num_ranges;
+
+    if (!stored->on_message_completed
+        || (num_ranges = http_cache_range(request, stored, &range)) == -1) {
+        return false;
+    }
 
-	int s = getaddrinfo(hostname, port, &hints, result);
-	if (s) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        *result = NULL;
+    // The body is what follows the headers.
+    if (!http_cache_make_partial(stored,
+            value + value_len - stored->content_length, &range, num_ranges,
+            dst, dst_len)) {
+        perror("partial response cannot be made");
         return false;
-	}
+    }
+
+    return true;
+}
+
+// Tell whether the stale value may answer request at once, while it is
+// refreshed in the background.
+static bool cache_stale_while_revalidate(http_request_t *request,
+    const char *stale) {
+    return http_cache_stale_while_revalidate((http_cache_entry_t *) stale,
+        request, http_clock_now(), stale_while_revalidate);
+}
+
+// Tell whether the stale value may answer request as origin failed.
+static bool cache_stale_if_error(http_request_t *request, const char *stale) {
+    return http_cache_stale_if_error((http_cache_entry_t *) stale, request,
+        http_clock_now(), stale_if_error);
+}
+
+// Tell whether the stale value is of use to a miss of request: revalidated
+// with request made conditional on it, or sent if origin fails.
+static bool cache_keep_stale(http_request_t *request, const char *stale,
+    size_t stale_len, bool *conditional) {
+    *conditional = cache_revalidate(request, stale, stale_len);
+
+    return *conditional || cache_stale_if_error(request, stale);
+}
+
+// A request may be sent again on a fresh connection when a reused one was
+// closed by origin before any response byte arrived.
+static bool is_retryable(http_request_t *request) {
+    return request->method == HTTP_GET || request->method == HTTP_HEAD
+        || request->method == HTTP_OPTIONS;
+}
+
+static bool send_all(int sockfd, const char *data, size_t len) {
+    ssize_t sent;
+
+    while (len != 0) {
+        if ((sent = send(sockfd, data, len, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        data += sent;
+        len -= sent;
+    }
+
+    return true;
+}
+
+// Send iov with as few system calls as possible. iov is consumed.
+static bool send_iov(int sockfd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen != 0) {
+        if ((sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        while (msg.msg_iovlen != 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (sent != 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return true;
+}
+
+// Send the response of a cache value, from its memfd if it has one so that
+// the kernel sends its pages without copying them.
+static bool send_cached(int sockfd, const char *value, size_t len) {
+    off_t offset;
+    ssize_t sent;
+    int fd;
+
+    len -= sizeof(http_cache_entry_t);
+
+    if ((fd = lru_cache_value_fd((void *) value, &offset)) == -1) {
+        return send_all(sockfd, value + sizeof(http_cache_entry_t), len);
+    }
+
+    offset += sizeof(http_cache_entry_t);
+
+    while (len != 0) {
+        if ((sent = sendfile(sockfd, fd, &offset, len)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        len -= sent;
+    }
 
     return true;
 }
 
+// Send the cached response in value to client, or the part of it asked for
+// by the Range of request. response is set to the cached one, and
+// keep_alive to false if it must be followed by close.
+static bool send_hit(int sockfd, http_request_t *request, const char *value,
+    size_t value_len, http_response_t *response, bool *keep_alive) {
+    char *partial;
+    size_t partial_len;
+    bool sent;
+
+    reset_http_response(response);
+    *keep_alive = parse_cached(value, value_len, response);
+
+    if (!cache_partial(request, response, value, value_len, &partial,
+            &partial_len)) {
+        return send_cached(sockfd, value, value_len);
+    }
+
+    sent = send_all(sockfd, partial, partial_len);
+    free(partial);
+
+    return sent;
+}
+
+// Stop parser after each request, so that a pipelined request following it
+// is left unparsed until the current one is answered.
+static int request_on_message_complete(http_parser *parser) {
+    int r = request_on_message_complete_cb(parser);
+
+    http_parser_pause(parser, 1);
+    return r;
+}
+
+static void refresh_start(http_request_t *request);
+
 // Called from thread. receive request from client.
 // The server side of proxy.
 // If cache is existed, hit is set to true. And cache is sent directly to client.
+// So is a stale one within stale-while-revalidate, refreshed meanwhile.
+// Otherwise a concurrent fetch of the same response is waited for. On a
+// miss, a stale response is returned in miss to revalidate or to fall back
+// on, and the fetch others wait for.
 // When client request connect method upgrade is set to true.
-static bool rcv_request(int sockfd, http_request_t *request,
-        http_response_t *response, bool *upgrade, bool *hit) {
+static bool rcv_request(client_t *client, http_request_t *request,
+        http_response_t *response, bool *upgrade, bool *hit, miss_t *miss) {
     http_parser *parser;
     http_parser_settings settings;
-    int nparsed, recved;
-    char buf[BUFFER_SIZE] = {0};
-    char *key, *value;
-    size_t key_len, value_len;
-    size_t sent, remaining, offset;
-    lru_cache_error err;
+    ssize_t recved;
+    size_t nparsed;
+    char *value;
+    size_t value_len;
+    bool started = false, fresh, keep_alive;
+
+    *upgrade = false;
+    memset(miss, 0, sizeof(miss_t));
 
     parser = malloc(sizeof(http_parser));
     if (!parser) {
@@ -98,20 +674,51 @@ static bool rcv_request(int sockfd, http_request_t *request,
     settings.on_header_field = request_on_header_field_cb;
     settings.on_header_value = request_on_header_value_cb;
     settings.on_body = request_on_body_cb;
-    settings.on_message_complete = request_on_message_complete_cb;
+    settings.on_message_complete = request_on_message_complete;
 
     http_parser_init(parser, HTTP_REQUEST);
     parser->data = request;
-    *upgrade = false;
 
     while (!request->on_message_completed) {
-        if ((recved = recv(sockfd, buf, BUFFER_SIZE, 0)) == -1) {
-            perror("recv() failed");
-            free(parser);
-            return false;
+        if (client->offset == client->len) {
+            // Headers reference client->buf, keep them before it is reused.
+            if (started && !retain_http_headers(request->headers)) {
+                perror("headers cannot be retained");
+                free(parser);
+                return false;
+            }
+
+            recved = recv(client->sockfd, client->buf, BUFFER_SIZE, 0);
+
+            if (recved <= 0 && !started && (recved == 0
+                    || errno == EAGAIN || errno == EWOULDBLOCK)) {
+                client->closed = true;  // Idle between requests.
+                free(parser);
+                return false;
+            }
+
+            if (recved == -1) {
+                perror("recv() failed");
+                free(parser);
+                return false;
+            }
+
+            if (recved == 0) {
+                fprintf(stderr, "client closed before a complete request\n");
+                free(parser);
+                return false;
+            }
+
+            client->len = recved;
+            client->offset = 0;
         }
 
-        nparsed = http_parser_execute(parser, &settings, buf, recved);
+        started = true;
+        borrow_http_headers(request->headers, client->buf, client->len);
+        nparsed = http_parser_execute(parser, &settings,
+            client->buf + client->offset, client->len - client->offset);
+        client->offset += nparsed;
+
         if (parser->upgrade) {
             // fprintf(stderr, "HTTP tunnel is not implemented\n");
             free(parser);
@@ -119,487 +726,2176 @@ static bool rcv_request(int sockfd, http_request_t *request,
             return true;
         }
 
-        if (nparsed != recved) {
+        if (client->offset != client->len
+            && !request->on_message_completed) {
             fprintf(stderr, "nparsed != recved\n");
             free(parser);
             return false;
         }
     }
 
-    key_len = strlen(request->host) + strlen(request->port)
-        + 1 /* ":" */ + strlen(request->path) + 1;
-    key = malloc(key_len);
+    client->keep_alive = http_should_keep_alive(parser);
 
-    if (!key) {
-        perror("key cannot be initialized");
-        free(parser);
-        return false;
-    }
+    free(parser);
 
-    strcpy(key, request->host);
-    strcat(key, ":");
-    strcat(key, request->port);
-    strcat(key, request->path);
+    value = cache_lookup(request, &value_len, &fresh);
 
-    err = lru_cache_get(cache, key, key_len, (void **) &value, &value_len);
-    if (err != LRU_CACHE_NO_ERROR) {
-        fprintf(stderr, "lru_cache_get() failed\n");
-        free(parser);
-        free(key);
-        return false;
+    // Stale within stale-while-revalidate is a hit too, refreshed meanwhile.
+    if (!fresh && value && cache_stale_while_revalidate(request, value)) {
+        refresh_start(request);
+        fresh = true;
     }
 
-    free(key);
+    if (!fresh && request->method == HTTP_GET
+        && (miss->flight = flight_enter(request)) == NULL) {
+        // Fetched by another request meanwhile.
+        lru_cache_release(value);
+        value = cache_lookup(request, &value_len, &fresh);
+    }
 
-    *hit = value ? true : false;
+    *hit = fresh;
     if (*hit) {    // Hit.
-        remaining = value_len;
-        offset = 0;
+        // value is ours until released, even if evicted meanwhile.
+        if (!send_hit(client->sockfd, request, value, value_len, response,
+                &keep_alive)) {
+            perror("send() failed");
+            lru_cache_release(value);
+            return false;
+        }
 
-        while (remaining != 0) {
-            size_t buf_size;
+        // A response delimited by EOF must be followed by close.
+        client->keep_alive = client->keep_alive && keep_alive;
+        lru_cache_release(value);
+    } else if (value && cache_keep_stale(request, value, value_len,
+            &miss->conditional)) {
+        miss->stale = value;
+        miss->stale_len = value_len;
+    } else {
+        lru_cache_release(value);
+    }
 
-            if (remaining <= BUFFER_SIZE) {
-                buf_size = remaining;
-            } else {
-                buf_size = BUFFER_SIZE;
-            }
+    return true;
+}
 
-            memcpy(buf, value + offset, buf_size);
-            if ((sent = send(sockfd, buf, buf_size, 0)) == -1) {
-                perror("send() failed");
-                free(parser);
+// Connect to host:port. Return connected socket or -1.
+static int connect_origin(const char *host, const char *port) {
+    resolver_result_t result;
+    struct sockaddr_in addr;
+    size_t i;
+    int sockfd = -1;
+
+    if (!resolver_resolve(resolver, host, &result)) {
+        fprintf(stderr, "Could not resolve %s\n", host);
+        return -1;
+    }
+
+    for (i = 0; i < result.num_addrs; i++) {
+        make_sockaddr(&addr, &result, i, port);
+
+        if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+            continue;
+
+        if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) != -1)
+            break;
+
+        close(sockfd);
+        sockfd = -1;
+    }
+
+    if (sockfd == -1) {
+        fprintf(stderr, "Could not connect\n");
+    }
+
+    return sockfd;
+}
+
+// Connections pooled in epoll mode are non-blocking.
+static bool set_blocking(int sockfd) {
+    int flags;
+
+    if ((flags = fcntl(sockfd, F_GETFL, 0)) == -1) {
+        return false;
+    }
+
+    return (flags & O_NONBLOCK) == 0
+        || fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) != -1;
+}
+
+// Called from thread. send request to origin server. and receive its response.
+// The client side of proxy.
+// sockfd will be used in rcv_and_send_response().
+// An idle connection from upstream pool is used unless fresh is true.
+// reused tells whether it was.
+static bool send_request(http_request_t *request, http_response_t *response,
+    int *sockfd, bool fresh, bool *reused) {
+    struct iovec iov[REQUEST_IOV_LEN(DEFAULT_MAX_HEADERS)];
+    char line[REQUEST_LINE_LEN];
+    int iovcnt;
+
+    *reused = false;
+
+    if (request->host == NULL || strcmp(request->host, "") == 0) {
+        fprintf(stderr, "hostname is not specified\n");
+        return false;
+    }
+
+    if (!set_header(request->headers, "Connection", "keep-alive")) {
+        fprintf(stderr, "set_header() failed\n");
+        return false;
+    }
+
+    // Request is sent from its headers in place, with one writev.
+    if ((iovcnt = make_request_iov(request, line, iov,
+            sizeof(iov) / sizeof(iov[0]))) == -1) {
+        fprintf(stderr, "make_request_iov() failed\n");
+        return false;
+    }
+
+    if (!fresh && (*sockfd = upstream_pool_get(upstream, request->host,
+            request->port)) != -1) {
+        if (set_blocking(*sockfd) && send_iov(*sockfd, iov, iovcnt)) {
+            *reused = true;
+            return true;
+        }
+
+        close(*sockfd);     // Closed by origin. Connect again.
+        iovcnt = make_request_iov(request, line, iov,
+            sizeof(iov) / sizeof(iov[0]));
+    }
+
+    if ((*sockfd = connect_origin(request->host, request->port)) == -1) {
+        return false;
+    }
+
+    if (!send_iov(*sockfd, iov, iovcnt)) {
+        perror("send() failed");
+        close(*sockfd);
+        return false;
+    }
+
+    return true;
+}
+
+// Called from thread.
+// receive response from origin server and forward to client.
+// server_sockfd was created in send_request.
+// We do not need to close client_sockfd, becuase it will be closed end of
+// the thread_main().
+// Store response in cache.
+// server_sockfd is returned to upstream pool if origin keeps it alive, and
+// keep_alive tells whether it does.
+// If server_sockfd was reused and origin closed it before responding, retry
+// is set to true so that request can be sent again.
+// If miss->stale is set, nothing is relayed until the status is known.
+// stale is sent and refreshed when origin answers 304 to request made
+// conditional on it. A 5xx within stale-if-error fails with miss->stale
+// still set, so that it can be sent instead.
+// miss->flight ends once the response is stored or may not be.
+// client_sockfd is -1 for a refresh nobody waits for.
+static bool rcv_and_send_response(int server_sockfd, int client_sockfd,
+    http_request_t *request, http_response_t *response, bool reused,
+    miss_t *miss, bool *retry, bool *keep_alive) {
+    http_parser *parser;
+    http_parser_settings settings;
+    ssize_t recved;
+    size_t nparsed, relayed;
+    char buf[BUFFER_SIZE];
+    candidate_t candidate;
+    candidate_block_t *block;
+    bool holding = miss->stale != NULL, sent;
+
+    *retry = false;
+    *keep_alive = false;
+
+    parser = malloc(sizeof(http_parser));
+    if (!parser) {
+        perror("parser cannot be initialized");
+        close(server_sockfd);
+        return false;
+    }
+
+    http_parser_settings_init(&settings);
+    settings.on_header_field = response_on_header_field_cb;
+    settings.on_header_value = response_on_header_value_cb;
+    settings.on_headers_complete = response_on_headers_complete_cb;
+    settings.on_body = response_on_body_cb;
+    settings.on_message_complete = response_on_message_complete_cb;
+
+    http_parser_init(parser, HTTP_RESPONSE);
+    parser->data = response;
+    response->request_method = request->method;
+    memset(&candidate, 0, sizeof(candidate_t));
+    candidate.request_time = http_clock_now();
+    relayed = 0;
+
+    while (!response->on_message_completed) {
+        if ((recved = recv(server_sockfd, buf, BUFFER_SIZE, 0)) == -1
+            || recved == 0) {
+            if (reused && relayed == 0 && is_retryable(request)) {
+                *retry = true;
+                free(parser);
+                close(server_sockfd);
+                return false;
+            }
+        }
+
+        if (recved == -1) {
+            perror("recv() failed");
+            free(parser);
+            candidate_drop(&candidate);
+            close(server_sockfd);
+            return false;
+        }
+
+        // recved == 0 lets the parser complete a response delimited by EOF.
+        nparsed = http_parser_execute(parser, &settings, buf, recved);
+
+        if (nparsed != recved || (recved == 0
+                && !response->on_message_completed)) {
+            fprintf(stderr, "nparsed != recved\n");
+            free(parser);
+            candidate_drop(&candidate);
+            close(server_sockfd);
+            return false;
+        }
+
+        if (recved == 0) {
+            break;
+        }
+
+        // Forwarded as it arrives, kept only while it may be cached.
+        candidate_append(&candidate, buf, recved);
+        relayed += recved;
+
+        if (holding) {
+            if (parser->status_code == 0
+                || (parser->status_code == HTTP_STATUS_NOT_MODIFIED
+                    && miss->conditional)) {
+                continue;
+            }
+
+            if (parser->status_code >= 500
+                && cache_stale_if_error(request, miss->stale)) {
+                fprintf(stderr, "origin answered %d\n", parser->status_code);
+                free(parser);
+                candidate_drop(&candidate);
+                close(server_sockfd);
                 return false;
             }
 
-            remaining -= sent;
-            offset += sent;
+            // Modified. What was held is all in candidate.
+            holding = false;
+            lru_cache_release(miss->stale);
+            miss->stale = NULL;
+
+            sent = true;
+            for (block = candidate.head; block && sent && client_sockfd != -1;
+                block = block->next) {
+                sent = send_all(client_sockfd, block->data, block->len);
+            }
+        } else {
+            sent = client_sockfd == -1
+                || send_all(client_sockfd, buf, recved);
+        }
+
+        if (!sent) {
+            perror("send() failed");
+            free(parser);
+            candidate_drop(&candidate);
+            close(server_sockfd);
+            return false;
+        }
+
+        // Requests waiting for it need not wait for one that is not cached.
+        candidate_check(&candidate, request, response);
+        if (candidate.dropped) {
+            inflight_end(flights, miss->flight);
+            miss->flight = NULL;
+        }
+    }
+
+    *keep_alive = http_should_keep_alive(parser);
+    free(parser);
+
+    if (holding) {
+        // Not modified, the stale response goes to client instead.
+        cache_refresh(request, miss->stale, miss->stale_len, response,
+            candidate.request_time);
+    } else {
+        candidate_store(&candidate, request, response);
+    }
+    candidate_drop(&candidate);
+    inflight_end(flights, miss->flight);
+    miss->flight = NULL;
+
+    if (*keep_alive) {
+        upstream_pool_put(upstream, request->host, request->port,
+            server_sockfd);
+    } else {
+        close(server_sockfd);
+    }
+
+    if (holding) {
+        if (client_sockfd != -1 && !send_hit(client_sockfd, request,
+                miss->stale, miss->stale_len, response, keep_alive)) {
+            perror("send() failed");
+            return false;
+        }
+
+        printf("revalidated ");
+        print_cache_status();
+    }
+    return true;
+}
+
+// This function is called for HTTPS connection.
+// The proxy sever just forward to client's tcp stream to origin server
+// and vice versa unless tcp connection is closed.
+static void http_tunnel(client_t *client, http_request_t *request) {
+    http_response_t *response;
+    tunnel_t tunnel;
+    char *res_str;
+    size_t res_len;
+    int server_sockfd;
+
+    if (request->host == NULL || strcmp(request->host, "") == 0) {
+        fprintf(stderr, "hostname is not specified\n");
+        close(client->sockfd);
+        return;
+    }
+
+    if ((server_sockfd = connect_origin(request->host, request->port)) == -1) {
+        close(client->sockfd);
+        return;
+    }
+
+    if ((response = init_http_response(0)) == NULL) {
+        perror("response cannot be initialized");
+        close(client->sockfd);
+        close(server_sockfd);
+        return;
+    }
+
+    response->http_major = request->http_major;
+    response->http_minor = request->http_minor;
+    response->status = HTTP_STATUS_OK;
+
+    if (!make_response_string(response, &res_str, &res_len)) {
+        fprintf(stderr, "make_response_string() failed\n");
+        free(response);
+        close(client->sockfd);
+        close(server_sockfd);
+        return;
+    }
+    free(response);
+
+    // Bytes following CONNECT belong to the tunneled stream.
+    if (!send_all(client->sockfd, res_str, res_len)
+        || !send_all(server_sockfd, client->buf + client->offset,
+            client->len - client->offset)) {
+        perror("send() failed");
+        free(res_str);
+        close(client->sockfd);
+        close(server_sockfd);
+        return;
+    }
+    free(res_str);
+
+    if (tunnel_init(&tunnel, client->sockfd, server_sockfd, true)) {
+        tunnel_run(&tunnel);
+        tunnel_free(&tunnel);
+    }
+
+    close(server_sockfd);
+    close(client->sockfd);
+}
+
+// Called from thread. Send request to origin and relay its response to
+// client. Retried once on a fresh connection if a reused one turned out to
+// be closed by origin. keep_alive is set to false if the response must be
+// followed by close.
+static bool forward_request(int client_sockfd, http_request_t *request,
+    http_response_t *response, miss_t *miss, bool *keep_alive) {
+    int server_sockfd;
+    bool reused, retry;
+
+    if (!send_request(request, response, &server_sockfd, false, &reused)) {
+        fprintf(stderr, "send_request() failed\n");
+        return false;
+    }
+
+    if (reused) {
+        printf("reuse - %s:%s, ", request->host, request->port);
+        print_upstream_status();
+    }
+
+    if (rcv_and_send_response(server_sockfd, client_sockfd, request,
+            response, reused, miss, &retry, keep_alive)) {
+        return true;
+    }
+
+    if (!retry) {
+        fprintf(stderr, "rcv_and_send_response() failed\n");
+        return false;
+    }
+
+    if (!send_request(request, response, &server_sockfd, true, &reused)) {
+        fprintf(stderr, "send_request() failed\n");
+        return false;
+    }
+
+    if (!rcv_and_send_response(server_sockfd, client_sockfd, request,
+            response, false, miss, &retry, keep_alive)) {
+        fprintf(stderr, "rcv_and_send_response() failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Send the stale response of miss instead of what origin failed to give,
+// if nothing was relayed and stale-if-error allows it. keep_alive is set
+// to false if the response must be followed by close.
+static bool send_stale(int client_sockfd, http_request_t *request,
+    http_response_t *response, miss_t *miss, bool *keep_alive) {
+    if (!miss->stale || !cache_stale_if_error(request, miss->stale)) {
+        return false;
+    }
+
+    if (!send_hit(client_sockfd, request, miss->stale, miss->stale_len,
+            response, keep_alive)) {
+        perror("send() failed");
+        return false;
+    }
+
+    printf("stale ");
+    print_cache_status();
+    return true;
+}
+
+// Copy request with its headers, for a refresh outliving the client's
+// fetch. Range and the client's own conditions are left out, so that the
+// whole response comes back to be stored, and a 304 refers to the cached
+// one.
+static http_request_t *copy_request(http_request_t *request) {
+    http_headers_t *headers = request->headers;
+    http_request_t *copy;
+    size_t i;
+
+    if ((copy = init_http_request(0)) == NULL) {
+        return NULL;
+    }
+
+    copy->method = request->method;
+    copy->http_major = request->http_major;
+    copy->http_minor = request->http_minor;
+    strcpy(copy->path, request->path);
+    strcpy(copy->ip, request->ip);
+    strcpy(copy->schema, request->schema);
+    strcpy(copy->port, request->port);
+    strcpy(copy->host, request->host);
+
+    for (i = 0; i < headers->num_headers; i++) {
+        switch (headers->field_id[i]) {
+        case HTTP_HEADER_RANGE:
+        case HTTP_HEADER_IF_RANGE:
+        case HTTP_HEADER_IF_NONE_MATCH:
+        case HTTP_HEADER_IF_MODIFIED_SINCE:
+        case HTTP_HEADER_IF_MATCH:
+        case HTTP_HEADER_IF_UNMODIFIED_SINCE:
+            continue;
+        }
+
+        if (headers->value_len[i] == 0) {
+            continue;
+        }
+
+        if (!append_header_field(copy->headers, headers->field[i],
+                headers->field_len[i])
+            || !append_header_value(copy->headers, headers->value[i],
+                headers->value_len[i])) {
+            free_http_request(copy);
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+// Fetch of a stale response served meanwhile.
+typedef struct {
+    http_request_t *request;
+    inflight_flight_t *flight;
+} refresh_t;
+
+// Refresh job entry point. The response is relayed to nobody, only
+// stored.
+static void refresh_main(void *data) {
+    refresh_t *refresh = (refresh_t *) data;
+    http_request_t *request = refresh->request;
+    http_response_t *response;
+    miss_t miss;
+    char *value;
+    size_t value_len;
+    bool fresh, keep_alive;
+
+    memset(&miss, 0, sizeof(miss_t));
+    miss.flight = refresh->flight;
+
+    // Revalidated against what is cached now, unless another request
+    // refreshed it meanwhile.
+    value = cache_lookup(request, &value_len, &fresh);
+    if (fresh) {
+        lru_cache_release(value);
+    } else if ((response = init_http_response(0)) == NULL) {
+        perror("response cannot be initialized");
+        lru_cache_release(value);
+    } else {
+        if (value && cache_keep_stale(request, value, value_len,
+                &miss.conditional)) {
+            miss.stale = value;
+            miss.stale_len = value_len;
+        } else {
+            lru_cache_release(value);
+        }
+
+        if (!forward_request(-1, request, response, &miss, &keep_alive)) {
+            fprintf(stderr, "refresh of %s%s failed\n", request->host,
+                request->path);
         }
+        free_http_response(response);
+    }
+
+    lru_cache_release(miss.stale);
+    inflight_end(flights, miss.flight);
+    free_http_request(request);
+    free(refresh);
+}
+
+// Refresh the response to request on the refresh pool, unless it is being
+// fetched already or the pool is full. Called from any mode, so it never
+// blocks.
+static void refresh_start(http_request_t *request) {
+    refresh_t *refresh;
+    char *key;
+    size_t key_len;
 
-        http_parser_settings_init(&settings);
-        settings.on_header_field = response_on_header_field_cb;
-        settings.on_header_value = response_on_header_value_cb;
-        settings.on_body = response_on_body_cb;
-        settings.on_message_complete = response_on_message_complete_cb;
+    if ((key = make_cache_key(request, &key_len)) == NULL) {
+        perror("key cannot be initialized");
+        return;
+    }
+
+    if ((refresh = malloc(sizeof(refresh_t))) == NULL) {
+        perror("refresh cannot be initialized");
+        free(key);
+        return;
+    }
+
+    refresh->flight = inflight_lead(flights, key, key_len);
+    free(key);
+
+    if (!refresh->flight) {
+        free(refresh);
+        return;
+    }
 
-        http_parser_init(parser, HTTP_RESPONSE);
-        parser->data = response;
-        http_parser_execute(parser, &settings, value, value_len);
+    if ((refresh->request = copy_request(request)) == NULL) {
+        perror("request cannot be copied");
+        inflight_end(flights, refresh->flight);
+        free(refresh);
+        return;
+    }
+
+    // Skipped when full, the next stale hit tries again.
+    if (thpool_add_work(refreshes, refresh_main, refresh) == -1) {
+        inflight_end(flights, refresh->flight);
+        free_http_request(refresh->request);
+        free(refresh);
+    }
+}
+
+// thread entry point.
+// Requests on the connection are served in order until either side asks
+// for close or client stays idle for CLIENT_IDLE_TIMEOUT.
+static void thread_main(void *data) {
+    args_t *args = (args_t *) data;
+    client_t *client;
+    http_request_t *request;
+    http_response_t *response;
+    struct timeval timeout = { CLIENT_IDLE_TIMEOUT, 0 };
+    miss_t miss;
+    bool hit, upgrade, keep_alive;
+
+    if ((client = malloc(sizeof(client_t))) == NULL) {
+        perror("client cannot be initialized");
+        close(args->sockfd);
+        free(args);
+        return;
+    }
+    memset(client, 0, sizeof(client_t));
+    client->sockfd = args->sockfd;
+
+    if (setsockopt(client->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(timeout)) < 0) {
+        perror("setsockopt(SO_RCVTIMEO) failed");
+    }
+
+    if ((request = init_http_request(0)) == NULL) {
+        perror("request cannot be initialized");
+        close(args->sockfd);
+        free(client);
+        free(args);
+        return;
+    }
+
+    if ((response = init_http_response(0)) == NULL) {
+        perror("response cannot be initialized");
+        free_http_request(request);
+        close(args->sockfd);
+        free(client);
+        free(args);
+        return;
+    }
+
+    strcpy(request->ip, args->ip);
+
+    do {
+        // Memory of headers is reused by every request of the client.
+        reset_http_request(request);
+        reset_http_response(response);
+
+        if (!rcv_request(client, request, response, &upgrade, &hit, &miss)) {
+            if (!client->closed) {
+                fprintf(stderr, "rcv_request() failed\n");
+            }
+            client->keep_alive = false;
+        } else if (upgrade) {       // HTTP tunneling
+            // char str[128] = {0};
+            // strcpy(str, request->host);
+            // strcat(str, ":");
+            // strcat(str, request->port);
+            // printf("\nreceived HTTP tunnel (CONNECT Method) request from client\n");
+            // printf("Unable to cache\n");
+            // printf("request: %s\n", str);
+            // fflush(stdout);
+            http_tunnel(client, request);
+            free_http_request(request);
+            free_http_response(response);
+            free(client);
+            free(args);
+            return;
+        } else if (hit) {
+            printf("hit ");
+            print_cache_status();
+            log_http_request(request, response);
+        } else if (!forward_request(args->sockfd, request, response, &miss,
+                &keep_alive)
+            && !send_stale(args->sockfd, request, response, &miss,
+                &keep_alive)) {
+            fprintf(stderr, "forward_request() failed\n");
+            client->keep_alive = false;
+        } else {
+            log_http_request(request, response);
+            client->keep_alive = client->keep_alive && keep_alive;
+        }
+
+        lru_cache_release(miss.stale);
+        inflight_end(flights, miss.flight);
+    } while (client->keep_alive);
+
+    free_http_request(request);
+    free_http_response(response);
+    close(args->sockfd);
+    free(client);
+    free(args);
+}
+
+// Create ipv4 TCP socket listening on port.
+static int create_listen_socket(int port) {
+	int sockfd;
+	int opt;
+	socklen_t opt_size = sizeof(opt);
+	struct sockaddr_in server_addr;
+
+	// Create ipv4 TCP socket
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        error("socket failed");
+    }
+
+	opt = 1;
+    // Set socket option to be reuse address to avoid error "Address already in use"
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, opt_size) < 0) {
+        error("setsockopt(SO_REUSEADDR) failed");
+    }
+
+	// Required on Linux >= 3.9
+    #ifdef SO_REUSEPORT
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, opt_size) < 0) {
+        error("setsockopt(SO_REUSEPORT) failed");
+    }
+    #endif
+
+    // Set IP socket address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    // Bind the address to the socket
+    if (bind(sockfd, (struct sockaddr *) &server_addr,
+        sizeof(server_addr)) < 0) {
+        error("bind failed");
+    }
+
+    // Listen for connections on the socket
+    if (listen(sockfd, BACKLOG) < 0) {
+        error("listen failed");
+    }
+
+    return sockfd;
+}
+
+/* ************************** epoll reactor mode *************************** */
+
+typedef enum {
+    CONN_READ_REQUEST = 0,
+    CONN_RESOLVING,         // Waiting for resolver thread.
+    CONN_WAITING,           // Waiting for a fetch of the same response.
+    CONN_CONNECTING,        // Non-blocking connect() to origin in progress.
+    CONN_SEND_REQUEST,
+    CONN_RELAY_RESPONSE,
+    CONN_SEND_HIT,
+    CONN_TUNNEL
+} conn_state;
+
+// Bytes that the peer was not ready to accept yet.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t offset;
+    bool cached;        // data is a cache value, released instead of freed.
+} pending_t;
+
+struct conn;
+
+// Per reactor thread state. Each worker owns its listener, epoll instance
+// and connections, so workers never share anything but the cache, log,
+// upstream pool and resolver.
+typedef struct {
+    int id;
+    pthread_t thread;
+    reactor_t *reactor;
+    int listen_sockfd;
+    bool affinity;          // Pin to CPU (id % number of CPUs).
+    char *buf;              // Scratch buffer shared by all connections.
+    int resolve_fd;         // eventfd signalled by resolver thread, or by
+                            // the end of a fetch connections wait for.
+    pthread_mutex_t lock;   // Protects resolved and landed.
+    struct conn *resolved;  // Connections whose lookup completed.
+    struct conn *landed;    // Connections whose awaited fetch ended.
+    struct conn *idle_head; // Connections reading a request or waiting for
+    struct conn *idle_tail; // a fetch, least recently active first.
+} worker_t;
+
+// Per client connection state. The handlers below advance state as far
+// as the sockets allow and return on EAGAIN, so no thread ever blocks on
+// a single connection.
+typedef struct conn {
+    conn_state state;
+    worker_t *worker;
+    int client_sockfd;
+    int server_sockfd;
+    http_parser parser;
+    http_request_t *request;
+    http_response_t *response;
+    resolver_result_t resolved;
+    size_t addr_index;      // Address being connected.
+    struct conn *next_resolved;
+    pending_t to_client;
+    pending_t to_server;
+    pending_t from_client;  // Pipelined bytes following current request.
+    candidate_t candidate;  // Response to be cached.
+    char *stale;            // Cached response to revalidate or to fall back
+    size_t stale_len;       // on, until anything is relayed.
+    bool conditional;       // Request was made conditional on stale.
+    inflight_flight_t *flight;  // Fetch other connections wait for.
+    inflight_waiter_t waiter;   // Follows the fetch of another one.
+    struct conn *next_landed;
+    bool followed;          // Waited for a fetch already.
+    bool tunnel;
+    tunnel_t relay;         // Valid in CONN_TUNNEL.
+    bool keep_alive;        // Client allows another request after this one.
+    bool retryable;         // Reused server_sockfd has not responded yet.
+    bool fresh;             // Do not take server_sockfd from upstream pool.
+    bool idle;              // In the idle list of worker.
+    time_t active;          // Last time the client sent anything, or since
+                            // when conn waits for a fetch.
+    struct conn *idle_prev;
+    struct conn *idle_next;
+} conn_t;
+
+static void conn_on_client(reactor_t *reactor, int fd, uint32_t events,
+    void *data);
+static void conn_on_server(reactor_t *reactor, int fd, uint32_t events,
+    void *data);
+static void conn_connect(conn_t *conn);
+static bool conn_retry(conn_t *conn);
+static void conn_read_request(conn_t *conn);
+
+static bool set_nonblocking(int sockfd) {
+    int flags;
+
+    if ((flags = fcntl(sockfd, F_GETFL, 0)) == -1) {
+        return false;
+    }
+
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static bool pending_append(pending_t *pending, const char *data, size_t len) {
+    char *new_data;
+
+    if (pending->offset != 0) {
+        memmove(pending->data, pending->data + pending->offset,
+            pending->len - pending->offset);
+        pending->len -= pending->offset;
+        pending->offset = 0;
+    }
+
+    if ((new_data = realloc(pending->data, pending->len + len)) == NULL) {
+        return false;
+    }
+
+    memcpy(new_data + pending->len, data, len);
+    pending->data = new_data;
+    pending->len += len;
+
+    return true;
+}
+
+static void pending_free(pending_t *pending) {
+    if (pending->cached) {
+        lru_cache_release(pending->data);
+    } else {
+        free(pending->data);
+    }
+    memset(pending, 0, sizeof(pending_t));
+}
+
+// Write pending bytes to sockfd.
+// Return 1 if everything is written, 0 if sockfd would block, -1 on error.
+static int pending_flush(int sockfd, pending_t *pending) {
+    ssize_t sent;
+    off_t base, offset;
+    int fd = -1;
+
+    // A cache value in a memfd is sent from there.
+    if (pending->cached) {
+        fd = lru_cache_value_fd(pending->data, &base);
+    }
+
+    while (pending->offset < pending->len) {
+        if (fd != -1) {
+            offset = base + pending->offset;
+            sent = sendfile(sockfd, fd, &offset,
+                pending->len - pending->offset);
+        } else {
+            sent = send(sockfd, pending->data + pending->offset,
+                pending->len - pending->offset, MSG_NOSIGNAL);
+        }
+
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+
+            return -1;
+        }
+
+        pending->offset += sent;
+    }
+
+    pending_free(pending);
+    return 1;
+}
+
+// Send data to sockfd and keep what could not be sent in pending.
+// pending must be empty.
+static bool send_or_pend(int sockfd, pending_t *pending, const char *data,
+    size_t len) {
+    ssize_t sent;
+
+    while ((sent = send(sockfd, data, len, MSG_NOSIGNAL)) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            sent = 0;
+            break;
+        }
+
+        return false;
+    }
+
+    if (sent < len) {
+        return pending_append(pending, data + sent, len - sent);
+    }
+
+    return true;
+}
+
+static conn_t *conn_init(worker_t *worker, int client_sockfd,
+    const char *ip) {
+    conn_t *conn;
+
+    if ((conn = malloc(sizeof(conn_t))) == NULL) {
+        return NULL;
+    }
+    memset(conn, 0, sizeof(conn_t));
+
+    if ((conn->request = init_http_request(0)) == NULL) {
+        free(conn);
+        return NULL;
+    }
+
+    if ((conn->response = init_http_response(0)) == NULL) {
+        free_http_request(conn->request);
+        free(conn);
+        return NULL;
+    }
+
+    strcpy(conn->request->ip, ip);
+    conn->state = CONN_READ_REQUEST;
+    conn->worker = worker;
+    conn->client_sockfd = client_sockfd;
+    conn->server_sockfd = -1;
+
+    http_parser_init(&conn->parser, HTTP_REQUEST);
+    conn->parser.data = conn->request;
+
+    return conn;
+}
+
+static void conn_close_server(conn_t *conn) {
+    if (conn->server_sockfd != -1) {
+        reactor_del(conn->worker->reactor, conn->server_sockfd);
+        close(conn->server_sockfd);
+        conn->server_sockfd = -1;
+    }
+}
+
+// Move conn to the tail of the idle list, as it is waiting for the client.
+static void conn_idle(conn_t *conn) {
+    worker_t *worker = conn->worker;
+
+    if (conn->idle && conn == worker->idle_tail) {
+        conn->active = http_clock_now();
+        return;
+    }
+
+    if (conn->idle) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+        if (conn->idle_prev) {
+            conn->idle_prev->idle_next = conn->idle_next;
+        } else {
+            worker->idle_head = conn->idle_next;
+        }
+    }
+
+    conn->idle_prev = worker->idle_tail;
+    conn->idle_next = NULL;
+    if (worker->idle_tail) {
+        worker->idle_tail->idle_next = conn;
+    } else {
+        worker->idle_head = conn;
+    }
+    worker->idle_tail = conn;
+
+    conn->idle = true;
+    conn->active = http_clock_now();
+}
+
+// Remove conn from the idle list, as the client has sent a request.
+static void conn_busy(conn_t *conn) {
+    worker_t *worker = conn->worker;
+
+    if (!conn->idle) {
+        return;
+    }
+
+    if (conn->idle_prev) {
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else {
+        worker->idle_head = conn->idle_next;
+    }
+
+    if (conn->idle_next) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else {
+        worker->idle_tail = conn->idle_prev;
+    }
+
+    conn->idle = false;
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+}
+
+static void conn_on_resolved(const resolver_result_t *result, void *data);
+static void conn_on_landed(void *data);
+
+static void conn_close(conn_t *conn) {
+    worker_t *worker = conn->worker;
+    conn_t **p;
+
+    if (conn->state == CONN_RESOLVING) {
+        resolver_cancel(resolver, conn_on_resolved, conn);
+
+        // The answer may be queued already.
+        pthread_mutex_lock(&worker->lock);
+        for (p = &worker->resolved; *p; p = &(*p)->next_resolved) {
+            if (*p == conn) {
+                *p = conn->next_resolved;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    // Unless the fetch ended already, and conn may be queued.
+    if (conn->state == CONN_WAITING
+        && !inflight_cancel(flights, &conn->waiter)) {
+        pthread_mutex_lock(&worker->lock);
+        for (p = &worker->landed; *p; p = &(*p)->next_landed) {
+            if (*p == conn) {
+                *p = conn->next_landed;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    if (conn->state == CONN_TUNNEL) {
+        tunnel_free(&conn->relay);
+    }
+
+    conn_busy(conn);
+    reactor_del(worker->reactor, conn->client_sockfd);
+    close(conn->client_sockfd);
+    conn_close_server(conn);
+
+    pending_free(&conn->to_client);
+    pending_free(&conn->to_server);
+    pending_free(&conn->from_client);
+    candidate_drop(&conn->candidate);
+    lru_cache_release(conn->stale);
+    inflight_end(flights, conn->flight);
+    free_http_request(conn->request);
+    free_http_response(conn->response);
+    free(conn);
+}
+
+// Serve the next request on the connection, or close it if either side
+// does not keep it alive. keep_alive tells whether the response allows it.
+static void conn_next_request(conn_t *conn, bool keep_alive) {
+    if (!keep_alive || !conn->keep_alive) {
+        conn_close(conn);
+        return;
+    }
+
+    // Memory of headers is reused by every request of the connection.
+    reset_http_request(conn->request);
+    reset_http_response(conn->response);
+
+    conn_close_server(conn);
+    pending_free(&conn->to_server);
+    candidate_reset(&conn->candidate);
+    lru_cache_release(conn->stale);
+    conn->stale = NULL;
+    conn->conditional = false;
+    inflight_end(flights, conn->flight);
+    conn->flight = NULL;
+    conn->followed = false;
+    conn->keep_alive = false;
+    conn->retryable = false;
+    conn->fresh = false;
+
+    conn->state = CONN_READ_REQUEST;
+    http_parser_init(&conn->parser, HTTP_REQUEST);
+    conn->parser.data = conn->request;
+    conn_read_request(conn);
+}
+
+static void conn_send_hit(conn_t *conn) {
+    int r;
+
+    if ((r = pending_flush(conn->client_sockfd, &conn->to_client)) == 0) {
+        return;
+    }
+
+    if (r == -1) {
+        perror("send() failed");
+        conn_close(conn);
+        return;
+    }
+
+    printf("hit ");
+    print_cache_status();
+    log_http_request(conn->request, conn->response);
+
+    // A response delimited by EOF must be followed by close.
+    conn_next_request(conn, http_should_keep_alive(&conn->parser));
+}
+
+// Send the cached response in value to client, or the part of it asked for
+// by the Range of the request. The reference to value is taken over.
+static void conn_start_hit(conn_t *conn, char *value, size_t value_len) {
+    char *partial;
+    size_t partial_len;
+
+    reset_http_response(conn->response);
+    http_parser_init(&conn->parser, HTTP_RESPONSE);
+    conn->parser.data = conn->response;
+    http_parser_execute(&conn->parser, &response_settings,
+        value + sizeof(http_cache_entry_t),
+        value_len - sizeof(http_cache_entry_t));
+
+    if (cache_partial(conn->request, conn->response, value, value_len,
+            &partial, &partial_len)) {
+        lru_cache_release(value);
+        conn->to_client.data = partial;
+        conn->to_client.len = partial_len;
+        conn->to_client.offset = 0;
+        conn->to_client.cached = false;
+    } else {
+        // Sent in place, after its entry. The reference keeps value alive
+        // if it is evicted while the client drains it.
+        conn->to_client.data = value;
+        conn->to_client.len = value_len;
+        conn->to_client.offset = sizeof(http_cache_entry_t);
+        conn->to_client.cached = true;
+    }
+
+    conn->state = CONN_SEND_HIT;
+    conn_send_hit(conn);
+}
+
+static void conn_finish_response(conn_t *conn) {
+    char *stale = conn->stale;
+    bool keep_alive;
+
+    if (stale) {
+        // Not modified, the stale response goes to client instead.
+        cache_refresh(conn->request, stale, conn->stale_len, conn->response,
+            conn->candidate.request_time);
+    } else {
+        candidate_store(&conn->candidate, conn->request, conn->response);
+    }
+    inflight_end(flights, conn->flight);
+    conn->flight = NULL;
+
+    if ((keep_alive = http_should_keep_alive(&conn->parser))) {
+        reactor_del(conn->worker->reactor, conn->server_sockfd);
+        upstream_pool_put(upstream, conn->request->host, conn->request->port,
+            conn->server_sockfd);
+        conn->server_sockfd = -1;
+    }
+
+    if (stale) {
+        printf("revalidated ");
+        print_cache_status();
+
+        conn_close_server(conn);
+        conn->stale = NULL;
+        conn_start_hit(conn, stale, conn->stale_len);
+        return;
+    }
+
+    log_http_request(conn->request, conn->response);
+    conn_next_request(conn, keep_alive);
+}
+
+// Stop revalidating, and send the response held until its status was known.
+static bool conn_release_held(conn_t *conn) {
+    candidate_block_t *block;
+
+    lru_cache_release(conn->stale);
+    conn->stale = NULL;
+
+    for (block = conn->candidate.head; block; block = block->next) {
+        if (!pending_append(&conn->to_client, block->data, block->len)) {
+            return false;
+        }
+    }
+
+    return pending_flush(conn->client_sockfd, &conn->to_client) != -1;
+}
+
+// Origin failed before anything was relayed. Send the stale response
+// instead if stale-if-error allows it, or close.
+static void conn_fail(conn_t *conn) {
+    char *stale = conn->stale;
+
+    if (!stale || !cache_stale_if_error(conn->request, stale)) {
+        conn_close(conn);
+        return;
+    }
+
+    conn_close_server(conn);
+    pending_free(&conn->to_server);
+    candidate_reset(&conn->candidate);
+    inflight_end(flights, conn->flight);
+    conn->flight = NULL;
+
+    printf("stale ");
+    print_cache_status();
+
+    conn->stale = NULL;
+    conn_start_hit(conn, stale, conn->stale_len);
+}
+
+// Forward response from origin to client. Reading from origin stops while
+// client is not able to receive, so a slow client never makes us buffer
+// more than one read.
+static void conn_relay_response(conn_t *conn) {
+    char *buf = conn->worker->buf;
+    ssize_t recved;
+    size_t nparsed;
+    int r;
+
+    if ((r = pending_flush(conn->client_sockfd, &conn->to_client)) == -1) {
+        perror("send() failed");
+        conn_close(conn);
+        return;
+    } else if (r == 0) {
+        return;
+    }
+
+    while (!conn->response->on_message_completed) {
+        if ((recved = recv(conn->server_sockfd, buf, BUFFER_SIZE, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+
+            if (!conn_retry(conn)) {
+                perror("recv() failed");
+                conn_fail(conn);
+            }
+            return;
+        }
+
+        if (recved == 0 && conn_retry(conn)) {
+            return;
+        }
+        conn->retryable = false;
+
+        // recved == 0 lets the parser complete a response delimited by EOF.
+        nparsed = http_parser_execute(&conn->parser, &response_settings,
+            buf, recved);
+
+        if (nparsed != recved || (recved == 0
+                && !conn->response->on_message_completed)) {
+            fprintf(stderr, "nparsed != recved\n");
+            conn_fail(conn);
+            return;
+        }
+
+        candidate_append(&conn->candidate, buf, recved);
+
+        if (conn->stale) {
+            if (conn->parser.status_code == 0
+                || (conn->parser.status_code == HTTP_STATUS_NOT_MODIFIED
+                    && conn->conditional)) {
+                continue;
+            }
+
+            if (conn->parser.status_code >= 500
+                && cache_stale_if_error(conn->request, conn->stale)) {
+                fprintf(stderr, "origin answered %d\n",
+                    conn->parser.status_code);
+                conn_fail(conn);
+                return;
+            }
+
+            // Modified. What was held is all in candidate.
+            if (!conn_release_held(conn)) {
+                perror("send() failed");
+                conn_close(conn);
+                return;
+            }
+        } else if (!send_or_pend(conn->client_sockfd, &conn->to_client, buf,
+                recved)) {
+            perror("send() failed");
+            conn_close(conn);
+            return;
+        }
+
+        // Connections waiting for it need not wait for one that is not
+        // cached.
+        candidate_check(&conn->candidate, conn->request, conn->response);
+        if (conn->candidate.dropped) {
+            inflight_end(flights, conn->flight);
+            conn->flight = NULL;
+        }
+
+        if (conn->to_client.len != 0) {
+            return;     // Wait for EPOLLOUT on client.
+        }
+    }
+
+    conn_finish_response(conn);
+}
+
+static void conn_send_request(conn_t *conn) {
+    int r;
+
+    if ((r = pending_flush(conn->server_sockfd, &conn->to_server)) == -1) {
+        if (!conn_retry(conn)) {
+            perror("send() failed");
+            conn_fail(conn);
+        }
+        return;
+    } else if (r == 0) {
+        return;
+    }
+
+    conn->state = CONN_RELAY_RESPONSE;
+    conn->candidate.request_time = http_clock_now();
+    http_parser_init(&conn->parser, HTTP_RESPONSE);
+    conn->parser.data = conn->response;
+    conn->response->request_method = conn->request->method;
+    conn_relay_response(conn);
+}
+
+// Flush the CONNECT response and bytes that followed CONNECT, then relay
+// until both sides are closed.
+static void conn_tunnel(conn_t *conn) {
+    int r;
+
+    if ((r = pending_flush(conn->client_sockfd, &conn->to_client)) == 1) {
+        r = pending_flush(conn->server_sockfd, &conn->to_server);
+    }
+
+    if (r == 1) {
+        r = tunnel_pump(&conn->relay) == 0 ? 0 : -1;
+    }
+
+    if (r == -1) {
+        conn_close(conn);
+    }
+}
+
+static void conn_start_tunnel(conn_t *conn) {
+    http_response_t *response;
+    char *res_str;
+    size_t res_len;
+
+    if ((response = init_http_response(0)) == NULL) {
+        perror("response cannot be initialized");
+        conn_close(conn);
+        return;
+    }
+
+    response->http_major = conn->request->http_major;
+    response->http_minor = conn->request->http_minor;
+    response->status = HTTP_STATUS_OK;
+
+    if (!make_response_string(response, &res_str, &res_len)) {
+        fprintf(stderr, "make_response_string() failed\n");
+        free_http_response(response);
+        conn_close(conn);
+        return;
+    }
+    free_http_response(response);
+
+    if (!tunnel_init(&conn->relay, conn->client_sockfd, conn->server_sockfd,
+            true)) {
+        free(res_str);
+        conn_close(conn);
+        return;
+    }
+
+    conn->to_client.data = res_str;
+    conn->to_client.len = res_len;
+    conn->to_client.offset = 0;
+    conn->state = CONN_TUNNEL;
+    conn_tunnel(conn);
+}
+
+static void conn_on_connected(conn_t *conn) {
+    if (conn->tunnel) {
+        conn_start_tunnel(conn);
+    } else {
+        conn->state = CONN_SEND_REQUEST;
+        conn_send_request(conn);
+    }
+}
+
+// Try addresses from conn->addr_index until a non-blocking connect() is
+// started.
+static void conn_try_connect(conn_t *conn) {
+    struct sockaddr_in addr;
+    int sockfd;
+
+    for (; conn->addr_index < conn->resolved.num_addrs; conn->addr_index++) {
+        make_sockaddr(&addr, &conn->resolved, conn->addr_index,
+            conn->request->port);
+
+        if ((sockfd = socket(AF_INET,
+                SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+            continue;
+
+        if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            && errno != EINPROGRESS) {
+            close(sockfd);
+            continue;
+        }
+
+        if (!reactor_add(conn->worker->reactor, sockfd,
+                EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                conn_on_server, conn)) {
+            perror("reactor_add() failed");
+            close(sockfd);
+            continue;
+        }
+
+        conn->server_sockfd = sockfd;
+        conn->state = CONN_CONNECTING;
+        return;
+    }
+
+    fprintf(stderr, "Could not connect\n");
+    conn_fail(conn);
+}
+
+// Take an idle connection to origin from upstream pool.
+static bool conn_reuse(conn_t *conn) {
+    int sockfd;
+
+    if ((sockfd = upstream_pool_get(upstream, conn->request->host,
+            conn->request->port)) == -1) {
+        return false;
+    }
+
+    if (!set_nonblocking(sockfd)
+        || !reactor_add(conn->worker->reactor, sockfd,
+            EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, conn_on_server, conn)) {
+        perror("reactor_add() failed");
+        close(sockfd);
+        return false;
+    }
+
+    printf("reuse - %s:%s, ", conn->request->host, conn->request->port);
+    print_upstream_status();
+
+    conn->server_sockfd = sockfd;
+    conn->retryable = is_retryable(conn->request);
+    conn->state = CONN_SEND_REQUEST;
+    conn_send_request(conn);
+    return true;
+}
+
+// Called from resolver thread. Hand conn back to its worker.
+static void conn_on_resolved(const resolver_result_t *result, void *data) {
+    conn_t *conn = (conn_t *) data;
+    worker_t *worker = conn->worker;
+    uint64_t one = 1;
+
+    conn->resolved = *result;
+
+    pthread_mutex_lock(&worker->lock);
+    conn->next_resolved = worker->resolved;
+    worker->resolved = conn;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (write(worker->resolve_fd, &one, sizeof(one)) == -1
+        && errno != EAGAIN) {
+        perror("write(resolve_fd) failed");
+    }
+}
+
+static void conn_resolved(conn_t *conn) {
+    if (conn->resolved.status != RESOLVER_OK) {
+        fprintf(stderr, "Could not resolve %s\n", conn->request->host);
+        conn_fail(conn);
+        return;
+    }
+
+    conn->addr_index = 0;
+    conn_try_connect(conn);
+}
+
+static void conn_connect(conn_t *conn) {
+    resolver_result_t result;
+
+    if (strcmp(conn->request->host, "") == 0) {
+        fprintf(stderr, "hostname is not specified\n");
+        conn_close(conn);
+        return;
+    }
+
+    if (!conn->tunnel && !conn->fresh && conn_reuse(conn)) {
+        return;
+    }
+
+    switch (resolver_lookup(resolver, conn->request->host, &result,
+            conn_on_resolved, conn)) {
+    case 1:
+        conn->resolved = result;
+        conn_resolved(conn);
+        break;
+
+    case 0:
+        conn->state = CONN_RESOLVING;
+        break;
+
+    default:
+        fprintf(stderr, "resolver_lookup() failed\n");
+        conn_fail(conn);
+        break;
+    }
+}
+
+// Called on the thread ending the fetch conn waits for, so conn is handed
+// to its own worker.
+static void conn_on_landed(void *data) {
+    conn_t *conn = (conn_t *) data;
+    worker_t *worker = conn->worker;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&worker->lock);
+    conn->next_landed = worker->landed;
+    worker->landed = conn;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (write(worker->resolve_fd, &one, sizeof(one)) == -1
+        && errno != EAGAIN) {
+        perror("write(resolve_fd) failed");
+    }
+}
+
+// Lead the fetch of the response to conn->request, or wait for the one in
+// progress. Return true if conn waits.
+static bool conn_follow(conn_t *conn) {
+    char *key;
+    size_t key_len;
+    int r;
+
+    if ((key = make_cache_key(conn->request, &key_len)) == NULL) {
+        perror("key cannot be initialized");
+        return false;
+    }
+
+    conn->waiter.cb = conn_on_landed;
+    conn->waiter.data = conn;
+    r = inflight_join(flights, key, key_len, &conn->flight, &conn->waiter);
+    free(key);
+
+    if (r != 0) {
+        return false;
+    }
+
+    conn->followed = true;
+    conn->state = CONN_WAITING;
+    conn_idle(conn);    // Until FLIGHT_WAIT_TIMEOUT.
+    return true;
+}
+
+static void conn_handle_request(conn_t *conn) {
+    char *value, *req_str;
+    size_t value_len, req_size;
+    bool fresh;
+
+    value = cache_lookup(conn->request, &value_len, &fresh);
+
+    // Stale within stale-while-revalidate is a hit too, refreshed meanwhile.
+    if (!fresh && value
+        && cache_stale_while_revalidate(conn->request, value)) {
+        refresh_start(conn->request);
+        fresh = true;
+    }
+
+    if (fresh) {    // Hit.
+        conn_start_hit(conn, value, value_len);
+        return;
+    }
+
+    // Looked up again once a fetch of the same response in progress ends.
+    if (!conn->followed && conn->request->method == HTTP_GET
+        && conn_follow(conn)) {
+        lru_cache_release(value);
+        return;
+    }
+
+    // A stale response is sent if origin answers 304 to a conditional one,
+    // or fails within stale-if-error.
+    if (value && cache_keep_stale(conn->request, value, value_len,
+            &conn->conditional)) {
+        conn->stale = value;
+        conn->stale_len = value_len;
+    } else {
+        lru_cache_release(value);
+    }
+
+    if (!set_header(conn->request->headers, "Connection", "keep-alive")
+        || !make_request_string(conn->request, &req_str, &req_size)) {
+        fprintf(stderr, "make_request_string() failed\n");
+        conn_close(conn);
+        return;
     }
 
-    free(parser);
-    return true;
+    conn->to_server.data = req_str;
+    conn->to_server.len = req_size;
+    conn->to_server.offset = 0;
+    conn_connect(conn);
 }
 
-// Called from thread. send request to origin server. and receive its response.
-// The client side of proxy.
-// sockfd will be used in rcv_and_send_response().
-static bool send_request(http_request_t *request, http_response_t *response,
-    int *sockfd) {
-    struct addrinfo *addrinfo, *rp;
-    size_t remaining, offset, sent;
-    size_t req_size;
+// A reused connection may have been closed by origin just before the
+// request was sent. Send the request again on a fresh connection.
+// Return false if conn cannot be retried and is left as is.
+static bool conn_retry(conn_t *conn) {
     char *req_str;
-    char buf[BUFFER_SIZE] = {0};
+    size_t req_size;
 
-    if (request->host == NULL || strcmp(request->host, "") == 0) {
-        fprintf(stderr, "hostname is not specified\n");
+    if (!conn->retryable) {
         return false;
     }
 
-    if (!get_addrinfo(request->host, request->port, &addrinfo)) {
-        fprintf(stderr, "get_addrinfo() failed\n");
-        return false;
+    conn->retryable = false;
+    conn->fresh = true;
+    conn_close_server(conn);
+    pending_free(&conn->to_server);
+
+    if (!make_request_string(conn->request, &req_str, &req_size)) {
+        fprintf(stderr, "make_request_string() failed\n");
+        conn_close(conn);
+        return true;
     }
 
-    for (rp = addrinfo; rp != NULL; rp = rp->ai_next) {
-        if ((*sockfd = socket(rp->ai_family, rp->ai_socktype,
-            rp->ai_protocol)) == -1)
-            continue;
+    conn->to_server.data = req_str;
+    conn->to_server.len = req_size;
+    conn->to_server.offset = 0;
+    conn_connect(conn);
+    return true;
+}
 
-        if (connect(*sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break;
+// Feed client bytes to request parser. Bytes following a complete request
+// are kept in conn->from_client until it is answered.
+// Return 1 if a request is complete, 0 if more bytes are needed, -1 on error.
+static int conn_parse_request(conn_t *conn, const char *data, size_t len) {
+    size_t nparsed;
+
+    nparsed = http_parser_execute(&conn->parser, &request_settings,
+        data, len);
+
+    if (conn->parser.upgrade) {
+        // Bytes following CONNECT belong to the tunneled stream.
+        if (nparsed < len && !pending_append(&conn->to_server,
+                data + nparsed, len - nparsed)) {
+            perror("pending_append() failed");
+            return -1;
+        }
 
-        close(*sockfd);
+        conn->tunnel = true;
+        return 1;
     }
 
-    if (rp == NULL) {
-        fprintf(stderr, "Could not connect\n");
-        return false;
-    }
+    if (conn->request->on_message_completed) {
+        if (nparsed < len && !pending_append(&conn->from_client,
+                data + nparsed, len - nparsed)) {
+            perror("pending_append() failed");
+            return -1;
+        }
 
-    freeaddrinfo(addrinfo);
+        conn->keep_alive = http_should_keep_alive(&conn->parser);
+        return 1;
+    }
 
-    if (!make_request_string(request, &req_str, &req_size)) {
-        fprintf(stderr, "make_request_string() failed\n");
-        close(*sockfd);
-        return false;
+    if (nparsed != len) {
+        fprintf(stderr, "nparsed != recved\n");
+        return -1;
     }
 
-    remaining = req_size;
-    offset = 0;
+    return 0;
+}
+
+static void conn_read_request(conn_t *conn) {
+    char *buf = conn->worker->buf;
+    pending_t pipelined = conn->from_client;
+    ssize_t recved;
+    int r = 0;
+
+    if (pipelined.len != 0) {
+        memset(&conn->from_client, 0, sizeof(pending_t));
+        r = conn_parse_request(conn, pipelined.data + pipelined.offset,
+            pipelined.len - pipelined.offset);
+        pending_free(&pipelined);
+    }
 
-    while (remaining != 0) {
-        size_t buf_size;
+    while (r == 0) {
+        if ((recved = recv(conn->client_sockfd, buf, BUFFER_SIZE, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-        if (remaining <= BUFFER_SIZE) {
-            buf_size = remaining;
-        } else {    // remaining > sock_snd_buf_size
-            buf_size = BUFFER_SIZE;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recv() failed");
+                conn_close(conn);
+            } else {
+                conn_idle(conn);
+            }
+            return;
         }
 
-        memcpy(buf, req_str + offset, buf_size);
-        if ((sent = send(*sockfd, buf, buf_size, 0)) == -1) {
-            perror("send() failed");
-            free(req_str);
-            close(*sockfd);
-            return false;
+        if (recved == 0) {      // Client closed before a complete request.
+            conn_close(conn);
+            return;
         }
 
-        remaining -= sent;
-        offset += sent;
+        r = conn_parse_request(conn, buf, recved);
     }
 
-    free(req_str);
-    return true;
+    if (r == -1) {
+        conn_close(conn);
+        return;
+    }
+
+    conn_busy(conn);
+    if (conn->tunnel) {
+        conn_connect(conn);
+    } else {
+        conn_handle_request(conn);
+    }
 }
 
-// Called from thread.
-// receive response from origin server and forward to client.
-// server_sockfd was created in send_request.
-// We do not need to close client_sockfd, becuase it will be closed end of
-// the thread_main().
-// Store response in cache.
-static bool rcv_and_send_response(int server_sockfd, int client_sockfd,
-    http_request_t *request, http_response_t *response) {
-    http_parser *parser;
-    http_parser_settings settings;
-    size_t recved, nparsed, sent;
-    char buf[BUFFER_SIZE] = {0};
-    char *key, *value;
-    size_t key_len, value_len, offset;
-    lru_cache_error err;
+static void conn_on_client(reactor_t *reactor, int fd, uint32_t events,
+    void *data) {
+    conn_t *conn = (conn_t *) data;
 
-    parser = malloc(sizeof(http_parser));
-    if (!parser) {
-        perror("parser cannot be initialized");
-        close(server_sockfd);
-        return false;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(conn);
+        return;
     }
 
-    http_parser_settings_init(&settings);
-    settings.on_header_field = response_on_header_field_cb;
-    settings.on_header_value = response_on_header_value_cb;
-    settings.on_body = response_on_body_cb;
-    settings.on_message_complete = response_on_message_complete_cb;
+    switch (conn->state) {
+    case CONN_READ_REQUEST:
+        conn_read_request(conn);
+        break;
 
-    http_parser_init(parser, HTTP_RESPONSE);
-    parser->data = response;
-    value = NULL;
-    value_len = 0;
-    offset = 0;
+    case CONN_SEND_HIT:
+        conn_send_hit(conn);
+        break;
 
-    while (!response->on_message_completed) {
-        if ((recved = recv(server_sockfd, buf, BUFFER_SIZE, 0)) == -1) {
-            perror("recv() failed");
-            free(parser);
-            close(server_sockfd);
-            return false;
+    case CONN_RELAY_RESPONSE:
+        if (events & EPOLLOUT) {
+            conn_relay_response(conn);
         }
+        break;
 
-        nparsed = http_parser_execute(parser, &settings, buf, recved);
+    case CONN_TUNNEL:
+        conn_tunnel(conn);
+        break;
 
-        if (nparsed != recved) {
-            fprintf(stderr, "nparsed != recved\n");
-            free(parser);
-            close(server_sockfd);
-            return false;
-        }
+    default:        // Waiting for origin.
+        break;
+    }
+}
 
-        value_len += recved;
+static void conn_on_server(reactor_t *reactor, int fd, uint32_t events,
+    void *data) {
+    conn_t *conn = (conn_t *) data;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
 
-        if (!value) {
-            value = malloc(value_len);
-        } else {
-            value = realloc(value, value_len);
+    switch (conn->state) {
+    case CONN_CONNECTING:
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1) {
+            err = errno;
         }
 
-        if (!value) {
-            perror("value cannot be initialized");
-            fprintf(stderr, "nparsed != recved\n");
-            free(parser);
-            close(server_sockfd);
-            return false;
+        if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            conn_close_server(conn);
+            conn->addr_index++;
+            conn_try_connect(conn);
+        } else if (events & EPOLLOUT) {
+            conn_on_connected(conn);
         }
+        break;
 
-        memcpy(value + offset, buf, recved);
+    case CONN_SEND_REQUEST:
+        conn_send_request(conn);
+        break;
 
-        offset += recved;
+    case CONN_RELAY_RESPONSE:
+        conn_relay_response(conn);
+        break;
 
-        if ((sent = send(client_sockfd, buf, recved, 0)) == -1) {
-            perror("send() failed");
-            free(parser);
-            free(value);
-            close(server_sockfd);
-            return false;
-        }
+    case CONN_TUNNEL:
+        conn_tunnel(conn);
+        break;
+
+    default:
+        break;
     }
+}
 
-    free(parser);
+static void on_accept(reactor_t *reactor, int fd, uint32_t events,
+    void *data) {
+    worker_t *worker = (worker_t *) data;
+    struct sockaddr_in client_addr;
+    socklen_t client_addrlen;
+    char ip_str[INET_ADDRSTRLEN] = {0};
+    conn_t *conn;
+    int sockfd;
 
-    if (value_len <= OBJECT_SIZE) {
-        key_len = strlen(request->host) + strlen(request->port)
-            + 1 /* ":" */ + strlen(request->path) + 1;
-        key = malloc(key_len);
-        if (!key) {
-            perror("key cannot be initialized");
-            free(value);
-            close(server_sockfd);
-            return false;
+    while (1) {
+        client_addrlen = sizeof(struct sockaddr_in);
+        if ((sockfd = accept4(fd, (struct sockaddr *) &client_addr,
+                &client_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept failed");
+            }
+            return;
         }
 
-        strcpy(key, request->host);
-        strcat(key, ":");
-        strcat(key, request->port);
-        strcat(key, request->path);
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
 
-        // Note: Do not free value if err == LRU_CACHE_NO_ERROR.
-        err = lru_cache_set(cache, key, key_len, value, value_len);
-        if (err != LRU_CACHE_NO_ERROR) {
-            fprintf(stderr, "lru_cache_set() failed\n");
-            free(key);
-            free(value);
-            close(server_sockfd);
-            return false;
+        if ((conn = conn_init(worker, sockfd, ip_str)) == NULL) {
+            perror("conn cannot be initialized");
+            close(sockfd);
+            continue;
         }
 
-        printf("caching - key: %s, ", key);
-        print_cache_status();
+        if (!reactor_add(reactor, sockfd,
+                EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                conn_on_client, conn)) {
+            perror("reactor_add() failed");
+            free_http_request(conn->request);
+            free_http_response(conn->response);
+            free(conn);
+            close(sockfd);
+            continue;
+        }
 
-        free(key);
+        conn_idle(conn);
     }
-
-    close(server_sockfd);
-    return true;
 }
 
-// This function is called for HTTPS connection.
-// The proxy sever just forward to client's tcp stream to origin server
-// and vice versa unless tcp connection is closed.
-static void http_tunnel(int client_sockfd, http_request_t *request) {
-    struct addrinfo *addrinfo, *rp;
-    http_response_t *response;
-    char *res_str;
-    char buf[BUFFER_SIZE] = {0};
-    size_t res_len, remaining, offset, bytes /* using at recv and send */;
-    int server_sockfd;
-
-    if (request->host == NULL || strcmp(request->host, "") == 0) {
-        fprintf(stderr, "hostname is not specified\n");
-        close(client_sockfd);
-        return;
-    }
+// Close connections that sent nothing for CLIENT_IDLE_TIMEOUT while a
+// request is awaited, as thread mode does with SO_RCVTIMEO. Those waiting
+// for the fetch of another one as long go to the origin themselves.
+static void on_idle_check(reactor_t *reactor, void *data) {
+    worker_t *worker = (worker_t *) data;
+    time_t now = http_clock_now();
+    conn_t *conn;
+
+    while ((conn = worker->idle_head)
+        && now - conn->active >= CLIENT_IDLE_TIMEOUT) {
+        if (conn->state != CONN_WAITING) {
+            conn_close(conn);
+            continue;
+        }
 
-    if (!get_addrinfo(request->host, request->port, &addrinfo)) {
-        fprintf(stderr, "get_addrinfo() failed\n");
-        close(client_sockfd);
-        return;
+        // Queued to be continued if the fetch ended meanwhile.
+        conn_busy(conn);
+        if (inflight_cancel(flights, &conn->waiter)) {
+            conn->state = CONN_READ_REQUEST;
+            conn_handle_request(conn);
+        }
     }
+}
 
-    for (rp = addrinfo; rp != NULL; rp = rp->ai_next) {
-        if ((server_sockfd = socket(rp->ai_family, rp->ai_socktype,
-            rp->ai_protocol)) == -1)
-            continue;
-
-        if (connect(server_sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break;
+// Continue connections whose lookup was completed by resolver thread, and
+// those whose awaited fetch ended.
+static void on_resolve_event(reactor_t *reactor, int fd, uint32_t events,
+    void *data) {
+    worker_t *worker = (worker_t *) data;
+    conn_t *conn, *next, *landed;
+    uint64_t count;
 
-        close(server_sockfd);
+    while (read(fd, &count, sizeof(count)) > 0) {
+        ;
     }
 
-    if (rp == NULL) {
-        fprintf(stderr, "Could not connect\n");
-        close(client_sockfd);
-        return;
+    pthread_mutex_lock(&worker->lock);
+    conn = worker->resolved;
+    worker->resolved = NULL;
+    landed = worker->landed;
+    worker->landed = NULL;
+    pthread_mutex_unlock(&worker->lock);
+
+    for (; conn; conn = next) {
+        next = conn->next_resolved;
+        conn->next_resolved = NULL;
+        conn_resolved(conn);
     }
 
-    freeaddrinfo(addrinfo);
-
-    if ((response = init_http_response(0)) == NULL) {
-        perror("response cannot be initialized");
-        close(client_sockfd);
-        close(server_sockfd);
-        return;
+    for (conn = landed; conn; conn = next) {
+        next = conn->next_landed;
+        conn->next_landed = NULL;
+        conn_busy(conn);
+        conn->state = CONN_READ_REQUEST;
+        conn_handle_request(conn);
     }
+}
 
-    response->http_major = request->http_major;
-    response->http_minor = request->http_minor;
-    response->status = HTTP_STATUS_OK;
+static void init_parser_settings() {
+    http_parser_settings_init(&request_settings);
+    request_settings.on_url = request_on_url_cb;
+    request_settings.on_header_field = request_on_header_field_cb;
+    request_settings.on_header_value = request_on_header_value_cb;
+    request_settings.on_body = request_on_body_cb;
+    request_settings.on_message_complete = request_on_message_complete;
+
+    http_parser_settings_init(&response_settings);
+    response_settings.on_header_field = response_on_header_field_cb;
+    response_settings.on_header_value = response_on_header_value_cb;
+    response_settings.on_headers_complete = response_on_headers_complete_cb;
+    response_settings.on_body = response_on_body_cb;
+    response_settings.on_message_complete = response_on_message_complete_cb;
+}
 
-    if (!make_response_string(response, &res_str, &res_len)) {
-        fprintf(stderr, "make_response_string() failed\n");
-        free(response);
-        close(client_sockfd);
-        close(server_sockfd);
-        return;
+static void *worker_main(void *data) {
+    worker_t *worker = (worker_t *) data;
+    cpu_set_t cpuset;
+    long num_cpus;
+
+    if (worker->affinity
+        && (num_cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+        CPU_ZERO(&cpuset);
+        CPU_SET(worker->id % num_cpus, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                &cpuset)) {
+            fprintf(stderr, "worker %d: pthread_setaffinity_np() failed\n",
+                worker->id);
+        }
     }
-    free(response);
-
-    remaining = res_len;
-    offset = 0;
 
-    while (remaining != 0) {
-        size_t buf_size;
+    if (!set_nonblocking(worker->listen_sockfd)) {
+        error("set_nonblocking() failed");
+    }
 
-        if (remaining <= BUFFER_SIZE) {
-            buf_size = remaining;
-        } else {
-            buf_size = BUFFER_SIZE;
-        }
+    if ((worker->buf = malloc(BUFFER_SIZE)) == NULL) {
+        error("buffer cannot be initialized");
+    }
 
-        memcpy(buf, res_str + offset, buf_size);
-        if ((bytes = send(client_sockfd, buf, buf_size, 0)) == -1) {
-            perror("send() failed");
-            free(res_str);
-            close(client_sockfd);
-            close(server_sockfd);
-            return;
-        }
+    if ((worker->reactor = reactor_init(0)) == NULL) {
+        error("reactor_init() failed");
+    }
 
-        remaining -= bytes;
-        offset += bytes;
+    if ((worker->resolve_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+        || pthread_mutex_init(&worker->lock, NULL)) {
+        error("resolver event cannot be initialized");
     }
-    free(res_str);
 
-    while (1) {
-        while (1) {
-            if ((bytes = recv(client_sockfd, buf, BUFFER_SIZE,
-                    MSG_DONTWAIT | MSG_NOSIGNAL)) == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;
-                } else {
-                    if (errno == EPIPE) {
-                        close(server_sockfd);
-                    } else {
-                        perror("recv(client_sockfd) failed");
-                        close(server_sockfd);
-                        close(client_sockfd);
-                    }
-                    return;
-                }
-            }
+    if (!reactor_add(worker->reactor, worker->resolve_fd, EPOLLIN | EPOLLET,
+            on_resolve_event, worker)) {
+        error("reactor_add() failed");
+    }
 
-            if ((bytes = send(server_sockfd, buf, bytes, MSG_NOSIGNAL)) == -1) {
-                if (errno == EPIPE) {
-                    close(client_sockfd);
-                } else {
-                    perror("send(server_sockfd) failed");
-                    close(server_sockfd);
-                    close(client_sockfd);
-                }
-                return;
-            }
-        }
+    if (!reactor_add(worker->reactor, worker->listen_sockfd,
+            EPOLLIN | EPOLLET, on_accept, worker)) {
+        error("reactor_add() failed");
+    }
 
-        while (1) {
-            if ((bytes = recv(server_sockfd, buf, BUFFER_SIZE,
-                    MSG_DONTWAIT | MSG_NOSIGNAL)) == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;
-                } else {
-                    if (errno == EPIPE) {
-                        close(client_sockfd);
-                    } else {
-                        perror("recv(server_sockfd) failed");
-                        close(server_sockfd);
-                        close(client_sockfd);
-                    }
-                    return;
-                }
-            }
+    reactor_set_tick(worker->reactor, IDLE_CHECK_INTERVAL, on_idle_check,
+        worker);
 
-            if ((bytes = send(client_sockfd, buf, bytes, MSG_NOSIGNAL)) == -1) {
-                if (errno == EPIPE) {
-                    close(server_sockfd);
-                } else {
-                    perror("send(client_sockfd) failed");
-                    close(server_sockfd);
-                    close(client_sockfd);
-                }
-                return;
-            }
-        }
+    if (reactor_run(worker->reactor) == -1) {
+        error("reactor_run() failed");
     }
+
+    return NULL;
 }
 
-// thread entry point.
-static void thread_main(void *data) {
-    args_t *args = (args_t *) data;
-    http_request_t *request;
-    http_response_t *response;
-    int server_sockfd;
-    bool hit, upgrade;
+// Serve connections from num_workers epoll loops. Every worker binds its
+// own SO_REUSEPORT listener so the kernel spreads accepts across them.
+// sockfd is used by the first worker. Does not return.
+static void run_reactor(int sockfd, int port, int num_workers,
+    bool affinity) {
+    worker_t *workers;
+    int i;
 
-    if ((request = init_http_request(0)) == NULL) {
-        perror("request cannot be initialized");
-        return;
+    if ((workers = malloc(sizeof(worker_t) * num_workers)) == NULL) {
+        error("workers cannot be initialized");
+    }
+    memset(workers, 0, sizeof(worker_t) * num_workers);
+
+    for (i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].affinity = affinity;
+#ifdef SO_REUSEPORT
+        workers[i].listen_sockfd = i == 0 ? sockfd : create_listen_socket(port);
+#else
+        workers[i].listen_sockfd = sockfd;     // Share one listener.
+#endif
     }
 
-    if ((response = init_http_response(0)) == NULL) {
-        perror("response cannot be initialized");
-        free(request);
-        return;
+    for (i = 1; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                &workers[i])) {
+            error("pthread_create() failed");
+        }
     }
 
-    strcpy(request->ip, args->ip);
+    workers[0].thread = pthread_self();
+    worker_main(&workers[0]);
+}
 
-    if (!rcv_request(args->sockfd, request, response, &upgrade, &hit)) {
-        fprintf(stderr, "rcv_request() failed\n");
-    } else if (upgrade) {       // HTTP tunneling
-        // char str[128] = {0};
-        // strcpy(str, request->host);
-        // strcat(str, ":");
-        // strcat(str, request->port);
-        // printf("\nreceived HTTP tunnel (CONNECT Method) request from client\n");
-        // printf("Unable to cache\n");
-        // printf("request: %s\n", str);
-        // fflush(stdout);
-        http_tunnel(args->sockfd, request);
-        free(request);
-        free(response);
-        free(args);
-        return;
-    } else if (hit) {
-        printf("hit ");
-        print_cache_status();
-        log_http_request(request, response);
-    } else if (!send_request(request, response, &server_sockfd)) {
-        fprintf(stderr, "send_request() failed\n");
-    } else if (!rcv_and_send_response(server_sockfd, args->sockfd,
-            request, response)){
-        fprintf(stderr, "send_response() failed\n");
-    } else {
-        log_http_request(request, response);
-    }
+/* ************************************************************************* */
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage %s [options] [port]\n", prog);
+	fprintf(stderr, "  -m, --mode <thread|epoll|pool>  "
+		"connection handling (default: thread)\n");
+	fprintf(stderr, "  -w, --workers <N>               "
+		"number of epoll loops, implies --mode epoll (default: 1)\n");
+	fprintf(stderr, "  -a, --affinity                  "
+		"pin each epoll loop to a CPU\n");
+	fprintf(stderr, "  -p, --pool-size <N>             "
+		"threads in pool mode (default: %d)\n", THREAD_NUM);
+	fprintf(stderr, "  -q, --queue-len <N>             "
+		"connections queued in pool mode before answering 503 "
+		"(default: %d)\n", QUEUE_LEN);
+	fprintf(stderr, "  -l, --log-flush <ms>            "
+		"interval of access log writes (default: %d)\n",
+		HTTP_LOG_DEFAULT_FLUSH_INTERVAL);
+	fprintf(stderr, "  -s, --stale-while-revalidate <sec>\n"
+		"                                  serve stale responses while "
+		"refreshing them (default: 0)\n");
+	fprintf(stderr, "  -e, --stale-if-error <sec>      "
+		"serve stale responses when origin fails (default: 0)\n");
+}
 
-    free_http_request(request);
-    free_http_response(response);
-    close(args->sockfd);
-    free(args);
+// Reject a connection the pool has no room for. The accept loop must not
+// block on a slow client, so this is a single best-effort send.
+static void reject_connection(int sockfd) {
+    static const char res_str[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+
+    send(sockfd, res_str, sizeof(res_str) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sockfd);
 }
 
 int main(int argc, char *argv[]) {
 	int sockfd;
-	int opt;
 	int port;
-	socklen_t opt_size = sizeof(opt);
+	int c;
+	int num_workers = 1;
+	int pool_size = THREAD_NUM;
+	int queue_len = QUEUE_LEN;
+	int log_flush = HTTP_LOG_DEFAULT_FLUSH_INTERVAL;
+	enum { MODE_THREAD = 0, MODE_EPOLL, MODE_POOL } mode = MODE_THREAD;
+	bool affinity = false;
+	threadpool thpool = NULL;
+	struct option long_options[] = {
+		{ "mode", required_argument, NULL, 'm' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "affinity", no_argument, NULL, 'a' },
+		{ "pool-size", required_argument, NULL, 'p' },
+		{ "queue-len", required_argument, NULL, 'q' },
+		{ "log-flush", required_argument, NULL, 'l' },
+		{ "stale-while-revalidate", required_argument, NULL, 's' },
+		{ "stale-if-error", required_argument, NULL, 'e' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "m:w:ap:q:l:s:e:h", long_options,
+			NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			if (strcmp(optarg, "thread") == 0) {
+				mode = MODE_THREAD;
+			} else if (strcmp(optarg, "epoll") == 0) {
+				mode = MODE_EPOLL;
+			} else if (strcmp(optarg, "pool") == 0) {
+				mode = MODE_POOL;
+			} else {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'w':
+			num_workers = atoi(optarg);
+			if (num_workers < 1) {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			mode = MODE_EPOLL;
+			break;
+
+		case 'a':
+			affinity = true;
+			break;
+
+		case 'p':
+			pool_size = atoi(optarg);
+			if (pool_size < 1) {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'q':
+			queue_len = atoi(optarg);
+			if (queue_len < 1) {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'l':
+			log_flush = atoi(optarg);
+			if (log_flush < 1) {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 's':
+			stale_while_revalidate = atoi(optarg);
+			if (stale_while_revalidate < 0) {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'e':
+			stale_if_error = atoi(optarg);
+			if (stale_if_error < 0) {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage %s [port]\n", argv[0]);
+	if (argc - optind != 1) {
+		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	port = atoi(argv[1]);
+	port = atoi(argv[optind]);
 
 	if (!(port >= 1024 && port <= 65535)) {
 		fprintf(stderr, "port number must be in (1024 <= port <= 65535)\n");
@@ -611,51 +2907,67 @@ int main(int argc, char *argv[]) {
         error("cache initialization failed");
     }
 
-	// Create ipv4 TCP socket
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-        error("socket failed");
+    if ((upstream = upstream_pool_init(UPSTREAM_MAX_IDLE,
+            UPSTREAM_MAX_IDLE_PER_HOST, UPSTREAM_IDLE_TIMEOUT)) == NULL) {
+        error("upstream pool initialization failed");
     }
 
-	opt = 1;
-    // Set socket option to be reuse address to avoid error "Address already in use"
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, opt_size) < 0) {
-        error("setsockopt(SO_REUSEADDR) failed");
+    if ((resolver = resolver_init(NULL, 0, 0)) == NULL) {
+        error("resolver initialization failed");
     }
 
-	// Required on Linux >= 3.9
-    #ifdef SO_REUSEPORT
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, opt_size) < 0) {
-        error("setsockopt(SO_REUSEPORT) failed");
+    if ((flights = inflight_init(0)) == NULL) {
+        error("inflight initialization failed");
     }
-    #endif
-
-	struct sockaddr_in server_addr;
-    // Set IP socket address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
 
-    // Bind the address to the socket
-    if (bind(sockfd, (struct sockaddr *) &server_addr,
-        sizeof(server_addr)) < 0) {
-        error("bind failed");
+    if ((refreshes = thpool_init_bounded(REFRESH_THREADS,
+            REFRESH_QUEUE_LEN)) == NULL) {
+        error("refresh pool initialization failed");
     }
 
-    // Listen for connections on the socket
-    if (listen(sockfd, BACKLOG) < 0) {
-        error("listen failed");
-    }
+    // A peer closing mid-send must not kill the whole proxy.
+    signal(SIGPIPE, SIG_IGN);
 
-    char ip_str[INET_ADDRSTRLEN] = {0};
-    inet_ntop(AF_INET, &server_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
-    printf("running on %s:%d\n", ip_str, port);
+    sockfd = create_listen_socket(port);
+
+    if (mode == MODE_EPOLL) {
+        printf("running on 0.0.0.0:%d (epoll, %d workers)\n", port,
+            num_workers);
+    } else if (mode == MODE_POOL) {
+        printf("running on 0.0.0.0:%d (pool, %d threads, %d queued)\n", port,
+            pool_size, queue_len);
+    } else {
+        printf("running on 0.0.0.0:%d (thread)\n", port);
+    }
     fflush(stdout);
 
     if (!http_log_set_file("proxy.log")) {      // Set log file
         error("http_log_set_file() failed");
     }
 
+    // Timestamps are read from a clock refreshed once a second.
+    if (!http_clock_start()) {
+        error("http_clock_start() failed");
+    }
+
+    // Requests are logged in batches by a thread of its own.
+    if (!http_log_start(log_flush)) {
+        error("http_log_start() failed");
+    }
+
+    init_parser_settings();
+
+    if (mode == MODE_EPOLL) {
+        run_reactor(sockfd, port, num_workers, affinity);
+    }
+
+    if (mode == MODE_POOL
+        && (thpool = thpool_init_bounded(pool_size, queue_len)) == NULL) {
+        error("thpool_init_bounded() failed");
+    }
+
+    char ip_str[INET_ADDRSTRLEN] = {0};
+
     while (1) {
         args_t *args = malloc(sizeof(args_t));
         pthread_t pid;
@@ -675,9 +2987,22 @@ int main(int argc, char *argv[]) {
         inet_ntop(AF_INET, &client_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
         strcpy(args->ip, ip_str);
 
-        pthread_create(&pid, NULL, (void *) thread_main, (void *) args);
+        if (mode == MODE_POOL) {
+            if (thpool_add_work(thpool, thread_main, (void *) args) == -1) {
+                reject_connection(args->sockfd);
+                free(args);
+            }
+        } else if (pthread_create(&pid, NULL, (void *) thread_main,
+                (void *) args) == 0) {
+            pthread_detach(pid);
+        } else {
+            perror("pthread_create() failed");
+            close(args->sockfd);
+            free(args);
+        }
     }
 
+    thpool_destroy(thpool);
     close(sockfd);
 
     return 0;
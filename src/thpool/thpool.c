@@ -16,6 +16,12 @@
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef THPOOL_LIST_QUEUE
+#include <sched.h>
+#include <semaphore.h>
+#endif
 #if defined(__linux__)
 #include <sys/prctl.h>
 #endif
@@ -34,6 +40,11 @@
 #define err(str)
 #endif
 
+/* Job queue length when max_jobs is 0 */
+#define THPOOL_DEFAULT_MAX_JOBS 65536
+
+#define CACHE_LINE_SIZE 64
+
 static volatile int threads_keepalive;
 static volatile int threads_on_hold;
 
@@ -42,12 +53,14 @@ static volatile int threads_on_hold;
 /* ========================== STRUCTURES ============================ */
 
 
+#ifdef THPOOL_LIST_QUEUE
 /* Binary semaphore */
 typedef struct bsem {
 	pthread_mutex_t mutex;
 	pthread_cond_t   cond;
 	int v;
 } bsem;
+#endif
 
 
 /* Job */
@@ -58,15 +71,56 @@ typedef struct job{
 } job;
 
 
-/* Job queue */
+#ifdef THPOOL_LIST_QUEUE
+
+/* Job queue
+ *
+ * Linked list guarded by one mutex. Kept for comparison with the ring
+ * (see bench/thpool); build with -DTHPOOL_LIST_QUEUE to use it.
+ */
 typedef struct jobqueue{
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
 	job  *front;                         /* pointer to front of queue */
 	job  *rear;                          /* pointer to rear  of queue */
 	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	volatile int len;                    /* number of jobs in queue   */
+	int   max_len;                       /* list bound, 0: unbounded  */
+} jobqueue;
+
+#else
+
+/* Job slot of the ring */
+typedef struct job_slot{
+	volatile size_t seq;                 /* turn of this slot         */
+	void   (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+} job_slot;
+
+
+/* Job queue
+ *
+ * Bounded multi-producer/multi-consumer ring (D. Vyukov). Producers and
+ * consumers claim slots with one CAS on their own index, so they never
+ * take a lock nor allocate per job. Idle threads sleep on a counting
+ * semaphore which producers post only when somebody sleeps, so a busy
+ * pool makes no syscall per job.
+ */
+typedef struct jobqueue{
+	job_slot* slots;                     /* ring of 2^n slots         */
+	size_t    mask;                      /* number of slots - 1       */
+	int       max_len;                   /* queue bound, never 0      */
+	sem_t     has_jobs;                  /* number of jobs to pull    */
+	char      pad0[CACHE_LINE_SIZE];
+	volatile size_t head;                /* next slot to push         */
+	char      pad1[CACHE_LINE_SIZE - sizeof(size_t)];
+	volatile size_t tail;                /* next slot to pull         */
+	char      pad2[CACHE_LINE_SIZE - sizeof(size_t)];
+	volatile int len;                    /* number of jobs in queue   */
+	volatile int sleepers;               /* threads in jobqueue_wait  */
 } jobqueue;
 
+#endif
+
 
 /* Thread */
 typedef struct thread{
@@ -98,17 +152,21 @@ static void* thread_do(struct thread* thread_p);
 static void  thread_hold(int sig_id);
 static void  thread_destroy(struct thread* thread_p);
 
-static int   jobqueue_init(jobqueue* jobqueue_p);
+static int   jobqueue_init(jobqueue* jobqueue_p, int max_len);
 static void  jobqueue_clear(jobqueue* jobqueue_p);
-static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
-static struct job* jobqueue_pull(jobqueue* jobqueue_p);
+static int   jobqueue_push(jobqueue* jobqueue_p, void (*function_p)(void*), void* arg_p);
+static int   jobqueue_pull(jobqueue* jobqueue_p, struct job* job_p);
+static void  jobqueue_wait(jobqueue* jobqueue_p);
+static void  jobqueue_wake_all(jobqueue* jobqueue_p, int num_threads);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
+#ifdef THPOOL_LIST_QUEUE
 static void  bsem_init(struct bsem *bsem_p, int value);
 static void  bsem_reset(struct bsem *bsem_p);
 static void  bsem_post(struct bsem *bsem_p);
 static void  bsem_post_all(struct bsem *bsem_p);
 static void  bsem_wait(struct bsem *bsem_p);
+#endif
 
 
 
@@ -119,6 +177,12 @@ static void  bsem_wait(struct bsem *bsem_p);
 
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
+	return thpool_init_bounded(num_threads, 0);
+}
+
+
+/* Initialise thread pool with a bounded job queue */
+struct thpool_* thpool_init_bounded(int num_threads, int max_jobs){
 
 	threads_on_hold   = 0;
 	threads_keepalive = 1;
@@ -127,6 +191,10 @@ struct thpool_* thpool_init(int num_threads){
 		num_threads = 0;
 	}
 
+	if (max_jobs < 0){
+		max_jobs = 0;
+	}
+
 	/* Make new thread pool */
 	thpool_* thpool_p;
 	thpool_p = (struct thpool_*)malloc(sizeof(struct thpool_));
@@ -138,7 +206,7 @@ struct thpool_* thpool_init(int num_threads){
 	thpool_p->num_threads_working = 0;
 
 	/* Initialise the job queue */
-	if (jobqueue_init(&thpool_p->jobqueue) == -1){
+	if (jobqueue_init(&thpool_p->jobqueue, max_jobs) == -1){
 		err("thpool_init(): Could not allocate memory for job queue\n");
 		free(thpool_p);
 		return NULL;
@@ -174,21 +242,12 @@ struct thpool_* thpool_init(int num_threads){
 
 /* Add work to the thread pool */
 int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
-	job* newjob;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
-	if (newjob==NULL){
-		err("thpool_add_work(): Could not allocate memory for new job\n");
+	/* add job to queue */
+	if (jobqueue_push(&thpool_p->jobqueue, function_p, arg_p) == -1){
 		return -1;
 	}
 
-	/* add function and argument */
-	newjob->function=function_p;
-	newjob->arg=arg_p;
-
-	/* add job to queue */
-	jobqueue_push(&thpool_p->jobqueue, newjob);
-
 	return 0;
 }
 
@@ -196,7 +255,8 @@ int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
 /* Wait until all jobs have finished */
 void thpool_wait(thpool_* thpool_p){
 	pthread_mutex_lock(&thpool_p->thcount_lock);
-	while (thpool_p->jobqueue.len || thpool_p->num_threads_working) {
+	while (__atomic_load_n(&thpool_p->jobqueue.len, __ATOMIC_ACQUIRE)
+		|| __atomic_load_n(&thpool_p->num_threads_working, __ATOMIC_ACQUIRE)) {
 		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
 	}
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
@@ -219,14 +279,14 @@ void thpool_destroy(thpool_* thpool_p){
 	double tpassed = 0.0;
 	time (&start);
 	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		jobqueue_wake_all(&thpool_p->jobqueue, threads_total);
 		time (&end);
 		tpassed = difftime(end,start);
 	}
 
 	/* Poll remaining threads */
 	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		jobqueue_wake_all(&thpool_p->jobqueue, threads_total);
 		sleep(1);
 	}
 
@@ -263,7 +323,7 @@ void thpool_resume(thpool_* thpool_p) {
 
 
 int thpool_num_threads_working(thpool_* thpool_p){
-	return thpool_p->num_threads_working;
+	return __atomic_load_n(&thpool_p->num_threads_working, __ATOMIC_RELAXED);
 }
 
 
@@ -348,32 +408,26 @@ static void* thread_do(struct thread* thread_p){
 
 	while(threads_keepalive){
 
-		bsem_wait(thpool_p->jobqueue.has_jobs);
-
-		if (threads_keepalive){
+		__atomic_add_fetch(&thpool_p->num_threads_working, 1, __ATOMIC_SEQ_CST);
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
-
-			/* Read job from queue and execute it */
-			void (*func_buff)(void*);
-			void*  arg_buff;
-			job* job_p = jobqueue_pull(&thpool_p->jobqueue);
-			if (job_p) {
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				func_buff(arg_buff);
-				free(job_p);
-			}
+		/* Read job from queue and execute it */
+		job job_buff;
+		int pulled = jobqueue_pull(&thpool_p->jobqueue, &job_buff);
+		if (pulled == 0) {
+			job_buff.function(job_buff.arg);
+		}
 
+		/* Only the thread leaving the pool idle touches the lock */
+		if (__atomic_sub_fetch(&thpool_p->num_threads_working, 1, __ATOMIC_SEQ_CST) == 0
+			&& __atomic_load_n(&thpool_p->jobqueue.len, __ATOMIC_SEQ_CST) == 0) {
 			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			if (!thpool_p->num_threads_working) {
-				pthread_cond_signal(&thpool_p->threads_all_idle);
-			}
+			pthread_cond_signal(&thpool_p->threads_all_idle);
 			pthread_mutex_unlock(&thpool_p->thcount_lock);
+		}
 
+		if (pulled == -1) {
+			/* Queue is empty, sleep until a job is pushed */
+			jobqueue_wait(&thpool_p->jobqueue);
 		}
 	}
 	pthread_mutex_lock(&thpool_p->thcount_lock);
@@ -396,9 +450,12 @@ static void thread_destroy (thread* thread_p){
 /* ============================ JOB QUEUE =========================== */
 
 
+#ifdef THPOOL_LIST_QUEUE
+
 /* Initialize queue */
-static int jobqueue_init(jobqueue* jobqueue_p){
+static int jobqueue_init(jobqueue* jobqueue_p, int max_len){
 	jobqueue_p->len = 0;
+	jobqueue_p->max_len = max_len;
 	jobqueue_p->front = NULL;
 	jobqueue_p->rear  = NULL;
 
@@ -416,9 +473,10 @@ static int jobqueue_init(jobqueue* jobqueue_p){
 
 /* Clear the queue */
 static void jobqueue_clear(jobqueue* jobqueue_p){
+	job job_buff;
 
 	while(jobqueue_p->len){
-		free(jobqueue_pull(jobqueue_p));
+		jobqueue_pull(jobqueue_p, &job_buff);
 	}
 
 	jobqueue_p->front = NULL;
@@ -429,13 +487,32 @@ static void jobqueue_clear(jobqueue* jobqueue_p){
 }
 
 
-/* Add (allocated) job to queue
+/* Add job to queue
+ *
+ * @return 0 on success, -1 if a bounded queue is full or on no memory.
  */
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
+static int jobqueue_push(jobqueue* jobqueue_p, void (*function_p)(void*), void* arg_p){
+	job* newjob;
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	newjob=(struct job*)malloc(sizeof(struct job));
+	if (newjob==NULL){
+		err("thpool_add_work(): Could not allocate memory for new job\n");
+		return -1;
+	}
+
+	/* add function and argument */
+	newjob->function=function_p;
+	newjob->arg=arg_p;
 	newjob->prev = NULL;
 
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+
+	if (jobqueue_p->max_len && jobqueue_p->len >= jobqueue_p->max_len){
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+		free(newjob);
+		return -1;
+	}
+
 	switch(jobqueue_p->len){
 
 		case 0:  /* if no jobs in queue */
@@ -452,20 +529,18 @@ static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
 
 	bsem_post(jobqueue_p->has_jobs);
 	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	return 0;
 }
 
 
 /* Get first job from queue(removes it from queue)
-<<<<<<< HEAD
  *
- * Notice: Caller MUST hold a mutex
-=======
->>>>>>> da2c0fe45e43ce0937f272c8cd2704bdc0afb490
+ * @return 0 and the job copied to job_p, -1 if the queue is empty.
  */
-static struct job* jobqueue_pull(jobqueue* jobqueue_p){
+static int jobqueue_pull(jobqueue* jobqueue_p, struct job* job_p){
 
 	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	job* job_p = jobqueue_p->front;
+	job* front_p = jobqueue_p->front;
 
 	switch(jobqueue_p->len){
 
@@ -479,7 +554,7 @@ static struct job* jobqueue_pull(jobqueue* jobqueue_p){
 					break;
 
 		default: /* if >1 jobs in queue */
-					jobqueue_p->front = job_p->prev;
+					jobqueue_p->front = front_p->prev;
 					jobqueue_p->len--;
 					/* more than one job in queue -> post it */
 					bsem_post(jobqueue_p->has_jobs);
@@ -487,7 +562,27 @@ static struct job* jobqueue_pull(jobqueue* jobqueue_p){
 	}
 
 	pthread_mutex_unlock(&jobqueue_p->rwmutex);
-	return job_p;
+
+	if (front_p == NULL){
+		return -1;
+	}
+
+	*job_p = *front_p;
+	free(front_p);
+	return 0;
+}
+
+
+/* Block until a job may be available */
+static void jobqueue_wait(jobqueue* jobqueue_p){
+	bsem_wait(jobqueue_p->has_jobs);
+}
+
+
+/* Wake up every thread blocked in jobqueue_wait() */
+static void jobqueue_wake_all(jobqueue* jobqueue_p, int num_threads){
+	(void)num_threads;
+	bsem_post_all(jobqueue_p->has_jobs);
 }
 
 
@@ -497,9 +592,183 @@ static void jobqueue_destroy(jobqueue* jobqueue_p){
 	free(jobqueue_p->has_jobs);
 }
 
+#else
 
+/* Initialize queue
+ *
+ * The ring has room for max_len jobs rounded up to a power of two. Unlike
+ * the list, it is always bounded: max_len 0 means THPOOL_DEFAULT_MAX_JOBS.
+ */
+static int jobqueue_init(jobqueue* jobqueue_p, int max_len){
+	size_t size = 1, i;
 
+	memset(jobqueue_p, 0, sizeof(jobqueue));
+	jobqueue_p->max_len = max_len ? max_len : THPOOL_DEFAULT_MAX_JOBS;
 
+	while (size < (size_t)jobqueue_p->max_len){
+		size <<= 1;
+	}
+
+	jobqueue_p->slots = (struct job_slot*)malloc(size * sizeof(struct job_slot));
+	if (jobqueue_p->slots == NULL){
+		return -1;
+	}
+
+	for (i = 0; i < size; i++){
+		jobqueue_p->slots[i].seq = i;
+	}
+	jobqueue_p->mask = size - 1;
+
+	if (sem_init(&jobqueue_p->has_jobs, 0, 0) == -1){
+		free(jobqueue_p->slots);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Clear the queue */
+static void jobqueue_clear(jobqueue* jobqueue_p){
+	job job_buff;
+
+	while (jobqueue_pull(jobqueue_p, &job_buff) == 0){
+		;
+	}
+
+	while (sem_trywait(&jobqueue_p->has_jobs) == 0){
+		;
+	}
+}
+
+
+/* Add job to queue
+ *
+ * @return 0 on success, -1 if the queue is full.
+ */
+static int jobqueue_push(jobqueue* jobqueue_p, void (*function_p)(void*), void* arg_p){
+	job_slot* slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	/* Reserve room first, the ring itself never overflows afterwards */
+	if (__atomic_add_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST) > jobqueue_p->max_len){
+		__atomic_sub_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+
+	pos = __atomic_load_n(&jobqueue_p->head, __ATOMIC_RELAXED);
+	while (1){
+		slot = &jobqueue_p->slots[pos & jobqueue_p->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0){
+			if (__atomic_compare_exchange_n(&jobqueue_p->head, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		} else {
+			/* diff < 0 (consumer still copying out) or another producer won */
+			pos = __atomic_load_n(&jobqueue_p->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->function = function_p;
+	slot->arg      = arg_p;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with jobqueue_wait(): either it sees len or we see it sleeping */
+	if (__atomic_load_n(&jobqueue_p->sleepers, __ATOMIC_SEQ_CST) > 0){
+		sem_post(&jobqueue_p->has_jobs);
+	}
+	return 0;
+}
+
+
+/* Get first job from queue(removes it from queue)
+ *
+ * @return 0 and the job copied to job_p, -1 if the queue is empty.
+ */
+static int jobqueue_pull(jobqueue* jobqueue_p, struct job* job_p){
+	job_slot* slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&jobqueue_p->tail, __ATOMIC_RELAXED);
+	while (1){
+		slot = &jobqueue_p->slots[pos & jobqueue_p->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0){
+			if (__atomic_compare_exchange_n(&jobqueue_p->tail, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		} else if (diff < 0){
+			if (__atomic_load_n(&jobqueue_p->head, __ATOMIC_ACQUIRE) == pos){
+				return -1;   /* empty */
+			}
+			/* claimed by a producer that has not published it yet */
+			sched_yield();
+			pos = __atomic_load_n(&jobqueue_p->tail, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&jobqueue_p->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	job_p->function = slot->function;
+	job_p->arg      = slot->arg;
+	__atomic_store_n(&slot->seq, pos + jobqueue_p->mask + 1, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&jobqueue_p->len, 1, __ATOMIC_ACQ_REL);
+
+	return 0;
+}
+
+
+/* Block until a job may be available */
+static void jobqueue_wait(jobqueue* jobqueue_p){
+	__atomic_add_fetch(&jobqueue_p->sleepers, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&jobqueue_p->len, __ATOMIC_SEQ_CST) == 0){
+		while (sem_wait(&jobqueue_p->has_jobs) == -1 && errno == EINTR){
+			;
+		}
+	}
+
+	__atomic_sub_fetch(&jobqueue_p->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Wake up every thread blocked in jobqueue_wait() */
+static void jobqueue_wake_all(jobqueue* jobqueue_p, int num_threads){
+	int value;
+
+	if (sem_getvalue(&jobqueue_p->has_jobs, &value) == 0 && value >= num_threads){
+		return;
+	}
+
+	while (num_threads-- > 0){
+		sem_post(&jobqueue_p->has_jobs);
+	}
+}
+
+
+/* Free all queue resources back to the system */
+static void jobqueue_destroy(jobqueue* jobqueue_p){
+	jobqueue_clear(jobqueue_p);
+	sem_destroy(&jobqueue_p->has_jobs);
+	free(jobqueue_p->slots);
+}
+
+#endif
+
+
+
+
+
+#ifdef THPOOL_LIST_QUEUE
 
 /* ======================== SYNCHRONISATION ========================= */
 
@@ -549,3 +818,5 @@ static void bsem_wait(bsem* bsem_p) {
 	bsem_p->v = 0;
 	pthread_mutex_unlock(&bsem_p->mutex);
 }
+
+#endif
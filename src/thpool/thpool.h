@@ -21,7 +21,9 @@ typedef struct thpool_* threadpool;
  * @brief  Initialize threadpool
  *
  * Initializes a threadpool. This function will not return untill all
- * threads have initialized successfully.
+ * threads have initialized successfully. Same as thpool_init_bounded()
+ * with max_jobs 0, so the job queue holds at most 65536 jobs unless built
+ * with THPOOL_LIST_QUEUE.
  *
  * @example
  *
@@ -37,6 +39,29 @@ typedef struct thpool_* threadpool;
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief  Initialize threadpool with a bounded job queue
+ *
+ * Same as thpool_init() but thpool_add_work() fails instead of queueing
+ * once max_jobs jobs are waiting. This lets the caller shed load (e.g.
+ * answer 503) rather than letting the queue grow without limit.
+ *
+ * @example
+ *
+ *    ..
+ *    threadpool thpool;
+ *    thpool = thpool_init_bounded(4, 128);  //4 threads, at most 128 queued
+ *    ..
+ *
+ * @param  num_threads   number of threads to be created in the threadpool
+ * @param  max_jobs      maximum number of queued jobs, 0 for 65536
+ *                       (unbounded if built with THPOOL_LIST_QUEUE)
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_bounded(int num_threads, int max_jobs);
+
+
 /**
  * @brief Add work to the job queue
  *
@@ -62,7 +87,8 @@ threadpool thpool_init(int num_threads);
  * @param  threadpool    threadpool to which the work will be added
  * @param  function_p    pointer to function to add as work
  * @param  arg_p         pointer to an argument
- * @return 0 on successs, -1 otherwise.
+ * @return 0 on successs, -1 otherwise (including when the job queue is
+ *         full).
  */
 int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
 
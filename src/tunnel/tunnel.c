@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "tunnel.h"
+
+static bool set_nonblocking(int fd) {
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) == -1) {
+		return false;
+	}
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static void tunnel_close_pipe(tunnel_dir_t *dir) {
+	if (dir->pipe[0] != -1) {
+		close(dir->pipe[0]);
+		close(dir->pipe[1]);
+		dir->pipe[0] = dir->pipe[1] = -1;
+	}
+}
+
+static void tunnel_dir_init(tunnel_dir_t *dir, int from, int to,
+	bool use_splice) {
+	memset(dir, 0, sizeof(tunnel_dir_t));
+	dir->from = from;
+	dir->to = to;
+
+	if (!use_splice || pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+		dir->pipe[0] = dir->pipe[1] = -1;
+	}
+}
+
+// Read from dir->from into the pipe or buf.
+static ssize_t tunnel_fill(tunnel_dir_t *dir) {
+	ssize_t n;
+
+	if (dir->pipe[0] != -1) {
+		n = splice(dir->from, NULL, dir->pipe[1], NULL, TUNNEL_PIPE_SIZE,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (n != -1 || errno != EINVAL) {
+			return n;
+		}
+
+		// Not spliceable. The pipe is empty, so switch to copying.
+		tunnel_close_pipe(dir);
+	}
+
+	if (!dir->buf && (dir->buf = malloc(TUNNEL_BUFFER_SIZE)) == NULL) {
+		return -1;
+	}
+
+	dir->offset = 0;
+	return recv(dir->from, dir->buf, TUNNEL_BUFFER_SIZE, 0);
+}
+
+// Write pending bytes from the pipe or buf to dir->to.
+static ssize_t tunnel_drain(tunnel_dir_t *dir) {
+	if (dir->pipe[0] != -1) {
+		return splice(dir->pipe[0], NULL, dir->to, NULL, dir->pending,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	}
+
+	return send(dir->to, dir->buf + dir->offset, dir->pending, MSG_NOSIGNAL);
+}
+
+// Return 1 on EOF, 0 if would block, -1 on error.
+static int tunnel_pump_dir(tunnel_dir_t *dir) {
+	ssize_t n;
+
+	if (dir->eof) {
+		return 1;
+	}
+
+	while (1) {
+		while (dir->pending > 0) {
+			if ((n = tunnel_drain(dir)) == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+			}
+
+			dir->pending -= n;
+			dir->offset += n;
+		}
+
+		if ((n = tunnel_fill(dir)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+
+		if (n == 0) {
+			dir->eof = true;
+			shutdown(dir->to, SHUT_WR);
+			return 1;
+		}
+
+		dir->pending = n;
+	}
+}
+
+bool tunnel_init(tunnel_t *tunnel, int client_sockfd, int server_sockfd,
+	bool use_splice) {
+	if (!set_nonblocking(client_sockfd) || !set_nonblocking(server_sockfd)) {
+		perror("tunnel cannot set O_NONBLOCK");
+		return false;
+	}
+
+	tunnel_dir_init(&tunnel->up, client_sockfd, server_sockfd, use_splice);
+	tunnel_dir_init(&tunnel->down, server_sockfd, client_sockfd, use_splice);
+	return true;
+}
+
+void tunnel_free(tunnel_t *tunnel) {
+	tunnel_close_pipe(&tunnel->up);
+	tunnel_close_pipe(&tunnel->down);
+	free(tunnel->up.buf);
+	free(tunnel->down.buf);
+}
+
+int tunnel_pump(tunnel_t *tunnel) {
+	int up, down;
+
+	if ((up = tunnel_pump_dir(&tunnel->up)) == -1
+		|| (down = tunnel_pump_dir(&tunnel->down)) == -1) {
+		return -1;
+	}
+
+	return up == 1 && down == 1;
+}
+
+// Add the event dir waits for to fds, which holds {client, server}.
+static void tunnel_wait_for(tunnel_dir_t *dir, struct pollfd *fds) {
+	if (dir->eof) {
+		return;
+	}
+
+	if (dir->pending > 0) {
+		fds[dir->to == fds[0].fd ? 0 : 1].events |= POLLOUT;
+	} else {
+		fds[dir->from == fds[0].fd ? 0 : 1].events |= POLLIN;
+	}
+}
+
+bool tunnel_run(tunnel_t *tunnel) {
+	struct pollfd fds[2];
+	int r;
+
+	while ((r = tunnel_pump(tunnel)) == 0) {
+		fds[0].fd = tunnel->up.from;
+		fds[1].fd = tunnel->down.from;
+		fds[0].events = fds[1].events = 0;
+		tunnel_wait_for(&tunnel->up, fds);
+		tunnel_wait_for(&tunnel->down, fds);
+
+		if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+			perror("poll() failed");
+			return false;
+		}
+	}
+
+	return r == 1;
+}
@@ -0,0 +1,68 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TUNNEL_PIPE_SIZE (64*1024)      // Bytes moved by one splice().
+#define TUNNEL_BUFFER_SIZE (16*1024)    // Copy buffer if splice() is unusable.
+
+// One direction of a tunnel. Bytes read from `from` and not yet written to
+// `to` wait in the pipe, or in buf when copying.
+typedef struct {
+	int from;
+	int to;
+	int pipe[2];            // {-1, -1} when copying through buf.
+	char *buf;
+	size_t pending;
+	size_t offset;          // Of pending bytes in buf.
+	bool eof;               // `from` is closed and `to` is shut down.
+} tunnel_dir_t;
+
+typedef struct {
+	tunnel_dir_t up;        // Client to server.
+	tunnel_dir_t down;      // Server to client.
+} tunnel_t;
+
+/**
+ * Init tunnel_t relaying between two connected sockets, which are made
+ * non-blocking. The sockets are not owned by the tunnel.
+ *
+ * @params use_splice Move bytes with splice() through a pipe per direction,
+ *         so they never enter userspace. If false, or if pipes cannot be
+ *         created, bytes are copied through a buffer.
+ * @return true if succeed, otherwise false.
+ */
+bool tunnel_init(tunnel_t *tunnel, int client_sockfd, int server_sockfd,
+	bool use_splice);
+
+/**
+ * Close pipes and free buffers. Sockets are left open.
+ */
+void tunnel_free(tunnel_t *tunnel);
+
+/**
+ * Move bytes both ways until neither direction can make progress without
+ * blocking. EOF on one side shuts down writing on the other, and the
+ * other direction keeps flowing.
+ *
+ * @return 1 if both directions reached EOF, 0 if the tunnel should wait
+ *         for readiness, -1 on error.
+ */
+int tunnel_pump(tunnel_t *tunnel);
+
+/**
+ * Run tunnel_pump() until it ends, sleeping in poll() whenever both
+ * directions would block.
+ *
+ * @return true if both sides closed normally, otherwise false.
+ */
+bool tunnel_run(tunnel_t *tunnel);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
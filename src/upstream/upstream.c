@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "upstream.h"
+
+#define SWEEP_INTERVAL 1000     // ms
+
+static long long now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * djb2
+ */
+static uint32_t upstream_hash(const char *key) {
+	uint32_t h = 5381;
+
+	while (*key) {
+		h = ((h << 5) + h) + (unsigned char) *key++;
+	}
+
+	return h % UPSTREAM_HASH_SIZE;
+}
+
+static void make_key(char *key, size_t key_size, const char *host,
+	const char *port) {
+	snprintf(key, key_size, "%s:%s", host, port);
+}
+
+/**
+ * Check that an idle connection was not closed by origin. An idle HTTP
+ * connection must have nothing to read, so EOF, data and errors all make
+ * it unusable.
+ */
+static bool upstream_conn_alive(int sockfd) {
+	char c;
+	ssize_t n;
+
+	while ((n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT)) == -1
+		&& errno == EINTR) {
+		;
+	}
+
+	return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * Unlink and free host. Its connections must be taken out already.
+ */
+static void upstream_remove_host(upstream_pool_t *pool, upstream_host_t *prev,
+	upstream_host_t *host, uint32_t hash_index) {
+	if (prev) {
+		prev->next = host->next;
+	} else {
+		pool->hosts[hash_index] = host->next;
+	}
+
+	free(host->conns);
+	free(host->key);
+	free(host);
+}
+
+/**
+ * Close connections of host idle longer than idle_timeout. Connections
+ * are stacked by time, so expired ones are at the bottom.
+ */
+static void upstream_expire_host(upstream_pool_t *pool, upstream_host_t *host,
+	long long now) {
+	size_t i, n = 0;
+
+	while (n < host->num_conns
+		&& now - host->conns[n].since >= pool->idle_timeout) {
+		close(host->conns[n].sockfd);
+		n++;
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	for (i = n; i < host->num_conns; i++) {
+		host->conns[i - n] = host->conns[i];
+	}
+
+	host->num_conns -= n;
+	pool->stats.idle -= n;
+	pool->stats.expired += n;
+}
+
+static void upstream_sweep(upstream_pool_t *pool, long long now) {
+	upstream_host_t *host, *prev, *next;
+	uint32_t i;
+
+	for (i = 0; i < UPSTREAM_HASH_SIZE; i++) {
+		prev = NULL;
+		for (host = pool->hosts[i]; host; host = next) {
+			next = host->next;
+			upstream_expire_host(pool, host, now);
+
+			if (host->num_conns == 0) {
+				upstream_remove_host(pool, prev, host, i);
+			} else {
+				prev = host;
+			}
+		}
+	}
+
+	pool->last_sweep = now;
+}
+
+upstream_pool_t *upstream_pool_init(size_t max_idle, size_t max_idle_per_host,
+	long long idle_timeout) {
+	upstream_pool_t *pool = malloc(sizeof(upstream_pool_t));
+	if (!pool) {
+		perror("upstream_pool cannot create object");
+		return NULL;
+	}
+
+	memset(pool, 0, sizeof(upstream_pool_t));
+	pool->max_idle = max_idle;
+	pool->max_idle_per_host = max_idle_per_host;
+	pool->idle_timeout = idle_timeout;
+	pool->last_sweep = now_ms();
+
+	if (pthread_mutex_init(&pool->lock, NULL)) {
+		perror("upstream_pool cannot create mutex");
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void upstream_pool_free(upstream_pool_t *pool) {
+	upstream_host_t *host, *next;
+	uint32_t i;
+	size_t j;
+
+	if (!pool) return;
+
+	for (i = 0; i < UPSTREAM_HASH_SIZE; i++) {
+		for (host = pool->hosts[i]; host; host = next) {
+			next = host->next;
+			for (j = 0; j < host->num_conns; j++) {
+				close(host->conns[j].sockfd);
+			}
+			free(host->conns);
+			free(host->key);
+			free(host);
+		}
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+int upstream_pool_get(upstream_pool_t *pool, const char *host,
+	const char *port) {
+	char key[256];
+	uint32_t hash_index;
+	upstream_host_t *item, *prev = NULL;
+	long long now = now_ms();
+	int sockfd = -1;
+
+	make_key(key, sizeof(key), host, port);
+	hash_index = upstream_hash(key);
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (item = pool->hosts[hash_index]; item; item = item->next) {
+		if (strcmp(item->key, key) == 0) {
+			break;
+		}
+		prev = item;
+	}
+
+	if (item) {
+		upstream_expire_host(pool, item, now);
+
+		while (item->num_conns > 0 && sockfd == -1) {
+			sockfd = item->conns[--item->num_conns].sockfd;
+			pool->stats.idle--;
+
+			if (!upstream_conn_alive(sockfd)) {
+				close(sockfd);
+				sockfd = -1;
+				pool->stats.stale++;
+			}
+		}
+
+		if (item->num_conns == 0) {
+			upstream_remove_host(pool, prev, item, hash_index);
+		}
+	}
+
+	if (sockfd == -1) {
+		pool->stats.misses++;
+	} else {
+		pool->stats.hits++;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return sockfd;
+}
+
+bool upstream_pool_put(upstream_pool_t *pool, const char *host,
+	const char *port, int sockfd) {
+	char key[256];
+	uint32_t hash_index;
+	upstream_host_t *item;
+	long long now = now_ms();
+
+	make_key(key, sizeof(key), host, port);
+	hash_index = upstream_hash(key);
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (now - pool->last_sweep >= SWEEP_INTERVAL) {
+		upstream_sweep(pool, now);
+	}
+
+	if (pool->stats.idle >= pool->max_idle || pool->max_idle_per_host == 0) {
+		goto reject;
+	}
+
+	for (item = pool->hosts[hash_index]; item; item = item->next) {
+		if (strcmp(item->key, key) == 0) {
+			break;
+		}
+	}
+
+	if (!item) {
+		if ((item = malloc(sizeof(upstream_host_t))) == NULL) {
+			goto reject;
+		}
+		memset(item, 0, sizeof(upstream_host_t));
+
+		item->key = malloc(strlen(key) + 1);
+		item->conns = malloc(sizeof(upstream_conn_t) * pool->max_idle_per_host);
+		if (!item->key || !item->conns) {
+			free(item->key);
+			free(item->conns);
+			free(item);
+			goto reject;
+		}
+
+		strcpy(item->key, key);
+		item->next = pool->hosts[hash_index];
+		pool->hosts[hash_index] = item;
+	}
+
+	if (item->num_conns >= pool->max_idle_per_host) {
+		goto reject;
+	}
+
+	item->conns[item->num_conns].sockfd = sockfd;
+	item->conns[item->num_conns].since = now;
+	item->num_conns++;
+	pool->stats.idle++;
+
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+
+reject:
+	pool->stats.rejected++;
+	pthread_mutex_unlock(&pool->lock);
+	close(sockfd);
+	return false;
+}
+
+void upstream_pool_expire(upstream_pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	upstream_sweep(pool, now_ms());
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void upstream_pool_stats(upstream_pool_t *pool, upstream_stats_t *stats) {
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->lock);
+}
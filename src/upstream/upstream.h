@@ -0,0 +1,92 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define UPSTREAM_HASH_SIZE 256
+
+typedef struct {
+	size_t hits;            // Idle connection reused.
+	size_t misses;          // No usable idle connection.
+	size_t stale;           // Idle connection closed by origin.
+	size_t expired;         // Idle connection closed after idle_timeout.
+	size_t rejected;        // Connection not kept because pool was full.
+	size_t idle;            // Connections idle now.
+} upstream_stats_t;
+
+typedef struct upstream_conn {
+	int sockfd;
+	long long since;        // ms, CLOCK_MONOTONIC
+} upstream_conn_t;
+
+// Idle connections to one origin. conns is a stack, the most recently
+// used connection is on top.
+typedef struct upstream_host {
+	char *key;              // <host>:<port>
+	upstream_conn_t *conns;
+	size_t num_conns;
+	struct upstream_host *next;
+} upstream_host_t;
+
+typedef struct {
+	upstream_host_t *hosts[UPSTREAM_HASH_SIZE];
+	size_t max_idle;
+	size_t max_idle_per_host;
+	long long idle_timeout;     // ms
+	long long last_sweep;       // ms
+	upstream_stats_t stats;
+	pthread_mutex_t lock;
+} upstream_pool_t;
+
+/**
+ * Init upstream_pool_t.
+ *
+ * @params max_idle Maximum number of idle connections in the pool.
+ * @params max_idle_per_host Maximum number of idle connections per origin.
+ * @params idle_timeout Idle connections older than this (ms) are closed.
+ */
+upstream_pool_t *upstream_pool_init(size_t max_idle, size_t max_idle_per_host,
+	long long idle_timeout);
+
+/**
+ * Close every idle connection and free upstream_pool_t.
+ */
+void upstream_pool_free(upstream_pool_t *pool);
+
+/**
+ * Take an idle connection to host:port out of the pool.
+ * The connection is checked not to be closed by origin before returned.
+ *
+ * @return Connected socket, or -1 if there is no usable idle connection.
+ */
+int upstream_pool_get(upstream_pool_t *pool, const char *host,
+	const char *port);
+
+/**
+ * Give a connection to host:port back to the pool. The pool owns sockfd
+ * afterwards and closes it if the pool is full.
+ *
+ * @return true if sockfd is kept, otherwise false.
+ */
+bool upstream_pool_put(upstream_pool_t *pool, const char *host,
+	const char *port, int sockfd);
+
+/**
+ * Close idle connections older than idle_timeout.
+ */
+void upstream_pool_expire(upstream_pool_t *pool);
+
+/**
+ * Copy counters of the pool.
+ */
+void upstream_pool_stats(upstream_pool_t *pool, upstream_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,218 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <cache/inflight.h>
+
+typedef struct {
+	inflight_t *inflight;
+	int entered;
+	int led;
+} waiter_state_t;
+
+static void on_landed(void *data) {
+	(*(int *) data)++;
+}
+
+static void waiter_init(inflight_waiter_t *waiter, int *landed) {
+	waiter->cb = on_landed;
+	waiter->data = landed;
+}
+
+static void *waiter_main(void *data) {
+	waiter_state_t *s = (waiter_state_t *) data;
+
+	__atomic_add_fetch(&s->entered, 1, __ATOMIC_SEQ_CST);
+	if (inflight_enter(s->inflight, "a", 1, 10 * 1000) != NULL) {
+		__atomic_add_fetch(&s->led, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+static void test_inflight_join(void **state) {
+	inflight_t *inflight = inflight_init(1);
+	inflight_flight_t *a, *b, *flight;
+	inflight_waiter_t waiters[3];
+	inflight_stats_t stats;
+	int landed = 0, i;
+
+	assert_non_null(inflight);
+	for (i = 0; i < 3; i++) {
+		waiter_init(&waiters[i], &landed);
+	}
+
+	// Keys in one bucket do not share a flight.
+	assert_int_equal(inflight_join(inflight, "a", 1, &a, &waiters[0]), 1);
+	assert_int_equal(inflight_join(inflight, "b", 1, &b, &waiters[0]), 1);
+	assert_int_equal(inflight_join(inflight, "a", 1, &flight, &waiters[1]),
+		0);
+	assert_null(flight);
+	assert_true(waiters[1].flight == a);
+	assert_int_equal(inflight_join(inflight, "a", 1, &flight, &waiters[2]),
+		0);
+
+	inflight_end(inflight, b);
+	assert_int_equal(landed, 0);
+	inflight_end(inflight, a);
+	assert_int_equal(landed, 2);
+	assert_null(waiters[1].flight);
+
+	// The next request leads again.
+	assert_int_equal(inflight_join(inflight, "a", 1, &a, &waiters[0]), 1);
+	inflight_end(inflight, a);
+	inflight_end(inflight, NULL);
+
+	inflight_stats(inflight, &stats);
+	assert_int_equal(stats.leaders, 3);
+	assert_int_equal(stats.followers, 2);
+	assert_int_equal(stats.in_flight, 0);
+
+	inflight_free(inflight);
+}
+
+static void test_inflight_cancel(void **state) {
+	inflight_t *inflight = inflight_init(0);
+	inflight_flight_t *a, *flight;
+	inflight_waiter_t waiters[4];
+	int landed = 0, cancelled = 0, i;
+
+	assert_non_null(inflight);
+	waiter_init(&waiters[0], &landed);
+	waiter_init(&waiters[1], &cancelled);
+	waiter_init(&waiters[2], &landed);
+	waiter_init(&waiters[3], &cancelled);
+
+	// Followers are unlinked wherever they are in the list.
+	assert_int_equal(inflight_join(inflight, "a", 1, &a, &waiters[0]), 1);
+	for (i = 1; i < 4; i++) {
+		assert_int_equal(inflight_join(inflight, "a", 1, &flight,
+			&waiters[i]), 0);
+	}
+
+	assert_true(inflight_cancel(inflight, &waiters[3]));
+	assert_true(inflight_cancel(inflight, &waiters[1]));
+	assert_false(inflight_cancel(inflight, &waiters[1]));
+	inflight_end(inflight, a);
+	assert_int_equal(landed, 1);
+	assert_int_equal(cancelled, 0);
+
+	// Too late once the flight ended.
+	assert_false(inflight_cancel(inflight, &waiters[2]));
+
+	// Followers left are not called.
+	assert_int_equal(inflight_join(inflight, "a", 1, &a, &waiters[0]), 1);
+	assert_int_equal(inflight_join(inflight, "a", 1, &flight, &waiters[2]),
+		0);
+	inflight_free(inflight);
+	assert_int_equal(landed, 1);
+}
+
+static void test_inflight_enter(void **state) {
+	waiter_state_t s = { inflight_init(0), 0, 0 };
+	inflight_flight_t *a;
+	pthread_t threads[4];
+	inflight_stats_t stats;
+	int i;
+
+	assert_non_null(s.inflight);
+	assert_non_null(a = inflight_enter(s.inflight, "a", 1, 0));
+
+	for (i = 0; i < 4; i++) {
+		assert_int_equal(pthread_create(&threads[i], NULL, waiter_main, &s),
+			0);
+	}
+
+	// Every waiter follows before the flight ends.
+	do {
+		usleep(10 * 1000);
+		inflight_stats(s.inflight, &stats);
+	} while (stats.followers < 4);
+
+	inflight_end(s.inflight, a);
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	assert_int_equal(s.led, 0);
+	inflight_stats(s.inflight, &stats);
+	assert_int_equal(stats.leaders, 1);
+	assert_int_equal(stats.in_flight, 0);
+
+	inflight_free(s.inflight);
+}
+
+static void test_inflight_enter_timeout(void **state) {
+	inflight_t *inflight = inflight_init(0);
+	inflight_flight_t *a, *flight;
+	inflight_waiter_t waiter;
+	inflight_stats_t stats;
+	struct timespec start, end;
+	long elapsed;
+	int landed = 0;
+
+	assert_non_null(inflight);
+	assert_non_null(a = inflight_enter(inflight, "a", 1, 0));
+
+	// A leader that never ends holds followers up for timeout only.
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	assert_null(inflight_enter(inflight, "a", 1, 100));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) * 1000
+		+ (end.tv_nsec - start.tv_nsec) / 1000000;
+	assert_true(elapsed >= 100);
+
+	// The follower left, so the end does not reach it.
+	waiter_init(&waiter, &landed);
+	assert_int_equal(inflight_join(inflight, "a", 1, &flight, &waiter), 0);
+	inflight_end(inflight, a);
+	assert_int_equal(landed, 1);
+
+	inflight_stats(inflight, &stats);
+	assert_int_equal(stats.leaders, 1);
+	assert_int_equal(stats.followers, 2);
+	assert_int_equal(stats.in_flight, 0);
+
+	inflight_free(inflight);
+}
+
+static void test_inflight_lead(void **state) {
+	inflight_t *inflight = inflight_init(0);
+	inflight_flight_t *a, *flight;
+	inflight_waiter_t waiter;
+	inflight_stats_t stats;
+	int landed = 0;
+
+	assert_non_null(inflight);
+	assert_non_null(a = inflight_lead(inflight, "a", 1));
+	assert_null(inflight_lead(inflight, "a", 1));
+	waiter_init(&waiter, &landed);
+	assert_int_equal(inflight_join(inflight, "a", 1, &flight, &waiter), 0);
+
+	inflight_stats(inflight, &stats);
+	assert_int_equal(stats.leaders, 1);
+	assert_int_equal(stats.followers, 1);
+
+	inflight_end(inflight, a);
+	assert_int_equal(landed, 1);
+	assert_non_null(a = inflight_lead(inflight, "a", 1));
+	inflight_end(inflight, a);
+
+	inflight_free(inflight);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_inflight_join),
+		cmocka_unit_test(test_inflight_cancel),
+		cmocka_unit_test(test_inflight_enter),
+		cmocka_unit_test(test_inflight_enter_timeout),
+		cmocka_unit_test(test_inflight_lead),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -3,8 +3,10 @@
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <cache/lru.h>
 
@@ -86,6 +88,7 @@ static void test_lru_get(void **state) {
     assert_non_null(value);
     assert_true(value_len == strlen(values[0]) + 1);
     assert_true(strcmp(value, values[0]) == 0);
+    lru_cache_release(value);
 
     err = lru_cache_get(cache, keys[1], strlen(keys[1])+1,
         (void **) &value, &value_len);
@@ -138,6 +141,329 @@ static void test_hit(void **state) {
     assert_non_null(value);
     assert_true(value_len == strlen(long_values[0]) + 1);
     assert_true(memcmp(long_values[0], value, strlen(long_keys[0])+1) == 0);
+    lru_cache_release(value);
+}
+
+static void test_one_bucket(void **state) {
+    size_t size = lru_cache_item_size(6, 7);
+    lru_cache_t *cache = lru_cache_init_sharded(3 * size, 3 * size, 1);
+    char *found;
+    size_t found_len;
+    int i;
+
+    assert_non_null(cache);
+    assert_true(cache->shards[0].hash_table_size == 1);
+
+    // Evicted and deleted items are unlinked from anywhere in the chain.
+    for (i = 0; i < 5; i++) {
+        assert_true(lru_cache_set(cache, keys[i], strlen(keys[i])+1,
+            values[i], 7) == LRU_CACHE_NO_ERROR);
+    }
+    assert_true(lru_cache_delete(cache, keys[3], strlen(keys[3])+1)
+        == LRU_CACHE_NO_ERROR);
+
+    for (i = 0; i < 5; i++) {
+        lru_cache_get(cache, keys[i], strlen(keys[i])+1,
+            (void **) &found, &found_len);
+        if (i == 2 || i == 4) {
+            assert_string_equal(found, values[i]);
+            lru_cache_release(found);
+        } else {
+            assert_null(found);
+        }
+    }
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+}
+
+static void test_release(void **state) {
+    size_t size = lru_cache_item_size(5, 7);
+    lru_cache_t *cache = lru_cache_init_sharded(size, size, 1);
+    char *value, *found;
+    size_t value_len, found_len;
+
+    assert_non_null(cache);
+    assert_true(lru_cache_set(cache, keys[0], strlen(keys[0])+1,
+        values[0], strlen(values[0])+1) == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, keys[0], strlen(keys[0])+1,
+        (void **) &value, &value_len);
+    assert_non_null(value);
+
+    // Evicted by another key, but still readable until released.
+    assert_true(lru_cache_set(cache, keys[1], strlen(keys[1])+1,
+        values[1], strlen(values[1])+1) == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, keys[0], strlen(keys[0])+1,
+        (void **) &found, &found_len);
+    assert_null(found);
+    assert_string_equal(value, values[0]);
+
+    // Replaced, too.
+    lru_cache_get(cache, keys[1], strlen(keys[1])+1,
+        (void **) &found, &found_len);
+    assert_true(lru_cache_set(cache, keys[1], strlen(keys[1])+1,
+        values[2], strlen(values[2])+1) == LRU_CACHE_NO_ERROR);
+    assert_string_equal(found, values[1]);
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+    assert_string_equal(value, values[0]);
+    lru_cache_release(value);
+    lru_cache_release(found);
+    lru_cache_release(NULL);
+}
+
+static void test_shards(void **state) {
+    size_t size = lru_cache_item_size(6, 60);
+    lru_cache_t *cache = lru_cache_init_sharded(4 * size, size, 4);
+    char key[16], value[1024];
+    char *found;
+    size_t found_len;
+    int i, hits = 0;
+
+    assert_non_null(cache);
+    assert_true(cache->num_shards == 4);
+    assert_true(cache->total_memory == 4 * size);
+
+    // Bigger than a shard.
+    memset(value, 'x', sizeof(value));
+    assert_true(lru_cache_set(cache, "big", 4, value, size)
+        == LRU_CACHE_VALUE_TOO_LONG);
+
+    // Each shard holds one 60 bytes value, evicting its own LRU only.
+    for (i = 0; i < 64; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        assert_true(lru_cache_set(cache, key, strlen(key)+1, value, 60)
+            == LRU_CACHE_NO_ERROR);
+        assert_true(lru_cache_free_memory(cache) <= 4 * size);
+    }
+
+    for (i = 0; i < 64; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        lru_cache_get(cache, key, strlen(key)+1, (void **) &found, &found_len);
+        if (found) {
+            hits++;
+            lru_cache_release(found);
+        }
+    }
+    assert_true(hits >= 1 && hits <= 4);
+    assert_true(lru_cache_free_memory(cache) == (4 - hits) * size);
+
+    // Shrinking a value to a smaller class gives memory back.
+    assert_true(lru_cache_item_size(6, 10) < size);
+    assert_true(lru_cache_set(cache, "key63", 6, value, 10)
+        == LRU_CACHE_NO_ERROR);
+    assert_true(lru_cache_free_memory(cache)
+        == (5 - hits) * size - lru_cache_item_size(6, 10));
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+}
+
+static void test_init(void **state) {
+    size_t len = 512*1024 - 1024, found_len;
+    lru_cache_t *cache = lru_cache_init(5*1024*1024, 512*1024);
+    char *value = malloc(len), *found;
+    int i;
+
+    assert_non_null(cache);
+    assert_true(cache->num_shards == 2);
+    assert_true(cache->shards[0].hash_table_size > 1);
+    memset(value, 'x', len);
+
+    // A value near the largest fits, and does not flush its shard.
+    assert_true(lru_cache_set(cache, "small", 6, value, 10)
+        == LRU_CACHE_NO_ERROR);
+    for (i = 0; i < 2; i++) {
+        assert_true(lru_cache_set(cache, keys[i], strlen(keys[i])+1,
+            value, len) == LRU_CACHE_NO_ERROR);
+    }
+    lru_cache_get(cache, "small", 6, (void **) &found, &found_len);
+    assert_non_null(found);
+    lru_cache_release(found);
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+    free(value);
+}
+
+static void test_lru_order(void **state) {
+    size_t size = lru_cache_item_size(6, 7);
+    lru_cache_t *cache = lru_cache_init_sharded(3 * size, size, 1);
+    char *found;
+    size_t found_len;
+    int i;
+
+    assert_non_null(cache);
+
+    for (i = 0; i < 3; i++) {
+        assert_true(lru_cache_set(cache, keys[i], strlen(keys[i])+1,
+            values[i], 7) == LRU_CACHE_NO_ERROR);
+    }
+
+    // "zero" is used again, so "one" is the least recently used.
+    lru_cache_get(cache, keys[0], strlen(keys[0])+1,
+        (void **) &found, &found_len);
+    assert_non_null(found);
+    lru_cache_release(found);
+
+    assert_true(lru_cache_set(cache, keys[3], strlen(keys[3])+1,
+        values[3], 7) == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, keys[1], strlen(keys[1])+1,
+        (void **) &found, &found_len);
+    assert_null(found);
+
+    // Replacing "two" makes it recent, so "zero" goes next.
+    assert_true(lru_cache_set(cache, keys[2], strlen(keys[2])+1,
+        values[2], 7) == LRU_CACHE_NO_ERROR);
+    assert_true(lru_cache_set(cache, keys[4], strlen(keys[4])+1,
+        values[4], 7) == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, keys[0], strlen(keys[0])+1,
+        (void **) &found, &found_len);
+    assert_null(found);
+
+    for (i = 2; i < 5; i++) {
+        lru_cache_get(cache, keys[i], strlen(keys[i])+1,
+            (void **) &found, &found_len);
+        assert_non_null(found);
+        lru_cache_release(found);
+    }
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+}
+
+static void test_value_fd(void **state) {
+    lru_cache_t *cache = lru_cache_init_sharded(1024*1024, 1024, 1);
+    size_t len = LRU_CACHE_MEMFD_MIN, found_len;
+    char *value = malloc(len), *read_back = malloc(len), *found;
+    off_t offset;
+    int fd;
+
+    assert_non_null(cache);
+    memset(value, 'x', len);
+
+    // Large value is sent from its memfd.
+    assert_true(lru_cache_set(cache, "large", 6, value, len)
+        == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, "large", 6, (void **) &found, &found_len);
+    assert_true(found_len == len);
+    assert_memory_equal(found, value, len);
+
+    fd = lru_cache_value_fd(found, &offset);
+    assert_true(fd != -1);
+    assert_true(pread(fd, read_back, len, offset) == len);
+    assert_memory_equal(read_back, value, len);
+    lru_cache_release(found);
+
+    // Small value is in memory.
+    assert_true(lru_cache_set(cache, "small", 6, value, len - 1)
+        == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, "small", 6, (void **) &found, &found_len);
+    assert_true(lru_cache_value_fd(found, &offset) == -1);
+    lru_cache_release(found);
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+    free(value);
+    free(read_back);
+}
+
+static void test_item_size(void **state) {
+    size_t size = lru_cache_item_size(6, 60);
+
+    // Charged a whole chunk, header included.
+    assert_true(size >= sizeof(lru_item_t) + sizeof(lru_value_t) + 66);
+    assert_true(size == lru_cache_item_size(1, 65));
+    assert_true(lru_cache_item_size(6, 61) >= size);
+
+    // Large values are charged in pages.
+    size = lru_cache_item_size(6, LRU_SLAB_MAX_CHUNK);
+    assert_true(size % LRU_CACHE_LARGE_ALIGN == 0);
+    assert_true(size >= LRU_SLAB_MAX_CHUNK + 6);
+}
+
+static void test_class_lru(void **state) {
+    size_t small = lru_cache_item_size(6, 10);
+    size_t large = lru_cache_item_size(6, 1000);
+    lru_cache_t *cache = lru_cache_init_sharded(2 * small + large, small, 1);
+    char value[1000];
+    char *found;
+    size_t found_len;
+
+    assert_non_null(cache);
+    memset(value, 'x', sizeof(value));
+
+    assert_true(lru_cache_set(cache, "big1", 5, value, 1000)
+        == LRU_CACHE_NO_ERROR);
+    assert_true(lru_cache_set(cache, "small1", 7, value, 10)
+        == LRU_CACHE_NO_ERROR);
+    assert_true(lru_cache_set(cache, "small2", 7, value, 10)
+        == LRU_CACHE_NO_ERROR);
+
+    // "big1" is the least recently used, but a small item takes the chunk
+    // of the oldest one of its class.
+    assert_true(lru_cache_set(cache, "small3", 7, value, 10)
+        == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, "small1", 7, (void **) &found, &found_len);
+    assert_null(found);
+    lru_cache_get(cache, "big1", 5, (void **) &found, &found_len);
+    assert_non_null(found);
+    lru_cache_release(found);
+
+    // A class without items evicts the least recently used of the shard.
+    assert_true(lru_cache_set(cache, "mid", 4, value, 500)
+        == LRU_CACHE_NO_ERROR);
+    lru_cache_get(cache, "small2", 7, (void **) &found, &found_len);
+    assert_null(found);
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+}
+
+static void test_churn(void **state) {
+    lru_cache_t *cache = lru_cache_init_sharded(8*1024*1024, 8192, 4);
+    size_t peak = 0, len;
+    char key[32], *value = malloc(LRU_SLAB_MAX_CHUNK);
+    int i;
+
+    assert_non_null(cache);
+    memset(value, 'x', LRU_SLAB_MAX_CHUNK);
+    srand(1);
+
+    // Mixed sizes keep taking chunks freed by others, so pages stop
+    // growing once the cache is full.
+    for (i = 0; i < 100000; i++) {
+        snprintf(key, sizeof(key), "key%d", rand() % 4096);
+        len = rand() % (LRU_SLAB_MAX_CHUNK - 256);
+        assert_true(lru_cache_set(cache, key, strlen(key)+1, value, len)
+            == LRU_CACHE_NO_ERROR);
+        assert_true(lru_cache_free_memory(cache) <= 8*1024*1024);
+
+        if (i == 50000) {
+            peak = lru_cache_slab_memory(cache);
+        }
+    }
+
+    assert_true(lru_cache_slab_memory(cache) <= peak + 4 * LRU_SLAB_PAGE_SIZE);
+    assert_true(lru_cache_slab_memory(cache) <= 12*1024*1024);
+
+    assert_true(lru_cache_free(cache) == LRU_CACHE_NO_ERROR);
+    free(value);
+}
+
+static void test_setv(void **state) {
+    lru_cache_t *cache = (lru_cache_t *) *state;
+    struct iovec iov[3] = {
+        { "HTTP/1.1 200 OK\r\n", 17 },
+        { "\r\n", 2 },
+        { "body", 5 },
+    };
+    char *value;
+    size_t value_len;
+
+    assert_true(lru_cache_setv(cache, keys[2], strlen(keys[2])+1, iov, 3)
+        == LRU_CACHE_NO_ERROR);
+
+    lru_cache_get(cache, keys[2], strlen(keys[2])+1,
+        (void **) &value, &value_len);
+    assert_non_null(value);
+    assert_true(value_len == 24);
+    assert_string_equal(value, "HTTP/1.1 200 OK\r\n\r\nbody");
+    lru_cache_release(value);
 }
 
 int main() {
@@ -146,6 +472,16 @@ int main() {
         cmocka_unit_test(test_lru_get),
         cmocka_unit_test(test_lru_delete),
         cmocka_unit_test(test_hit),
+        cmocka_unit_test(test_setv),
+        cmocka_unit_test(test_shards),
+        cmocka_unit_test(test_init),
+        cmocka_unit_test(test_lru_order),
+        cmocka_unit_test(test_release),
+        cmocka_unit_test(test_one_bucket),
+        cmocka_unit_test(test_value_fd),
+        cmocka_unit_test(test_item_size),
+        cmocka_unit_test(test_class_lru),
+        cmocka_unit_test(test_churn),
     };
     return cmocka_run_group_tests(tests, setup, teardown);
 }
@@ -3,4 +3,5 @@ BASEDIR=$(dirname $0)
 
 $BASEDIR/../test.sh "$BASEDIR/test_lru.c \
 $BASEDIR/../../src/cache/lru.c \
+$BASEDIR/../../src/cache/slab.c \
 -lpthread"
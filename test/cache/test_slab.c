@@ -0,0 +1,161 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <cache/slab.h>
+
+static int setup(void **state) {
+    lru_slab_t *slab = lru_slab_init();
+
+    if (!slab) {
+        return -1;
+    }
+
+    *state = slab;
+    return 0;
+}
+
+static int teardown(void **state) {
+    lru_slab_close((lru_slab_t *) *state);
+    return 0;
+}
+
+static void test_slab_classes(void **state) {
+    lru_slab_t *slab = (lru_slab_t *) *state;
+    int i;
+
+    assert_true(slab->num_classes > 1);
+    assert_true(slab->classes[0].size == LRU_SLAB_MIN_CHUNK);
+    assert_true(slab->classes[slab->num_classes - 1].size
+        == LRU_SLAB_MAX_CHUNK);
+
+    for (i = 1; i < slab->num_classes; i++) {
+        assert_true(slab->classes[i].size > slab->classes[i - 1].size);
+        assert_true(slab->classes[i].size % 8 == 0);
+        assert_true(lru_slab_chunk_size(slab->classes[i].size)
+            == slab->classes[i].size);
+    }
+
+    assert_int_equal(lru_slab_class(slab, 1), 0);
+    assert_int_equal(lru_slab_class(slab, LRU_SLAB_MIN_CHUNK + 1), 1);
+    assert_int_equal(lru_slab_class(slab, LRU_SLAB_MAX_CHUNK),
+        slab->num_classes - 1);
+    assert_int_equal(lru_slab_class(slab, LRU_SLAB_MAX_CHUNK + 1), -1);
+    assert_true(lru_slab_chunk_size(LRU_SLAB_MAX_CHUNK + 1) == 0);
+}
+
+static void test_slab_reuse(void **state) {
+    lru_slab_t *slab = (lru_slab_t *) *state;
+    size_t per_page = slab->classes[0].per_page, i;
+    char *first, *chunk, *chunks[per_page];
+
+    first = lru_slab_alloc(slab, 0);
+    assert_non_null(first);
+    assert_true((uintptr_t) first % 8 == 0);
+    assert_true(lru_slab_memory(slab) == LRU_SLAB_PAGE_SIZE);
+    memset(first, 'x', LRU_SLAB_MIN_CHUNK);
+
+    // A freed chunk is handed out again.
+    lru_slab_free(slab, first);
+    assert_true(lru_slab_alloc(slab, 0) == first);
+    chunks[0] = first;
+
+    // The page is full, so the next chunk takes another one.
+    for (i = 1; i < per_page; i++) {
+        assert_non_null(chunks[i] = lru_slab_alloc(slab, 0));
+    }
+    assert_true(lru_slab_memory(slab) == LRU_SLAB_PAGE_SIZE);
+    assert_non_null(chunk = lru_slab_alloc(slab, 0));
+    assert_true(lru_slab_memory(slab) == 2 * LRU_SLAB_PAGE_SIZE);
+
+    // The empty page is kept for any class.
+    lru_slab_free(slab, chunk);
+    assert_true(lru_slab_memory(slab) == 2 * LRU_SLAB_PAGE_SIZE);
+    chunk = lru_slab_alloc(slab, slab->num_classes - 1);
+    assert_non_null(chunk);
+    assert_true(lru_slab_memory(slab) == 2 * LRU_SLAB_PAGE_SIZE);
+    lru_slab_free(slab, chunk);
+
+    for (i = 0; i < per_page; i++) {
+        lru_slab_free(slab, chunks[i]);
+    }
+}
+
+static void test_slab_close(void **state) {
+    lru_slab_t *slab = lru_slab_init();
+    char *chunk;
+
+    assert_non_null(slab);
+    chunk = lru_slab_alloc(slab, 0);
+    assert_non_null(chunk);
+
+    // Chunks in use outlive the slab.
+    lru_slab_close(slab);
+    memset(chunk, 'x', LRU_SLAB_MIN_CHUNK);
+    lru_slab_free(slab, chunk);
+}
+
+static void *churn_main(void *data) {
+    lru_slab_t *slab = (lru_slab_t *) data;
+    unsigned int seed = (uintptr_t) &seed;
+    char *chunks[64] = { NULL };
+    int i, j, c;
+
+    for (i = 0; i < 20000; i++) {
+        j = rand_r(&seed) % 64;
+        if (chunks[j]) {
+            lru_slab_free(slab, chunks[j]);
+        }
+
+        c = rand_r(&seed) % slab->num_classes;
+        if ((chunks[j] = lru_slab_alloc(slab, c)) != NULL) {
+            memset(chunks[j], j, slab->classes[c].size);
+        }
+    }
+
+    for (j = 0; j < 64; j++) {
+        if (chunks[j]) {
+            lru_slab_free(slab, chunks[j]);
+        }
+    }
+
+    return NULL;
+}
+
+static void test_slab_threads(void **state) {
+    lru_slab_t *slab = (lru_slab_t *) *state;
+    pthread_t threads[4];
+    int i;
+
+    // Threads allocating from the same and other classes at once.
+    for (i = 0; i < 4; i++) {
+        assert_int_equal(pthread_create(&threads[i], NULL, churn_main, slab),
+            0);
+    }
+
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Every page is empty, so only spares are left.
+    assert_true(lru_slab_memory(slab)
+        <= LRU_SLAB_SPARE_PAGES * LRU_SLAB_PAGE_SIZE);
+    assert_true(slab->num_spare * LRU_SLAB_PAGE_SIZE
+        == lru_slab_memory(slab));
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_slab_classes, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_slab_reuse, setup, teardown),
+        cmocka_unit_test(test_slab_close),
+        cmocka_unit_test_setup_teardown(test_slab_threads, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,434 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <http/http_cache.h>
+
+#define DATE "Mon, 27 Jul 2009 12:28:53 GMT"
+#define NOW 1248697733      // DATE
+
+typedef struct {
+	http_request_t *request;
+	http_response_t *response;
+} state_t;
+
+static int setup(void **state) {
+	state_t *s;
+
+	if ((s = malloc(sizeof(state_t))) == NULL) {
+		return -1;
+	}
+
+	s->request = init_http_request(0);
+	s->response = init_http_response(0);
+	if (!s->request || !s->response) {
+		return -1;
+	}
+
+	s->request->method = HTTP_GET;
+	s->response->status = HTTP_STATUS_OK;
+
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state) {
+	state_t *s = (state_t *) *state;
+
+	free_http_request(s->request);
+	free_http_response(s->response);
+	free(s);
+
+	return 0;
+}
+
+static void set(http_headers_t *headers, const char *field,
+	const char *value) {
+	assert_true(append_header_field(headers, field, strlen(field)));
+	assert_true(append_header_value(headers, value, strlen(value)));
+}
+
+static void test_parse_date(void **state) {
+	assert_true(http_cache_parse_date(DATE) == NOW);
+	assert_true(http_cache_parse_date("Monday, 27-Jul-09 12:28:53 GMT")
+		== NOW);
+	assert_true(http_cache_parse_date("Mon Jul 27 12:28:53 2009") == NOW);
+	assert_true(http_cache_parse_date("0") == -1);
+	assert_true(http_cache_parse_date(DATE " x") == -1);
+}
+
+static void test_storable(void **state) {
+	state_t *s = (state_t *) *state;
+
+	assert_true(http_cache_storable(s->request, s->response));
+
+	s->request->method = HTTP_HEAD;
+	assert_false(http_cache_storable(s->request, s->response));
+	s->request->method = HTTP_GET;
+
+	s->response->status = HTTP_STATUS_PARTIAL_CONTENT;
+	assert_false(http_cache_storable(s->request, s->response));
+	s->response->status = HTTP_STATUS_NOT_FOUND;
+	assert_true(http_cache_storable(s->request, s->response));
+
+	// Commas in a quoted argument do not end the directive, and no-cache
+	// is stored to be revalidated.
+	set(s->response->headers, "Cache-Control", "no-cache=\"a, private\"");
+	assert_true(http_cache_storable(s->request, s->response));
+	reset_http_headers(s->response->headers);
+	set(s->response->headers, "cache-control", "max-age=\"a, private\"");
+	assert_true(http_cache_storable(s->request, s->response));
+
+	set(s->response->headers, "Cache-Control", "public, PRIVATE");
+	assert_false(http_cache_storable(s->request, s->response));
+	reset_http_headers(s->response->headers);
+
+	set(s->response->headers, "Set-Cookie", "a=b");
+	assert_false(http_cache_storable(s->request, s->response));
+	reset_http_headers(s->response->headers);
+
+	set(s->response->headers, "Vary", "Accept, *");
+	assert_false(http_cache_storable(s->request, s->response));
+	reset_http_headers(s->response->headers);
+
+	set(s->request->headers, "Cache-Control", "no-store");
+	assert_false(http_cache_storable(s->request, s->response));
+	reset_http_headers(s->request->headers);
+
+	// Authorized unless public.
+	set(s->request->headers, "Authorization", "Basic eDp5");
+	assert_false(http_cache_storable(s->request, s->response));
+	set(s->response->headers, "Cache-Control", "public");
+	assert_true(http_cache_storable(s->request, s->response));
+}
+
+static void test_lifetime(void **state) {
+	state_t *s = (state_t *) *state;
+	http_headers_t *headers = s->response->headers;
+	http_cache_entry_t entry;
+
+	// Heuristic, a tenth of the time since Last-Modified.
+	set(headers, "Date", DATE);
+	set(headers, "Last-Modified", "Mon, 27 Jul 2009 12:11:13 GMT");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.lifetime, 106);
+	assert_int_equal(entry.initial_age, 0);
+
+	// Expires is relative to Date.
+	set(headers, "Expires", "Mon, 27 Jul 2009 12:29:53 GMT");
+	http_cache_init_entry(&entry, s->response, NOW + 5, NOW + 10);
+	assert_int_equal(entry.lifetime, 60);
+	assert_int_equal(entry.initial_age, 10);
+
+	// max-age, then s-maxage, take precedence.
+	set(headers, "Cache-Control", "public, max-age=30");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.lifetime, 30);
+	set(headers, "Cache-Control", "s-maxage=20");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.lifetime, 20);
+
+	// Age from an upstream cache, plus the time the response took.
+	set(headers, "Age", "7");
+	http_cache_init_entry(&entry, s->response, NOW - 2, NOW);
+	assert_int_equal(entry.initial_age, 9);
+	assert_int_equal(http_cache_age(&entry, NOW + 10), 19);
+
+	reset_http_headers(headers);
+	set(headers, "Date", DATE);
+	set(headers, "Expires", "0");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.lifetime, 0);
+
+	reset_http_headers(headers);
+	set(headers, "Cache-Control", "max-age=30, no-cache");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.lifetime, 0);
+
+	reset_http_headers(headers);
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.lifetime, 0);
+}
+
+static void test_update(void **state) {
+	state_t *s = (state_t *) *state;
+	http_response_t *not_modified = init_http_response(0);
+	http_cache_entry_t entry;
+
+	assert_non_null(not_modified);
+	not_modified->status = HTTP_STATUS_NOT_MODIFIED;
+
+	set(s->response->headers, "Date", DATE);
+	set(s->response->headers, "Age", "50");
+	set(s->response->headers, "Cache-Control", "max-age=60");
+	set(s->response->headers, "ETag", "\"a\"");
+
+	// Freshness of the stored response is kept, its age is not.
+	set(not_modified->headers, "Date", "Mon, 27 Jul 2009 12:38:53 GMT");
+	http_cache_update_entry(&entry, s->response, not_modified, NOW + 600,
+		NOW + 600);
+	assert_int_equal(entry.lifetime, 60);
+	assert_int_equal(entry.initial_age, 0);
+	assert_int_equal(entry.response_time, NOW + 600);
+
+	set(not_modified->headers, "Cache-Control", "max-age=120");
+	http_cache_update_entry(&entry, s->response, not_modified, NOW + 600,
+		NOW + 600);
+	assert_int_equal(entry.lifetime, 120);
+
+	set(not_modified->headers, "Cache-Control", "no-cache");
+	http_cache_update_entry(&entry, s->response, not_modified, NOW + 600,
+		NOW + 600);
+	assert_int_equal(entry.lifetime, 0);
+
+	free_http_response(not_modified);
+}
+
+static void test_conditional(void **state) {
+	state_t *s = (state_t *) *state;
+	http_headers_t *headers = s->request->headers;
+
+	assert_false(http_cache_has_validator(s->response));
+	assert_false(http_cache_make_conditional(s->request, s->response));
+
+	set(s->response->headers, "ETag", "\"a\"");
+	set(s->response->headers, "Last-Modified", DATE);
+	assert_true(http_cache_has_validator(s->response));
+	assert_true(http_cache_make_conditional(s->request, s->response));
+	assert_string_equal(find_header(headers, HTTP_HEADER_IF_NONE_MATCH),
+		"\"a\"");
+	assert_string_equal(find_header(headers, HTTP_HEADER_IF_MODIFIED_SINCE),
+		DATE);
+
+	// A conditional request of client is left as is.
+	reset_http_headers(headers);
+	set(headers, "If-None-Match", "\"b\"");
+	assert_false(http_cache_make_conditional(s->request, s->response));
+	assert_string_equal(find_header(headers, HTTP_HEADER_IF_NONE_MATCH),
+		"\"b\"");
+	assert_null(find_header(headers, HTTP_HEADER_IF_MODIFIED_SINCE));
+}
+
+static void test_fresh(void **state) {
+	state_t *s = (state_t *) *state;
+	http_headers_t *headers = s->request->headers;
+	http_cache_entry_t entry = { NOW, 10, 60, -1, -1, false, false };
+
+	assert_true(http_cache_fresh(&entry, s->request, NOW));
+	assert_true(http_cache_fresh(&entry, s->request, NOW + 49));
+	assert_false(http_cache_fresh(&entry, s->request, NOW + 50));
+
+	set(headers, "Cache-Control", "max-age=20");
+	assert_true(http_cache_fresh(&entry, s->request, NOW + 10));
+	assert_false(http_cache_fresh(&entry, s->request, NOW + 11));
+	reset_http_headers(headers);
+
+	set(headers, "Cache-Control", "min-fresh=30");
+	assert_true(http_cache_fresh(&entry, s->request, NOW + 20));
+	assert_false(http_cache_fresh(&entry, s->request, NOW + 21));
+	reset_http_headers(headers);
+
+	set(headers, "Pragma", "no-cache");
+	assert_false(http_cache_fresh(&entry, s->request, NOW));
+	set(headers, "Cache-Control", "max-age=100");
+	assert_true(http_cache_fresh(&entry, s->request, NOW));
+	set(headers, "Cache-Control", "no-cache");
+	assert_false(http_cache_fresh(&entry, s->request, NOW));
+}
+
+static void test_stale(void **state) {
+	state_t *s = (state_t *) *state;
+	http_headers_t *headers = s->response->headers;
+	http_cache_entry_t entry;
+
+	set(headers, "Date", DATE);
+	set(headers, "Cache-Control",
+		"max-age=60, stale-while-revalidate=30, stale-if-error=300");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.stale_while_revalidate, 30);
+	assert_int_equal(entry.stale_if_error, 300);
+	assert_false(entry.must_revalidate);
+
+	// Directives of the response win over the defaults.
+	assert_true(http_cache_stale_while_revalidate(&entry, s->request,
+		NOW + 89, 0));
+	assert_false(http_cache_stale_while_revalidate(&entry, s->request,
+		NOW + 90, 1000));
+	assert_true(http_cache_stale_if_error(&entry, s->request, NOW + 359, 0));
+	assert_false(http_cache_stale_if_error(&entry, s->request, NOW + 360, 0));
+
+	set(s->request->headers, "Cache-Control", "max-age=1000");
+	assert_false(http_cache_stale_while_revalidate(&entry, s->request,
+		NOW + 61, 0));
+	assert_false(http_cache_stale_if_error(&entry, s->request, NOW + 61, 0));
+	reset_http_headers(s->request->headers);
+
+	reset_http_headers(headers);
+	set(headers, "Cache-Control", "max-age=60");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_int_equal(entry.stale_while_revalidate, -1);
+	assert_false(http_cache_stale_while_revalidate(&entry, s->request,
+		NOW + 61, 0));
+	assert_true(http_cache_stale_while_revalidate(&entry, s->request,
+		NOW + 61, 10));
+	assert_false(http_cache_stale_while_revalidate(&entry, s->request,
+		NOW + 70, 10));
+
+	// A request may ask for stale-if-error itself.
+	set(s->request->headers, "Cache-Control", "stale-if-error=20");
+	assert_true(http_cache_stale_if_error(&entry, s->request, NOW + 79, 0));
+	assert_false(http_cache_stale_if_error(&entry, s->request, NOW + 80, 0));
+	reset_http_headers(s->request->headers);
+
+	reset_http_headers(headers);
+	set(headers, "Cache-Control", "max-age=60, must-revalidate");
+	http_cache_init_entry(&entry, s->response, NOW, NOW);
+	assert_true(entry.must_revalidate);
+	assert_false(http_cache_stale_while_revalidate(&entry, s->request,
+		NOW + 61, 10));
+	assert_false(http_cache_stale_if_error(&entry, s->request, NOW + 61, 10));
+}
+
+static void test_range(void **state) {
+	state_t *s = (state_t *) *state;
+	http_headers_t *headers = s->request->headers;
+	range_t range;
+
+	s->response->content_length = 10;
+	set(s->response->headers, "ETag", "\"a\"");
+	set(s->response->headers, "Last-Modified", DATE);
+
+	assert_int_equal(http_cache_range(s->request, s->response, &range), -1);
+
+	// Ranges adding up to more than the body.
+	set(headers, "Range", "bytes=0-5, -5, 2-");
+	assert_int_equal(http_cache_range(s->request, s->response, &range), -1);
+	reset_http_headers(headers);
+
+	set(headers, "Range", "bytes=2-4, -3, 20-");
+	assert_int_equal(http_cache_range(s->request, s->response, &range), 2);
+	assert_int_equal(range.start[0], 2);
+	assert_int_equal(range.end[0], 4);
+	assert_int_equal(range.start[1], 7);
+	assert_int_equal(range.end[1], 9);
+	reset_http_headers(headers);
+
+	set(headers, "Range", "bytes=10-, -0");
+	assert_int_equal(http_cache_range(s->request, s->response, &range), 0);
+	reset_http_headers(headers);
+
+	// If-Range holds for the stored validators only.
+	set(headers, "Range", "bytes=8-");
+	set(headers, "If-Range", "\"a\"");
+	assert_int_equal(http_cache_range(s->request, s->response, &range), 1);
+	assert_int_equal(range.end[0], 9);
+	reset_http_headers(headers);
+
+	set(headers, "Range", "bytes=8-");
+	set(headers, "If-Range", DATE);
+	assert_int_equal(http_cache_range(s->request, s->response, &range), 1);
+	reset_http_headers(headers);
+
+	set(headers, "Range", "bytes=8-");
+	set(headers, "If-Range", "W/\"a\"");
+	assert_int_equal(http_cache_range(s->request, s->response, &range), -1);
+	reset_http_headers(headers);
+
+	set(headers, "Range", "bytes=8-");
+	set(s->response->headers, "Transfer-Encoding", "chunked");
+	assert_int_equal(http_cache_range(s->request, s->response, &range), -1);
+}
+
+static void test_partial(void **state) {
+	state_t *s = (state_t *) *state;
+	const char *body = "0123456789";
+	range_t range = { BYTES, { 2, 9 }, { 4, 9 }, 2 };
+	char *dst, *part;
+	size_t len;
+
+	s->response->http_major = 1;
+	s->response->http_minor = 1;
+	s->response->content_length = 10;
+	set(s->response->headers, "Content-Type", "text/plain");
+	set(s->response->headers, "Content-Length", "10");
+
+	assert_true(http_cache_make_partial(s->response, body, &range, 1, &dst,
+		&len));
+	assert_string_equal(dst, "HTTP/1.1 206 Partial Content\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Range: bytes 2-4/10\r\n"
+		"Content-Length: 3\r\n\r\n234");
+	assert_int_equal(len, strlen(dst));
+	free(dst);
+
+	assert_true(http_cache_make_partial(s->response, body, &range, 0, &dst,
+		&len));
+	assert_string_equal(dst, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+		"Content-Range: bytes */10\r\n"
+		"Content-Length: 0\r\n\r\n");
+	free(dst);
+
+	// Each part has its own Content-Type and Content-Range.
+	assert_true(http_cache_make_partial(s->response, body, &range, 2, &dst,
+		&len));
+	assert_int_equal(len, strlen(dst));
+	assert_non_null(strstr(dst, "Content-Type: multipart/byteranges; "
+		"boundary="));
+	assert_non_null(part = strstr(dst, "\r\nContent-Type: text/plain\r\n"
+		"Content-Range: bytes 2-4/10\r\n\r\n234\r\n--"));
+	assert_non_null(strstr(part, "\r\nContent-Type: text/plain\r\n"
+		"Content-Range: bytes 9-9/10\r\n\r\n9\r\n--"));
+	assert_string_equal(dst + len - 4, "--\r\n");
+
+	// Content-Length counts the parts and the closing boundary.
+	part = strstr(dst, "\r\n\r\n") + 4;
+	assert_int_equal(strtol(strstr(dst, "Content-Length: ") + 16, NULL, 10),
+		len - (part - dst));
+	free(dst);
+}
+
+static void test_vary(void **state) {
+	state_t *s = (state_t *) *state;
+	char vary[HTTP_CACHE_VARY_LEN], *key;
+	size_t key_len;
+	int vary_len;
+
+	assert_int_equal(http_cache_vary(s->response, vary, sizeof(vary)), 0);
+
+	set(s->response->headers, "Vary", "Accept-Encoding,  User-Agent");
+	set(s->response->headers, "vary", "ACCEPT-LANGUAGE");
+	vary_len = http_cache_vary(s->response, vary, sizeof(vary));
+	assert_string_equal(vary, "accept-encoding,user-agent,accept-language");
+	assert_int_equal(vary_len, strlen(vary));
+	assert_int_equal(http_cache_vary(s->response, vary, 16), -1);
+
+	set(s->request->headers, "Accept-Language", "en");
+	set(s->request->headers, "accept-encoding", "gzip");
+	key = http_cache_variant_key("a:80/", 6, vary, vary_len, s->request,
+		&key_len);
+	assert_non_null(key);
+	assert_string_equal(key, "a:80/\naccept-encoding:gzip\nuser-agent:"
+		"\naccept-language:en");
+	assert_int_equal(key_len, strlen(key) + 1);
+	free(key);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_parse_date),
+		cmocka_unit_test_setup_teardown(test_storable, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_lifetime, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_fresh, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_update, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_conditional, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_stale, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_range, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_partial, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_vary, setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
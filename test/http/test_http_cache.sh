@@ -0,0 +1,9 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+$BASEDIR/../test.sh "$BASEDIR/test_http_cache.c \
+$BASEDIR/../../src/http/http_cache.c \
+$BASEDIR/../../src/http/http_common.c \
+$BASEDIR/../../src/http/http_request.c \
+$BASEDIR/../../src/http/http_response.c \
+$BASEDIR/../../src/http/http_parser.c"
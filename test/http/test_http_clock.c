@@ -0,0 +1,51 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <http/http_clock.h>
+
+static void assert_date(time_t now, const char *date) {
+	char expected[HTTP_DATE_LEN];
+	struct tm tm;
+
+	strftime(expected, sizeof(expected), "%a, %d %b %Y %H:%M:%S GMT",
+		gmtime_r(&now, &tm));
+	assert_string_equal(date, expected);
+}
+
+static void test_http_clock(void **state) {
+	time_t now;
+
+	// Refreshed by readers when not started.
+	now = http_clock_now();
+	assert_true(now >= time(NULL) - 1 && now <= time(NULL) + 1);
+	assert_date(now, http_clock_date());
+	assert_int_equal(strlen(http_clock_date()), 29);
+}
+
+static void test_http_clock_thread(void **state) {
+	time_t before;
+
+	assert_true(http_clock_start());
+	before = http_clock_now();
+	assert_date(before, http_clock_date());
+
+	usleep(1100 * 1000);
+	assert_true(http_clock_now() > before);
+	assert_true(http_clock_now() >= time(NULL) - 1);
+	assert_date(http_clock_now(), http_clock_date());
+
+	http_clock_stop();
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_http_clock),
+		cmocka_unit_test(test_http_clock_thread),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
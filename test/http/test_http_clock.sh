@@ -0,0 +1,6 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+$BASEDIR/../test.sh "$BASEDIR/test_http_clock.c \
+$BASEDIR/../../src/http/http_clock.c \
+-lpthread"
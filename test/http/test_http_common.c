@@ -4,7 +4,9 @@
 #include <cmocka.h>
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <http/http_common.h>
 
 static int setup(void **state) {
@@ -58,8 +60,180 @@ static void test_find_value(void **state) {
     assert_null(value);
 }
 
-static int test_get_range(void **state) {
-    // TODO: Test get_range() function
+static void test_append_header(void **state) {
+    http_headers_t *headers = (http_headers_t *) *state;
+    char long_value[HTTP_ARENA_BLOCK_SIZE * 2];
+    char field[16];
+    int i;
+
+    // Fragments continue the current field or value.
+    assert_true(append_header_field(headers, "Con", 3));
+    assert_true(append_header_field(headers, "nection", 7));
+    assert_true(append_header_value(headers, "keep", 4));
+    assert_true(append_header_value(headers, "-alive", 6));
+    assert_true(append_header_field(headers, "Host", 4));
+    assert_true(append_header_value(headers, "a.test", 6));
+    assert_int_equal(headers->num_headers, 2);
+    assert_string_equal(find_header_value(headers, "Connection"),
+        "keep-alive");
+    assert_string_equal(find_header_value(headers, "Host"), "a.test");
+
+    // Values larger than a block, and more blocks than one.
+    memset(long_value, 'x', sizeof(long_value));
+    assert_true(append_header_field(headers, "Cookie", 6));
+    assert_true(append_header_value(headers, long_value, 100));
+    assert_true(append_header_value(headers, long_value,
+        sizeof(long_value) - 101));
+    assert_int_equal(strlen(find_header_value(headers, "Cookie")),
+        sizeof(long_value) - 1);
+
+    for (i = 0; i < 40; i++) {
+        snprintf(field, sizeof(field), "X-%d", i);
+        assert_true(append_header_field(headers, field, strlen(field)));
+        assert_true(append_header_value(headers, long_value, 200));
+    }
+    assert_int_equal(headers->num_headers, 43);
+    assert_string_equal(find_header_value(headers, "Host"), "a.test");
+
+    // Limit of headers.
+    for (i = 43; i < DEFAULT_MAX_HEADERS; i++) {
+        assert_true(append_header_field(headers, "a", 1));
+        assert_true(append_header_value(headers, "b", 1));
+    }
+    assert_false(append_header_field(headers, "a", 1));
+
+    reset_http_headers(headers);
+    assert_int_equal(headers->num_headers, 0);
+    assert_null(find_header_value(headers, "Host"));
+    assert_true(append_header_field(headers, "Host", 4));
+    assert_true(append_header_value(headers, "b.test", 6));
+    assert_string_equal(find_header_value(headers, "Host"), "b.test");
+}
+
+static void test_borrow_header(void **state) {
+    http_headers_t *headers = (http_headers_t *) *state;
+    char buf[] = "Host: a.testConnection: keep-alive";
+    char *dst;
+
+    // Fragments in buf are referenced, and contiguous ones grow in place.
+    borrow_http_headers(headers, buf, sizeof(buf) - 1);
+    assert_true(append_header_field(headers, buf, 4));
+    assert_true(append_header_value(headers, buf + 6, 6));
+    assert_true(append_header_field(headers, buf + 12, 5));
+    assert_true(append_header_field(headers, buf + 17, 5));
+    assert_true(headers->field[0] == buf);
+    assert_true(headers->field[1] == buf + 12);
+    assert_int_equal(headers->field_len[1], 10);
+    assert_int_equal(headers->arena.head->used, 0);
+
+    // The value spans reads, so it is copied with its first fragment.
+    assert_true(retain_http_headers(headers));
+    memset(buf, '-', sizeof(buf) - 1);
+    assert_true(append_header_value(headers, "keep", 4));
+    assert_true(append_header_value(headers, "-alive", 6));
+    assert_string_equal(find_header_value(headers, "Connection"),
+        "keep-alive");
+    assert_string_equal(find_header_value(headers, "Host"), "a.test");
+
+    // Lookup terminates a borrowed value by copying it.
+    reset_http_headers(headers);
+    strcpy(buf, "Host: b.test");
+    borrow_http_headers(headers, buf, strlen(buf));
+    assert_true(append_header_field(headers, buf, 4));
+    assert_true(append_header_value(headers, buf + 6, 6));
+    assert_int_equal(get_headers_length(headers), 16);
+    dst = malloc(get_headers_length(headers));
+    assert_int_equal(write_headers(headers, dst), 16);
+    assert_memory_equal(dst, "Host: b.test\r\n\r\n", 16);
+    free(dst);
+    assert_string_equal(find_header_value(headers, "Host"), "b.test");
+    assert_true(headers->value[0] != buf + 6);
+}
+
+static void test_header_index(void **state) {
+    http_headers_t *headers = (http_headers_t *) *state;
+
+    assert_int_equal(get_header_id("cache-control", 13),
+        HTTP_HEADER_CACHE_CONTROL);
+    assert_int_equal(get_header_id("Cache-Contro", 12), HTTP_HEADER_OTHER);
+    assert_int_equal(get_header_id("TE", 2), HTTP_HEADER_TE);
+    assert_int_equal(get_header_id("IF-RANGE", 8), HTTP_HEADER_IF_RANGE);
+    assert_int_equal(get_header_id("proxy-authorization", 19),
+        HTTP_HEADER_PROXY_AUTHORIZATION);
+    assert_int_equal(get_header_id("X-Range", 7), HTTP_HEADER_OTHER);
+
+    // Lookup ignores case, and the first of duplicates is found.
+    assert_true(append_header_field(headers, "host", 4));
+    assert_true(append_header_value(headers, "a.test", 6));
+    assert_true(append_header_field(headers, "X-Trace", 7));
+    assert_true(append_header_value(headers, "1", 1));
+    assert_true(append_header_field(headers, "HOST", 4));
+    assert_true(append_header_value(headers, "b.test", 6));
+    assert_string_equal(find_header(headers, HTTP_HEADER_HOST), "a.test");
+    assert_string_equal(find_header_value(headers, "Host"), "a.test");
+    assert_string_equal(find_header_value(headers, "x-trace"), "1");
+    assert_null(find_header(headers, HTTP_HEADER_CONNECTION));
+
+    // A field spanning reads is indexed by its whole name.
+    assert_true(append_header_field(headers, "Conn", 4));
+    assert_true(append_header_field(headers, "ection", 6));
+    assert_true(append_header_value(headers, "close", 5));
+    assert_string_equal(find_header(headers, HTTP_HEADER_CONNECTION),
+        "close");
+
+    // set_header replaces regardless of case.
+    assert_true(set_header(headers, "connection", "keep-alive"));
+    assert_int_equal(headers->num_headers, 4);
+    assert_string_equal(find_header(headers, HTTP_HEADER_CONNECTION),
+        "keep-alive");
+    assert_true(set_header(headers, "Vary", "Accept"));
+    assert_string_equal(find_header(headers, HTTP_HEADER_VARY), "Accept");
+
+    reset_http_headers(headers);
+    assert_null(find_header(headers, HTTP_HEADER_HOST));
+}
+
+static void test_get_range(void **state) {
+    char many[MAX_RANGE * 4 + 16];
+    range_t range;
+    int i;
+
+    assert_int_equal(get_range("bytes=0-499", &range), 0);
+    assert_int_equal(range.unit, BYTES);
+    assert_int_equal(range.num_range, 1);
+    assert_int_equal(range.start[0], 0);
+    assert_int_equal(range.end[0], 499);
+
+    // Open and suffix ranges, with empty elements and spaces.
+    assert_int_equal(get_range("bytes=500-, ,-200 ,1-1", &range), 0);
+    assert_int_equal(range.num_range, 3);
+    assert_int_equal(range.start[0], 500);
+    assert_int_equal(range.end[0], -1);
+    assert_int_equal(range.start[1], -1);
+    assert_int_equal(range.end[1], 200);
+    assert_int_equal(range.start[2], 1);
+    assert_int_equal(range.end[2], 1);
+
+    assert_int_equal(get_range("bytes=99999999999999999999-", &range), 0);
+    assert_int_equal(range.start[0], INT_MAX);
+
+    assert_int_equal(get_range("items=0-1", &range), 0);
+    assert_int_equal(range.unit, UNIT_NONE);
+    assert_int_equal(range.num_range, 0);
+
+    assert_int_equal(get_range("bytes=5-1", &range), -1);
+    assert_int_equal(get_range("bytes=-", &range), -1);
+    assert_int_equal(get_range("bytes=1", &range), -1);
+    assert_int_equal(get_range("bytes=1-2x", &range), -1);
+    assert_int_equal(get_range("bytes=", &range), -1);
+    assert_int_equal(get_range("0-1", &range), -1);
+
+    // More ranges than fit.
+    strcpy(many, "bytes=");
+    for (i = 0; i <= MAX_RANGE; i++) {
+        strcat(many, "1-2,");
+    }
+    assert_int_equal(get_range(many, &range), -1);
 }
 
 int main() {
@@ -68,6 +242,10 @@ int main() {
         cmocka_unit_test_setup_teardown(test_set_header_duplicated,
             setup, teardown),
         cmocka_unit_test_setup_teardown(test_find_value, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_append_header, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_borrow_header, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_header_index, setup, teardown),
+        cmocka_unit_test(test_get_range),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -5,8 +5,13 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <http/http_log.h>
 
+#define ASYNC_LOG_FILE "/tmp/test_http_log.log"
+#define THREAD_RECORDS 100     // Fit in a ring.
+
 typedef struct {
 	http_request_t *request;
 	http_response_t *response;
@@ -63,9 +68,74 @@ static void test_http_log(void **state) {
 	log_http_request(req, res);
 }
 
+static size_t count_lines(const char *path) {
+	FILE *fp = fopen(path, "r");
+	size_t n = 0;
+	int c;
+
+	if (!fp) {
+		return 0;
+	}
+
+	while ((c = fgetc(fp)) != EOF) {
+		n += c == '\n';
+	}
+
+	fclose(fp);
+	return n;
+}
+
+static void *log_thread_main(void *data) {
+	state_t *s = (state_t *) data;
+	int i;
+
+	for (i = 0; i < THREAD_RECORDS; i++) {
+		log_http_request(s->request, s->response);
+	}
+
+	return NULL;
+}
+
+static void test_http_log_async(void **state) {
+	state_t *s = (state_t *) *state;
+	pthread_t threads[4];
+	int i;
+
+	unlink(ASYNC_LOG_FILE);
+	assert_true(http_log_set_file(ASYNC_LOG_FILE));
+
+	// Records of every thread are written by the log thread.
+	assert_true(http_log_start(10));
+	for (i = 0; i < 4; i++) {
+		assert_int_equal(pthread_create(&threads[i], NULL, log_thread_main,
+			s), 0);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	usleep(100 * 1000);
+	http_log_stop();
+	assert_int_equal(http_log_dropped(), 0);
+	assert_int_equal(count_lines(ASYNC_LOG_FILE), 4 * THREAD_RECORDS);
+
+	// A full ring drops instead of waiting for the log thread, and every
+	// record is either written or counted.
+	assert_true(http_log_start(60 * 1000));
+	for (i = 0; i < 10 * HTTP_LOG_RING_SIZE; i++) {
+		log_http_request(s->request, s->response);
+	}
+	http_log_stop();
+	assert_int_equal(count_lines(ASYNC_LOG_FILE) + http_log_dropped(),
+		4 * THREAD_RECORDS + 10 * HTTP_LOG_RING_SIZE);
+
+	assert_true(http_log_set_file(NULL));
+	unlink(ASYNC_LOG_FILE);
+}
+
 int main() {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_http_log),
+        cmocka_unit_test(test_http_log_async),
     };
     return cmocka_run_group_tests(tests, setup, teardown);
 }
@@ -275,11 +275,49 @@ static void test_parse_url(void **state) {
 	assert_string_equal(request->schema, "http");
 }
 
+static void test_request_iov(void **state) {
+	state_t *s = (state_t *) *state;
+	http_parser *parser = s->parser;
+	http_parser_settings *settings = s->settings;
+	http_request_t *request = s->request;
+	struct iovec iov[REQUEST_IOV_LEN(DEFAULT_MAX_HEADERS)];
+	char line[REQUEST_LINE_LEN], buf[1024], *str;
+	size_t len = 0, str_len;
+	int i, iovcnt;
+
+	parser->data = request;
+	http_parser_init(parser, HTTP_REQUEST);
+	borrow_http_headers(request->headers, messages[0], strlen(messages[0]));
+	assert_int_equal(http_parser_execute(parser, settings, messages[0],
+		strlen(messages[0])), strlen(messages[0]));
+
+	// Line, 4 per header, empty line and content.
+	iovcnt = make_request_iov(request, line, iov,
+		sizeof(iov) / sizeof(iov[0]));
+	assert_int_equal(iovcnt, 1 + 4 * 6 + 1 + 1);
+	assert_true(iov[1].iov_base == messages[0] + 16);
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	assert_int_equal(len, strlen(messages[0]));
+	assert_memory_equal(buf, messages[0], len);
+
+	assert_true(make_request_string(request, &str, &str_len));
+	assert_int_equal(str_len, len);
+	assert_memory_equal(str, buf, len);
+	free(str);
+
+	assert_int_equal(make_request_iov(request, line, iov, 4 * 6 + 1), -1);
+}
+
 int main() {
 	const struct CMUnitTest tests[] = {
         cmocka_unit_test_setup_teardown(test_http_request, setup, teardown),
         cmocka_unit_test_setup_teardown(test_failed_http_request, setup, teardown),
         cmocka_unit_test_setup_teardown(test_parse_url, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_request_iov, setup, teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
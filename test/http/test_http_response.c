@@ -46,6 +46,7 @@ static int setup(void **state) {
 	http_parser_settings_init(settings);
 	settings->on_header_field = response_on_header_field_cb;
 	settings->on_header_value = response_on_header_value_cb;
+	settings->on_headers_complete = response_on_headers_complete_cb;
 	settings->on_body = response_on_body_cb;
 	settings->on_message_complete = response_on_message_complete_cb;
 
@@ -122,9 +123,74 @@ static void test_response_parse(void **state) {
 		"</html>";
 }
 
+static void test_response_headers_completed(void **state) {
+	state_t *s = (state_t *) *state;
+	http_parser *parser = s->parser;
+	http_parser_settings *settings = s->settings;
+	http_response_t *response = s->response;
+
+	size_t recved, nparsed, head;
+	recved = strlen(s->buf);
+	head = strstr(s->buf, "\r\n\r\n") + 4 - s->buf;
+
+	reset_http_response(response);
+	http_parser_init(parser, HTTP_RESPONSE);
+	parser->data = response;
+
+	// Status is known as soon as the headers are.
+	nparsed = http_parser_execute(parser, settings, s->buf, head);
+	assert_true(nparsed == head);
+	assert_true(response->on_headers_completed);
+	assert_false(response->on_message_completed);
+	assert_true(response->status == HTTP_STATUS_OK);
+
+	nparsed += http_parser_execute(parser, settings, s->buf + head,
+		recved - head);
+	assert_true(nparsed == recved);
+	assert_true(response->on_message_completed);
+}
+
+static void test_response_head(void **state) {
+	state_t *s = (state_t *) *state;
+	http_parser *parser = s->parser;
+	http_parser_settings *settings = s->settings;
+	http_response_t *response = s->response;
+	char *not_modified = "HTTP/1.1 304 Not Modified\r\n"
+		"Content-Length: 56\r\n"
+		"\r\n";
+
+	size_t nparsed, head;
+	head = strstr(s->buf, "\r\n\r\n") + 4 - s->buf;
+
+	// The answer to HEAD ends with its headers, despite Content-Length.
+	reset_http_response(response);
+	http_parser_init(parser, HTTP_RESPONSE);
+	parser->data = response;
+	response->request_method = HTTP_HEAD;
+
+	nparsed = http_parser_execute(parser, settings, s->buf, head);
+	assert_true(nparsed == head);
+	assert_true(response->on_message_completed);
+	assert_true(response->content_length == 0);
+
+	// So does a 304 to GET.
+	reset_http_response(response);
+	http_parser_init(parser, HTTP_RESPONSE);
+	parser->data = response;
+	response->request_method = HTTP_GET;
+
+	nparsed = http_parser_execute(parser, settings, not_modified,
+		strlen(not_modified));
+	assert_true(nparsed == strlen(not_modified));
+	assert_true(response->on_message_completed);
+	assert_true(response->status == HTTP_STATUS_NOT_MODIFIED);
+}
+
 int main() {
 	const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_response_parse),
+        cmocka_unit_test(test_response_headers_completed),
+        cmocka_unit_test(test_response_head),
     };
     return cmocka_run_group_tests(tests, setup, teardown);
 }
@@ -0,0 +1,114 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <reactor/reactor.h>
+
+typedef struct {
+	reactor_t *reactor;
+	int fds[2];
+	int called;
+	int ticks;
+	char buf[16];
+} state_t;
+
+static int setup(void **state) {
+	state_t *s;
+
+	if ((s = malloc(sizeof(state_t))) == NULL) {
+		return -1;
+	}
+	memset(s, 0, sizeof(state_t));
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, s->fds) == -1) {
+		free(s);
+		return -1;
+	}
+
+	if ((s->reactor = reactor_init(0)) == NULL) {
+		close(s->fds[0]);
+		close(s->fds[1]);
+		free(s);
+		return -1;
+	}
+
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state) {
+	state_t *s = (state_t *) *state;
+	reactor_free(s->reactor);
+	close(s->fds[0]);
+	close(s->fds[1]);
+	free(s);
+	return 0;
+}
+
+static void on_readable(reactor_t *reactor, int fd, uint32_t events,
+	void *data) {
+	state_t *s = (state_t *) data;
+
+	assert_true(events & EPOLLIN);
+	assert_true(read(fd, s->buf, sizeof(s->buf)) > 0);
+	s->called++;
+	reactor_stop(reactor);
+}
+
+static void on_tick(reactor_t *reactor, void *data) {
+	state_t *s = (state_t *) data;
+
+	if (++s->ticks == 3) {
+		reactor_stop(reactor);
+	}
+}
+
+static void test_reactor_add(void **state) {
+	state_t *s = (state_t *) *state;
+
+	assert_true(reactor_add(s->reactor, s->fds[0], EPOLLIN | EPOLLET,
+		on_readable, s));
+	assert_true(write(s->fds[1], "ping", 5) == 5);
+
+	assert_int_equal(reactor_run(s->reactor), 0);
+	assert_int_equal(s->called, 1);
+	assert_string_equal(s->buf, "ping");
+}
+
+static void test_reactor_del(void **state) {
+	state_t *s = (state_t *) *state;
+
+	assert_true(reactor_add(s->reactor, s->fds[0], EPOLLIN, on_readable, s));
+	assert_true(reactor_del(s->reactor, s->fds[0]));
+	assert_false(reactor_del(s->reactor, s->fds[0]));
+	assert_true(write(s->fds[1], "ping", 5) == 5);
+
+	// Only the tick can stop the loop now.
+	reactor_set_tick(s->reactor, 1, on_tick, s);
+	assert_int_equal(reactor_run(s->reactor), 0);
+	assert_int_equal(s->called, 0);
+}
+
+static void test_reactor_tick(void **state) {
+	state_t *s = (state_t *) *state;
+
+	reactor_set_tick(s->reactor, 1, on_tick, s);
+	assert_int_equal(reactor_run(s->reactor), 0);
+	assert_int_equal(s->ticks, 3);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_reactor_add, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_reactor_del, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_reactor_tick, setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
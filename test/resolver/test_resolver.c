@@ -0,0 +1,326 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <resolver/resolver.h>
+
+/**
+ * Stub DNS server on 127.0.0.1, answering
+ *   a.test     A 10.0.0.1, 10.0.0.2 with TTL 1
+ *   slow.test  A 10.0.0.3 with TTL 60, after 200ms
+ *   nx.test    NXDOMAIN
+ *   fail.test  SERVFAIL
+ * and dropping anything else.
+ */
+typedef struct {
+	int sockfd;
+	int port;
+	int queries;
+	int ports[2];		// Source ports of the first queries.
+	bool stop;
+	pthread_t thread;
+} stub_t;
+
+typedef struct {
+	stub_t stub;
+	resolver_t *resolver;
+	int called;
+	resolver_result_t result;
+} state_t;
+
+static size_t put_a(unsigned char *buf, size_t len, const char *addr,
+	unsigned int ttl) {
+	unsigned char *p = buf + len;
+
+	*p++ = 0xc0;		// Name of the question.
+	*p++ = 12;
+	*p++ = 0; *p++ = 1;	// A
+	*p++ = 0; *p++ = 1;	// IN
+	*p++ = ttl >> 24; *p++ = ttl >> 16; *p++ = ttl >> 8; *p++ = ttl;
+	*p++ = 0; *p++ = 4;
+	inet_pton(AF_INET, addr, p);
+
+	buf[7]++;		// ANCOUNT
+	return len + 16;
+}
+
+static void *stub_main(void *data) {
+	stub_t *stub = (stub_t *) data;
+	struct pollfd pfd = { stub->sockfd, POLLIN, 0 };
+	struct sockaddr_in from;
+	socklen_t from_len;
+	unsigned char buf[512];
+	char name[256];
+	ssize_t len;
+	size_t i, off;
+
+	while (!__atomic_load_n(&stub->stop, __ATOMIC_SEQ_CST)) {
+		if (poll(&pfd, 1, 20) <= 0) {
+			continue;
+		}
+
+		from_len = sizeof(from);
+		if ((len = recvfrom(stub->sockfd, buf, sizeof(buf), 0,
+				(struct sockaddr *) &from, &from_len)) < 12) {
+			continue;
+		}
+		if ((i = __atomic_fetch_add(&stub->queries, 1,
+				__ATOMIC_SEQ_CST)) < 2) {
+			__atomic_store_n(&stub->ports[i], ntohs(from.sin_port),
+				__ATOMIC_SEQ_CST);
+		}
+
+		for (off = 12, i = 0; buf[off] != 0; off += buf[off] + 1) {
+			if (i) name[i++] = '.';
+			memcpy(name + i, buf + off + 1, buf[off]);
+			i += buf[off];
+		}
+		name[i] = '\0';
+		len = off + 5;		// End of question.
+
+		buf[2] |= 0x80;		// QR
+		if (strcmp(name, "a.test") == 0) {
+			len = put_a(buf, len, "10.0.0.1", 1);
+			len = put_a(buf, len, "10.0.0.2", 1);
+		} else if (strcmp(name, "slow.test") == 0) {
+			usleep(200 * 1000);
+			len = put_a(buf, len, "10.0.0.3", 60);
+		} else if (strcmp(name, "nx.test") == 0) {
+			buf[3] = 3;
+		} else if (strcmp(name, "fail.test") == 0) {
+			buf[3] = 2;
+		} else {
+			continue;
+		}
+
+		sendto(stub->sockfd, buf, len, 0, (struct sockaddr *) &from,
+			from_len);
+	}
+
+	return NULL;
+}
+
+static int setup(void **state) {
+	state_t *s;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if ((s = malloc(sizeof(state_t))) == NULL) {
+		return -1;
+	}
+	memset(s, 0, sizeof(state_t));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((s->stub.sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1
+		|| bind(s->stub.sockfd, (struct sockaddr *) &addr,
+			sizeof(addr)) == -1
+		|| getsockname(s->stub.sockfd, (struct sockaddr *) &addr,
+			&addr_len) == -1
+		|| pthread_create(&s->stub.thread, NULL, stub_main, &s->stub)) {
+		free(s);
+		return -1;
+	}
+	s->stub.port = ntohs(addr.sin_port);
+
+	if ((s->resolver = resolver_init("127.0.0.1", s->stub.port, 100))
+		== NULL) {
+		return -1;
+	}
+
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state) {
+	state_t *s = (state_t *) *state;
+
+	resolver_free(s->resolver);
+	__atomic_store_n(&s->stub.stop, true, __ATOMIC_SEQ_CST);
+	pthread_join(s->stub.thread, NULL);
+	close(s->stub.sockfd);
+	free(s);
+	return 0;
+}
+
+static int queries(state_t *s) {
+	return __atomic_load_n(&s->stub.queries, __ATOMIC_SEQ_CST);
+}
+
+static void on_resolved(const resolver_result_t *result, void *data) {
+	state_t *s = (state_t *) data;
+
+	s->result = *result;
+	__atomic_add_fetch(&s->called, 1, __ATOMIC_SEQ_CST);
+}
+
+static void wait_called(state_t *s, int n) {
+	int i;
+
+	for (i = 0; i < 200 && __atomic_load_n(&s->called, __ATOMIC_SEQ_CST) < n;
+		i++) {
+		usleep(10 * 1000);
+	}
+}
+
+static void test_resolver_numeric(void **state) {
+	state_t *s = (state_t *) *state;
+	resolver_result_t result;
+
+	assert_int_equal(resolver_lookup(s->resolver, "192.168.0.1", &result,
+		on_resolved, s), 1);
+	assert_int_equal(result.status, RESOLVER_OK);
+	assert_int_equal(result.num_addrs, 1);
+	assert_int_equal(ntohl(result.addrs[0].s_addr), 0xc0a80001);
+	assert_int_equal(queries(s), 0);
+
+	assert_int_equal(resolver_lookup(s->resolver, "", &result,
+		on_resolved, s), -1);
+	assert_int_equal(resolver_lookup(s->resolver, "a..test", &result,
+		on_resolved, s), -1);
+}
+
+static void test_resolver_cache(void **state) {
+	state_t *s = (state_t *) *state;
+	resolver_result_t result;
+	resolver_stats_t stats;
+
+	assert_true(resolver_resolve(s->resolver, "a.test", &result));
+	assert_int_equal(result.num_addrs, 2);
+	assert_int_equal(ntohl(result.addrs[0].s_addr), 0x0a000001);
+	assert_int_equal(ntohl(result.addrs[1].s_addr), 0x0a000002);
+	assert_int_equal(queries(s), 1);
+
+	// Cached, and names are case-insensitive.
+	assert_int_equal(resolver_lookup(s->resolver, "A.Test.", &result,
+		on_resolved, s), 1);
+	assert_int_equal(result.num_addrs, 2);
+	assert_int_equal(queries(s), 1);
+
+	// TTL is 1 sec.
+	usleep(1100 * 1000);
+	assert_true(resolver_resolve(s->resolver, "a.test", &result));
+	assert_int_equal(queries(s), 2);
+
+	resolver_stats(s->resolver, &stats);
+	assert_int_equal(stats.hits, 1);
+	assert_int_equal(stats.misses, 2);
+}
+
+static void test_resolver_negative(void **state) {
+	state_t *s = (state_t *) *state;
+	resolver_result_t result;
+	resolver_stats_t stats;
+
+	assert_false(resolver_resolve(s->resolver, "nx.test", &result));
+	assert_int_equal(result.status, RESOLVER_NOT_FOUND);
+	assert_false(resolver_resolve(s->resolver, "nx.test", &result));
+	assert_int_equal(result.status, RESOLVER_NOT_FOUND);
+	assert_int_equal(queries(s), 1);
+
+	// Server failure is not cached.
+	assert_false(resolver_resolve(s->resolver, "fail.test", &result));
+	assert_int_equal(result.status, RESOLVER_FAILED);
+	assert_false(resolver_resolve(s->resolver, "fail.test", &result));
+	assert_int_equal(queries(s), 3);
+
+	resolver_stats(s->resolver, &stats);
+	assert_int_equal(stats.negative_hits, 1);
+	assert_int_equal(stats.failures, 2);
+}
+
+static void test_resolver_coalesce(void **state) {
+	state_t *s = (state_t *) *state;
+	resolver_result_t result;
+	resolver_stats_t stats;
+
+	assert_int_equal(resolver_lookup(s->resolver, "slow.test", &result,
+		on_resolved, s), 0);
+	assert_int_equal(resolver_lookup(s->resolver, "slow.test", &result,
+		on_resolved, s), 0);
+
+	wait_called(s, 2);
+	assert_int_equal(s->called, 2);
+	assert_int_equal(s->result.status, RESOLVER_OK);
+	assert_int_equal(ntohl(s->result.addrs[0].s_addr), 0x0a000003);
+
+	resolver_stats(s->resolver, &stats);
+	assert_int_equal(stats.misses, 1);
+	assert_int_equal(stats.coalesced, 1);
+}
+
+static void test_resolver_timeout(void **state) {
+	state_t *s = (state_t *) *state;
+	resolver_result_t result;
+
+	assert_false(resolver_resolve(s->resolver, "drop.test", &result));
+	assert_int_equal(result.status, RESOLVER_FAILED);
+	assert_int_equal(queries(s), RESOLVER_RETRIES);
+}
+
+static void test_resolver_cancel(void **state) {
+	state_t *s = (state_t *) *state;
+	resolver_result_t result;
+
+	assert_int_equal(resolver_lookup(s->resolver, "slow.test", &result,
+		on_resolved, s), 0);
+	resolver_cancel(s->resolver, on_resolved, s);
+
+	// The answer is still cached.
+	usleep(400 * 1000);
+	assert_int_equal(s->called, 0);
+	assert_int_equal(resolver_lookup(s->resolver, "slow.test", &result,
+		on_resolved, s), 1);
+}
+
+static void test_resolver_ports(void **state) {
+	state_t *s = (state_t *) *state;
+	resolver_result_t result;
+	int i;
+
+	// Queries in flight do not share a socket.
+	assert_int_equal(resolver_lookup(s->resolver, "drop.test", &result,
+		on_resolved, s), 0);
+	assert_int_equal(resolver_lookup(s->resolver, "drop2.test", &result,
+		on_resolved, s), 0);
+
+	for (i = 0; i < 50 && queries(s) < 2; i++) {
+		usleep(10 * 1000);
+	}
+	assert_true(queries(s) >= 2);
+	assert_int_not_equal(s->stub.ports[0], 0);
+	assert_int_not_equal(s->stub.ports[0], s->stub.ports[1]);
+
+	resolver_cancel(s->resolver, on_resolved, s);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_resolver_numeric,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_resolver_cache,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_resolver_negative,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_resolver_coalesce,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_resolver_timeout,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_resolver_cancel,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_resolver_ports,
+			setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,5 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+$BASEDIR/../test.sh "$BASEDIR/test_resolver.c \
+$BASEDIR/../../src/resolver/resolver.c"
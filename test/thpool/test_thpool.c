@@ -0,0 +1,107 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <thpool/thpool.h>
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started;
+	int done;
+	int release;
+} state_t;
+
+static int setup(void **state) {
+	state_t *s;
+
+	if ((s = malloc(sizeof(state_t))) == NULL) {
+		return -1;
+	}
+	memset(s, 0, sizeof(state_t));
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state) {
+	state_t *s = (state_t *) *state;
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+	return 0;
+}
+
+// Block until released by the test.
+static void blocking_job(void *data) {
+	state_t *s = (state_t *) data;
+
+	pthread_mutex_lock(&s->lock);
+	s->started++;
+	pthread_cond_broadcast(&s->cond);
+	while (!s->release) {
+		pthread_cond_wait(&s->cond, &s->lock);
+	}
+	s->done++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void test_thpool_add_work(void **state) {
+	state_t *s = (state_t *) *state;
+	threadpool thpool = thpool_init(2);
+	int i;
+
+	assert_non_null(thpool);
+
+	s->release = 1;
+	for (i = 0; i < 100; i++) {
+		assert_int_equal(thpool_add_work(thpool, blocking_job, s), 0);
+	}
+
+	thpool_wait(thpool);
+	assert_int_equal(s->done, 100);
+	thpool_destroy(thpool);
+}
+
+static void test_thpool_bounded(void **state) {
+	state_t *s = (state_t *) *state;
+	threadpool thpool = thpool_init_bounded(1, 2);
+
+	assert_non_null(thpool);
+
+	// Occupy the only thread.
+	assert_int_equal(thpool_add_work(thpool, blocking_job, s), 0);
+	pthread_mutex_lock(&s->lock);
+	while (s->started == 0) {
+		pthread_cond_wait(&s->cond, &s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	assert_int_equal(thpool_add_work(thpool, blocking_job, s), 0);
+	assert_int_equal(thpool_add_work(thpool, blocking_job, s), 0);
+	assert_int_equal(thpool_add_work(thpool, blocking_job, s), -1);
+
+	pthread_mutex_lock(&s->lock);
+	s->release = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	thpool_wait(thpool);
+	assert_int_equal(s->done, 3);
+	thpool_destroy(thpool);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_thpool_add_work, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_thpool_bounded, setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
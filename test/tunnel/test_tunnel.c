@@ -0,0 +1,165 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <tunnel/tunnel.h>
+
+#define STREAM_SIZE (1024*1024)
+
+// client[0] plays client, client[1] and server[0] are tunneled, server[1]
+// plays origin.
+typedef struct {
+	int client[2];
+	int server[2];
+	tunnel_t tunnel;
+} state_t;
+
+static int setup(void **state) {
+	state_t *s;
+
+	if ((s = malloc(sizeof(state_t))) == NULL) {
+		return -1;
+	}
+
+	// Nothing to free unless a test inits the tunnel.
+	memset(&s->tunnel, 0, sizeof(tunnel_t));
+	s->tunnel.up.pipe[0] = s->tunnel.down.pipe[0] = -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, s->client) == -1
+		|| socketpair(AF_UNIX, SOCK_STREAM, 0, s->server) == -1) {
+		free(s);
+		return -1;
+	}
+
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state) {
+	state_t *s = (state_t *) *state;
+
+	tunnel_free(&s->tunnel);
+	close(s->client[0]);
+	close(s->client[1]);
+	close(s->server[0]);
+	close(s->server[1]);
+	free(s);
+	return 0;
+}
+
+static void *write_stream(void *data) {
+	int sockfd = *(int *) data;
+	char buf[4096];
+	size_t i, sent = 0;
+	ssize_t n;
+
+	while (sent < STREAM_SIZE) {
+		for (i = 0; i < sizeof(buf); i++) {
+			buf[i] = (char) (sent + i);
+		}
+
+		if ((n = send(sockfd, buf, sizeof(buf), 0)) <= 0) {
+			break;
+		}
+		sent += n;
+	}
+
+	shutdown(sockfd, SHUT_WR);
+	return NULL;
+}
+
+// Read stream to EOF, check it and shut down. Return number of bytes read.
+static void *read_stream(void *data) {
+	int sockfd = *(int *) data;
+	char buf[4096];
+	size_t i, recved = 0;
+	ssize_t n;
+
+	while ((n = recv(sockfd, buf, sizeof(buf), 0)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] != (char) (recved + i)) {
+				shutdown(sockfd, SHUT_WR);
+				return (void *) -1;
+			}
+		}
+		recved += n;
+	}
+
+	shutdown(sockfd, SHUT_WR);
+	return (void *) recved;
+}
+
+static void relay_stream(state_t *s, bool use_splice) {
+	pthread_t writer, reader;
+	void *recved;
+
+	assert_true(tunnel_init(&s->tunnel, s->client[1], s->server[0],
+		use_splice));
+
+	pthread_create(&writer, NULL, write_stream, &s->client[0]);
+	pthread_create(&reader, NULL, read_stream, &s->server[1]);
+
+	// Ends when both writer and reader shut down.
+	assert_true(tunnel_run(&s->tunnel));
+
+	pthread_join(writer, NULL);
+	pthread_join(reader, &recved);
+	assert_int_equal((size_t) recved, STREAM_SIZE);
+
+	// splice() moved everything without falling back.
+	assert_int_equal(s->tunnel.up.pipe[0] != -1, use_splice);
+}
+
+static void test_tunnel_splice(void **state) {
+	relay_stream((state_t *) *state, true);
+}
+
+static void test_tunnel_copy(void **state) {
+	relay_stream((state_t *) *state, false);
+}
+
+static void test_tunnel_half_close(void **state) {
+	state_t *s = (state_t *) *state;
+	char buf[16];
+
+	assert_true(tunnel_init(&s->tunnel, s->client[1], s->server[0], true));
+	assert_int_equal(tunnel_pump(&s->tunnel), 0);
+
+	// Client is done sending, origin still answers.
+	send(s->client[0], "ping", 4, 0);
+	shutdown(s->client[0], SHUT_WR);
+	assert_int_equal(tunnel_pump(&s->tunnel), 0);
+	assert_true(s->tunnel.up.eof);
+
+	assert_int_equal(recv(s->server[1], buf, sizeof(buf), 0), 4);
+	assert_memory_equal(buf, "ping", 4);
+	assert_int_equal(recv(s->server[1], buf, sizeof(buf), 0), 0);
+
+	send(s->server[1], "pong", 4, 0);
+	assert_int_equal(tunnel_pump(&s->tunnel), 0);
+	assert_int_equal(recv(s->client[0], buf, sizeof(buf), 0), 4);
+	assert_memory_equal(buf, "pong", 4);
+
+	shutdown(s->server[1], SHUT_WR);
+	assert_int_equal(tunnel_pump(&s->tunnel), 1);
+	assert_int_equal(recv(s->client[0], buf, sizeof(buf), 0), 0);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_tunnel_splice,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_tunnel_copy,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_tunnel_half_close,
+			setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,6 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+$BASEDIR/../test.sh "$BASEDIR/test_tunnel.c \
+$BASEDIR/../../src/tunnel/tunnel.c \
+-lpthread"
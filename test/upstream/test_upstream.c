@@ -0,0 +1,155 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <upstream/upstream.h>
+
+typedef struct {
+	upstream_pool_t *pool;
+	int fds[2];		// fds[0] goes to pool, fds[1] plays origin.
+} state_t;
+
+static int setup(void **state) {
+	state_t *s;
+
+	if ((s = malloc(sizeof(state_t))) == NULL) {
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, s->fds) == -1) {
+		free(s);
+		return -1;
+	}
+
+	if ((s->pool = upstream_pool_init(2, 1, 60000)) == NULL) {
+		close(s->fds[0]);
+		close(s->fds[1]);
+		free(s);
+		return -1;
+	}
+
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state) {
+	state_t *s = (state_t *) *state;
+	upstream_pool_free(s->pool);
+	close(s->fds[1]);
+	free(s);
+	return 0;
+}
+
+static void test_upstream_pool_get(void **state) {
+	state_t *s = (state_t *) *state;
+	upstream_stats_t stats;
+
+	assert_int_equal(upstream_pool_get(s->pool, "example.com", "80"), -1);
+	assert_true(upstream_pool_put(s->pool, "example.com", "80", s->fds[0]));
+
+	assert_int_equal(upstream_pool_get(s->pool, "example.com", "8080"), -1);
+	assert_int_equal(upstream_pool_get(s->pool, "example.com", "80"),
+		s->fds[0]);
+	assert_int_equal(upstream_pool_get(s->pool, "example.com", "80"), -1);
+
+	upstream_pool_stats(s->pool, &stats);
+	assert_int_equal(stats.hits, 1);
+	assert_int_equal(stats.misses, 3);
+	assert_int_equal(stats.idle, 0);
+
+	close(s->fds[0]);
+}
+
+static void test_upstream_pool_stale(void **state) {
+	state_t *s = (state_t *) *state;
+	upstream_stats_t stats;
+
+	assert_true(upstream_pool_put(s->pool, "example.com", "80", s->fds[0]));
+	assert_true(write(s->fds[1], "x", 1) == 1);	// Unexpected data.
+
+	assert_int_equal(upstream_pool_get(s->pool, "example.com", "80"), -1);
+
+	upstream_pool_stats(s->pool, &stats);
+	assert_int_equal(stats.stale, 1);
+	assert_int_equal(stats.idle, 0);
+}
+
+static void test_upstream_pool_closed(void **state) {
+	state_t *s = (state_t *) *state;
+	upstream_stats_t stats;
+
+	assert_true(upstream_pool_put(s->pool, "example.com", "80", s->fds[0]));
+	shutdown(s->fds[1], SHUT_WR);
+
+	assert_int_equal(upstream_pool_get(s->pool, "example.com", "80"), -1);
+
+	upstream_pool_stats(s->pool, &stats);
+	assert_int_equal(stats.stale, 1);
+}
+
+static void test_upstream_pool_limit(void **state) {
+	state_t *s = (state_t *) *state;
+	upstream_stats_t stats;
+	int fds[2], other[2];
+
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, other), 0);
+
+	assert_true(upstream_pool_put(s->pool, "example.com", "80", s->fds[0]));
+	// max_idle_per_host is 1.
+	assert_false(upstream_pool_put(s->pool, "example.com", "80", fds[0]));
+	assert_true(upstream_pool_put(s->pool, "example.org", "80", other[0]));
+
+	upstream_pool_stats(s->pool, &stats);
+	assert_int_equal(stats.rejected, 1);
+	assert_int_equal(stats.idle, 2);
+
+	// max_idle is 2.
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	assert_false(upstream_pool_put(s->pool, "example.net", "80", fds[0]));
+
+	upstream_pool_stats(s->pool, &stats);
+	assert_int_equal(stats.rejected, 2);
+
+	close(fds[1]);
+	close(other[1]);
+}
+
+static void test_upstream_pool_expire(void **state) {
+	state_t *s = (state_t *) *state;
+	upstream_stats_t stats;
+
+	upstream_pool_free(s->pool);
+	assert_non_null(s->pool = upstream_pool_init(2, 1, 10));
+
+	assert_true(upstream_pool_put(s->pool, "example.com", "80", s->fds[0]));
+	usleep(20 * 1000);
+	upstream_pool_expire(s->pool);
+
+	upstream_pool_stats(s->pool, &stats);
+	assert_int_equal(stats.expired, 1);
+	assert_int_equal(stats.idle, 0);
+	assert_int_equal(upstream_pool_get(s->pool, "example.com", "80"), -1);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_upstream_pool_get,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_upstream_pool_stale,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_upstream_pool_closed,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_upstream_pool_limit,
+			setup, teardown),
+		cmocka_unit_test_setup_teardown(test_upstream_pool_expire,
+			setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
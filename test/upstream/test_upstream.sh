@@ -0,0 +1,5 @@
+#!/bin/bash
+BASEDIR=$(dirname $0)
+
+$BASEDIR/../test.sh "$BASEDIR/test_upstream.c \
+$BASEDIR/../../src/upstream/upstream.c"